@@ -0,0 +1,599 @@
+// bench.c - 回环吞吐基准: 进程内启动服务器, 按文件大小和并发数的组合测 put / get
+// 每个组合输出吞吐、每 GB 的 CPU 时间和系统调用次数, 结果为 JSON, 便于不同版本之间对比
+#define _GNU_SOURCE
+#include "discovery.h"
+#include "transfer.h"
+#include "conn_pool.h"
+#include "wan.h"
+#include <signal.h>
+#include <ftw.h>
+#include <sys/resource.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+int running = 1;
+
+#define BENCH_MAX_SIZES     16
+#define BENCH_MAX_LEVELS    8
+#define BENCH_MAX_STREAMS   64
+#define BENCH_MAX_ROUNDS    100000
+#define BENCH_FILL_BLOCK    (4 << 20)       // 生成测试文件时每次写入的数据量
+#define BENCH_SPACE_MARGIN  (1ULL << 30)    // 磁盘剩余空间至少留这么多
+#define BENCH_READY_WAIT    200             // 等待服务器开始监听的次数, 每次 10ms
+#define BENCH_DIR_LEN       (MAX_PATH_LEN + 8)  // 临时目录 (不超过 MAX_PATH_LEN) 下的 src / srv / dst
+#define BENCH_PATH_LEN      (MAX_PATH_LEN + 64) // 其中的测试文件
+
+typedef struct {
+    uint64_t sizes[BENCH_MAX_SIZES];
+    int size_count;
+    int levels[BENCH_MAX_LEVELS];   // 并发传输数
+    int level_count;
+    double min_time;                // 每个组合至少测这么久, 小文件多跑几轮
+    const char* dir;                // 在这个目录下建临时目录存放测试文件
+    int io_backend;
+    int verbose;                    // 非 0: 保留客户端和服务器的输出
+    const char* network;            // 非 NULL: 客户端经过模拟这种网络的代理连接服务器
+} BenchOptions;
+
+typedef int (*BenchTransfer)(const char* filename, const char* ip, int port, const char* username,
+                             const char* password);
+
+typedef struct {
+    const char* name;
+    BenchTransfer transfer;
+} BenchOp;
+
+typedef struct {
+    BenchTransfer transfer;
+    char filename[64];
+    int port;
+    int result;
+    pthread_t thread;
+} BenchTask;
+
+// 一次采样: 墙钟时间, 进程 (服务器和客户端) 的 CPU 时间, 系统调用次数
+typedef struct {
+    struct timespec wall;
+    struct rusage usage;
+    uint64_t syscalls;
+} BenchSample;
+
+typedef struct {
+    uint64_t bytes;
+    double seconds;
+    double cpu;
+    uint64_t syscalls;
+    int rounds;
+    int ok;
+} BenchResult;
+
+static FILE* bench_out;         // JSON 结果, 原来的标准输出
+static FILE* bench_log;         // 进度, 原来的标准错误
+static int syscall_fd = -1;     // raw_syscalls:sys_enter 计数器, -1 表示不可用
+static int first_result = 1;
+
+// 统计整个进程的系统调用: 继承到之后创建的线程, 所以要在启动服务器之前打开
+static int open_syscall_counter(void)
+{
+    static const char* paths[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+    };
+    struct perf_event_attr attr;
+    unsigned long long id = 0;
+
+    for(size_t i = 0; i < sizeof(paths) / sizeof(paths[0]) && id == 0; i ++)
+    {
+        FILE* f = fopen(paths[i], "r");
+        if(!f)
+            continue;
+        if(fscanf(f, "%llu", &id) != 1)
+            id = 0;
+        fclose(f);
+    }
+    if(id == 0)
+        return -1;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.size = sizeof(attr);
+    attr.config = id;
+    attr.inherit = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+static void bench_sample(BenchSample* sample)
+{
+    clock_gettime(CLOCK_MONOTONIC, &sample->wall);
+    getrusage(RUSAGE_SELF, &sample->usage);
+    sample->syscalls = 0;
+    if(syscall_fd >= 0 && read(syscall_fd, &sample->syscalls, sizeof(sample->syscalls)) != sizeof(sample->syscalls))
+        sample->syscalls = 0;
+}
+
+static double timeval_seconds(const struct timeval* tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static void bench_account(BenchResult* result, const BenchSample* start, const BenchSample* end)
+{
+    result->seconds += (end->wall.tv_sec - start->wall.tv_sec) + (end->wall.tv_nsec - start->wall.tv_nsec) / 1e9;
+    result->cpu += timeval_seconds(&end->usage.ru_utime) - timeval_seconds(&start->usage.ru_utime) +
+                   timeval_seconds(&end->usage.ru_stime) - timeval_seconds(&start->usage.ru_stime);
+    result->syscalls += end->syscalls - start->syscalls;
+}
+
+// 解析 4K / 64M / 8G 这样的大小
+static int parse_size(const char* text, uint64_t* size)
+{
+    char* end;
+    unsigned long long value = strtoull(text, &end, 10);
+
+    if(end == text)
+        return -1;
+    switch(*end)
+    {
+        case 'k': case 'K': value <<= 10; end ++; break;
+        case 'm': case 'M': value <<= 20; end ++; break;
+        case 'g': case 'G': value <<= 30; end ++; break;
+        default: break;
+    }
+    if(*end != '\0' || value == 0)
+        return -1;
+    *size = value;
+    return 0;
+}
+
+static void format_size(uint64_t size, char* buf, size_t len)
+{
+    if(size >= (1ULL << 30) && size % (1ULL << 30) == 0)
+        snprintf(buf, len, "%" PRIu64 "G", size >> 30);
+    else if(size >= (1 << 20) && size % (1 << 20) == 0)
+        snprintf(buf, len, "%" PRIu64 "M", size >> 20);
+    else if(size >= (1 << 10) && size % (1 << 10) == 0)
+        snprintf(buf, len, "%" PRIu64 "K", size >> 10);
+    else
+        snprintf(buf, len, "%" PRIu64, size);
+}
+
+static int parse_list(char* text, BenchOptions* options, int sizes)
+{
+    char* save = NULL;
+
+    if(sizes)
+        options->size_count = 0;
+    else
+        options->level_count = 0;
+    for(char* tok = strtok_r(text, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    {
+        if(sizes)
+        {
+            if(options->size_count == BENCH_MAX_SIZES || parse_size(tok, &options->sizes[options->size_count]) < 0)
+                return -1;
+            options->size_count ++;
+        }
+        else
+        {
+            int level = atoi(tok);
+            if(options->level_count == BENCH_MAX_LEVELS || level <= 0 || level > BENCH_MAX_STREAMS)
+                return -1;
+            options->levels[options->level_count ++] = level;
+        }
+    }
+    return (sizes ? options->size_count : options->level_count) > 0 ? 0 : -1;
+}
+
+// 生成测试文件: 每块开头写入块号, 各块内容不同
+static int create_source(const char* path, uint64_t size)
+{
+    uint64_t* block = malloc(BENCH_FILL_BLOCK);
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    int ret = -1;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0 || !block)
+        goto out;
+
+    for(size_t i = 0; i < BENCH_FILL_BLOCK / sizeof(uint64_t); i ++)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        block[i] = state;
+    }
+    for(uint64_t offset = 0; offset < size; offset += BENCH_FILL_BLOCK)
+    {
+        size_t len = size - offset < BENCH_FILL_BLOCK ? size - offset : BENCH_FILL_BLOCK;
+        block[0] = offset;
+        for(size_t done = 0; done < len; )
+        {
+            ssize_t n = pwrite(fd, (char*)block + done, len - done, offset + done);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+                goto out;
+            done += n;
+        }
+    }
+    ret = 0;
+
+out:
+    if(fd >= 0)
+        close(fd);
+    free(block);
+    return ret;
+}
+
+static void* bench_task(void* arg)
+{
+    BenchTask* task = (BenchTask*)arg;
+
+    task->result = task->transfer(task->filename, "127.0.0.1", task->port, NULL, NULL);
+    return NULL;
+}
+
+// 在当前目录下同时传输 streams 个文件, 计入一轮的时间和开销
+static int run_round(const BenchOp* op, uint64_t size, int streams, int port, BenchResult* result)
+{
+    BenchTask tasks[BENCH_MAX_STREAMS];
+    BenchSample start, end;
+    int started, ok = 1;
+
+    bench_sample(&start);
+    for(started = 0; started < streams; started ++)
+    {
+        BenchTask* task = &tasks[started];
+        task->transfer = op->transfer;
+        task->port = port;
+        task->result = -1;
+        snprintf(task->filename, sizeof(task->filename), "b%" PRIu64 ".%d", size, started);
+        if(pthread_create(&task->thread, NULL, bench_task, task) != 0)
+            break;
+    }
+    for(int i = 0; i < started; i ++)
+    {
+        pthread_join(tasks[i].thread, NULL);
+        ok = ok && tasks[i].result == 0;
+    }
+    bench_sample(&end);
+
+    bench_account(result, &start, &end);
+    result->bytes += size * started;
+    result->rounds ++;
+    return ok && started == streams ? 0 : -1;
+}
+
+static void unlink_copies(const char* dir, uint64_t size, int streams)
+{
+    char path[BENCH_PATH_LEN];
+
+    for(int i = 0; i < streams; i ++)
+    {
+        snprintf(path, sizeof(path), "%s/b%" PRIu64 ".%d", dir, size, i);
+        unlink(path);
+    }
+}
+
+// 下载的文件大小都对才算成功
+static int check_copies(const char* dir, uint64_t size, int streams)
+{
+    char path[BENCH_PATH_LEN];
+    struct stat st;
+
+    for(int i = 0; i < streams; i ++)
+    {
+        snprintf(path, sizeof(path), "%s/b%" PRIu64 ".%d", dir, size, i);
+        if(stat(path, &st) != 0 || (uint64_t)st.st_size != size)
+            return -1;
+    }
+    return 0;
+}
+
+static void report(const char* op, uint64_t size, int streams, const BenchResult* result, const char* skipped)
+{
+    char label[32];
+
+    format_size(size, label, sizeof(label));
+    fprintf(bench_out, "%s\n    {\"op\": \"%s\", \"size\": %" PRIu64 ", \"concurrency\": %d, ",
+            first_result ? "" : ",", op, size, streams);
+    first_result = 0;
+    if(skipped)
+    {
+        fprintf(bench_out, "\"skipped\": \"%s\"}", skipped);
+        fprintf(bench_log, "%-4s %6s x%-3d skipped (%s)\n", op, label, streams, skipped);
+        fflush(bench_out);
+        return;
+    }
+
+    double gb = (double)result->bytes / (1ULL << 30);
+    double rate = result->seconds > 0 ? result->bytes / result->seconds / (1024 * 1024) : 0;
+    fprintf(bench_out, "\"rounds\": %d, \"bytes\": %" PRIu64 ", \"seconds\": %.6f, \"mb_per_s\": %.1f, "
+            "\"cpu_seconds_per_gb\": %.3f, ", result->rounds, result->bytes, result->seconds, rate, result->cpu / gb);
+    if(syscall_fd >= 0)
+        fprintf(bench_out, "\"syscalls_per_gb\": %.0f, ", result->syscalls / gb);
+    else
+        fprintf(bench_out, "\"syscalls_per_gb\": null, ");
+    fprintf(bench_out, "\"ok\": %s}", result->ok ? "true" : "false");
+    fflush(bench_out);
+
+    fprintf(bench_log, "%-4s %6s x%-3d %10.1f MB/s %8.3f cpu-s/GB %s\n", op, label, streams, rate, result->cpu / gb,
+            result->ok ? "" : "FAILED");
+}
+
+// 一个组合: 从 src 上传 streams 份到服务器, 再下载到 dst; 每个方向重复到至少 min_time 秒
+static void bench_cell(const BenchOptions* options, const char* root, uint64_t size, int streams, int port)
+{
+    static const BenchOp ops[] = {
+        { "put", send_tcp_file },
+        { "get", receive_tcp_file },
+    };
+    char src[BENCH_DIR_LEN], dst[BENCH_DIR_LEN], srv[BENCH_DIR_LEN], base[BENCH_PATH_LEN], path[BENCH_PATH_LEN];
+    struct statvfs vfs;
+
+    snprintf(src, sizeof(src), "%s/src", root);
+    snprintf(dst, sizeof(dst), "%s/dst", root);
+    snprintf(srv, sizeof(srv), "%s/srv", root);
+    snprintf(base, sizeof(base), "%s/b%" PRIu64, src, size);
+
+    // 服务器和下载各存 streams 份, 源文件用硬链接共享一份
+    if(statvfs(root, &vfs) == 0 &&
+       (uint64_t)vfs.f_bavail * vfs.f_frsize < size * (2 * streams + 1) + BENCH_SPACE_MARGIN)
+    {
+        for(size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i ++)
+            report(ops[i].name, size, streams, NULL, "not enough disk space");
+        return;
+    }
+
+    int ok = access(base, F_OK) == 0 || create_source(base, size) == 0;
+    for(int i = 0; i < streams && ok; i ++)
+    {
+        snprintf(path, sizeof(path), "%s/b%" PRIu64 ".%d", src, size, i);
+        ok = link(base, path) == 0;
+    }
+
+    for(size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i ++)
+    {
+        const BenchOp* op = &ops[i];
+        BenchResult result;
+
+        memset(&result, 0, sizeof(result));
+        result.ok = ok && chdir(op->transfer == send_tcp_file ? src : dst) == 0;
+        while(result.ok && (result.rounds == 0 || result.seconds < options->min_time) &&
+              result.rounds < BENCH_MAX_ROUNDS)
+        {
+            // 下载前删掉上一轮的文件, 不会被当成续传
+            if(op->transfer == receive_tcp_file)
+                unlink_copies(dst, size, streams);
+            result.ok = run_round(op, size, streams, port, &result) == 0;
+        }
+        if(result.ok)
+            result.ok = check_copies(op->transfer == send_tcp_file ? srv : dst, size, streams) == 0;
+        report(op->name, size, streams, &result, NULL);
+    }
+
+    unlink_copies(src, size, streams);
+    unlink_copies(srv, size, streams);
+    unlink_copies(dst, size, streams);
+}
+
+// 由系统分配一个空闲端口
+static int pick_port(void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int port = -1;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+       getsockname(fd, (struct sockaddr*)&addr, &len) == 0)
+        port = ntohs(addr.sin_port);
+    close(fd);
+    return port;
+}
+
+// 服务器线程启动后才开始监听, 连得上再开始测
+static int wait_server(int port)
+{
+    for(int i = 0; i < BENCH_READY_WAIT; i ++)
+    {
+        struct sockaddr_in addr;
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd < 0)
+            return -1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int ret = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+        close(fd);
+        if(ret == 0)
+            return 0;
+        usleep(10000);
+    }
+    return -1;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: lftp-bench [-d dir] [-s sizes] [-c levels] [-t seconds] [-b posix|uring|copy] [-w network] [-v]\n"
+            "  -d dir      directory for the temporary test files (default /tmp)\n"
+            "  -s sizes    comma separated file sizes (default 4K,64K,1M,16M,256M,1G,8G)\n"
+            "  -c levels   comma separated concurrent transfer counts (default 1,4,16)\n"
+            "  -t seconds  minimum measuring time per size/concurrency/direction (default 1)\n"
+            "  -b backend  server I/O backend (default posix)\n"
+            "  -w network  run the transfers through an emulated network, e.g. wifi, wan or\n"
+            "              \"delay=40,jitter=5,rate=20,loss=0.5\" (see lftp-wan -h)\n"
+            "  -v          keep client and server output on stdout/stderr\n"
+            "Results are printed to stdout as JSON, progress to stderr\n");
+}
+
+int main(int argc, char* argv[])
+{
+    BenchOptions options;
+    char sizes[] = "4K,64K,1M,16M,256M,1G,8G";
+    char levels[] = "1,4,16";
+    char root[MAX_PATH_LEN], path[BENCH_PATH_LEN];
+    int opt;
+
+    memset(&options, 0, sizeof(options));
+    parse_list(sizes, &options, 1);
+    parse_list(levels, &options, 0);
+    options.min_time = 1.0;
+    options.dir = "/tmp";
+    options.io_backend = IO_BACKEND_POSIX;
+
+    while((opt = getopt(argc, argv, "d:s:c:t:b:w:vh")) != -1)
+    {
+        switch(opt)
+        {
+            case 'd': options.dir = optarg; break;
+            case 's':
+                if(parse_list(optarg, &options, 1) < 0)
+                {
+                    fprintf(stderr, "Invalid size list: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                if(parse_list(optarg, &options, 0) < 0)
+                {
+                    fprintf(stderr, "Invalid concurrency list (1-%d): %s\n", BENCH_MAX_STREAMS, optarg);
+                    return 1;
+                }
+                break;
+            case 't': options.min_time = atof(optarg); break;
+            case 'b':
+                if(strcmp(optarg, "posix") == 0)
+                    options.io_backend = IO_BACKEND_POSIX;
+                else if(strcmp(optarg, "uring") == 0)
+                    options.io_backend = IO_BACKEND_URING;
+                else if(strcmp(optarg, "copy") == 0)
+                    options.io_backend = IO_BACKEND_COPY;
+                else
+                {
+                    fprintf(stderr, "Unknown I/O backend: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'w': options.network = optarg; break;
+            case 'v': options.verbose = 1; break;
+            default: usage(); return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    WanConditions network;
+    char network_spec[WAN_SPEC_LEN] = "";
+    if(options.network)
+    {
+        if(wan_parse(options.network, &network) < 0)
+        {
+            fprintf(stderr, "Invalid network conditions: %s\n", options.network);
+            return 1;
+        }
+        wan_format(&network, network_spec, sizeof(network_spec));
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // 测试中要切换当前目录, 用绝对路径
+    char* dir = realpath(options.dir, NULL);
+    int len = snprintf(root, sizeof(root), "%s/lftp-bench.XXXXXX", dir ? dir : options.dir);
+    free(dir);
+    if(len >= (int)sizeof(root) || !mkdtemp(root))
+    {
+        perror("Failed to create benchmark directory");
+        return 1;
+    }
+    const char* subdirs[] = { "src", "srv", "dst" };
+    for(size_t i = 0; i < sizeof(subdirs) / sizeof(subdirs[0]); i ++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", root, subdirs[i]);
+        mkdir(path, 0755);
+    }
+
+    // 客户端和服务器的 printf 不混进结果
+    bench_out = fdopen(dup(STDOUT_FILENO), "w");
+    bench_log = fdopen(dup(STDERR_FILENO), "w");
+    setvbuf(bench_log, NULL, _IOLBF, 0);
+    if(!options.verbose)
+    {
+        int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if(null_fd >= 0)
+        {
+            fflush(stdout);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            close(null_fd);
+        }
+    }
+
+    syscall_fd = open_syscall_counter();
+    if(syscall_fd < 0)
+        fprintf(bench_log, "Syscall counting unavailable (needs perf_event_open and tracefs)\n");
+
+    ServerOptions server_options;
+    memset(&server_options, 0, sizeof(server_options));
+    server_options.io_backend = options.io_backend;
+    snprintf(path, sizeof(path), "%s/srv", root);
+    int port = pick_port();
+    if(port < 0 || start_tcp_server(port, path, NULL, NULL, &server_options) != 0 || wait_server(port) < 0)
+    {
+        fprintf(bench_log, "Failed to start the benchmark server\n");
+        nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        return 1;
+    }
+
+    // 客户端改连代理, 代理再转发到服务器
+    int client_port = port;
+    if(options.network)
+    {
+        client_port = pick_port();
+        if(client_port < 0 || wan_proxy_start(client_port, "127.0.0.1", port, &network, NULL) < 0 ||
+           wait_server(client_port) < 0)
+        {
+            fprintf(bench_log, "Failed to start the network emulation proxy\n");
+            stop_tcp_server();
+            nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+            return 1;
+        }
+    }
+
+    static const char* backends[] = { "posix", "uring", "copy" };
+    fprintf(bench_out, "{\n  \"benchmark\": \"lftp-bench\",\n  \"protocol\": %d,\n  \"io_backend\": \"%s\",\n"
+            "  \"cpus\": %ld,\n  \"min_time\": %.3f,\n  \"network\": \"%s\",\n  \"results\": [",
+            PROTOCOL_VERSION, backends[options.io_backend], sysconf(_SC_NPROCESSORS_ONLN), options.min_time,
+            options.network ? network_spec : "loopback");
+
+    for(int i = 0; i < options.size_count; i ++)
+    {
+        for(int j = 0; j < options.level_count; j ++)
+            bench_cell(&options, root, options.sizes[i], options.levels[j], client_port);
+        snprintf(path, sizeof(path), "%s/src/b%" PRIu64, root, options.sizes[i]);
+        unlink(path);
+    }
+    fprintf(bench_out, "\n  ]\n}\n");
+    fflush(bench_out);
+
+    conn_pool_clear();
+    stop_tcp_server();
+    if(chdir("/") == 0)
+        nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return 0;
+}
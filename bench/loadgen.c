@@ -0,0 +1,550 @@
+// loadgen.c - 连接规模的压力测试: 大量连接同时认证并按比例发出小文件 put / get
+// 记录建连、认证、首字节和完成的延迟直方图, 结果为 JSON; 默认在进程内启动服务器, 只走回环
+#define _GNU_SOURCE
+#include "discovery.h"
+#include "transfer.h"
+#include "histogram.h"
+#include <signal.h>
+#include <ftw.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+int running = 1;
+
+#define LOAD_MAX_CONNS      20000
+#define LOAD_STACK_SIZE     (256 << 10)     // 连接线程的栈, 连接多时省内存
+#define LOAD_READY_WAIT     200             // 等待服务器开始监听的次数, 每次 10ms
+#define LOAD_USER           "load"          // 进程内服务器的账号, 认证阶段照常校验
+#define LOAD_PASSWORD       "load"
+
+typedef struct {
+    int conns;
+    double duration;
+    double rate;                    // 所有连接合计的目标请求率, 0 表示每个连接收到回复就发下一个
+    int put_percent;
+    uint64_t size;
+    int files;                      // get 轮流取的文件数
+    int per_conn;                   // 每个连接发这么多请求后重连, 0 表示不重连
+    int port;                       // 非 0: 压测已经在运行的本机服务器
+    char username[MAX_USERNAME_LEN];
+    char password[MAX_PASSWORD_LEN];
+} LoadOptions;
+
+enum {
+    LOAD_CONNECT = 0,
+    LOAD_AUTH,                      // 认证和协议协商
+    LOAD_FIRST_BYTE,                // 从请求开始到收到回复的第一个字节
+    LOAD_COMPLETE,                  // 从请求开始到整个请求结束
+    LOAD_METRICS,
+};
+
+static const char* metric_names[LOAD_METRICS] = { "connect", "auth", "first_byte", "complete" };
+
+typedef struct {
+    const LoadOptions* options;
+    int port;
+    int source_fd;                  // put 发送的数据
+    int sink_fd;                    // get 收到的数据写到这里: 所有连接共用的 memfd, 只占一个文件的内存
+    struct timespec begin;
+    struct timespec deadline;
+    Histogram hist[LOAD_METRICS];
+    uint64_t puts;
+    uint64_t gets;
+    uint64_t errors;
+} LoadRun;
+
+typedef struct {
+    LoadRun* run;
+    int id;
+    uint64_t rng;
+    pthread_t thread;
+} LoadConn;
+
+static uint64_t timespec_ns(const struct timespec* ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return timespec_ns(&ts);
+}
+
+static uint64_t next_random(uint64_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// 建连并认证, 分别记录两段延迟; 失败返回 -1
+static int load_connect(LoadConn* conn, uint16_t* features)
+{
+    LoadRun* run = conn->run;
+    const LoadOptions* options = run->options;
+
+    uint64_t start = now_ns();
+    int sockfd = open_clientfd("127.0.0.1", run->port);
+    if(sockfd < 0)
+        return -1;
+    uint64_t connected = now_ns();
+    histogram_record(&run->hist[LOAD_CONNECT], connected - start);
+
+    if(send_auth_request(sockfd, options->username, options->password) < 0 || receive_auth_reponse(sockfd) <= 0 ||
+       negotiate_protocol(sockfd, features) < PROTOCOL_V2)
+    {
+        close(sockfd);
+        return -1;
+    }
+    histogram_record(&run->hist[LOAD_AUTH], now_ns() - connected);
+    return sockfd;
+}
+
+// 等回复的第一个字节, 记录首字节延迟
+static int wait_first_byte(int sockfd, LoadRun* run, uint64_t start)
+{
+    char c;
+
+    if(recv(sockfd, &c, 1, MSG_PEEK | MSG_WAITALL) != 1)
+        return -1;
+    histogram_record(&run->hist[LOAD_FIRST_BYTE], now_ns() - start);
+    return 0;
+}
+
+static int load_put(int sockfd, LoadConn* conn, uint64_t start)
+{
+    LoadRun* run = conn->run;
+    FileHeader header;
+    char name[32];
+
+    // 每个连接覆盖自己的文件, 服务器上的文件数不随请求数增长; 和默认的 put 一样不带 CRC
+    uint16_t name_len = snprintf(name, sizeof(name), "p%d", conn->id);
+    encode_file_header(&header, PROTOCOL_V2, CMD_PUT_FILE, run->options->size, name_len);
+    if(send(sockfd, &header, sizeof(FileHeader), MSG_MORE) != sizeof(FileHeader) ||
+       send(sockfd, name, name_len, 0) != name_len)
+        return -1;
+    if(send_file_range(sockfd, run->source_fd, 0, run->options->size) < 0 || send_chunk_end(sockfd) < 0 ||
+       wait_first_byte(sockfd, run, start) < 0)
+        return -1;
+    return receive_file_header(sockfd, &header) < 0 || header.command != CMD_ACK ? -1 : 0;
+}
+
+static int load_get(int sockfd, LoadConn* conn, uint64_t start)
+{
+    LoadRun* run = conn->run;
+    FileHeader header;
+    char name[MAX_FILENAME_LEN];
+
+    uint16_t name_len = snprintf(name, sizeof(name), "g%d", (int)(next_random(&conn->rng) % run->options->files));
+    encode_file_header(&header, PROTOCOL_V2, CMD_GET_FILE, 0, name_len);
+    if(send(sockfd, &header, sizeof(FileHeader), MSG_MORE) != sizeof(FileHeader) ||
+       send(sockfd, name, name_len, 0) != name_len || wait_first_byte(sockfd, run, start) < 0)
+        return -1;
+
+    if(receive_file_header(sockfd, &header) < 0 || header.command != CMD_GET_FILE ||
+       header.filename_len >= sizeof(name) ||
+       recv(sockfd, name, header.filename_len, MSG_WAITALL) != header.filename_len)
+        return -1;
+    if(receive_file_chunks(sockfd, run->sink_fd, 0, file_header_size(&header), NULL, NULL) < 0)
+        return -1;
+    return send_response(sockfd, CMD_ACK) < 0 ? -1 : 0;
+}
+
+// 一个连接: 按目标请求率排定每个请求的开始时间, 延迟从排定的时间算起,
+// 服务器变慢时排队等待的时间也计入延迟 (不会因为少发请求而低估)
+static void* load_thread(void* arg)
+{
+    LoadConn* conn = (LoadConn*)arg;
+    LoadRun* run = conn->run;
+    const LoadOptions* options = run->options;
+    uint64_t deadline = timespec_ns(&run->deadline);
+    uint64_t interval = options->rate > 0 ? (uint64_t)(1e9 * options->conns / options->rate) : 0;
+    // 各连接错开起点, 请求均匀分布
+    uint64_t next = timespec_ns(&run->begin) + (interval ? next_random(&conn->rng) % interval : 0);
+    uint16_t features = 0;
+    int sockfd = -1, served = 0;
+
+    while(1)
+    {
+        if(interval)
+        {
+            struct timespec ts = { (time_t)(next / 1000000000ULL), (long)(next % 1000000000ULL) };
+            if(next >= deadline)
+                break;
+            while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+        }
+        else if(now_ns() >= deadline)
+        {
+            break;
+        }
+
+        if(sockfd < 0 && (sockfd = load_connect(conn, &features)) < 0)
+        {
+            __atomic_add_fetch(&run->errors, 1, __ATOMIC_RELAXED);
+            next += interval;
+            continue;
+        }
+
+        uint64_t start = interval ? next : now_ns();
+        int put = (int)(next_random(&conn->rng) % 100) < options->put_percent;
+        int ret = put ? load_put(sockfd, conn, start) : load_get(sockfd, conn, start);
+        if(ret == 0)
+        {
+            histogram_record(&run->hist[LOAD_COMPLETE], now_ns() - start);
+            __atomic_add_fetch(put ? &run->puts : &run->gets, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            __atomic_add_fetch(&run->errors, 1, __ATOMIC_RELAXED);
+        }
+
+        // 出错后连接状态未知, 重新建连
+        served ++;
+        if(ret < 0 || (options->per_conn > 0 && served >= options->per_conn))
+        {
+            close(sockfd);
+            sockfd = -1;
+            served = 0;
+        }
+        next += interval;
+    }
+    if(sockfd >= 0)
+        close(sockfd);
+    return NULL;
+}
+
+static int write_file(const char* path, uint64_t size)
+{
+    char block[64 << 10];
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+    for(size_t i = 0; i < sizeof(block); i ++)
+        block[i] = (char)next_random(&state);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+        return -1;
+    for(uint64_t done = 0; done < size; )
+    {
+        size_t len = size - done < sizeof(block) ? size - done : sizeof(block);
+        ssize_t n = write(fd, block, len);
+        if(n <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+    close(fd);
+    return 0;
+}
+
+// 先上传 get 用的文件, 压测外部服务器时也一样
+static int upload_get_files(LoadRun* run)
+{
+    LoadConn conn;
+    FileHeader header;
+    uint16_t features;
+    char name[32];
+
+    memset(&conn, 0, sizeof(conn));
+    conn.run = run;
+    int sockfd = load_connect(&conn, &features);
+    if(sockfd < 0)
+        return -1;
+    for(int i = 0; i < run->options->files; i ++)
+    {
+        uint16_t name_len = snprintf(name, sizeof(name), "g%d", i);
+        encode_file_header(&header, PROTOCOL_V2, CMD_PUT_FILE, run->options->size, name_len);
+        if(send(sockfd, &header, sizeof(FileHeader), MSG_MORE) != sizeof(FileHeader) ||
+           send(sockfd, name, name_len, 0) != name_len ||
+           send_file_range(sockfd, run->source_fd, 0, run->options->size) < 0 || send_chunk_end(sockfd) < 0 ||
+           receive_file_header(sockfd, &header) < 0 || header.command != CMD_ACK)
+        {
+            close(sockfd);
+            return -1;
+        }
+    }
+    close(sockfd);
+    // 预热的记录不计入结果
+    for(int i = 0; i < LOAD_METRICS; i ++)
+        histogram_init(&run->hist[i]);
+    return 0;
+}
+
+static int pick_port(void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int port = -1;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 &&
+       getsockname(fd, (struct sockaddr*)&addr, &len) == 0)
+        port = ntohs(addr.sin_port);
+    close(fd);
+    return port;
+}
+
+static int wait_server(int port)
+{
+    for(int i = 0; i < LOAD_READY_WAIT; i ++)
+    {
+        struct sockaddr_in addr;
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd < 0)
+            return -1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int ret = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+        close(fd);
+        if(ret == 0)
+            return 0;
+        usleep(10000);
+    }
+    return -1;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    remove(path);
+    return 0;
+}
+
+static int parse_size(const char* text, uint64_t* size)
+{
+    char* end;
+    unsigned long long value = strtoull(text, &end, 10);
+
+    if(end == text)
+        return -1;
+    switch(*end)
+    {
+        case 'k': case 'K': value <<= 10; end ++; break;
+        case 'm': case 'M': value <<= 20; end ++; break;
+        default: break;
+    }
+    if(*end != '\0')
+        return -1;
+    *size = value;
+    return 0;
+}
+
+static void report(FILE* out, FILE* log, LoadRun* run, double elapsed)
+{
+    const LoadOptions* options = run->options;
+    uint64_t done = run->puts + run->gets;
+
+    fprintf(out, "{\n  \"tool\": \"lftp-load\",\n  \"connections\": %d,\n  \"duration\": %.3f,\n"
+            "  \"target_rate\": %.1f,\n  \"put_percent\": %d,\n  \"file_size\": %" PRIu64 ",\n"
+            "  \"requests_per_connection\": %d,\n  \"requests\": %" PRIu64 ",\n  \"puts\": %" PRIu64 ",\n"
+            "  \"gets\": %" PRIu64 ",\n  \"errors\": %" PRIu64 ",\n  \"rate\": %.1f,\n  \"latency_us\": {",
+            options->conns, elapsed, options->rate, options->put_percent, options->size, options->per_conn, done,
+            run->puts, run->gets, run->errors, elapsed > 0 ? done / elapsed : 0);
+    fprintf(log, "%" PRIu64 " requests (%" PRIu64 " put, %" PRIu64 " get), %" PRIu64 " errors, %.1f req/s\n",
+            done, run->puts, run->gets, run->errors, elapsed > 0 ? done / elapsed : 0);
+    fprintf(log, "%-11s %10s %10s %10s %10s %10s %10s\n", "latency(us)", "count", "mean", "p50", "p99", "p999", "max");
+
+    for(int i = 0; i < LOAD_METRICS; i ++)
+    {
+        const Histogram* hist = &run->hist[i];
+        double p50 = histogram_percentile(hist, 50) / 1e3;
+        double p99 = histogram_percentile(hist, 99) / 1e3;
+        double p999 = histogram_percentile(hist, 99.9) / 1e3;
+        double max = hist->max / 1e3;
+        double mean = histogram_mean(hist) / 1e3;
+
+        fprintf(out, "%s\n    \"%s\": {\"count\": %" PRIu64 ", \"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f, "
+                "\"p999\": %.1f, \"max\": %.1f}", i ? "," : "", metric_names[i], hist->total, mean, p50, p99, p999, max);
+        fprintf(log, "%-11s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                metric_names[i], hist->total, mean, p50, p99, p999, max);
+    }
+    fprintf(out, "\n  }\n}\n");
+    fflush(out);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: lftp-load [-n conns] [-t seconds] [-r rate] [-m put%%] [-s size] [-f files] [-k requests]\n"
+            "                 [-p port] [-u user:password]\n"
+            "  -n conns     concurrent connections (default 100, at most %d)\n"
+            "  -t seconds   test duration (default 10)\n"
+            "  -r rate      target requests per second over all connections (default 0: closed loop)\n"
+            "  -m put%%      percentage of requests that are puts (default 50)\n"
+            "  -s size      file size of every request (default 4K)\n"
+            "  -f files     number of distinct files the gets read (default 16)\n"
+            "  -k requests  reconnect after this many requests per connection (default 0: never)\n"
+            "  -p port      load a server already running on 127.0.0.1 instead of an in-process one\n"
+            "  -u user:pw   credentials for -p\n"
+            "Results are printed to stdout as JSON, a summary to stderr\n", LOAD_MAX_CONNS);
+}
+
+int main(int argc, char* argv[])
+{
+    static LoadRun run;
+    LoadOptions options;
+    char root[] = "/tmp/lftp-load.XXXXXX";
+    char path[sizeof(root) + 32];
+    int opt;
+
+    memset(&options, 0, sizeof(options));
+    options.conns = 100;
+    options.duration = 10;
+    options.put_percent = 50;
+    options.size = 4 << 10;
+    options.files = 16;
+
+    while((opt = getopt(argc, argv, "n:t:r:m:s:f:k:p:u:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': options.conns = atoi(optarg); break;
+            case 't': options.duration = atof(optarg); break;
+            case 'r': options.rate = atof(optarg); break;
+            case 'm': options.put_percent = atoi(optarg); break;
+            case 's':
+                if(parse_size(optarg, &options.size) < 0)
+                {
+                    fprintf(stderr, "Invalid size: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'f': options.files = atoi(optarg); break;
+            case 'k': options.per_conn = atoi(optarg); break;
+            case 'p': options.port = atoi(optarg); break;
+            case 'u':
+            {
+                char* sep = strchr(optarg, ':');
+                if(!sep)
+                {
+                    fprintf(stderr, "Expected user:password\n");
+                    return 1;
+                }
+                *sep = '\0';
+                snprintf(options.username, sizeof(options.username), "%s", optarg);
+                snprintf(options.password, sizeof(options.password), "%s", sep + 1);
+                break;
+            }
+            default: usage(); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(options.conns <= 0 || options.conns > LOAD_MAX_CONNS || options.duration <= 0 || options.rate < 0 ||
+       options.put_percent < 0 || options.put_percent > 100 || options.files <= 0 || options.per_conn < 0)
+    {
+        usage();
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // 每个连接在进程内占两个 fd (客户端和服务器端)
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if(!mkdtemp(root))
+    {
+        perror("Failed to create load test directory");
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/srv", root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/source", root);
+
+    // 客户端和服务器的 printf 不混进结果
+    FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+    FILE* log = fdopen(dup(STDERR_FILENO), "w");
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    // 不能直接收到 /dev/null: splice 写 /dev/null 不推进偏移, 接收循环会一直等下去
+    int sink_fd = memfd_create("lftp-load", MFD_CLOEXEC);
+    if(!out || !log || null_fd < 0 || sink_fd < 0 || write_file(path, options.size) < 0)
+    {
+        perror("Failed to prepare load test");
+        nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        return 1;
+    }
+    fflush(stdout);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+
+    run.options = &options;
+    run.sink_fd = sink_fd;
+    run.source_fd = open(path, O_RDONLY | O_CLOEXEC);
+    run.port = options.port;
+    if(!run.port)
+    {
+        ServerOptions server_options;
+        memset(&server_options, 0, sizeof(server_options));
+        server_options.backlog = options.conns > 128 ? options.conns : 0;
+        server_options.queue_size = options.conns > 128 ? options.conns : 0;
+        snprintf(options.username, sizeof(options.username), "%s", LOAD_USER);
+        snprintf(options.password, sizeof(options.password), "%s", LOAD_PASSWORD);
+        snprintf(path, sizeof(path), "%s/srv", root);
+        run.port = pick_port();
+        if(run.port < 0 || start_tcp_server(run.port, path, LOAD_USER, LOAD_PASSWORD, &server_options) != 0 ||
+           wait_server(run.port) < 0)
+        {
+            fprintf(log, "Failed to start the load test server\n");
+            nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+            return 1;
+        }
+    }
+    if(options.put_percent < 100 && upload_get_files(&run) < 0)
+    {
+        fprintf(log, "Failed to upload the files for gets\n");
+        if(!options.port)
+            stop_tcp_server();
+        nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        return 1;
+    }
+
+    LoadConn* conns = calloc(options.conns, sizeof(LoadConn));
+    pthread_attr_t attr;
+    int started = 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, LOAD_STACK_SIZE);
+    clock_gettime(CLOCK_MONOTONIC, &run.begin);
+    uint64_t deadline = timespec_ns(&run.begin) + (uint64_t)(options.duration * 1e9);
+    run.deadline.tv_sec = deadline / 1000000000ULL;
+    run.deadline.tv_nsec = deadline % 1000000000ULL;
+    for(; conns && started < options.conns; started ++)
+    {
+        conns[started].run = &run;
+        conns[started].id = started;
+        conns[started].rng = 0x9e3779b97f4a7c15ULL * (started + 1);
+        if(pthread_create(&conns[started].thread, &attr, load_thread, &conns[started]) != 0)
+            break;
+    }
+    pthread_attr_destroy(&attr);
+    if(started < options.conns)
+        fprintf(log, "Started only %d of %d connections\n", started, options.conns);
+    for(int i = 0; i < started; i ++)
+        pthread_join(conns[i].thread, NULL);
+    double elapsed = (now_ns() - timespec_ns(&run.begin)) / 1e9;
+    free(conns);
+
+    report(out, log, &run, elapsed);
+
+    if(!options.port)
+        stop_tcp_server();
+    nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return 0;
+}
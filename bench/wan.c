@@ -0,0 +1,452 @@
+// wan.c - 模拟广域网的用户态 TCP 代理: 转发的数据按延迟、抖动、带宽和丢包排定送达时间,
+// 连接可以随机被重置; 不需要 tc/netem 之类的内核配置, 只走回环也能测高延迟链路上的表现
+#define _GNU_SOURCE
+#include "transfer.h"
+#include "wan.h"
+#include <math.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+
+#define WAN_SEGMENT         (16 << 10)      // 每次从一端读的数据量, 也是排定送达时间的单位
+#define WAN_STACK_SIZE      (256 << 10)
+#define WAN_MIN_RTO         0.2             // 丢包后重传的等待时间下限, 同 Linux 的 TCP_RTO_MIN
+
+// 一段等待送达的数据
+typedef struct WanSegment {
+    struct WanSegment* next;
+    uint64_t due;                   // 送达时间, CLOCK_MONOTONIC 纳秒
+    size_t len;
+    size_t sent;
+    char data[];
+} WanSegment;
+
+// 一个方向的链路, 所有连接共享带宽
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t free_at;               // 链路上已排定的数据发完的时间
+} WanLink;
+
+// 连接的一个方向: 从 from 读, 按时写到 to
+typedef struct {
+    int from;
+    int to;
+    WanLink* link;
+    WanSegment* head;
+    WanSegment* tail;
+    size_t queued;
+    uint64_t last_due;              // 送达时间不早于前一段, 保证按顺序
+    uint64_t bytes;
+    int eof;                        // from 已读到结束
+    int shut;                       // 已经 shutdown(to, SHUT_WR)
+} WanPipe;
+
+typedef struct {
+    int client_fd;
+    int id;
+    uint64_t rng;
+} WanConn;
+
+typedef struct {
+    WanConditions cond;
+    char target_ip[INET_ADDRSTRLEN];
+    int target_port;
+    int listenfd;
+    FILE* log;
+    WanLink links[2];               // 0: 客户端到服务器, 1: 服务器到客户端
+} WanProxy;
+
+static WanProxy proxy = { .links = { { PTHREAD_MUTEX_INITIALIZER, 0 }, { PTHREAD_MUTEX_INITIALIZER, 0 } } };
+
+static const struct {
+    const char* name;
+    WanConditions cond;
+} wan_profiles[] = {
+    { "lan",   { 0, 0, 0, 0, 0, WAN_DEFAULT_WINDOW } },
+    { "wifi",  { 0.003, 0.003, 50e6 / 8, 0.002, 0, WAN_DEFAULT_WINDOW } },
+    { "wan",   { 0.040, 0.005, 20e6 / 8, 0.001, 0, WAN_DEFAULT_WINDOW } },
+    { "lossy", { 0.100, 0.020, 5e6 / 8, 0.02, 30, WAN_DEFAULT_WINDOW } },
+};
+
+int wan_parse(const char* spec, WanConditions* cond)
+{
+    char buf[256];
+    char* save = NULL;
+
+    *cond = wan_profiles[0].cond;
+    if(snprintf(buf, sizeof(buf), "%s", spec) >= (int)sizeof(buf))
+        return -1;
+    for(char* item = strtok_r(buf, ",", &save); item; item = strtok_r(NULL, ",", &save))
+    {
+        char* eq = strchr(item, '=');
+        if(!eq)
+        {
+            size_t i;
+            for(i = 0; i < sizeof(wan_profiles) / sizeof(wan_profiles[0]); i ++)
+            {
+                if(strcmp(item, wan_profiles[i].name) == 0)
+                    break;
+            }
+            if(i == sizeof(wan_profiles) / sizeof(wan_profiles[0]))
+                return -1;
+            *cond = wan_profiles[i].cond;
+            continue;
+        }
+
+        char* end;
+        *eq = '\0';
+        double value = strtod(eq + 1, &end);
+        if(end == eq + 1 || *end != '\0' || !(value >= 0))
+            return -1;
+        if(strcmp(item, "delay") == 0)
+            cond->delay = value / 1e3;
+        else if(strcmp(item, "jitter") == 0)
+            cond->jitter = value / 1e3;
+        else if(strcmp(item, "rate") == 0)
+            cond->rate = value * 1e6 / 8;
+        else if(strcmp(item, "loss") == 0 && value <= 100)
+            cond->loss = value / 100;
+        else if(strcmp(item, "reset") == 0)
+            cond->reset = value;
+        else if(strcmp(item, "window") == 0 && value * 1024 >= WAN_MIN_WINDOW && value <= (1 << 20))
+            cond->window = (size_t)(value * 1024);
+        else
+            return -1;
+    }
+    return 0;
+}
+
+void wan_format(const WanConditions* cond, char* buf, size_t len)
+{
+    snprintf(buf, len, "delay=%g,jitter=%g,rate=%g,loss=%g,reset=%g,window=%zu", cond->delay * 1e3,
+             cond->jitter * 1e3, cond->rate * 8 / 1e6, cond->loss * 100, cond->reset, cond->window >> 10);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// [0, 1) 内均匀分布
+static double next_uniform(uint64_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (*state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// 排定一段数据的送达时间: 先在共享链路上排队发送, 再加上传播延迟和抖动, 丢包时再晚一个重传超时
+static uint64_t schedule_segment(WanPipe* pipe, size_t len, uint64_t now, uint64_t* rng)
+{
+    const WanConditions* cond = &proxy.cond;
+    uint64_t sent_at = now;
+
+    if(cond->rate > 0)
+    {
+        pthread_mutex_lock(&pipe->link->lock);
+        if(pipe->link->free_at < now)
+            pipe->link->free_at = now;
+        pipe->link->free_at += (uint64_t)(len * 1e9 / cond->rate);
+        sent_at = pipe->link->free_at;
+        pthread_mutex_unlock(&pipe->link->lock);
+    }
+
+    double delay = cond->delay + cond->jitter * (2 * next_uniform(rng) - 1);
+    if(cond->loss > 0)
+    {
+        double packets = (double)((len + WAN_PACKET_SIZE - 1) / WAN_PACKET_SIZE);
+        if(next_uniform(rng) < 1 - pow(1 - cond->loss, packets))
+            delay += 2 * cond->delay + WAN_MIN_RTO;
+    }
+    uint64_t due = sent_at + (delay > 0 ? (uint64_t)(delay * 1e9) : 0);
+    if(due < pipe->last_due)
+        due = pipe->last_due;
+    pipe->last_due = due;
+    return due;
+}
+
+// 从 from 读到窗口满或暂时没有数据; 连接出错返回 -1
+static int pipe_read(WanPipe* pipe, uint64_t* rng)
+{
+    while(!pipe->eof && pipe->queued < proxy.cond.window)
+    {
+        WanSegment* seg = malloc(sizeof(WanSegment) + WAN_SEGMENT);
+        if(!seg)
+            return -1;
+        ssize_t n = recv(pipe->from, seg->data, WAN_SEGMENT, MSG_DONTWAIT);
+        if(n <= 0)
+        {
+            free(seg);
+            if(n == 0)
+            {
+                pipe->eof = 1;
+                return 0;
+            }
+            if(errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        seg->next = NULL;
+        seg->len = n;
+        seg->sent = 0;
+        seg->due = schedule_segment(pipe, n, now_ns(), rng);
+        if(pipe->tail)
+            pipe->tail->next = seg;
+        else
+            pipe->head = seg;
+        pipe->tail = seg;
+        pipe->queued += n;
+    }
+    return 0;
+}
+
+// 写出所有已到送达时间的数据; 对端出错返回 -1, *blocked 表示 to 的发送缓冲区满了
+static int pipe_flush(WanPipe* pipe, uint64_t now, int* blocked)
+{
+    *blocked = 0;
+    while(pipe->head && pipe->head->due <= now)
+    {
+        WanSegment* seg = pipe->head;
+        ssize_t n = send(pipe->to, seg->data + seg->sent, seg->len - seg->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                *blocked = 1;
+                return 0;
+            }
+            return -1;
+        }
+        seg->sent += n;
+        pipe->bytes += n;
+        if(seg->sent < seg->len)
+            continue;
+        pipe->head = seg->next;
+        if(!pipe->head)
+            pipe->tail = NULL;
+        pipe->queued -= seg->len;
+        free(seg);
+    }
+
+    // 对端关闭了写, 数据都送达后把关闭也转发过去
+    if(!pipe->head && pipe->eof && !pipe->shut)
+    {
+        shutdown(pipe->to, SHUT_WR);
+        pipe->shut = 1;
+    }
+    return 0;
+}
+
+static void pipe_free(WanPipe* pipe)
+{
+    while(pipe->head)
+    {
+        WanSegment* seg = pipe->head;
+        pipe->head = seg->next;
+        free(seg);
+    }
+}
+
+// 关闭时发 RST 而不是 FIN
+static void reset_socket(int fd)
+{
+    struct linger linger = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(fd);
+}
+
+static void* wan_conn_thread(void* arg)
+{
+    WanConn* conn = (WanConn*)arg;
+    const WanConditions* cond = &proxy.cond;
+    WanPipe pipes[2];
+    const char* result = "closed";
+
+    int server_fd = open_clientfd(proxy.target_ip, proxy.target_port);
+    if(server_fd < 0)
+    {
+        if(proxy.log)
+            fprintf(proxy.log, "[%d] Failed to connect to %s:%d\n", conn->id, proxy.target_ip, proxy.target_port);
+        reset_socket(conn->client_fd);
+        free(conn);
+        return NULL;
+    }
+
+    memset(pipes, 0, sizeof(pipes));
+    pipes[0].from = pipes[1].to = conn->client_fd;
+    pipes[0].to = pipes[1].from = server_fd;
+    pipes[0].link = &proxy.links[0];
+    pipes[1].link = &proxy.links[1];
+
+    // 握手要一个来回: 客户端的第一个字节最早在建连后 1.5 个往返到达服务器
+    uint64_t start = now_ns();
+    pipes[0].last_due = start + (uint64_t)(3 * cond->delay * 1e9);
+    uint64_t reset_at = 0;
+    if(cond->reset > 0)
+        reset_at = start + (uint64_t)(-cond->reset * log(1 - next_uniform(&conn->rng)) * 1e9);
+    if(proxy.log)
+        fprintf(proxy.log, "[%d] Connected\n", conn->id);
+
+    while(!(pipes[0].shut && pipes[1].shut))
+    {
+        struct pollfd fds[2] = { { conn->client_fd, 0, 0 }, { server_fd, 0, 0 } };
+        uint64_t now = now_ns();
+        uint64_t wake = 0;
+        int failed = 0;
+
+        if(reset_at && now >= reset_at)
+        {
+            result = "reset";
+            break;
+        }
+
+        for(int i = 0; i < 2; i ++)
+        {
+            int blocked;
+            if(pipe_flush(&pipes[i], now, &blocked) < 0)
+            {
+                failed = 1;
+                break;
+            }
+            // fds[i] 是 pipes[i] 的来源, 也是 pipes[1 - i] 的去向
+            if(blocked)
+                fds[1 - i].events |= POLLOUT;
+            else if(pipes[i].head && (!wake || pipes[i].head->due < wake))
+                wake = pipes[i].head->due;
+            if(!pipes[i].eof && pipes[i].queued < cond->window)
+                fds[i].events |= POLLIN;
+        }
+        if(failed)
+        {
+            result = "aborted";
+            break;
+        }
+        if(reset_at && (!wake || reset_at < wake))
+            wake = reset_at;
+        // 不等待的一端不参与 poll, 否则半关闭后的 POLLHUP 会让 ppoll 一直立即返回
+        for(int i = 0; i < 2; i ++)
+        {
+            if(!fds[i].events)
+                fds[i].fd = -1;
+        }
+
+        struct timespec timeout, *ptimeout = NULL;
+        if(wake)
+        {
+            uint64_t wait = wake > now ? wake - now : 0;
+            timeout.tv_sec = wait / 1000000000ULL;
+            timeout.tv_nsec = wait % 1000000000ULL;
+            ptimeout = &timeout;
+        }
+        if(ppoll(fds, 2, ptimeout, NULL) < 0 && errno != EINTR)
+        {
+            result = "aborted";
+            break;
+        }
+
+        for(int i = 0; i < 2 && !failed; i ++)
+        {
+            if((fds[i].events & POLLIN) && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                failed = pipe_read(&pipes[i], &conn->rng) < 0;
+        }
+        if(failed)
+        {
+            result = "aborted";
+            break;
+        }
+    }
+
+    // 一端出错或模拟重置时两端都收到 RST, 正常结束时两个方向都已转发了 FIN
+    if(strcmp(result, "closed") == 0)
+    {
+        close(conn->client_fd);
+        close(server_fd);
+    }
+    else
+    {
+        reset_socket(conn->client_fd);
+        reset_socket(server_fd);
+    }
+    if(proxy.log)
+        fprintf(proxy.log, "[%d] Connection %s after %.3fs: %" PRIu64 " bytes up, %" PRIu64 " bytes down\n",
+                conn->id, result, (now_ns() - start) / 1e9, pipes[0].bytes, pipes[1].bytes);
+    pipe_free(&pipes[0]);
+    pipe_free(&pipes[1]);
+    free(conn);
+    return NULL;
+}
+
+static void* wan_accept_thread(void* arg)
+{
+    pthread_attr_t attr;
+    uint64_t seed = now_ns() | 1;
+    int id = 0;
+
+    (void)arg;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WAN_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while(1)
+    {
+        int fd = accept(proxy.listenfd, NULL, NULL);
+        if(fd < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+            {
+                if(errno == EMFILE || errno == ENFILE)
+                    usleep(10000);
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+
+        int optval = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+        WanConn* conn = malloc(sizeof(WanConn));
+        pthread_t thread;
+        if(!conn)
+        {
+            close(fd);
+            continue;
+        }
+        conn->client_fd = fd;
+        conn->id = ++ id;
+        conn->rng = seed * (uint64_t)(id + 1) | 1;
+        if(pthread_create(&thread, &attr, wan_conn_thread, conn) != 0)
+        {
+            close(fd);
+            free(conn);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return NULL;
+}
+
+int wan_proxy_start(int listen_port, const char* target_ip, int target_port, const WanConditions* cond,
+                    FILE* log)
+{
+    pthread_t thread;
+
+    proxy.cond = *cond;
+    if(proxy.cond.window < WAN_MIN_WINDOW)
+        proxy.cond.window = WAN_MIN_WINDOW;
+    snprintf(proxy.target_ip, sizeof(proxy.target_ip), "%s", target_ip);
+    proxy.target_port = target_port;
+    proxy.log = log;
+    proxy.listenfd = open_listenfd(listen_port, 0, 0);
+    if(proxy.listenfd < 0)
+        return -1;
+    if(pthread_create(&thread, NULL, wan_accept_thread, NULL) != 0)
+    {
+        close(proxy.listenfd);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,81 @@
+// wanproxy.c - lftp-wan: 在客户端和服务器之间模拟 Wi-Fi / 广域网的 TCP 代理
+// 例: 服务器 "server -P 5061", 代理 "lftp-wan -t 5061 wan", 客户端照常连 5060
+#define _GNU_SOURCE
+#include "transfer.h"
+#include "wan.h"
+#include <signal.h>
+
+int running = 1;
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: lftp-wan [-l port] -t [ip:]port [-v] [conditions]\n"
+            "  -l port       port to accept connections on (default %d)\n"
+            "  -t ip:port    server to forward to (default ip 127.0.0.1)\n"
+            "  -v            log every connection to stderr\n"
+            "  conditions    comma separated profile and settings, later ones override earlier ones:\n"
+            "                lan, wifi, wan, lossy,\n"
+            "                delay=ms (one way), jitter=ms, rate=Mbit/s (per direction, shared),\n"
+            "                loss=%% (per %d-byte packet), reset=s (mean connection lifetime),\n"
+            "                window=KB (bytes in flight per connection and direction)\n"
+            "                e.g. \"wan\", \"wifi,loss=1\", \"delay=40,jitter=5,rate=20\"\n", TCP_PORT, WAN_PACKET_SIZE);
+}
+
+int main(int argc, char* argv[])
+{
+    WanConditions cond;
+    char target_ip[INET_ADDRSTRLEN] = "127.0.0.1";
+    char spec[WAN_SPEC_LEN];
+    int listen_port = TCP_PORT, target_port = 0, verbose = 0;
+    int opt;
+
+    while((opt = getopt(argc, argv, "l:t:vh")) != -1)
+    {
+        switch(opt)
+        {
+            case 'l': listen_port = atoi(optarg); break;
+            case 't':
+            {
+                char* sep = strrchr(optarg, ':');
+                if(sep)
+                {
+                    *sep = '\0';
+                    snprintf(target_ip, sizeof(target_ip), "%s", optarg);
+                    optarg = sep + 1;
+                }
+                target_port = atoi(optarg);
+                break;
+            }
+            case 'v': verbose = 1; break;
+            default: usage(); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(listen_port <= 0 || listen_port > 65535 || target_port <= 0 || target_port > 65535 ||
+       listen_port == target_port || optind + 1 < argc)
+    {
+        usage();
+        return 1;
+    }
+    if(wan_parse(optind < argc ? argv[optind] : "lan", &cond) < 0)
+    {
+        fprintf(stderr, "Invalid conditions: %s\n", argv[optind]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stderr, NULL, _IOLBF, 0);
+    if(wan_proxy_start(listen_port, target_ip, target_port, &cond, verbose ? stderr : NULL) < 0)
+    {
+        perror("Failed to listen");
+        return 1;
+    }
+    wan_format(&cond, spec, sizeof(spec));
+    printf("Forwarding port %d to %s:%d with %s\n", listen_port, target_ip, target_port, spec);
+    fflush(stdout);
+
+    // 代理在后台线程中运行, 直到进程被终止
+    while(1)
+        pause();
+    return 0;
+}
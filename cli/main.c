@@ -2,6 +2,7 @@
 #include "color.h"
 #include "discovery.h"
 #include "shell.h"
+#include "log.h"
 #include <pthread.h>
 #include <signal.h>
 
@@ -31,6 +32,8 @@ int main() {
 
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    // 对端提前断开时 send/sendfile 返回 EPIPE, 而不是结束进程
+    signal(SIGPIPE, SIG_IGN);
 
     //  启动发现系统
     start_discovery_system();
@@ -44,6 +47,8 @@ int main() {
     printf(COLOR_GREEN"Enter 'exit' Exit lftp\n\n"COLOR_RESET);
     
     while (1) {
+        // 先输出已记录的日志, 不让它们插在提示符后面
+        log_flush();
         printf(COLOR_GREEN"(lftp)%s > "COLOR_RESET, cwd);
         fflush(stdout);
 
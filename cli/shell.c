@@ -2,6 +2,8 @@
 #include "shell.h"
 #include "discovery.h"
 #include "transfer.h"
+#include "transfer_engine.h"
+#include "telemetry.h"
 #include "color.h"
 
 
@@ -75,17 +77,95 @@ void print_help() {
     printf("  list users    - Show online devices\n");
     printf(COLOR_MAGENTA"\nServer Mode:\n"COLOR_RESET);
     printf("  server [-u user] [-p pass] [-r path] [-P port]  - Start TCP server\n");
+    printf("         [-w workers] [-q queue]                  - Worker threads / pending queue\n");
+    printf("         [-b backlog] [-R]                        - Listen backlog / per-cpu listeners\n");
+    printf("         [-i posix|uring|copy]                    - Transfer I/O backend\n");
+    printf("         [-D]                                     - Deduplicate uploaded chunks\n");
     printf("  stop                                            - Stop TCP server\n");
     printf(COLOR_MAGENTA"\nFile Transfer:\n"COLOR_RESET);
     printf("  put <IP> [-u user] [-p pass] <file>  - Upload file to server\n");
     printf("  get <IP> [-u user] [-p pass] <file>  - Download file from server\n");
+    printf("      [-j N]                           - Transfer byte ranges over N parallel connections\n");
+    printf("      [-r] <dir>                       - Transfer a directory tree (-j N: files over N connections)\n");
+    printf("      [-m]                             - Share one multiplexed connection with other transfers\n");
+    printf("      [-d]                             - put: send only the parts that differ from the server's copy\n");
+    printf("      [-z]                             - Compress data chunks (incompressible ones are sent as is)\n");
+    printf("      [-k]                             - put: checksum chunks and resend corrupt ones (no zero-copy)\n");
+    printf("  mput <IP> [-u user] [-p pass] <pattern>...  - Upload matching files over one connection\n");
+    printf("  mget <IP> [-u user] [-p pass] <pattern>...  - Download matching server files over one connection\n");
+    printf("  [-c high|normal|low]                 - Priority class (transfers run in the background)\n");
+    printf(COLOR_MAGENTA"\nJobs:\n"COLOR_RESET);
+    printf("  jobs          - List queued, running and finished transfers\n");
+    printf("  wait [id]     - Wait for a transfer (or all transfers) to finish\n");
+    printf("  cancel <id>   - Cancel a queued or running transfer\n");
+    printf("  stats         - Show live per-connection throughput and transfer counters\n");
     printf(COLOR_MAGENTA"\nGeneral:\n"COLOR_RESET);
+    printf("  log [debug|info|warn|error] [-f file|off]  - Set log level and log file (discovery is debug)\n");
     printf("  help          - Show this help\n");
     printf("  exit          - Exit program\n");
     printf("  clear         - Clear screen\n");
     printf(COLOR_MAGENTA"================================\n\n"COLOR_RESET);
 }
 
+// 传输命令作为后台任务提交: -c 指定优先级, 从参数中去掉后交给命令解析函数
+static void submit_transfer(int argc, char* argv[], JobFunc func)
+{
+    char* job_argv[64];
+    int job_argc = 0;
+    int priority = JOB_PRIO_NORMAL;
+    int recursive = 0;
+    char* filename = NULL;
+    uint64_t size = ENGINE_SIZE_UNKNOWN;
+
+    for(int i = 0; i < argc; i ++)
+    {
+        if(strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            priority = engine_parse_priority(argv[++i]);
+            if(priority < 0)
+            {
+                printf("Unknown priority class: %s (high, normal or low)\n", argv[i]);
+                return;
+            }
+            continue;
+        }
+        if(i >= 2 && (strcmp(argv[i], "-u") == 0 || strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "-j") == 0) &&
+           i + 1 < argc)
+        {
+            job_argv[job_argc ++] = argv[i ++];
+        }
+        else if(i >= 2 && strcmp(argv[i], "-r") == 0)
+        {
+            recursive = 1;
+        }
+        else if(i >= 2 && argv[i][0] != '-')
+        {
+            filename = argv[i];
+        }
+        job_argv[job_argc ++] = argv[i];
+    }
+    job_argv[job_argc] = NULL;
+
+    if(job_argc < 2)
+    {
+        printf("Missing server address\n");
+        return;
+    }
+
+    // 上传单个文件时按文件大小调度, 其它传输的大小事先未知
+    struct stat file_stat;
+    if(strcmp(job_argv[0], "put") == 0 && !recursive && filename && stat(filename, &file_stat) == 0)
+        size = file_stat.st_size;
+
+    int id = engine_submit(func, job_argc, job_argv, priority, job_argv[1], size);
+    if(id < 0)
+    {
+        printf(COLOR_RED"Failed to queue transfer\n"COLOR_RESET);
+        return;
+    }
+    printf("[%d] queued\n", id);
+}
+
 // Unix专用的命令执行
 void execute_command(char *input) {
     char *args[64];
@@ -117,11 +197,32 @@ void execute_command(char *input) {
     }
     else if (strcmp(args[0], "put") == 0 || strcmp(args[0], "get") == 0)
     {
-        // 传输文件
-        if(parse_transfer_command(i, args) != 0)
-        {
-            printf(COLOR_RED"Failed to transfer file\n"COLOR_RESET);
-        }
+        // 传输文件, 在后台运行
+        submit_transfer(i, args, parse_transfer_command);
+    }
+    else if (strcmp(args[0], "mput") == 0 || strcmp(args[0], "mget") == 0)
+    {
+        // 批量传输, 一个连接上连续发送
+        submit_transfer(i, args, parse_batch_command);
+    }
+    else if (strcmp(args[0], "jobs") == 0) {
+        engine_list();
+    }
+    else if (strcmp(args[0], "wait") == 0) {
+        // 不带任务号时等待所有任务
+        engine_wait(i > 1 ? atoi(args[1]) : 0);
+    }
+    else if (strcmp(args[0], "log") == 0) {
+        parse_log_command(i, args);
+    }
+    else if (strcmp(args[0], "stats") == 0) {
+        telemetry_print();
+    }
+    else if (strcmp(args[0], "cancel") == 0) {
+        if(i < 2)
+            printf("Usage: cancel <id>\n");
+        else
+            engine_cancel(atoi(args[1]));
     }
     else if (strcmp(args[0], "server") == 0) {
         // 启动服务器
@@ -1,33 +1,48 @@
 // client.c
+#define _GNU_SOURCE
 #include "discovery.h"
 #include "transfer.h"
+#include "progress.h"
+#include "journal.h"
+#include "conn_pool.h"
+#include "pack.h"
+#include "tree.h"
+#include "transfer_engine.h"
+#include "mux.h"
+#include "delta.h"
+#include "dedup.h"
+#include "compress.h"
+#include "telemetry.h"
 #include <sys/stat.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <sys/random.h>
+#include <sys/mman.h>
+#include <glob.h>
+#include <semaphore.h>
 
 
-// 发送文件给服务器， 返回 0 表示成功
-int send_tcp_file(const char* filename, const char* ip, int port, const char*username, const char* password)
+// 连接服务器, 完成认证和协议协商, 成功返回 socket, proto 为协商的版本
+// 返回的连接由 conn_pool_release 归还: 服务器回到等待文件头的状态时可以留给下一次传输
+// features 不为 NULL 时填入双方都支持的可选功能
+static int connect_server(const char* ip, int port, const char* username, const char* password, int* proto,
+                          uint16_t* features)
 {
-    int sockfd;
-    struct stat file_stat;
-
-    // 检查文件是否存在
-    if(stat(filename, &file_stat) != 0)
-    {
-        printf("File not found: %s \n", filename);
-        return -1;
-    }
+    uint16_t agreed;
 
-    if(!S_ISREG(file_stat.st_mode))
+    // 先复用池里同一服务器、同一用户的空闲连接, 省掉 TCP 握手和认证
+    int pooled = conn_pool_acquire(ip, port, username, password, proto, &agreed);
+    if(pooled >= 0)
     {
-        printf("Not a regular file: %s \n", filename);
-        return -1;
+        if(features)
+            *features = agreed;
+        engine_track_socket(pooled);
+        telemetry_attach(pooled, ip, port, engine_job_id());
+        return pooled;
     }
 
-    // 连接到服务器
-    sockfd = open_clientfd(ip, port);
+    int sockfd = open_clientfd(ip, port);
     if(sockfd < 0)
     {
         return -1;
@@ -50,174 +65,1624 @@ int send_tcp_file(const char* filename, const char* ip, int port, const char*use
         return -1;
     }
 
-    // 发送文件头 - 这里是只传输了一个文件的全部信息， todo 传输多个文件
-    if(send_file_header(sockfd, CMD_PUT_FILE, file_stat.st_size, strlen(filename)))
+    // 协商协议版本, 老服务器只支持 v1
+    *proto = negotiate_protocol(sockfd, &agreed);
+    if(*proto < 0)
     {
-        printf("Failed to send file header \n");
+        printf("Failed to negotiate protocol version\n");
         close(sockfd);
-        return -1;       
+        return -1;
+    }
+    if(features)
+        *features = agreed;
+    conn_pool_add(sockfd, ip, port, username, password, *proto, agreed);
+    // 后台任务登记连接, cancel 时断开
+    engine_track_socket(sockfd);
+    telemetry_attach(sockfd, ip, port, engine_job_id());
+    return sockfd;
+}
+
+// 续传上传的握手: 发送带 FILE_FLAG_RESUME 的文件头, 服务器回复已有的数据长度
+static int request_upload_resume(int sockfd, const char* filename, const struct stat* file_stat, uint64_t* offset)
+{
+    FileHeader header;
+    uint16_t name_len = strlen(filename);
+
+    encode_file_header(&header, PROTOCOL_V2, CMD_PUT_FILE, file_stat->st_size, name_len);
+    header.flags = htons(FILE_FLAG_RESUME);
+    header.session = htonl(file_stamp(file_stat));
+    if(send(sockfd, &header, sizeof(FileHeader), MSG_MORE) != sizeof(FileHeader) ||
+       send(sockfd, filename, name_len, 0) != name_len ||
+       receive_file_header(sockfd, &header) < 0)
+        return -1;
+
+    *offset = file_header_offset(&header);
+    if(header.command != CMD_RESUME || *offset > (uint64_t)file_stat->st_size)
+    {
+        printf("File transfer failed (server rejected)\n");
+        return -1;
+    }
+    if(*offset > 0)
+        printf("Resuming upload at %" PRIu64 "/%ld bytes\n", *offset, (long)file_stat->st_size);
+    return 0;
+}
+
+// 去重上传: 连接已经建立, 返回 0 表示成功; 文件块太多时返回 DEDUP_FALLBACK, 连接仍可用于普通上传
+static int send_tcp_file_dedup(int sockfd, const char* filename, const struct stat* file_stat)
+{
+    DedupStats stats;
+
+    int file_fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if(file_fd < 0)
+    {
+        perror("Failed to open file");
+        conn_pool_release(sockfd, 1);
+        return -1;
+    }
+
+    printf("Sending file: %s (Size  %ld bytes, deduplicated)\n", filename, (long)file_stat->st_size);
+    int ret = send_file_dedup(sockfd, filename, file_fd, file_stat->st_size, &stats);
+    close(file_fd);
+    if(ret == DEDUP_FALLBACK)
+        return ret;
+    if(ret > 0)
+    {
+        // 服务器拒绝后关闭连接, 不放回连接池
+        printf("Server rejected file request\n");
+        conn_pool_release(sockfd, 0);
+        return -1;
+    }
+
+    FileHeader response;
+    if(ret < 0 || receive_file_header(sockfd, &response) < 0)
+    {
+        printf("failed to receive response from server \n");
+        conn_pool_release(sockfd, 0);
+        return -1;
+    }
+    conn_pool_release(sockfd, 1);
+    if(response.command != CMD_ACK)
+    {
+        printf("File transfer failed (server rejected)\n");
+        return -1;
+    }
+    printf("File transfer completed successfully: %u of %u chunks sent (%" PRIu64 " bytes)\n",
+           stats.sent_chunks, stats.chunks, stats.sent);
+    return 0;
+}
+
+// 发送文件给服务器， 返回 0 表示成功
+// 服务器支持续传时, 从服务器日志记录的位置继续发送; 服务器开启去重时只上传它没有的块
+// options 为 PUT_* 的组合: PUT_COMPRESS 且服务器支持时压缩数据块, PUT_CRC 且服务器支持时数据块带 CRC32C
+int send_tcp_file_options(const char* filename, const char* ip, int port, const char*username, const char* password,
+                          int options)
+{
+    int compress = options & PUT_COMPRESS;
+    int sockfd;
+    struct stat file_stat;
+    uint64_t offset = 0;
+
+    // 检查文件是否存在
+    if(stat(filename, &file_stat) != 0)
+    {
+        printf("File not found: %s \n", filename);
+        return -1;
+    }
+
+    if(!S_ISREG(file_stat.st_mode))
+    {
+        printf("Not a regular file: %s \n", filename);
+        return -1;
+    }
+
+    // 连接到服务器
+    int proto;
+    uint16_t features;
+    sockfd = connect_server(ip, port, username, password, &proto, &features);
+    if(sockfd < 0)
+    {
+        return -1;
+    }
+
+    if(proto >= PROTOCOL_V2 && (features & FEATURE_DEDUP))
+    {
+        int ret = send_tcp_file_dedup(sockfd, filename, &file_stat);
+        if(ret != DEDUP_FALLBACK)
+            return ret;
+    }
+
+    if(proto >= PROTOCOL_V2 && (features & FEATURE_RESUME))
+    {
+        if(request_upload_resume(sockfd, filename, &file_stat, &offset) < 0)
+        {
+            conn_pool_release(sockfd, 0);
+            return -1;
+        }
     }
+    else
+    {
+        // 发送文件头 - 这里只传输一个文件, 多个文件用 mput / mget 在一个连接上连续传输
+        if(send_file_header(sockfd, proto, CMD_PUT_FILE, file_stat.st_size, strlen(filename)))
+        {
+            printf("Failed to send file header \n");
+            conn_pool_release(sockfd, 0);
+            return -1;
+        }
 
-    // 发送文件名称
-    send(sockfd, filename, strlen(filename), 0);
+        // 发送文件名称
+        send(sockfd, filename, strlen(filename), 0);
+    }
 
     // 传输数据
     int file_fd = open(filename, O_RDONLY);
-    off_t offset = 0;
+    if(file_fd < 0)
+    {
+        perror("Failed to open file");
+        conn_pool_release(sockfd, 0);
+        return -1;
+    }
 
     printf("Sending file: %s (Size  %ld bytes)\n", filename, (long)file_stat.st_size);
+    if(compress && !(proto >= PROTOCOL_V2 && (features & FEATURE_COMPRESS)))
+    {
+        printf("Server does not support compression, sending uncompressed\n");
+        compress = 0;
+    }
 
-    // todo ： 大文件传输的时候考虑sendfile + 分块 + epoll
-    ssize_t sent = sendfile(sockfd, file_fd, &offset, file_stat.st_size);
+    if((options & PUT_CRC) && !(proto >= PROTOCOL_V2 && (features & FEATURE_CRC)))
+        printf("Server does not support chunk checksums, sending without them\n");
 
-    if(sent != file_stat.st_size)
+    // v1 数据紧跟文件名发送, v2 按数据块发送; put -k 时每块带 CRC32C, 校验失败的块单独重传
+    // CRC 要在用户态读出数据计算, 不带 CRC 时两端才能用 sendfile / splice 零拷贝
+    int sent;
+    int crc = (options & PUT_CRC) && proto >= PROTOCOL_V2 && (features & FEATURE_CRC);
+    CompressStats stats;
+    if(compress)
+        sent = send_file_range_compress(sockfd, file_fd, offset, file_stat.st_size - offset, crc, &stats) < 0 ? -1
+                                                                                                              : send_chunk_end(sockfd);
+    else if(crc)
+        sent = send_file_range_crc(sockfd, file_fd, offset, file_stat.st_size - offset) < 0 ? -1 : send_chunk_end(sockfd);
+    else if(proto >= PROTOCOL_V2)
+        sent = send_file_range(sockfd, file_fd, offset, file_stat.st_size - offset) < 0 ? -1 : send_chunk_end(sockfd);
+    else
+        sent = send_file_data(sockfd, file_fd, 0, file_stat.st_size);
+    if(sent < 0)
     {
-        printf("File transfer incomplete: sent %ld/%ld bytes\n", sent, (long)file_stat.st_size);
         close(file_fd);
-        close(sockfd); 
+        conn_pool_release(sockfd, 0); 
         return -1;
     }
 
     // 等待服务器发送的确认消息， todo:如果是 NAK 就重试N次
     FileHeader response;
-    int ret = receive_file_header(sockfd, &response);
+    int ret = crc ? receive_upload_reply(sockfd, file_fd, &response) : receive_file_header(sockfd, &response);
     close(file_fd);
 
     if(ret >= 0)
     {
         if(response.command == CMD_ACK)
         {
-            printf("File transfer completed successfully\n");
-            close(sockfd);
+            if(compress)
+                printf("File transfer completed successfully: %" PRIu64 " bytes sent as %" PRIu64
+                       " (%u chunks compressed, %u sent as is)\n",
+                       stats.raw, stats.wire, stats.compressed, stats.bypassed);
+            else
+                printf("File transfer completed successfully\n");
+            conn_pool_release(sockfd, 1);
             return 0;
         }
         else
         {
             printf("File transfer failed (server rejected)\n");
-            close(sockfd);
+            conn_pool_release(sockfd, 1);
             return -1;
         }
     }
     printf("failed to receive response from server \n");
-    close(sockfd);
+    conn_pool_release(sockfd, 0);
     return -1;
 }
 
+int send_tcp_file(const char* filename, const char* ip, int port, const char*username, const char* password)
+{
+    return send_tcp_file_options(filename, ip, port, username, password, 0);
+}
+
+
+// 续传下载的请求: 带上本地日志记录的文件大小、标识和已有的长度
+static int request_download_resume(int sockfd, const char* filename, const TransferJournal* journal, uint64_t offset,
+                                   uint16_t flags)
+{
+    FileHeader header;
+    uint16_t name_len = strlen(filename);
+
+    encode_file_header(&header, PROTOCOL_V2, CMD_GET_FILE, journal->size, name_len);
+    header.flags = htons(FILE_FLAG_RESUME | flags);
+    header.session = htonl(journal->stamp);
+    set_file_header_offset(&header, offset);
+    if(send(sockfd, &header, sizeof(FileHeader), MSG_MORE) != sizeof(FileHeader) ||
+       send(sockfd, filename, name_len, 0) != name_len)
+        return -1;
+    return 0;
+}
 
 // 从服务器取出文件， 返回 0 表示成功
-int receive_tcp_file(const char* filename, const char* ip, int port, const char*username, const char* password)
+// 服务器支持续传时, 本地文件旁边的日志记录已收到的数据, 中断后再次 get 从断点继续
+// compress 非 0 且服务器支持时请求压缩发送, 压缩请求随续传请求一起发送
+static int receive_tcp_file_with(const char* filename, const char* ip, int port, const char*username,
+                                 const char* password, int compress)
 {
     int sockfd;
+    int file_fd = -1;
+    int resume, created = 0;
+    uint64_t offset = 0;
+    TransferJournal journal;
 
     FileHeader header;
 
     // 连接到服务器
-    sockfd = open_clientfd(ip, port);
+    int proto;
+    uint16_t features;
+    sockfd = connect_server(ip, port, username, password, &proto, &features);
     if(sockfd < 0)
     {
         return -1;
     }
-    printf("Connect to %s:%d\n", ip, port);
 
-    // 发送认证消息
-    if(send_auth_request(sockfd, username, password) < 0) 
+    resume = proto >= PROTOCOL_V2 && (features & FEATURE_RESUME);
+    if(compress && !(resume && (features & FEATURE_COMPRESS)))
     {
-        printf("Authentication failed \n");
-        close(sockfd);
-        return -1;
+        printf("Server does not support compression, receiving uncompressed\n");
+        compress = 0;
     }
-
-    // 接受认证响应
-    if(receive_auth_reponse(sockfd) <= 0)
+    if(resume)
     {
-        printf("Authentication rejected by server \n");
-        close(sockfd);
-        return -1;
+        // 保留已有内容, 服务器确认文件没变后才决定是否截断; 请求失败时删掉新建的空文件
+        file_fd = open(filename, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        created = file_fd >= 0;
+        if(file_fd < 0 && errno == EEXIST)
+            file_fd = open(filename, O_WRONLY | O_CLOEXEC);
+        if(file_fd < 0)
+        {
+            perror("Failed to create file\n");
+            conn_pool_release(sockfd, 1);
+            return -1;
+        }
+        offset = journal_load(&journal, filename, file_fd);
+        if(request_download_resume(sockfd, filename, &journal, offset, compress ? FILE_FLAG_COMPRESS : 0) < 0)
+        {
+            printf("Failed to send file header \n");
+            goto fail;
+        }
     }
-
-    // 发送文件头 - 这里是只传输了一个文件的全部信息， todo 传输多个文件
-    if(send_file_header(sockfd, CMD_GET_FILE, 0, strlen(filename)))
+    else
     {
-        printf("Failed to send file header \n");
-        close(sockfd);
-        return -1;       
-    }
+        // 发送文件头 - 这里只传输一个文件, 多个文件用 mput / mget 在一个连接上连续传输
+        if(send_file_header(sockfd, proto, CMD_GET_FILE, 0, strlen(filename)))
+        {
+            printf("Failed to send file header \n");
+            conn_pool_release(sockfd, 0);
+            return -1;
+        }
 
-    // 发送文件名称
-    send(sockfd, filename, strlen(filename), 0);
+        // 发送文件名称
+        send(sockfd, filename, strlen(filename), 0);
+    }
 
     // 接收文件头 - 包含文件的大小和文件名的大小
     if(receive_file_header(sockfd, &header) < 0)
     {
         printf("Failed to receive file header");
-        close(sockfd);
-        return -1;
+        goto fail;
     }
 
     if(header.command != CMD_GET_FILE)
     {
         printf("Server rejected file request\n");
-        close(sockfd);
-        return -1;
+        goto fail;
     }
 
     // 接收文件名
     char received_filename[MAX_FILENAME_LEN];
-    if(recv(sockfd, received_filename, header.filename_len, 0) != header.filename_len)
+    if(header.filename_len >= MAX_FILENAME_LEN ||
+       recv(sockfd, received_filename, header.filename_len, MSG_WAITALL) != header.filename_len)
     {
         printf("Failed to receive filename\n");
-        close(sockfd);
-        return -1;
+        goto fail;
     }
     received_filename[header.filename_len] = '\0';
 
-    printf("Receiving file: %s (Size: %u bytes)\n", received_filename, header.filesize);
+    uint64_t file_size = file_header_size(&header);
+    printf("Receiving file: %s (Size: %" PRIu64 " bytes)\n", received_filename, file_size);
 
-    // 接收文件内容
-    FILE* file = fopen(received_filename, "wb");
-    if(!file)
+    if(resume)
     {
-        perror("Failed to create file\n");
-        close(sockfd);
-        return -1;
-    }
-
-    char buffer[65536];
-    uint32_t total_received = 0;
-    ssize_t bytes_received;
-    
-    while (total_received < header.filesize) {
-        size_t to_receive = sizeof(buffer);
-        if (header.filesize - total_received < to_receive) {
-            to_receive = header.filesize - total_received;
+        // 服务器从 start 开始发送: 等于日志记录的位置时续传, 为 0 时文件已变, 从头接收
+        uint64_t start = file_header_offset(&header);
+        offset = journal_open(&journal, filename, file_fd, file_size, header.session);
+        if(start == 0)
+        {
+            offset = 0;
+            journal.count = 0;
+            if(ftruncate(file_fd, 0) < 0)
+            {
+                perror("ftruncate");
+                goto fail;
+            }
         }
-        
-        bytes_received = recv(sockfd, buffer, to_receive, 0);
-        if (bytes_received <= 0) {
-            send_response(sockfd, CMD_NAK);
-            printf("Connection error during file transfer\n");
-            fclose(file);
-            close(sockfd);
-            return -1;
+        else if(start != offset)
+        {
+            printf("Server resumed at an unexpected offset %" PRIu64 "\n", start);
+            goto fail;
+        }
+        else
+        {
+            printf("Resuming download at %" PRIu64 "/%" PRIu64 " bytes\n", offset, file_size);
         }
-        
-        fwrite(buffer, 1, bytes_received, file);
-        total_received += bytes_received;
-        
-        // 显示进度
-        if (header.filesize > 0) {
-            float progress = (float)total_received / header.filesize * 100;
-            printf("\rProgress: %.1f%% (%u/%u bytes)", 
-                   progress, total_received, header.filesize);
-            fflush(stdout);
+    }
+    else
+    {
+        // 接收文件内容
+        file_fd = open(received_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(file_fd < 0)
+        {
+            perror("Failed to create file\n");
+            conn_pool_release(sockfd, 0);
+            return -1;
         }
     }
 
+    // 进度由独立线程定时打印, 接收路径只累加计数
+    TransferProgress progress;
+    progress_start(&progress, file_size - offset);
+    int ret = proto >= PROTOCOL_V2 ? receive_file_chunks(sockfd, file_fd, offset, file_size - offset, &progress,
+                                                         resume ? &journal : NULL)
+                                   : receive_file_data(sockfd, file_fd, 0, file_size, &progress);
+    progress_finish(&progress);
+
+    // 中断时保存日志, 下次从断点继续; 完成后删除
+    if(resume)
+    {
+        if(ret < 0)
+            journal_save(&journal);
+        else
+            journal_remove(&journal);
+    }
+    close(file_fd);
+
+    if(ret < 0)
+    {
+        send_response(sockfd, CMD_NAK);
+        conn_pool_release(sockfd, 0);
+        return -1;
+    }
+
     send_response(sockfd, CMD_ACK);
-    printf("\nFile received successfully: %s\n", received_filename);
-    
-    fclose(file);
-    close(sockfd);
+    printf("File received successfully: %s\n", received_filename);
+
+    conn_pool_release(sockfd, 1);
     return 0;   
 
-}
\ No newline at end of file
+fail:
+    if(file_fd >= 0)
+        close(file_fd);
+    if(created)
+        unlink(filename);
+    conn_pool_release(sockfd, 0);
+    return -1;
+}
+
+int receive_tcp_file(const char* filename, const char* ip, int port, const char*username, const char* password)
+{
+    return receive_tcp_file_with(filename, ip, port, username, password, 0);
+}
+
+// get -z: 请求服务器压缩发送, 服务器不支持时照常接收
+int receive_tcp_file_compress(const char* filename, const char* ip, int port, const char* username,
+                              const char* password)
+{
+    return receive_tcp_file_with(filename, ip, port, username, password, 1);
+}
+
+
+// 发送范围请求并读取回复的文件头和文件名, 成功返回 0
+static int request_range(int sockfd, const char* filename, uint64_t offset, uint64_t length, FileHeader* response)
+{
+    FileHeader header;
+    char name[MAX_FILENAME_LEN];
+    uint16_t name_len = strlen(filename);
+
+    encode_file_header(&header, PROTOCOL_V2, CMD_GET_RANGE, length, name_len);
+    set_file_header_offset(&header, offset);
+    if(send(sockfd, &header, sizeof(FileHeader), MSG_MORE) != sizeof(FileHeader) ||
+       send(sockfd, filename, name_len, 0) != name_len)
+        return -1;
+
+    if(receive_file_header(sockfd, response) < 0)
+        return -1;
+    if(response->command != CMD_GET_RANGE)
+    {
+        printf("Server rejected file request\n");
+        return -1;
+    }
+
+    if(response->filename_len >= MAX_FILENAME_LEN ||
+       recv(sockfd, name, response->filename_len, MSG_WAITALL) != response->filename_len)
+        return -1;
+    return 0;
+}
+
+// get -j / put -j 的共享状态: 文件切成固定大小的范围, 各连接轮流领取下一个
+typedef struct {
+    const char* filename;
+    const char* ip;
+    int port;
+    const char* username;
+    const char* password;
+    int file_fd;
+    uint64_t size;
+    uint64_t range_size;
+    uint64_t next;                  // 下一个未领取范围的起点, 原子更新
+    int failed;                     // 任一连接出错后其他连接不再领取
+    TransferProgress* progress;
+    uint32_t session;               // put -j: 服务器用来把各连接归到同一个文件
+    int crc;                        // put -j -k: 服务器支持 FEATURE_CRC, 数据块带 CRC32C
+} RangeTransfer;
+
+typedef struct {
+    RangeTransfer* job;
+    int sockfd;                     // -1 表示需要自己建立连接
+    pthread_t thread;
+} RangeStream;
+
+// 范围切得比连接数多, 快的连接多取; 不小于一个数据块. 返回实际需要的连接数
+static int plan_ranges(RangeTransfer* job, int streams)
+{
+    uint64_t ranges = (uint64_t)streams * GET_RANGES_PER_STREAM;
+
+    job->range_size = (job->size + ranges - 1) / ranges;
+    if(job->range_size < CHUNK_SIZE)
+        job->range_size = CHUNK_SIZE;
+    if((job->size + job->range_size - 1) / job->range_size < (uint64_t)streams)
+        streams = job->size ? (job->size + job->range_size - 1) / job->range_size : 1;
+    return streams;
+}
+
+// 一个连接: 反复领取范围, 下载后写到文件对应位置
+static void* range_stream_thread(void* arg)
+{
+    RangeStream* stream = (RangeStream*)arg;
+    RangeTransfer* job = stream->job;
+    FileHeader response;
+    int proto = PROTOCOL_V2;
+
+    if(stream->sockfd < 0)
+        stream->sockfd = connect_server(job->ip, job->port, job->username, job->password, &proto, NULL);
+    if(stream->sockfd < 0 || proto < PROTOCOL_V2)
+    {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    while(!__atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+    {
+        uint64_t offset = __atomic_fetch_add(&job->next, job->range_size, __ATOMIC_RELAXED);
+        if(offset >= job->size)
+            break;
+        uint64_t length = job->size - offset < job->range_size ? job->size - offset : job->range_size;
+
+        if(request_range(stream->sockfd, job->filename, offset, length, &response) < 0 ||
+           file_header_size(&response) != job->size ||
+           receive_file_chunks(stream->sockfd, job->file_fd, offset, length, job->progress, NULL) < 0)
+        {
+            printf("Failed to download range %" PRIu64 "-%" PRIu64 "\n", offset, offset + length);
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        send_response(stream->sockfd, CMD_ACK);
+    }
+    return NULL;
+}
+
+// 用 streams 个连接并行下载文件的不同范围, 返回 0 表示成功
+// 服务器只支持 v1 时退回单连接下载
+int receive_tcp_file_parallel(const char* filename, const char* ip, int port, const char* username, const char* password,
+                              int streams)
+{
+    RangeTransfer job;
+    RangeStream stream[MAX_GET_STREAMS];
+    FileHeader response;
+    int proto, started = 0;
+
+    if(streams <= 1)
+        return receive_tcp_file(filename, ip, port, username, password);
+    if(streams > MAX_GET_STREAMS)
+        streams = MAX_GET_STREAMS;
+
+    int sockfd = connect_server(ip, port, username, password, &proto, NULL);
+    if(sockfd < 0)
+        return -1;
+    if(proto < PROTOCOL_V2)
+    {
+        printf("Server does not support range requests, using a single stream\n");
+        conn_pool_release(sockfd, 1);
+        return receive_tcp_file(filename, ip, port, username, password);
+    }
+
+    // 长度为 0 的范围只取回文件大小
+    if(request_range(sockfd, filename, 0, 0, &response) < 0 ||
+       receive_file_chunks(sockfd, -1, 0, 0, NULL, NULL) < 0)
+    {
+        conn_pool_release(sockfd, 0);
+        return -1;
+    }
+    send_response(sockfd, CMD_ACK);
+
+    memset(&job, 0, sizeof(job));
+    job.filename = filename;
+    job.ip = ip;
+    job.port = port;
+    job.username = username;
+    job.password = password;
+    job.size = file_header_size(&response);
+
+    // 预分配目标文件, 各范围直接写到最终位置
+    job.file_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(job.file_fd < 0)
+    {
+        perror("Failed to create file\n");
+        conn_pool_release(sockfd, 1);
+        return -1;
+    }
+    if(job.size > 0 && fallocate(job.file_fd, 0, 0, job.size) < 0 && ftruncate(job.file_fd, job.size) < 0)
+    {
+        perror("Failed to preallocate file");
+        close(job.file_fd);
+        conn_pool_release(sockfd, 1);
+        return -1;
+    }
+
+    streams = plan_ranges(&job, streams);
+
+    printf("Receiving file: %s (Size: %" PRIu64 " bytes) over %d streams\n", filename, job.size, streams);
+
+    TransferProgress progress;
+    progress_start(&progress, job.size);
+    job.progress = &progress;
+
+    // 第一个连接已经建立, 由当前线程使用
+    stream[0].job = &job;
+    stream[0].sockfd = sockfd;
+    for(started = 1; started < streams; started ++)
+    {
+        stream[started].job = &job;
+        stream[started].sockfd = -1;
+        if(engine_thread_create(&stream[started].thread, range_stream_thread, &stream[started]) != 0)
+            break;
+    }
+    range_stream_thread(&stream[0]);
+
+    for(int i = 1; i < started; i ++)
+        pthread_join(stream[i].thread, NULL);
+    for(int i = 0; i < started; i ++)
+    {
+        if(stream[i].sockfd >= 0)
+            conn_pool_release(stream[i].sockfd, !job.failed);
+    }
+    progress_finish(&progress);
+    close(job.file_fd);
+
+    if(job.failed)
+    {
+        printf("Parallel download failed: %s\n", filename);
+        return -1;
+    }
+    printf("File received successfully: %s\n", filename);
+    return 0;
+}
+
+
+// put -j 的一个连接: 发送 CMD_PUT_RANGE 后反复领取范围并发送数据块
+// 服务器在所有连接的范围都写入后才回复 ACK
+static void* range_upload_thread(void* arg)
+{
+    RangeStream* stream = (RangeStream*)arg;
+    RangeTransfer* job = stream->job;
+    FileHeader header;
+    uint16_t name_len = strlen(job->filename);
+    int proto = PROTOCOL_V2;
+
+    // 连不上的连接不领取范围, 其余连接会把数据发完
+    if(stream->sockfd < 0)
+        stream->sockfd = connect_server(job->ip, job->port, job->username, job->password, &proto, NULL);
+    if(stream->sockfd < 0 || proto < PROTOCOL_V2)
+    {
+        printf("Upload stream unavailable, continuing with the others\n");
+        if(stream->sockfd >= 0)
+            conn_pool_release(stream->sockfd, 1);
+        stream->sockfd = -1;
+        return NULL;
+    }
+
+    // 先领到范围再加入会话: 会话在领走的范围发完之前不会结束, 迟到的连接不会另开一个会话
+    uint64_t offset = __atomic_fetch_add(&job->next, job->range_size, __ATOMIC_RELAXED);
+    if(offset >= job->size && job->size > 0)
+    {
+        conn_pool_release(stream->sockfd, 1);
+        stream->sockfd = -1;
+        return NULL;
+    }
+
+    encode_file_header(&header, PROTOCOL_V2, CMD_PUT_RANGE, job->size, name_len);
+    header.session = htonl(job->session);
+    if(send(stream->sockfd, &header, sizeof(FileHeader), MSG_MORE) != sizeof(FileHeader) ||
+       send(stream->sockfd, job->filename, name_len, 0) != name_len)
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+
+    while(offset < job->size && !__atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+    {
+        uint64_t length = job->size - offset < job->range_size ? job->size - offset : job->range_size;
+
+        int sent = job->crc ? send_file_range_crc(stream->sockfd, job->file_fd, offset, length)
+                            : send_file_range(stream->sockfd, job->file_fd, offset, length);
+        if(sent < 0)
+        {
+            printf("Failed to upload range %" PRIu64 "-%" PRIu64 "\n", offset, offset + length);
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        }
+        offset = __atomic_fetch_add(&job->next, job->range_size, __ATOMIC_RELAXED);
+    }
+
+    if(!__atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+    {
+        int ret = send_chunk_end(stream->sockfd);
+        if(ret == 0)
+            ret = job->crc ? receive_upload_reply(stream->sockfd, job->file_fd, &header)
+                           : receive_file_header(stream->sockfd, &header);
+        if(ret >= 0 && header.command == CMD_ACK)
+            return NULL;
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+
+    // 出错时立即断开, 服务器随之放弃这次上传, 正在等待的连接收到 NAK
+    conn_pool_release(stream->sockfd, 0);
+    stream->sockfd = -1;
+    return NULL;
+}
+
+// 上传会话号, 区分同一文件的不同次上传
+static uint32_t new_upload_session(void)
+{
+    uint32_t session;
+
+    if(getrandom(&session, sizeof(session), 0) != sizeof(session))
+        session = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    return session;
+}
+
+// 用 streams 个连接并行上传文件的不同范围, 返回 0 表示成功; options 只看 PUT_CRC
+// 服务器只支持 v1 时退回单连接上传
+int send_tcp_file_parallel(const char* filename, const char* ip, int port, const char* username, const char* password,
+                           int streams, int options)
+{
+    RangeTransfer job;
+    RangeStream stream[MAX_PUT_STREAMS];
+    struct stat file_stat;
+    int proto, started = 0;
+    uint16_t features;
+
+    if(streams <= 1)
+        return send_tcp_file_options(filename, ip, port, username, password, options & PUT_CRC);
+    if(streams > MAX_PUT_STREAMS)
+        streams = MAX_PUT_STREAMS;
+
+    if(stat(filename, &file_stat) != 0 || !S_ISREG(file_stat.st_mode))
+    {
+        printf("File not found or not a regular file: %s \n", filename);
+        return -1;
+    }
+
+    int sockfd = connect_server(ip, port, username, password, &proto, &features);
+    if(sockfd < 0)
+        return -1;
+    if(proto < PROTOCOL_V2)
+    {
+        printf("Server does not support range uploads, using a single stream\n");
+        conn_pool_release(sockfd, 1);
+        return send_tcp_file_options(filename, ip, port, username, password, options & PUT_CRC);
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.filename = filename;
+    job.ip = ip;
+    job.port = port;
+    job.username = username;
+    job.password = password;
+    job.size = file_stat.st_size;
+    job.session = new_upload_session();
+    job.crc = (options & PUT_CRC) && (features & FEATURE_CRC);
+
+    job.file_fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if(job.file_fd < 0)
+    {
+        perror("Failed to open file");
+        conn_pool_release(sockfd, 1);
+        return -1;
+    }
+
+    streams = plan_ranges(&job, streams);
+    printf("Sending file: %s (Size: %" PRIu64 " bytes) over %d streams\n", filename, job.size, streams);
+
+    // 第一个连接已经建立, 由当前线程使用
+    stream[0].job = &job;
+    stream[0].sockfd = sockfd;
+    for(started = 1; started < streams; started ++)
+    {
+        stream[started].job = &job;
+        stream[started].sockfd = -1;
+        if(engine_thread_create(&stream[started].thread, range_upload_thread, &stream[started]) != 0)
+            break;
+    }
+    range_upload_thread(&stream[0]);
+
+    for(int i = 1; i < started; i ++)
+        pthread_join(stream[i].thread, NULL);
+    for(int i = 0; i < started; i ++)
+    {
+        if(stream[i].sockfd >= 0)
+            conn_pool_release(stream[i].sockfd, 1);
+    }
+    close(job.file_fd);
+
+    if(job.failed)
+    {
+        printf("File transfer failed (server rejected)\n");
+        return -1;
+    }
+    printf("File transfer completed successfully\n");
+    return 0;
+}
+
+
+// 建立多路复用连接时加锁, 同时开始的传输不会各自新建一个
+static pthread_mutex_t mux_connect_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 多路复用: 同一服务器上 -m 的传输共用一个连接, 没有时把一个新连接切换过去
+static struct MuxClient* connect_mux(const char* ip, int port, const char* username, const char* password)
+{
+    int proto;
+    uint16_t features;
+
+    pthread_mutex_lock(&mux_connect_lock);
+    struct MuxClient* mux = mux_client_get(ip, port, username, password);
+    if(mux)
+    {
+        pthread_mutex_unlock(&mux_connect_lock);
+        return mux;
+    }
+
+    int sockfd = connect_server(ip, port, username, password, &proto, &features);
+    if(sockfd >= 0 && !(features & FEATURE_MUX))
+    {
+        printf("Server does not support multiplexed transfers\n");
+        conn_pool_release(sockfd, 1);
+        sockfd = -1;
+    }
+    if(sockfd >= 0)
+    {
+        // 连接从此归多路复用所有: 不回连接池, 也不随某一个任务的取消而断开
+        engine_untrack_socket(sockfd);
+        conn_pool_detach(sockfd);
+        telemetry_detach(sockfd);
+        mux = mux_client_start(sockfd, ip, port, username, password);
+        if(!mux)
+            close(sockfd);
+    }
+    pthread_mutex_unlock(&mux_connect_lock);
+    return mux;
+}
+
+// 在共用的多路复用连接上上传文件, 返回 0 表示成功
+int send_tcp_file_mux(const char* filename, const char* ip, int port, const char* username, const char* password)
+{
+    struct MuxClient* mux = connect_mux(ip, port, username, password);
+    if(!mux)
+        return -1;
+
+    int ret = mux_send_file(mux, filename);
+    mux_client_put(mux);
+    return ret;
+}
+
+// 在共用的多路复用连接上下载文件, 返回 0 表示成功
+int receive_tcp_file_mux(const char* filename, const char* ip, int port, const char* username, const char* password)
+{
+    struct MuxClient* mux = connect_mux(ip, port, username, password);
+    if(!mux)
+        return -1;
+
+    int ret = mux_receive_file(mux, filename);
+    mux_client_put(mux);
+    return ret;
+}
+
+// 增量上传: 服务器上已有旧版本时只发送变化的部分, 服务器不支持时整个文件上传
+int send_tcp_file_delta(const char* filename, const char* ip, int port, const char* username, const char* password)
+{
+    struct stat file_stat;
+    DeltaStats stats;
+
+    if(stat(filename, &file_stat) != 0)
+    {
+        printf("File not found: %s \n", filename);
+        return -1;
+    }
+    if(!S_ISREG(file_stat.st_mode))
+    {
+        printf("Not a regular file: %s \n", filename);
+        return -1;
+    }
+
+    int proto;
+    uint16_t features;
+    int sockfd = connect_server(ip, port, username, password, &proto, &features);
+    if(sockfd < 0)
+        return -1;
+
+    if(proto < PROTOCOL_V2 || !(features & FEATURE_DELTA))
+    {
+        printf("Server does not support delta transfers, sending the whole file\n");
+        conn_pool_release(sockfd, 1);
+        return send_tcp_file(filename, ip, port, username, password);
+    }
+
+    int file_fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if(file_fd < 0)
+    {
+        perror("Failed to open file");
+        conn_pool_release(sockfd, 1);
+        return -1;
+    }
+
+    printf("Sending delta of file: %s (Size  %ld bytes)\n", filename, (long)file_stat.st_size);
+    int ret = send_file_delta(sockfd, filename, file_fd, file_stat.st_size, &stats);
+    close(file_fd);
+    if(ret > 0)
+    {
+        printf("Server rejected file request\n");
+        conn_pool_release(sockfd, 1);
+        return -1;
+    }
+
+    FileHeader response;
+    if(ret < 0 || receive_file_header(sockfd, &response) < 0)
+    {
+        printf("failed to receive response from server \n");
+        conn_pool_release(sockfd, 0);
+        return -1;
+    }
+    conn_pool_release(sockfd, 1);
+    if(response.command != CMD_ACK)
+    {
+        printf("File transfer failed (server rejected)\n");
+        return -1;
+    }
+    printf("File transfer completed successfully: %" PRIu64 " bytes matched, %" PRIu64 " bytes sent\n",
+           stats.matched, stats.literal);
+    return 0;
+}
+
+// 批量上传已发送的一个请求: 单个文件, 或者一个打包的多个小文件
+typedef struct {
+    char name[MAX_PATH_LEN * 2];    // 本地路径, 打包时为包里的第一个文件
+    int files;
+    int unreadable;                 // 打包时读取不完整的文件数, 服务器确认了也算失败
+} BatchItem;
+
+#define BATCH_WINDOW    256         // 已发送未确认的请求上限, 收确认的线程跟不上时发送等待
+
+// 批量上传的确认收集: 发送线程每排入一个请求 post 一次, 全部发完后再 post 一次表示结束
+typedef struct {
+    int sockfd;
+    BatchItem items[BATCH_WINDOW];  // 已发送未确认的请求, 按发送顺序循环使用
+    int queued;                     // 已发送的请求数, 原子更新
+    int handled;                    // 已收到的回复数
+    int succeeded;                  // 成功的文件数
+    int broken;                     // 连接出错, 数据流已不可用
+    sem_t pending;
+    sem_t slots;                    // items 中的空位
+} BatchAcks;
+
+// 按顺序读取服务器对每个上传的 ACK/NAK, 和发送并行, 往返延迟整批只付一次
+static void* batch_ack_thread(void* arg)
+{
+    BatchAcks* acks = (BatchAcks*)arg;
+    FileHeader response;
+
+    while(1)
+    {
+        sem_wait(&acks->pending);
+        if(acks->handled == __atomic_load_n(&acks->queued, __ATOMIC_ACQUIRE))
+            break;
+
+        if(receive_file_header(acks->sockfd, &response) < 0)
+        {
+            printf("failed to receive response from server \n");
+            __atomic_store_n(&acks->broken, 1, __ATOMIC_RELAXED);
+            sem_post(&acks->slots);
+            break;
+        }
+
+        // 打包的 NAK 带有失败的文件数, 单个文件的 NAK 表示整个请求失败
+        BatchItem* item = &acks->items[acks->handled % BATCH_WINDOW];
+        int failed = item->unreadable;
+        if(response.command != CMD_ACK)
+        {
+            int rejected = item->files;
+            if(item->files > 1 && response.filesize > 0 && response.filesize <= (uint32_t)item->files)
+                rejected = response.filesize;
+            if(rejected > failed)
+                failed = rejected;
+        }
+        acks->succeeded += item->files - failed;
+
+        if(failed > 0 && item->files > 1)
+            printf("Pack transfer failed for %d of %d files starting at %s\n", failed, item->files, item->name);
+        else if(failed > 0)
+            printf("File transfer failed (server rejected): %s\n", item->name);
+        acks->handled ++;
+        sem_post(&acks->slots);
+    }
+    return NULL;
+}
+
+// 记录一个已发送的请求; 窗口满时等待收确认的线程腾出位置
+static void queue_batch_item(BatchAcks* acks, const char* name, int files, int unreadable)
+{
+    sem_wait(&acks->slots);
+
+    BatchItem* item = &acks->items[acks->queued % BATCH_WINDOW];
+    snprintf(item->name, sizeof(item->name), "%s", name);
+    item->files = files;
+    item->unreadable = unreadable;
+    __atomic_add_fetch(&acks->queued, 1, __ATOMIC_RELEASE);
+    sem_post(&acks->pending);
+}
+
+// 等待打包的小文件, 路径和名字在发出后释放
+typedef struct {
+    char* paths[PACK_MAX_FILES];
+    char* names[PACK_MAX_FILES];
+    uint64_t sizes[PACK_MAX_FILES];
+    int count;
+    uint64_t bytes;
+} PackBatch;
+
+static void clear_pack(PackBatch* batch)
+{
+    for(int i = 0; i < batch->count; i ++)
+    {
+        free(batch->paths[i]);
+        free(batch->names[i]);
+    }
+    batch->count = 0;
+    batch->bytes = 0;
+}
+
+// 发出攒好的包, 连接出错返回 -1
+static int flush_pack(int sockfd, PackBatch* batch, BatchAcks* acks)
+{
+    if(batch->count == 0)
+        return 0;
+
+    int ret = send_file_pack(sockfd, batch->paths, batch->names, batch->sizes, batch->count);
+    if(ret >= 0)
+    {
+        printf("Sending pack: %d files (Size  %" PRIu64 " bytes)\n", batch->count, batch->bytes);
+        queue_batch_item(acks, batch->paths[0], batch->count, ret);
+    }
+    clear_pack(batch);
+    return ret < 0 ? -1 : 0;
+}
+
+// 小文件放进包里, 包满时先发出去; 不适合打包的文件返回 0, 由调用者单独发送
+static int add_to_pack(int sockfd, PackBatch* batch, BatchAcks* acks, const char* path, const char* name)
+{
+    struct stat file_stat;
+
+    if(stat(path, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) || file_stat.st_size > PACK_FILE_MAX)
+        return 0;
+
+    if((batch->count == PACK_MAX_FILES || batch->bytes + file_stat.st_size > PACK_MAX_BYTES) &&
+       flush_pack(sockfd, batch, acks) < 0)
+        return -1;
+
+    batch->paths[batch->count] = strdup(path);
+    batch->names[batch->count] = strdup(name);
+    if(!batch->paths[batch->count] || !batch->names[batch->count])
+    {
+        free(batch->paths[batch->count]);
+        free(batch->names[batch->count]);
+        return 0;
+    }
+    batch->sizes[batch->count] = file_stat.st_size;
+    batch->count ++;
+    batch->bytes += file_stat.st_size;
+    return 1;
+}
+
+// 发送一个上传请求: 文件头、文件名和数据, 不等待回复; 连接出错返回 -1, 本地文件不可读返回 1
+static int queue_upload(int sockfd, int proto, const char* path, const char* name)
+{
+    struct stat file_stat;
+    size_t name_len = strlen(name);
+
+    if(stat(path, &file_stat) != 0 || !S_ISREG(file_stat.st_mode))
+    {
+        printf("Skipping %s: not a regular file\n", path);
+        return 1;
+    }
+
+    int file_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(file_fd < 0)
+    {
+        perror(path);
+        return 1;
+    }
+
+    int ret = -1;
+    if(send_file_header(sockfd, proto, CMD_PUT_FILE, file_stat.st_size, name_len) == 0 &&
+       send(sockfd, name, name_len, MSG_MORE) == (ssize_t)name_len)
+    {
+        ret = proto >= PROTOCOL_V2 ? send_file_chunks(sockfd, file_fd, file_stat.st_size)
+                                   : send_file_data(sockfd, file_fd, 0, file_stat.st_size);
+    }
+    close(file_fd);
+
+    if(ret == 0)
+        printf("Sending file: %s (Size  %ld bytes)\n", path, (long)file_stat.st_size);
+    return ret;
+}
+
+// 一个连接上的批量上传: 请求连续发送, 另一个线程按顺序收确认
+// 服务器支持打包时, 小文件攒成包发送, 大文件仍然单独发送
+typedef struct {
+    int sockfd;
+    int proto;
+    uint16_t features;
+    BatchAcks* acks;
+    PackBatch* batch;               // NULL 表示服务器不支持打包
+    pthread_t ack_thread;
+} BatchUpload;
+
+static int batch_upload_begin(BatchUpload* up, const char* ip, int port, const char* username, const char* password)
+{
+    memset(up, 0, sizeof(BatchUpload));
+    up->sockfd = connect_server(ip, port, username, password, &up->proto, &up->features);
+    if(up->sockfd < 0)
+        return -1;
+
+    up->acks = calloc(1, sizeof(BatchAcks));
+    if(up->features & FEATURE_PACK)
+        up->batch = calloc(1, sizeof(PackBatch));
+    if(!up->acks || ((up->features & FEATURE_PACK) && !up->batch))
+        goto fail;
+
+    up->acks->sockfd = up->sockfd;
+    if(sem_init(&up->acks->pending, 0, 0) < 0 || sem_init(&up->acks->slots, 0, BATCH_WINDOW) < 0 ||
+       pthread_create(&up->ack_thread, NULL, batch_ack_thread, up->acks) != 0)
+        goto fail;
+    return 0;
+
+fail:
+    free(up->acks);
+    free(up->batch);
+    conn_pool_release(up->sockfd, 1);
+    return -1;
+}
+
+static int batch_upload_broken(BatchUpload* up)
+{
+    return __atomic_load_n(&up->acks->broken, __ATOMIC_RELAXED);
+}
+
+// 发送一个文件, name 为服务器上的文件名; 连接出错返回 -1
+static int batch_upload_add(BatchUpload* up, const char* path, const char* name)
+{
+    if(batch_upload_broken(up))
+        return -1;
+
+    int ret = up->batch ? add_to_pack(up->sockfd, up->batch, up->acks, path, name) : 0;
+    if(ret == 0)
+    {
+        ret = queue_upload(up->sockfd, up->proto, path, name);
+        if(ret == 0)
+            queue_batch_item(up->acks, path, 1, 0);
+        else if(ret > 0)
+            ret = 0;
+    }
+    if(ret < 0)
+        __atomic_store_n(&up->acks->broken, 1, __ATOMIC_RELAXED);
+    return ret < 0 ? -1 : 0;
+}
+
+// 发出剩下的包, 等所有确认收完后归还连接, 返回成功的文件数
+static int batch_upload_end(BatchUpload* up)
+{
+    BatchAcks* acks = up->acks;
+
+    if(up->batch && !batch_upload_broken(up) && flush_pack(up->sockfd, up->batch, acks) < 0)
+        __atomic_store_n(&acks->broken, 1, __ATOMIC_RELAXED);
+
+    // 连接出错时先断开, 让收确认的线程从 recv 返回
+    if(batch_upload_broken(up))
+        shutdown(up->sockfd, SHUT_RDWR);
+    sem_post(&acks->pending);
+    pthread_join(up->ack_thread, NULL);
+    sem_destroy(&acks->pending);
+    sem_destroy(&acks->slots);
+
+    conn_pool_release(up->sockfd, !acks->broken);
+    int succeeded = acks->succeeded;
+    if(up->batch)
+        clear_pack(up->batch);
+    free(up->batch);
+    free(acks);
+    return succeeded;
+}
+
+// mput: 展开本地通配符, 在一个连接上连续发送所有文件; 全部成功返回 0
+int send_tcp_files(char* const patterns[], int count, const char* ip, int port, const char* username, const char* password)
+{
+    glob_t matches;
+    BatchUpload up;
+
+    memset(&matches, 0, sizeof(matches));
+    for(int i = 0; i < count; i ++)
+    {
+        if(glob(patterns[i], i ? GLOB_APPEND : 0, NULL, &matches) == GLOB_NOMATCH)
+            printf("No match: %s\n", patterns[i]);
+    }
+    if(matches.gl_pathc == 0 || batch_upload_begin(&up, ip, port, username, password) < 0)
+    {
+        globfree(&matches);
+        return -1;
+    }
+
+    for(size_t i = 0; i < matches.gl_pathc; i ++)
+    {
+        const char* path = matches.gl_pathv[i];
+        const char* name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+        if(name[0] == '\0' || strlen(name) >= MAX_FILENAME_LEN)
+        {
+            printf("Skipping %s: not a regular file\n", path);
+            continue;
+        }
+        if(batch_upload_add(&up, path, name) < 0)
+            break;
+    }
+
+    int succeeded = batch_upload_end(&up);
+    printf("mput: %d/%zu files transferred\n", succeeded, matches.gl_pathc);
+
+    int ret = succeeded == (int)matches.gl_pathc ? 0 : -1;
+    globfree(&matches);
+    return ret;
+}
+
+// put -r 的一个发送连接: 从遍历队列取文件, 边遍历边发送
+typedef struct {
+    TreeWalk* walk;
+    const char* ip;
+    int port;
+    const char* username;
+    const char* password;
+    int files;                      // 取走的文件数
+    int succeeded;
+    int failed;                     // 连接失败, 没有发送
+} TreeSender;
+
+static void* tree_send_thread(void* arg)
+{
+    TreeSender* sender = (TreeSender*)arg;
+    BatchUpload up;
+    TreeItem item;
+
+    if(batch_upload_begin(&up, sender->ip, sender->port, sender->username, sender->password) < 0)
+    {
+        sender->failed = 1;
+        return NULL;
+    }
+    if(!(up.features & FEATURE_TREE))
+    {
+        // 别的连接也一样, 不必再取文件
+        printf("Server does not support recursive transfers\n");
+        sender->failed = 1;
+        tree_walk_cancel(sender->walk);
+        sender->succeeded = batch_upload_end(&up);
+        return NULL;
+    }
+
+    while(tree_walk_next(sender->walk, &item))
+    {
+        sender->files ++;
+        if(batch_upload_add(&up, item.path, item.name) < 0)
+            break;
+    }
+    sender->succeeded = batch_upload_end(&up);
+    return NULL;
+}
+
+// put -r: 多个线程并行遍历本地目录, streams 个连接同时从遍历结果取文件发送
+// 服务器上的文件放在目录名下, 缺少的目录由服务器创建; 全部成功返回 0
+int send_tcp_tree(const char* dirname, const char* ip, int port, const char* username, const char* password, int streams)
+{
+    TreeWalk walk;
+    TreeSender senders[MAX_PUT_STREAMS];
+    pthread_t threads[MAX_PUT_STREAMS];
+    int started = 0, files = 0, succeeded = 0;
+
+    if(streams < 1 || streams > MAX_PUT_STREAMS)
+        streams = 1;
+    if(tree_walk_start(&walk, dirname) < 0)
+        return -1;
+
+    for(int i = 0; i < streams; i ++)
+    {
+        memset(&senders[i], 0, sizeof(TreeSender));
+        senders[i].walk = &walk;
+        senders[i].ip = ip;
+        senders[i].port = port;
+        senders[i].username = username;
+        senders[i].password = password;
+        if(engine_thread_create(&threads[started], tree_send_thread, &senders[i]) != 0)
+            break;
+        started ++;
+    }
+
+    int failed = started == 0;
+    for(int i = 0; i < started; i ++)
+    {
+        pthread_join(threads[i], NULL);
+        files += senders[i].files;
+        succeeded += senders[i].succeeded;
+        failed |= senders[i].failed;
+    }
+    // 所有连接都出错时遍历可能还没结束, 剩下的文件不再发送
+    if(!tree_walk_done(&walk))
+    {
+        printf("put -r: transfer stopped before all files were sent\n");
+        failed = 1;
+    }
+    int skipped = __atomic_load_n(&walk.skipped, __ATOMIC_RELAXED);
+    tree_walk_stop(&walk);
+
+    printf("put -r: %d/%d files transferred", succeeded, files);
+    if(skipped > 0)
+        printf(", %d skipped", skipped);
+    printf("\n");
+    return !failed && succeeded == files && skipped == 0 ? 0 : -1;
+}
+
+
+// 文件名列表, 名字存放在 buf 里, 以 '\0' 分隔
+typedef struct {
+    char* buf;
+    size_t len;
+    const char** names;
+    int count;
+} NameList;
+
+static void free_name_list(NameList* list)
+{
+    free(list->buf);
+    free(list->names);
+    memset(list, 0, sizeof(NameList));
+}
+
+// 把 data 中 '\0' 分隔的文件名追加到列表; paths 为 0 时带 '/' 的名字不接受
+// 相对路径不能走出当前目录
+static int append_names(NameList* list, const char* data, size_t len, int paths)
+{
+    char* buf = realloc(list->buf, list->len + len);
+    if(!buf && list->len + len > 0)
+        return -1;
+    list->buf = buf;
+    memcpy(list->buf + list->len, data, len);
+    list->len += len;
+
+    // buf 可能被移动, 重新建立索引
+    int count = 0;
+    for(size_t i = 0; i < list->len; i ++)
+        count += list->buf[i] == '\0';
+    const char** names = realloc(list->names, (count + 1) * sizeof(char*));
+    if(!names)
+        return -1;
+    list->names = names;
+    list->count = 0;
+    for(size_t i = 0; i < list->len; i += strlen(list->buf + i) + 1)
+    {
+        const char* name = list->buf + i;
+        if(tree_valid_path(name) && (paths || !strchr(name, '/')))
+            list->names[list->count ++] = name;
+    }
+    return 0;
+}
+
+// 用 CMD_LIST 展开服务器上的通配符, 匹配的名字追加到 list; 连接出错返回 -1
+// FILE_FLAG_RECURSIVE: pattern 为目录, 列出其下所有文件的相对路径
+static int list_remote(int sockfd, const char* pattern, uint16_t flags, NameList* list)
+{
+    FileHeader header;
+    uint16_t name_len = strlen(pattern);
+
+    encode_file_header(&header, PROTOCOL_V2, CMD_LIST, 0, name_len);
+    header.flags = htons(FILE_FLAG_NO_ACK | flags);
+    if(send(sockfd, &header, sizeof(FileHeader), MSG_MORE) != sizeof(FileHeader) ||
+       send(sockfd, pattern, name_len, 0) != name_len ||
+       receive_file_header(sockfd, &header) < 0)
+        return -1;
+    if(header.command != CMD_LIST)
+    {
+        printf("Server rejected listing %s\n", pattern);
+        return 0;
+    }
+
+    // 列表按下载的格式分块发送, 先收进内存文件
+    uint64_t size = file_header_size(&header);
+    int fd = memfd_create("lftp-list", MFD_CLOEXEC);
+    if(fd < 0)
+        return -1;
+
+    int ret = receive_file_chunks(sockfd, fd, 0, size, NULL, NULL);
+    char* data = ret == 0 && size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if(ret == 0 && size > 0)
+    {
+        if(data == MAP_FAILED || append_names(list, data, size, flags & FILE_FLAG_RECURSIVE) < 0)
+            ret = -1;
+        if(data != MAP_FAILED)
+            munmap(data, size);
+    }
+    close(fd);
+
+    if(ret == 0 && size == 0)
+        printf("No match: %s\n", pattern);
+    return ret;
+}
+
+// 一个连接负责的下载: 列表中从 first 开始每隔 step 个取一个
+typedef struct {
+    int sockfd;
+    const NameList* list;
+    int first;
+    int step;
+    int failed;
+} BatchRequests;
+
+// 批量下载的发送线程: 把所有下载请求连续发出去, 服务器发完一个文件就处理下一个
+static void* batch_request_thread(void* arg)
+{
+    BatchRequests* requests = (BatchRequests*)arg;
+    FileHeader header;
+
+    for(int i = requests->first; i < requests->list->count; i += requests->step)
+    {
+        const char* name = requests->list->names[i];
+        uint16_t name_len = strlen(name);
+
+        encode_file_header(&header, PROTOCOL_V2, CMD_GET_FILE, 0, name_len);
+        header.flags = htons(FILE_FLAG_NO_ACK);
+        if(send(requests->sockfd, &header, sizeof(FileHeader), MSG_MORE) != sizeof(FileHeader) ||
+           send(requests->sockfd, name, name_len, 0) != name_len)
+        {
+            requests->failed = 1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+// 按顺序接收一个下载回复; 服务器拒绝返回 1, 数据流出错返回 -1
+// paths 为 1 时文件名是相对路径, 在当前目录下创建缺少的目录
+static int receive_batch_file(int sockfd, int paths)
+{
+    FileHeader header;
+    char name[MAX_PATH_LEN];
+
+    if(receive_file_header(sockfd, &header) < 0)
+        return -1;
+    if(header.command != CMD_GET_FILE)
+        return 1;
+
+    if(header.filename_len == 0 || header.filename_len >= (paths ? MAX_PATH_LEN : MAX_FILENAME_LEN) ||
+       recv(sockfd, name, header.filename_len, MSG_WAITALL) != header.filename_len)
+        return -1;
+    name[header.filename_len] = '\0';
+    if(!tree_valid_path(name) || (!paths && strchr(name, '/')))
+        return -1;
+    if(paths && tree_make_parents(name) < 0)
+        return -1;
+
+    uint64_t file_size = file_header_size(&header);
+    int file_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(file_fd < 0)
+    {
+        perror(name);
+        return -1;
+    }
+
+    int ret = receive_file_chunks(sockfd, file_fd, 0, file_size, NULL, NULL);
+    close(file_fd);
+    if(ret == 0)
+        printf("File received successfully: %s (%" PRIu64 " bytes)\n", name, file_size);
+    return ret;
+}
+
+// 在一个连接上连续请求 list 中从 first 开始每隔 step 个的文件, 回复按顺序接收
+// 返回收到的文件数, 连接出错时 *broken 置 1
+static int receive_batch(int sockfd, const NameList* list, int first, int step, int paths, int* broken)
+{
+    BatchRequests requests;
+    pthread_t request_thread;
+    int received = 0;
+
+    requests.sockfd = sockfd;
+    requests.list = list;
+    requests.first = first;
+    requests.step = step;
+    requests.failed = 0;
+    if(pthread_create(&request_thread, NULL, batch_request_thread, &requests) != 0)
+        return 0;
+
+    for(int i = first; i < list->count; i += step)
+    {
+        int ret = receive_batch_file(sockfd, paths);
+        if(ret < 0)
+        {
+            printf("Failed to receive file: %s\n", list->names[i]);
+            *broken = 1;
+            break;
+        }
+        if(ret > 0)
+            printf("Server rejected file request: %s\n", list->names[i]);
+        else
+            received ++;
+    }
+
+    // 中途出错时发送线程可能还阻塞在 send, 先断开连接
+    if(*broken)
+        shutdown(sockfd, SHUT_RDWR);
+    pthread_join(request_thread, NULL);
+    *broken |= requests.failed;
+    return received;
+}
+
+// mget: 用服务器列表展开通配符, 在一个连接上连续请求所有文件, 回复按顺序接收
+// 服务器不支持时逐个 get (仍复用同一个连接), 通配符不展开; 全部成功返回 0
+int receive_tcp_files(char* const patterns[], int count, const char* ip, int port, const char* username, const char* password)
+{
+    NameList list;
+    int proto, received = 0, broken = 0;
+    uint16_t features;
+
+    int sockfd = connect_server(ip, port, username, password, &proto, &features);
+    if(sockfd < 0)
+        return -1;
+
+    if(!(features & FEATURE_PIPELINE))
+    {
+        conn_pool_release(sockfd, 1);
+        printf("Server does not support batch requests, getting files one by one\n");
+        for(int i = 0; i < count; i ++)
+            received += receive_tcp_file(patterns[i], ip, port, username, password) == 0;
+        printf("mget: %d/%d files transferred\n", received, count);
+        return received == count ? 0 : -1;
+    }
+
+    memset(&list, 0, sizeof(list));
+    for(int i = 0; i < count && !broken; i ++)
+        broken = list_remote(sockfd, patterns[i], 0, &list) < 0;
+    if(broken || list.count == 0)
+    {
+        conn_pool_release(sockfd, !broken);
+        free_name_list(&list);
+        return -1;
+    }
+
+    received = receive_batch(sockfd, &list, 0, 1, 0, &broken);
+    conn_pool_release(sockfd, !broken);
+
+    printf("mget: %d/%d files transferred\n", received, list.count);
+    int ret = received == list.count ? 0 : -1;
+    free_name_list(&list);
+    return ret;
+}
+
+// get -r 的一个下载连接
+typedef struct {
+    const NameList* list;
+    int first;
+    int step;
+    const char* ip;
+    int port;
+    const char* username;
+    const char* password;
+    int received;
+} TreeReceiver;
+
+static void* tree_receive_thread(void* arg)
+{
+    TreeReceiver* receiver = (TreeReceiver*)arg;
+    int proto, broken = 0;
+
+    int sockfd = connect_server(receiver->ip, receiver->port, receiver->username, receiver->password, &proto, NULL);
+    if(sockfd < 0)
+        return NULL;
+    receiver->received = receive_batch(sockfd, receiver->list, receiver->first, receiver->step, 1, &broken);
+    conn_pool_release(sockfd, !broken);
+    return NULL;
+}
+
+// get -r: 服务器列出目录下整棵树, streams 个连接分别连续请求其中一部分文件
+// 文件按服务器上的相对路径保存在当前目录下; 全部成功返回 0
+int receive_tcp_tree(const char* dirname, const char* ip, int port, const char* username, const char* password,
+                     int streams)
+{
+    NameList list;
+    TreeReceiver receivers[MAX_GET_STREAMS];
+    pthread_t threads[MAX_GET_STREAMS];
+    int proto, broken = 0, received = 0;
+    uint16_t features;
+
+    if(streams < 1 || streams > MAX_GET_STREAMS)
+        streams = 1;
+
+    int sockfd = connect_server(ip, port, username, password, &proto, &features);
+    if(sockfd < 0)
+        return -1;
+    if((features & (FEATURE_TREE | FEATURE_PIPELINE)) != (FEATURE_TREE | FEATURE_PIPELINE))
+    {
+        printf("Server does not support recursive transfers\n");
+        conn_pool_release(sockfd, 1);
+        return -1;
+    }
+
+    memset(&list, 0, sizeof(list));
+    broken = list_remote(sockfd, dirname, FILE_FLAG_RECURSIVE, &list) < 0;
+    conn_pool_release(sockfd, !broken);
+    if(broken || list.count == 0)
+    {
+        free_name_list(&list);
+        return -1;
+    }
+    if(streams > list.count)
+        streams = list.count;
+
+    // 列表按目录聚集, 交错分配让各个连接的文件大小分布接近
+    int started = 0;
+    for(int i = 0; i < streams; i ++)
+    {
+        receivers[i].list = &list;
+        receivers[i].first = i;
+        receivers[i].step = streams;
+        receivers[i].ip = ip;
+        receivers[i].port = port;
+        receivers[i].username = username;
+        receivers[i].password = password;
+        receivers[i].received = 0;
+        if(engine_thread_create(&threads[i], tree_receive_thread, &receivers[i]) != 0)
+            break;
+        started ++;
+    }
+    for(int i = 0; i < started; i ++)
+    {
+        pthread_join(threads[i], NULL);
+        received += receivers[i].received;
+    }
+
+    printf("get -r: %d/%d files transferred\n", received, list.count);
+    int ret = received == list.count ? 0 : -1;
+    free_name_list(&list);
+    return ret;
+}
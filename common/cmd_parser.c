@@ -2,16 +2,23 @@
 #include "discovery.h"
 #include "color.h"
 #include "transfer.h"
+#include "worker_pool.h"
+#include "dedup.h"
+#include "log.h"
 
 
 // 解析服务器命令
-// 格式： server [-u username] [-p password] [-r root_path] [-P port]
+// 格式： server [-u username] [-p password] [-r root_path] [-P port] [-w workers] [-q queue]
+//              [-b backlog] [-R] [-i posix|uring|copy] [-D]
 int parse_server_command(int argc, char* argv[])
 {
     int port = TCP_PORT;
     char *root_path = NULL;
     char *username = NULL;
     char *password = NULL;   
+    ServerOptions options;
+
+    memset(&options, 0, sizeof(ServerOptions));
 
     int i = 1;
     while(i < argc)
@@ -23,21 +30,70 @@ int parse_server_command(int argc, char* argv[])
         } else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
             root_path = argv[++i];
         } else if(strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
-            int port = atoi(argv[++i]);
+            port = atoi(argv[++i]);
             if(port <= 0 || port > 65535) 
             {
                 printf("Invalid port number: %d\n", port);
                 return -1;                
             }
+        } else if(strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            options.workers = atoi(argv[++i]);
+            if(options.workers <= 0 || options.workers > MAX_SERVER_WORKERS)
+            {
+                printf("Invalid worker count: %d (1-%d)\n", options.workers, MAX_SERVER_WORKERS);
+                return -1;
+            }
+        } else if(strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            options.queue_size = atoi(argv[++i]);
+            if(options.queue_size <= 0 || options.queue_size > MAX_ACCEPT_QUEUE)
+            {
+                printf("Invalid queue size: %d (1-%d)\n", options.queue_size, MAX_ACCEPT_QUEUE);
+                return -1;
+            }
+        } else if(strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            options.backlog = atoi(argv[++i]);
+            if(options.backlog <= 0)
+            {
+                printf("Invalid backlog: %d\n", options.backlog);
+                return -1;
+            }
+        } else if(strcmp(argv[i], "-R") == 0) {
+            options.reuseport = 1;
+        } else if(strcmp(argv[i], "-D") == 0) {
+            options.dedup = 1;
+        } else if(strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            i ++;
+            if(strcmp(argv[i], "posix") == 0)
+                options.io_backend = IO_BACKEND_POSIX;
+            else if(strcmp(argv[i], "uring") == 0)
+                options.io_backend = IO_BACKEND_URING;
+            else if(strcmp(argv[i], "copy") == 0)
+                options.io_backend = IO_BACKEND_COPY;
+            else
+            {
+                printf("Unknown I/O backend: %s (posix, uring or copy)\n", argv[i]);
+                return -1;
+            }
         }
         else if (strcmp(argv[i], "-h") == 0 || 
                  strcmp(argv[i], "--help") == 0) {
-            printf("Usage: server [-u username] [-p password] [-r root_path] [-P port]\n");
+            printf("Usage: server [-u username] [-p password] [-r root_path] [-P port] [-w workers] [-q queue]\n");
+            printf("              [-b backlog] [-R] [-i posix|uring|copy] [-D]\n");
             printf("Options:\n");
             printf("  -u username  Set username for authentication\n");
             printf("  -p password  Set password for authentication\n");
             printf("  -r path      Set root directory for file access\n");
             printf("  -P port      Set TCP port (default: %d)\n", TCP_PORT);
+            printf("  -w workers   Set worker thread count (default: %d)\n", DEFAULT_SERVER_WORKERS);
+            printf("  -q queue     Set pending connection queue size (default: %d)\n", DEFAULT_ACCEPT_QUEUE);
+            printf("  -b backlog   Set listen backlog (default: %d)\n", DEFAULT_LISTEN_BACKLOG);
+            printf("  -R           One SO_REUSEPORT listener per worker, pinned to a cpu\n");
+            printf("               (-w defaults to the cpu count, -q is unused)\n");
+            printf("  -i backend   Transfer I/O backend: posix (default, splice/sendfile), uring,\n");
+            printf("               or copy (buffered recv+write uploads)\n");
+            printf("               (uring falls back to posix when the kernel lacks it)\n");
+            printf("  -D           Deduplicate uploads: files are stored as chunk lists in %s,\n", DEDUP_STORE_DIR);
+            printf("               clients only send the chunks the server does not have\n");
             printf("  -h, --help   Show this help message\n");
             return 0;  // 帮助信息，不启动服务器
         }
@@ -50,19 +106,25 @@ int parse_server_command(int argc, char* argv[])
         i ++;
     }
 
-    return start_tcp_server(port, root_path, username, password);
+    return start_tcp_server(port, root_path, username, password, &options);
 }
 
 // 解析文件传输命令, 返回 0 表示成功
-// 格式：get/put <IP> [-u username] [-p password] [filename]
+// 格式：get/put <IP> [-u username] [-p password] [-j streams] [-r] [-m] [-d] [-z] [-k] [filename]
 int parse_transfer_command(int argc, char* argv[])
 {
-    char filename[MAX_FILENAME_LEN] = {0};
+    char filename[MAX_PATH_LEN] = {0};
     char username[MAX_USERNAME_LEN] = {0};
     char password[MAX_PASSWORD_LEN] = {0};
     char ip[MAX_IP_LEN] = {0};
 
     int i = 1, cmd_type = 0; // cmd_type = 0 表示put， 1 表示get
+    int streams = 1;         // -j: 并行传输的连接数
+    int recursive = 0;       // -r: filename 为目录, 传输整棵树
+    int multiplex = 0;       // -m: 和同一服务器上的其他传输共用一个多路复用连接
+    int delta = 0;           // -d: 只上传和服务器上旧版本不同的部分
+    int compress = 0;        // -z: 压缩传输的数据块
+    int checksum = 0;        // -k: put 的数据块带 CRC32C, 放弃零拷贝
     int ret = 0;
     if(strcmp(argv[0], "get") == 0)
         cmd_type = 1;
@@ -82,11 +144,29 @@ int parse_transfer_command(int argc, char* argv[])
             username[MAX_USERNAME_LEN - 1] = '\0';
         } else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
             strncpy(password, argv[++i], MAX_PASSWORD_LEN - 1);
-            username[MAX_PASSWORD_LEN - 1] = '\0';
+            password[MAX_PASSWORD_LEN - 1] = '\0';
+        } else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            int max_streams = cmd_type ? MAX_GET_STREAMS : MAX_PUT_STREAMS;
+            streams = atoi(argv[++i]);
+            if(streams <= 0 || streams > max_streams)
+            {
+                printf("Invalid stream count: %d (1-%d)\n", streams, max_streams);
+                return -1;
+            }
+        } else if(strcmp(argv[i], "-r") == 0) {
+            recursive = 1;
+        } else if(strcmp(argv[i], "-m") == 0) {
+            multiplex = 1;
+        } else if(strcmp(argv[i], "-d") == 0) {
+            delta = 1;
+        } else if(strcmp(argv[i], "-z") == 0) {
+            compress = 1;
+        } else if(strcmp(argv[i], "-k") == 0) {
+            checksum = 1;
         } else if(argv[i][0] != '-')
         {
-            strncpy(filename, argv[i], MAX_FILENAME_LEN - 1);
-            filename[MAX_FILENAME_LEN - 1] = '\0';
+            strncpy(filename, argv[i], MAX_PATH_LEN - 1);
+            filename[MAX_PATH_LEN - 1] = '\0';
         } else {
             printf("Unknown option: %s\n", argv[i]);
             return -1;
@@ -99,14 +179,132 @@ int parse_transfer_command(int argc, char* argv[])
         return -1;
     }
 
+    if(checksum && (cmd_type || delta || recursive || multiplex))
+    {
+        printf("-k only applies to put without -r, -m or -d\n");
+        return -1;
+    }
+
+    if(compress)
+    {
+        if(delta || recursive || multiplex || streams > 1)
+        {
+            printf("-z only applies to a single-file put or get without -r, -j, -m or -d\n");
+            return -1;
+        }
+        return cmd_type ? receive_tcp_file_compress(filename, ip, TCP_PORT, username, password)
+                        : send_tcp_file_options(filename, ip, TCP_PORT, username, password,
+                                                PUT_COMPRESS | (checksum ? PUT_CRC : 0));
+    }
+
+    if(delta)
+    {
+        if(cmd_type || recursive || multiplex || streams > 1)
+        {
+            printf("-d only applies to a single-file put without -r, -j or -m\n");
+            return -1;
+        }
+        return send_tcp_file_delta(filename, ip, TCP_PORT, username, password);
+    }
+
+    if(multiplex)
+    {
+        if(recursive || streams > 1)
+        {
+            printf("-m cannot be combined with -r or -j\n");
+            return -1;
+        }
+        return cmd_type ? receive_tcp_file_mux(filename, ip, TCP_PORT, username, password)
+                        : send_tcp_file_mux(filename, ip, TCP_PORT, username, password);
+    }
+
+    // 目录树: -j 为同时传输文件的连接数
+    if(recursive)
+        return cmd_type ? receive_tcp_tree(filename, ip, TCP_PORT, username, password, streams)
+                        : send_tcp_tree(filename, ip, TCP_PORT, username, password, streams);
+
     if(cmd_type == 0)
     {
         // put 逻辑
-        ret = send_tcp_file(filename, ip, TCP_PORT, username, password);
+        ret = streams > 1 ? send_tcp_file_parallel(filename, ip, TCP_PORT, username, password, streams,
+                                                   checksum ? PUT_CRC : 0)
+                          : send_tcp_file_options(filename, ip, TCP_PORT, username, password, checksum ? PUT_CRC : 0);
     } else {
         // get 逻辑
-        ret = receive_tcp_file(filename, ip, TCP_PORT, username, password);
+        ret = streams > 1 ? receive_tcp_file_parallel(filename, ip, TCP_PORT, username, password, streams)
+                          : receive_tcp_file(filename, ip, TCP_PORT, username, password);
     }
 
     return ret;
-}
\ No newline at end of file
+}
+// 解析批量传输命令, 返回 0 表示全部成功
+// 格式：mput/mget <IP> [-u username] [-p password] <pattern>...
+int parse_batch_command(int argc, char* argv[])
+{
+    char username[MAX_USERNAME_LEN] = {0};
+    char password[MAX_PASSWORD_LEN] = {0};
+    char ip[MAX_IP_LEN] = {0};
+    char* patterns[64];
+    int count = 0;
+    int i = 1;
+
+    if(argc < 2)
+    {
+        printf("Missing server address\n");
+        return -1;
+    }
+    strncpy(ip, argv[i++], MAX_IP_LEN - 1);
+    ip[MAX_IP_LEN - 1] = '\0';
+
+    while(i < argc)
+    {
+        if(strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+            strncpy(username, argv[++i], MAX_USERNAME_LEN - 1);
+            username[MAX_USERNAME_LEN - 1] = '\0';
+        } else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            strncpy(password, argv[++i], MAX_PASSWORD_LEN - 1);
+            password[MAX_PASSWORD_LEN - 1] = '\0';
+        } else if(argv[i][0] != '-' && count < (int)(sizeof(patterns) / sizeof(patterns[0]))) {
+            patterns[count ++] = argv[i];
+        } else {
+            printf("Unknown option: %s\n", argv[i]);
+            return -1;
+        }
+        i ++;
+    }
+
+    if(count == 0) {
+        printf("Missing filename\n");
+        return -1;
+    }
+
+    if(strcmp(argv[0], "mput") == 0)
+        return send_tcp_files(patterns, count, ip, TCP_PORT, username, password);
+    return receive_tcp_files(patterns, count, ip, TCP_PORT, username, password);
+}
+
+// 解析日志命令, 不带参数时显示当前设置
+// 格式：log [debug|info|warn|error] [-f file|off]
+int parse_log_command(int argc, char* argv[])
+{
+    for(int i = 1; i < argc; i ++)
+    {
+        if(strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            const char* path = strcmp(argv[++i], "off") == 0 ? NULL : argv[i];
+            if(log_set_file(path) < 0)
+            {
+                printf("Failed to open log file %s: %s\n", path, strerror(errno));
+                return -1;
+            }
+        } else if(log_parse_level(argv[i]) >= 0) {
+            log_set_level(log_parse_level(argv[i]));
+        } else {
+            printf("Usage: log [debug|info|warn|error] [-f file|off]\n");
+            return -1;
+        }
+    }
+
+    const char* path = log_file_path();
+    printf("Log level: %s, log file: %s\n", log_level_name(log_level), path ? path : "none");
+    return 0;
+}
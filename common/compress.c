@@ -0,0 +1,283 @@
+// compress.c - 传输压缩: 数据块的 LZ 压缩和解压, 服务器端上传下载和客户端发送
+#include "transfer.h"
+#include "event_loop.h"
+#include "compress.h"
+#include "checksum.h"
+#include "dedup.h"
+#include "telemetry.h"
+#include "log.h"
+
+#define COMPRESS_MIN_SAVING 16      // 压缩后至少省下 1/16 才用压缩格式
+
+static int pwrite_full(int fd, const uint8_t* data, size_t len, uint64_t offset)
+{
+    while(len > 0)
+    {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int pread_full(int fd, uint8_t* data, size_t len, uint64_t offset)
+{
+    while(len > 0)
+    {
+        ssize_t n = pread(fd, data, len, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+uint32_t compress_chunk(const uint8_t* raw, uint32_t len, uint8_t* payload)
+{
+    uint32_t limit = len - len / COMPRESS_MIN_SAVING;
+    uint32_t be_len = htonl(len);
+
+    // 熵接近 8 比特的数据压不动, 不必试; 输出超过 limit 时 lz_compress 提前放弃
+    if(limit <= COMPRESS_HEAD || lz_incompressible(raw, len))
+        return 0;
+    size_t packed = lz_compress(raw, len, payload + COMPRESS_HEAD, limit - COMPRESS_HEAD);
+    if(packed == 0)
+        return 0;
+    memcpy(payload, &be_len, sizeof(be_len));
+    return COMPRESS_HEAD + packed;
+}
+
+int64_t decompress_chunk(const uint8_t* payload, uint32_t len, uint8_t* raw)
+{
+    uint32_t raw_len;
+
+    if(len < COMPRESS_HEAD)
+        return -1;
+    memcpy(&raw_len, payload, sizeof(raw_len));
+    raw_len = ntohl(raw_len);
+    if(raw_len == 0 || raw_len > COMPRESS_BLOCK)
+        return -1;
+    if(lz_decompress(payload + COMPRESS_HEAD, len - COMPRESS_HEAD, raw, raw_len) != (ssize_t)raw_len)
+        return -1;
+    return raw_len;
+}
+
+// 服务器端: 为当前传输分配压缩缓冲
+int open_compress(ClientConn* conn)
+{
+    if(conn->lz)
+        return 0;
+
+    CompressStream* lz = calloc(1, sizeof(CompressStream));
+    if(!lz)
+        return -1;
+    lz->raw = malloc(COMPRESS_BLOCK);
+    lz->packed = malloc(COMPRESS_PAYLOAD_MAX);
+    conn->lz = lz;
+    if(!lz->raw || !lz->packed)
+    {
+        close_compress(conn);
+        return -1;
+    }
+    return 0;
+}
+
+// 上传: 收齐一个压缩数据块后解压写入文件, 返回值同 handle_file_upload
+// 完成后 file_size 改为原始长度, 调用者按原始数据记账
+int handle_compress_upload(ClientConn* conn)
+{
+    CompressStream* lz = conn->lz;
+
+    while(conn->file_done < conn->file_size)
+    {
+        ssize_t n = recv(conn->fd, lz->packed + conn->file_done, conn->file_size - conn->file_done, 0);
+        telemetry_io(conn->stats, n > 0 ? n : 0, 1);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_STEP_BLOCKED;
+        }
+        if(n <= 0)
+        {
+            log_warn("Connection error during file transfer");
+            return CONN_STEP_CLOSE;
+        }
+        conn->file_done += n;
+    }
+
+    // 解压失败或越界说明数据流已不可信, 直接关闭
+    // 带 CRC 的块按校验失败处理: 不写文件, 要求客户端重传这一块的原始数据
+    int64_t raw = decompress_chunk(lz->packed, conn->file_size, lz->raw);
+    if((raw < 0 || (uint64_t)raw > conn->file_total - conn->file_offset) && (conn->chunk_flags & CHUNK_FLAG_CRC))
+    {
+        uint64_t left = conn->file_total - conn->file_offset;
+        conn->chunk_corrupt = 1;
+        conn->file_size = left < COMPRESS_BLOCK ? left : COMPRESS_BLOCK;
+        conn->file_done = conn->file_size;
+        return CONN_STEP_DONE;
+    }
+    if(raw < 0 || (uint64_t)raw > conn->file_total - conn->file_offset)
+    {
+        log_warn("Invalid compressed chunk at offset %" PRIu64, conn->file_offset);
+        return CONN_STEP_CLOSE;
+    }
+    if(!conn->file_failed && pwrite_full(conn->file_fd, lz->raw, raw, conn->file_offset) < 0)
+    {
+        log_error("Failed to write file: %s", strerror(errno));
+        conn->file_failed = 1;
+    }
+    telemetry_io(conn->stats, 0, 1);
+    if(conn->chunk_flags & CHUNK_FLAG_CRC)
+        conn->chunk_crc = crc32c(0, lz->raw, raw);
+    lz->wire_bytes += conn->file_size;
+    lz->raw_bytes += raw;
+    conn->file_size = raw;
+    conn->file_done = raw;
+    return CONN_STEP_DONE;
+}
+
+// 下载: 读出 [offset, offset + length) 并压缩, 排入块头; 数据由 handle_compress_download 发送
+int queue_compress_chunk(ClientConn* conn, uint64_t offset, uint32_t length)
+{
+    CompressStream* lz = conn->lz;
+    ChunkHeader chunk;
+
+    // 读不满说明文件在发送过程中被截断
+    if(conn->manifest ? dedup_pread(conn->manifest, -1, lz->raw, length, offset) != (ssize_t)length
+                      : pread_full(conn->file_fd, lz->raw, length, offset) < 0)
+        return CONN_STEP_CLOSE;
+    telemetry_io(conn->stats, 0, 1);
+    telemetry_chunk(conn->stats);
+
+    uint32_t packed = compress_chunk(lz->raw, length, lz->packed);
+    encode_chunk_header(&chunk, offset, packed ? packed : length);
+    if(packed)
+        chunk.flags = htonl(CHUNK_FLAG_LZ);
+    conn_queue(conn, &chunk, sizeof(ChunkHeader));
+
+    lz->out = packed ? lz->packed : lz->raw;
+    lz->out_len = packed ? packed : length;
+    lz->out_sent = 0;
+    lz->raw_bytes += length;
+    lz->wire_bytes += lz->out_len;
+
+    conn->file_offset = offset;
+    conn->file_size = length;
+    conn->file_done = 0;
+    return CONN_STEP_YIELD;
+}
+
+// 下载: 发送当前块的数据, 返回值同 handle_file_download
+int handle_compress_download(ClientConn* conn)
+{
+    CompressStream* lz = conn->lz;
+
+    while(lz->out_sent < lz->out_len)
+    {
+        ssize_t n = send(conn->fd, lz->out + lz->out_sent, lz->out_len - lz->out_sent, MSG_NOSIGNAL);
+        telemetry_io(conn->stats, n > 0 ? n : 0, 1);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_STEP_BLOCKED;
+            return CONN_STEP_CLOSE;
+        }
+        lz->out_sent += n;
+    }
+    conn->file_done = conn->file_size;
+    return CONN_STEP_DONE;
+}
+
+void close_compress(ClientConn* conn)
+{
+    CompressStream* lz = conn->lz;
+
+    if(!lz)
+        return;
+    free(lz->raw);
+    free(lz->packed);
+    free(lz);
+    conn->lz = NULL;
+}
+
+static int send_all(int sockfd, const void* data, size_t len, int flags)
+{
+    const char* p = data;
+
+    while(len > 0)
+    {
+        ssize_t n = send(sockfd, p, len, flags);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int send_file_range_compress(int sockfd, int file_fd, uint64_t offset, uint64_t length, int crc, CompressStats* stats)
+{
+    uint8_t* raw = malloc(COMPRESS_BLOCK);
+    uint8_t* packed = malloc(COMPRESS_PAYLOAD_MAX);
+    uint64_t end = offset + length;
+    int ret = -1;
+
+    memset(stats, 0, sizeof(CompressStats));
+    if(!raw || !packed)
+        goto out;
+
+    while(offset < end)
+    {
+        ChunkHeader chunk;
+        uint32_t size = end - offset < COMPRESS_BLOCK ? (uint32_t)(end - offset) : COMPRESS_BLOCK;
+
+        if(pread_full(file_fd, raw, size, offset) < 0)
+        {
+            perror("Failed to read file");
+            goto out;
+        }
+        uint32_t n = compress_chunk(raw, size, packed);
+        encode_chunk_header(&chunk, offset, n ? n : size);
+        chunk.flags = htonl((n ? CHUNK_FLAG_LZ : 0) | (crc ? CHUNK_FLAG_CRC : 0));
+
+        // MSG_MORE: 块头和随后的数据合并发送; CRC 按原始数据计算, 跟在数据后面, 只在 put -k 时计算
+        uint32_t sum = 0;
+        if(crc)
+            sum = htonl(crc32c(0, raw, size));
+        if(send_all(sockfd, &chunk, sizeof(chunk), MSG_MORE) < 0 ||
+           send_all(sockfd, n ? packed : raw, n ? n : size, crc ? MSG_MORE : 0) < 0 ||
+           (crc && send_all(sockfd, &sum, sizeof(sum), 0) < 0))
+            goto out;
+        // pread 和两到三次 send
+        telemetry_io(telemetry_thread, n ? n : size, crc ? 4 : 3);
+        telemetry_chunk(telemetry_thread);
+        stats->raw += size;
+        stats->wire += n ? n : size;
+        if(n)
+            stats->compressed ++;
+        else
+            stats->bypassed ++;
+        offset += size;
+    }
+    ret = 0;
+
+out:
+    free(raw);
+    free(packed);
+    return ret;
+}
@@ -0,0 +1,194 @@
+// conn_pool.c - 客户端连接池, 在多次 put/get 之间保留已认证的连接
+#include "conn_pool.h"
+#include "transfer_engine.h"
+#include "telemetry.h"
+
+static PooledConn pool[CONN_POOL_SIZE];
+static int pool_ready = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t reaper_thread;
+
+static int key_equal(const PooledConn* conn, const char* ip, int port, const char* username, const char* password)
+{
+    return conn->port == port && strcmp(conn->ip, ip) == 0 &&
+           strncmp(conn->username, username ? username : "", MAX_USERNAME_LEN - 1) == 0 &&
+           strncmp(conn->password, password ? password : "", MAX_PASSWORD_LEN - 1) == 0;
+}
+
+// 调用时持有 pool_lock
+static void pool_drop(PooledConn* conn)
+{
+    close(conn->sockfd);
+    conn->sockfd = -1;
+    conn->in_use = 0;
+}
+
+// 空闲的连接里不应该有待读的数据; 可读说明服务器已关闭或数据流已乱, 不能再用
+static int pool_alive(int sockfd)
+{
+    char c;
+    ssize_t n = recv(sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// 调用时持有 pool_lock
+static void pool_expire(time_t now)
+{
+    for(int i = 0; i < CONN_POOL_SIZE; i ++)
+    {
+        if(pool[i].sockfd >= 0 && !pool[i].in_use && now - pool[i].idle_since >= CONN_POOL_IDLE_TIMEOUT)
+            pool_drop(&pool[i]);
+    }
+}
+
+// 定时关闭超时的空闲连接, 避免 shell 空闲时一直占用服务器的连接
+static void* pool_reaper(void* arg)
+{
+    (void)arg;
+    while(1)
+    {
+        sleep(CONN_POOL_REAP_INTERVAL);
+        pthread_mutex_lock(&pool_lock);
+        pool_expire(time(NULL));
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return NULL;
+}
+
+// 调用时持有 pool_lock
+static void pool_init(void)
+{
+    if(pool_ready)
+        return;
+    for(int i = 0; i < CONN_POOL_SIZE; i ++)
+        pool[i].sockfd = -1;
+    pool_ready = 1;
+
+    if(pthread_create(&reaper_thread, NULL, pool_reaper, NULL) == 0)
+        pthread_detach(reaper_thread);
+}
+
+// 借出一个空闲连接, 没有可用的返回 -1
+int conn_pool_acquire(const char* ip, int port, const char* username, const char* password,
+                      int* proto, uint16_t* features)
+{
+    int sockfd = -1;
+
+    pthread_mutex_lock(&pool_lock);
+    pool_init();
+    pool_expire(time(NULL));
+    for(int i = 0; i < CONN_POOL_SIZE && sockfd < 0; i ++)
+    {
+        PooledConn* conn = &pool[i];
+        if(conn->sockfd < 0 || conn->in_use || !key_equal(conn, ip, port, username, password))
+            continue;
+        if(!pool_alive(conn->sockfd))
+        {
+            pool_drop(conn);
+            continue;
+        }
+        conn->in_use = 1;
+        sockfd = conn->sockfd;
+        *proto = conn->proto;
+        *features = conn->features;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return sockfd;
+}
+
+// 登记一个新建的连接 (借出状态); 池满时淘汰最久未用的空闲连接, 仍然没有空位就不缓存
+void conn_pool_add(int sockfd, const char* ip, int port, const char* username, const char* password,
+                   int proto, uint16_t features)
+{
+    PooledConn* slot = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    pool_init();
+    for(int i = 0; i < CONN_POOL_SIZE; i ++)
+    {
+        if(pool[i].sockfd < 0)
+        {
+            slot = &pool[i];
+            break;
+        }
+        if(!pool[i].in_use && (!slot || pool[i].idle_since < slot->idle_since))
+            slot = &pool[i];
+    }
+
+    if(slot)
+    {
+        if(slot->sockfd >= 0)
+            pool_drop(slot);
+
+        // shell 会 fork 外部命令, 缓存的连接不能泄漏给子进程
+        fcntl(sockfd, F_SETFD, FD_CLOEXEC);
+        slot->sockfd = sockfd;
+        slot->in_use = 1;
+        snprintf(slot->ip, sizeof(slot->ip), "%s", ip);
+        slot->port = port;
+        snprintf(slot->username, sizeof(slot->username), "%s", username ? username : "");
+        snprintf(slot->password, sizeof(slot->password), "%s", password ? password : "");
+        slot->proto = proto;
+        slot->features = features;
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// 归还连接: reusable 表示服务器已回到等待文件头的状态, 否则关闭
+void conn_pool_release(int sockfd, int reusable)
+{
+    telemetry_detach(sockfd);
+    // 被取消的任务的连接已经 shutdown, 不能再复用
+    if(engine_untrack_socket(sockfd))
+        reusable = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    for(int i = 0; pool_ready && i < CONN_POOL_SIZE; i ++)
+    {
+        if(pool[i].sockfd != sockfd || !pool[i].in_use)
+            continue;
+        if(reusable)
+        {
+            pool[i].in_use = 0;
+            pool[i].idle_since = time(NULL);
+        }
+        else
+        {
+            pool_drop(&pool[i]);
+        }
+        pthread_mutex_unlock(&pool_lock);
+        return;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    // 没有登记的连接 (池满时新建的)
+    close(sockfd);
+}
+
+// 借出的连接转作它用 (多路复用), 从池中移除但不关闭
+void conn_pool_detach(int sockfd)
+{
+    pthread_mutex_lock(&pool_lock);
+    for(int i = 0; pool_ready && i < CONN_POOL_SIZE; i ++)
+    {
+        if(pool[i].sockfd == sockfd && pool[i].in_use)
+        {
+            pool[i].sockfd = -1;
+            pool[i].in_use = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// 关闭所有空闲连接
+void conn_pool_clear(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    for(int i = 0; pool_ready && i < CONN_POOL_SIZE; i ++)
+    {
+        if(pool[i].sockfd >= 0 && !pool[i].in_use)
+            pool_drop(&pool[i]);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,791 @@
+// dedup.c
+#define _GNU_SOURCE
+#include "transfer.h"
+#include "event_loop.h"
+#include "dedup.h"
+#include "tree.h"
+#include "log.h"
+#include <endian.h>
+#include <sys/mman.h>
+
+
+// 块在仓库中的路径: 哈希的十六进制, 前两位作为子目录
+static void dedup_chunk_path(const uint8_t* hash, char* path)
+{
+    static const char hex[] = "0123456789abcdef";
+    char* p = path;
+
+    for(int i = 0; i < SHA256_DIGEST_LEN; i ++)
+    {
+        *p ++ = hex[hash[i] >> 4];
+        *p ++ = hex[hash[i] & 15];
+        if(i == 0)
+            *p ++ = '/';
+    }
+    *p = '\0';
+}
+
+#define DEDUP_PATH_LEN      (SHA256_DIGEST_LEN * 2 + 2)
+
+static uint32_t dedup_entry_length(const uint8_t* entry)
+{
+    uint32_t len;
+
+    memcpy(&len, entry + SHA256_DIGEST_LEN, sizeof(len));
+    return ntohl(len);
+}
+
+// 服务器启动时打开根目录下的块仓库, 不存在时创建
+int dedup_open_store(int root_fd)
+{
+    if(mkdirat(root_fd, DEDUP_STORE_DIR, 0755) != 0 && errno != EEXIST)
+    {
+        log_error("Failed to create chunk store: %s", strerror(errno));
+        return -1;
+    }
+    int fd = openat(root_fd, DEDUP_STORE_DIR, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0)
+        log_error("Failed to open chunk store: %s", strerror(errno));
+    return fd;
+}
+
+static int write_all(int fd, const void* data, size_t len)
+{
+    const char* p = data;
+
+    while(len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 去重模式下读取文件: fd 是清单时读入索引, 在 *reader 返回读取器, 数据在发送时从仓库逐块读取;
+// 不是清单时 *reader 为 NULL. 返回 fd, 失败时关闭 fd 并返回 -1
+// st 的大小改为展开后的大小, 其余字段仍是清单的, 续传标识不变
+int dedup_open_read(int store_fd, int fd, struct stat* st, DedupReader** reader)
+{
+    uint8_t head[DEDUP_MANIFEST_HEAD];
+    uint64_t size;
+    uint32_t count;
+
+    *reader = NULL;
+    if(st->st_size < DEDUP_MANIFEST_HEAD || pread(fd, head, sizeof(head), 0) != sizeof(head) ||
+       memcmp(head, DEDUP_MANIFEST_MAGIC, 8) != 0)
+        return fd;
+    memcpy(&size, head + 8, sizeof(size));
+    memcpy(&count, head + 16, sizeof(count));
+    size = be64toh(size);
+    count = ntohl(count);
+    if(count > DEDUP_MAX_CHUNKS || (uint64_t)st->st_size != DEDUP_MANIFEST_HEAD + (uint64_t)count * DEDUP_ENTRY_SIZE)
+        return fd;
+
+    size_t index_len = (size_t)count * DEDUP_ENTRY_SIZE;
+    DedupReader* r = calloc(1, sizeof(DedupReader));
+    if(!r)
+        goto fail;
+    r->store_fd = store_fd;
+    r->size = size;
+    r->count = count;
+    r->chunk_fd = -1;
+    r->index = malloc(index_len ? index_len : 1);
+    r->starts = malloc(((size_t)count + 1) * sizeof(uint64_t));
+    if(!r->index || !r->starts || pread(fd, r->index, index_len, DEDUP_MANIFEST_HEAD) != (ssize_t)index_len)
+        goto fail;
+
+    // 只累加索引里的长度; 块文件在读到时才打开, 缺少的块到那时才发现
+    uint64_t total = 0;
+    for(uint32_t i = 0; i < count; i ++)
+    {
+        r->starts[i] = total;
+        total += dedup_entry_length(r->index + (size_t)i * DEDUP_ENTRY_SIZE);
+    }
+    r->starts[count] = total;
+    if(total != size)
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    st->st_size = size;
+    *reader = r;
+    return fd;
+
+fail:
+    log_error("Failed to read manifest: %s", strerror(errno));
+    dedup_close_read(r);
+    close(fd);
+    return -1;
+}
+
+// 找到 offset 所在的块并打开, 返回块文件的 fd (由读取器关闭), *chunk_offset 为块内位置, *avail 为到块末尾的字节数
+// offset 不在文件内或块文件打不开时返回 -1
+int dedup_read_chunk(DedupReader* reader, uint64_t offset, off_t* chunk_offset, size_t* avail)
+{
+    uint32_t i = reader->cur;
+
+    if(offset >= reader->size)
+        return -1;
+    // 顺序读取时大多还在当前块, 否则二分查找起点不超过 offset 的最后一块
+    if(offset < reader->starts[i] || offset >= reader->starts[i + 1])
+    {
+        uint32_t lo = 0, hi = reader->count - 1;
+        while(lo < hi)
+        {
+            uint32_t mid = lo + (hi - lo + 1) / 2;
+            if(reader->starts[mid] <= offset)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        i = lo;
+    }
+
+    if(i != reader->cur || reader->chunk_fd < 0)
+    {
+        char path[DEDUP_PATH_LEN];
+
+        if(reader->chunk_fd >= 0)
+            close(reader->chunk_fd);
+        dedup_chunk_path(reader->index + (size_t)i * DEDUP_ENTRY_SIZE, path);
+        reader->cur = i;
+        reader->chunk_fd = openat(reader->store_fd, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if(reader->chunk_fd < 0)
+        {
+            log_warn("Missing chunk %s", path);
+            return -1;
+        }
+    }
+    *chunk_offset = offset - reader->starts[i];
+    *avail = reader->starts[i + 1] - offset;
+    return reader->chunk_fd;
+}
+
+// 和 pread 一样读取 [offset, offset + len), 可以跨块; reader 为 NULL 时直接读 fd
+ssize_t dedup_pread(DedupReader* reader, int fd, void* data, size_t len, uint64_t offset)
+{
+    size_t got = 0;
+
+    if(!reader)
+        return pread(fd, data, len, offset);
+    while(got < len && offset + got < reader->size)
+    {
+        off_t pos;
+        size_t avail;
+        int chunk_fd = dedup_read_chunk(reader, offset + got, &pos, &avail);
+        if(chunk_fd < 0)
+            return got ? (ssize_t)got : -1;
+
+        ssize_t n = pread(chunk_fd, (uint8_t*)data + got, len - got < avail ? len - got : avail, pos);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return got ? (ssize_t)got : -1;
+        if(n == 0)
+            break;      // 块文件比索引记录的短
+        got += n;
+    }
+    return got;
+}
+
+void dedup_close_read(DedupReader* reader)
+{
+    if(!reader)
+        return;
+    if(reader->chunk_fd >= 0)
+        close(reader->chunk_fd);
+    free(reader->index);
+    free(reader->starts);
+    free(reader);
+}
+
+// 下载结束或连接关闭时释放连接上的清单读取器
+void close_download_dedup(ClientConn* conn)
+{
+    dedup_close_read(conn->manifest);
+    conn->manifest = NULL;
+}
+
+// 服务器端: 收到 CMD_PUT_DEDUP 的文件名, 准备接收索引
+int open_upload_dedup(ClientConn* conn, int store_fd)
+{
+    uint64_t index_len = file_header_offset(&conn->header);
+
+    if(index_len % DEDUP_ENTRY_SIZE != 0 || index_len / DEDUP_ENTRY_SIZE > DEDUP_MAX_CHUNKS)
+    {
+        log_warn("Invalid dedup index length: %" PRIu64, index_len);
+        return -1;
+    }
+
+    DedupUpload* dedup = calloc(1, sizeof(DedupUpload));
+    if(!dedup)
+        return -1;
+    conn->dedup = dedup;
+    dedup->store_fd = store_fd;
+    dedup->size = file_header_size(&conn->header);
+    dedup->index_len = index_len;
+    dedup->count = index_len / DEDUP_ENTRY_SIZE;
+    dedup->index = malloc(index_len ? index_len : 1);
+    dedup->chunk = malloc(DEDUP_CHUNK_MAX);
+    if(!dedup->index || !dedup->chunk)
+        return -1;
+
+    if(!tree_request_path(conn, conn->filename))
+    {
+        log_warn("Security violation: Invalid file path");
+        return -1;
+    }
+    return 0;
+}
+
+// 索引项按哈希排序, 哈希相同时按位置, 用于找出同一文件里重复的块
+static int dedup_compare(const void* a, const void* b, void* arg)
+{
+    const uint8_t* index = arg;
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    int ret = memcmp(index + (size_t)x * DEDUP_ENTRY_SIZE, index + (size_t)y * DEDUP_ENTRY_SIZE, SHA256_DIGEST_LEN);
+    if(ret == 0)
+        ret = x < y ? -1 : x > y;
+    return ret;
+}
+
+// 检查索引, 生成回复的位图, 返回需要上传的字节数; 索引不合法返回 -1
+static int64_t dedup_check_index(DedupUpload* dedup, uint8_t* bitmap)
+{
+    uint64_t sum = 0;
+    uint64_t missing = 0;
+    uint32_t* order = malloc((dedup->count ? dedup->count : 1) * sizeof(uint32_t));
+
+    if(!order)
+        return -1;
+    for(uint32_t i = 0; i < dedup->count; i ++)
+    {
+        uint32_t len = dedup_entry_length(dedup->index + (size_t)i * DEDUP_ENTRY_SIZE);
+        if(len == 0 || len > DEDUP_CHUNK_MAX)
+        {
+            free(order);
+            return -1;
+        }
+        sum += len;
+        order[i] = i;
+    }
+    if(sum != dedup->size)
+    {
+        free(order);
+        return -1;
+    }
+
+    qsort_r(order, dedup->count, sizeof(uint32_t), dedup_compare, dedup->index);
+
+    for(uint32_t k = 0; k < dedup->count; k ++)
+    {
+        uint32_t i = order[k];
+        const uint8_t* entry = dedup->index + (size_t)i * DEDUP_ENTRY_SIZE;
+        char path[DEDUP_PATH_LEN];
+        struct stat st;
+
+        // 排序后重复的块相邻, 只有第一次出现的需要检查
+        if(k > 0 && memcmp(entry, dedup->index + (size_t)order[k - 1] * DEDUP_ENTRY_SIZE, SHA256_DIGEST_LEN) == 0)
+            continue;
+        dedup_chunk_path(entry, path);
+        if(fstatat(dedup->store_fd, path, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode) &&
+           (uint64_t)st.st_size == dedup_entry_length(entry))
+            continue;
+        bitmap[i / 8] |= 1 << (i % 8);
+        missing += dedup_entry_length(entry);
+    }
+    free(order);
+    return missing;
+}
+
+static int dedup_needed(const DedupUpload* dedup, uint32_t i)
+{
+    const uint8_t* bitmap = dedup->reply + sizeof(FileHeader);
+    return (bitmap[i / 8] >> (i % 8)) & 1;
+}
+
+// 跳到下一个需要接收数据的块
+static void dedup_next_chunk(DedupUpload* dedup)
+{
+    while(dedup->cur < dedup->count && !dedup_needed(dedup, dedup->cur))
+        dedup->cur ++;
+    dedup->chunk_got = 0;
+}
+
+// 接收索引, 查块仓库后发送位图; 全部发完返回 CONN_STEP_DONE, conn->file_total 为之后要接收的字节数
+int handle_dedup_index(ClientConn* conn)
+{
+    DedupUpload* dedup = conn->dedup;
+
+    while(dedup->index_got < dedup->index_len)
+    {
+        ssize_t n = recv(conn->fd, dedup->index + dedup->index_got, dedup->index_len - dedup->index_got, 0);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_STEP_BLOCKED;
+        }
+        if(n <= 0)
+            return CONN_STEP_CLOSE;
+        dedup->index_got += n;
+    }
+
+    if(!dedup->reply)
+    {
+        size_t bitmap_len = (dedup->count + 7) / 8;
+        FileHeader header;
+
+        dedup->reply = calloc(1, sizeof(FileHeader) + bitmap_len);
+        if(!dedup->reply)
+            return CONN_STEP_CLOSE;
+        int64_t missing = dedup_check_index(dedup, dedup->reply + sizeof(FileHeader));
+        if(missing < 0)
+        {
+            log_warn("Invalid dedup index");
+            return CONN_STEP_CLOSE;
+        }
+
+        log_info("Receiving deduplicated file: %s (Size: %" PRIu64 " bytes, %u chunks, %" PRId64 " bytes missing)",
+                 conn->filename, dedup->size, dedup->count, missing);
+        encode_file_header(&header, conn->proto, CMD_PUT_DEDUP, missing, 0);
+        set_file_header_offset(&header, bitmap_len);
+        memcpy(dedup->reply, &header, sizeof(header));
+        dedup->reply_len = sizeof(FileHeader) + bitmap_len;
+        conn->file_total = missing;
+        dedup_next_chunk(dedup);
+    }
+
+    while(dedup->reply_off < dedup->reply_len)
+    {
+        ssize_t n = send(conn->fd, dedup->reply + dedup->reply_off, dedup->reply_len - dedup->reply_off, MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_STEP_BLOCKED;
+        }
+        if(n <= 0)
+            return CONN_STEP_CLOSE;
+        dedup->reply_off += n;
+    }
+    return CONN_STEP_DONE;
+}
+
+// 后台存入一个块: 数据落盘后才 rename 到仓库里, 仓库里的块总是完整的
+typedef struct {
+    int store_fd;
+    int fd;                     // 写好的临时文件, 由后台线程关闭
+    char tmp[DEDUP_PATH_LEN + 32];
+    char path[DEDUP_PATH_LEN];
+} DedupStoreJob;
+
+static int dedup_commit_chunk(void* arg)
+{
+    DedupStoreJob* job = arg;
+    // 其他连接同时存入了同一块时 rename 覆盖的是相同的内容
+    int ret = fdatasync(job->fd) == 0 && renameat(job->store_fd, job->tmp, job->store_fd, job->path) == 0 ? 0 : -1;
+
+    if(ret < 0)
+    {
+        log_error("Failed to store chunk: %s", strerror(errno));
+        unlinkat(job->store_fd, job->tmp, 0);
+    }
+    close(job->fd);
+    free(job);
+    return ret;
+}
+
+// 校验收齐的块, 写入仓库里的临时文件, 落盘和 rename 交给后台线程
+static void dedup_store_chunk(ClientConn* conn)
+{
+    DedupUpload* dedup = conn->dedup;
+    const uint8_t* entry = dedup->index + (size_t)dedup->cur * DEDUP_ENTRY_SIZE;
+    uint8_t hash[SHA256_DIGEST_LEN];
+
+    sha256(dedup->chunk, dedup->chunk_got, hash);
+    if(memcmp(hash, entry, SHA256_DIGEST_LEN) != 0)
+    {
+        log_warn("Chunk %u of %s does not match its hash", dedup->cur, conn->filename);
+        dedup->failed = 1;
+        return;
+    }
+
+    DedupStoreJob* job = malloc(sizeof(DedupStoreJob));
+    if(!job)
+    {
+        dedup->failed = 1;
+        return;
+    }
+    job->store_fd = dedup->store_fd;
+    dedup_chunk_path(hash, job->path);
+    snprintf(job->tmp, sizeof(job->tmp), "%s.%d" DEDUP_TEMP_SUFFIX, job->path, conn->fd);
+    job->path[2] = '\0';
+    if(mkdirat(dedup->store_fd, job->path, 0755) != 0 && errno != EEXIST)
+    {
+        log_error("Failed to create chunk directory: %s", strerror(errno));
+        free(job);
+        dedup->failed = 1;
+        return;
+    }
+    job->path[2] = '/';
+
+    job->fd = openat(dedup->store_fd, job->tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if(job->fd < 0 || write_all(job->fd, dedup->chunk, dedup->chunk_got) < 0)
+    {
+        log_error("Failed to store chunk: %s", strerror(errno));
+        if(job->fd >= 0)
+        {
+            close(job->fd);
+            unlinkat(dedup->store_fd, job->tmp, 0);
+        }
+        free(job);
+        dedup->failed = 1;
+        return;
+    }
+    dedup->dirs[hash[0] / 8] |= 1 << (hash[0] % 8);
+    dedup->stored += dedup->chunk_got;
+    sync_submit(&dedup->sync, dedup_commit_chunk, job);
+}
+
+// 后台 fsync 仓库的一个子目录, 让其中 rename 进来的块持久
+typedef struct {
+    int store_fd;
+    char name[3];
+} DedupDirJob;
+
+static int dedup_sync_dir(void* arg)
+{
+    DedupDirJob* job = arg;
+    int fd = openat(job->store_fd, job->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    int ret = fd >= 0 && fsync(fd) == 0 ? 0 : -1;
+
+    if(ret < 0)
+        log_error("Failed to sync chunk directory %s: %s", job->name, strerror(errno));
+    if(fd >= 0)
+        close(fd);
+    free(job);
+    return ret;
+}
+
+// 等新块都落盘并 rename 完, 再 fsync 存入过新块的子目录; 返回 0 表示成功
+static int dedup_sync_store(DedupUpload* dedup)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    if(sync_wait(&dedup->sync) != 0)
+        return -1;
+    for(int i = 0; i < 256; i ++)
+    {
+        if(!(dedup->dirs[i / 8] & (1 << (i % 8))))
+            continue;
+        DedupDirJob* job = malloc(sizeof(DedupDirJob));
+        if(!job)
+            return -1;
+        job->store_fd = dedup->store_fd;
+        job->name[0] = hex[i >> 4];
+        job->name[1] = hex[i & 15];
+        job->name[2] = '\0';
+        sync_submit(&dedup->sync, dedup_sync_dir, job);
+    }
+    return sync_wait(&dedup->sync);
+}
+
+// 接收当前 v2 数据块, 按索引切成各个块存入仓库, 返回值同 handle_file_upload
+int handle_dedup_upload(ClientConn* conn)
+{
+    DedupUpload* dedup = conn->dedup;
+    size_t budget = EVENT_LOOP_CONN_BUDGET;
+
+    while(conn->file_done < conn->file_size)
+    {
+        if(budget == 0)
+            return CONN_STEP_YIELD;
+        // 数据总量已由 handle_request_chunk 按位图检查过, 这里不会超出最后一块
+        if(dedup->cur >= dedup->count)
+            return CONN_STEP_CLOSE;
+
+        uint32_t len = dedup_entry_length(dedup->index + (size_t)dedup->cur * DEDUP_ENTRY_SIZE);
+        size_t to_receive = len - dedup->chunk_got;
+        if(conn->file_size - conn->file_done < to_receive)
+            to_receive = conn->file_size - conn->file_done;
+
+        ssize_t n = recv(conn->fd, dedup->chunk + dedup->chunk_got, to_receive, 0);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_STEP_BLOCKED;
+        }
+        if(n <= 0)
+        {
+            log_warn("Connection error during dedup transfer");
+            return CONN_STEP_CLOSE;
+        }
+
+        dedup->chunk_got += n;
+        conn->file_done += n;
+        budget = (size_t)n < budget ? budget - n : 0;
+        if(dedup->chunk_got == len)
+        {
+            if(!dedup->failed)
+                dedup_store_chunk(conn);
+            dedup->cur ++;
+            dedup_next_chunk(dedup);
+        }
+    }
+    return CONN_STEP_DONE;
+}
+
+// 所有块都在仓库里后写入清单, 替换同名文件; 返回 0 表示成功
+int finish_upload_dedup(ClientConn* conn, int root_fd)
+{
+    DedupUpload* dedup = conn->dedup;
+    uint8_t head[DEDUP_MANIFEST_HEAD];
+    uint64_t size = htobe64(dedup->size);
+    uint32_t count = htonl(dedup->count);
+    const char* base;
+    char tmp[MAX_PATH_LEN + 32];
+
+    if(dedup->failed)
+        return -1;
+
+    // 新块先落盘, 清单才能指向它们
+    if(dedup_sync_store(dedup) != 0)
+        return -1;
+
+    memset(head, 0, sizeof(head));
+    memcpy(head, DEDUP_MANIFEST_MAGIC, 8);
+    memcpy(head + 8, &size, sizeof(size));
+    memcpy(head + 16, &count, sizeof(count));
+
+    int dir_fd = tree_open_parent(root_fd, conn->filename, 1, &base);
+    if(dir_fd < 0)
+    {
+        log_error("Failed to open directory: %s", strerror(errno));
+        return -1;
+    }
+    snprintf(tmp, sizeof(tmp), ".%s.%d" DEDUP_TEMP_SUFFIX, base, conn->fd);
+    int fd = openat(dir_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+    int ret = fd < 0 || write_all(fd, head, sizeof(head)) < 0 || write_all(fd, dedup->index, dedup->index_len) < 0 ||
+              fdatasync(fd) != 0 || renameat(dir_fd, tmp, dir_fd, base) != 0 ? -1 : 0;
+    if(ret < 0)
+    {
+        log_error("Failed to write manifest: %s", strerror(errno));
+        unlinkat(dir_fd, tmp, 0);
+    }
+    if(fd >= 0)
+        close(fd);
+    close(dir_fd);
+    return ret;
+}
+
+void close_upload_dedup(ClientConn* conn)
+{
+    DedupUpload* dedup = conn->dedup;
+
+    if(!dedup)
+        return;
+    // 后台线程还在用临时文件名和仓库, 等它们结束
+    sync_wait(&dedup->sync);
+    free(dedup->index);
+    free(dedup->reply);
+    free(dedup->chunk);
+    free(dedup);
+    conn->dedup = NULL;
+}
+
+
+// 客户端: gear 表由固定种子生成, 所有客户端切出相同的块
+static uint64_t dedup_gear[256];
+static pthread_once_t dedup_gear_once = PTHREAD_ONCE_INIT;
+
+static void dedup_gear_init(void)
+{
+    uint64_t x = 0x4C46545047454152ull;     // "LFTPGEAR"
+
+    for(int i = 0; i < 256; i ++)
+    {
+        // splitmix64
+        uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        dedup_gear[i] = z ^ (z >> 31);
+    }
+}
+
+// 掩码取高位: 每步左移一位, 高位由最近的 64 个字节决定
+#define DEDUP_AVG_BITS      14
+#define DEDUP_MASK(bits)    (((1ull << (bits)) - 1) << (64 - (bits)))
+#define DEDUP_MASK_SMALL    DEDUP_MASK(DEDUP_AVG_BITS + 2)
+#define DEDUP_MASK_LARGE    DEDUP_MASK(DEDUP_AVG_BITS - 2)
+
+// FastCDC: 不到平均大小时用更严的掩码, 超过后放宽, 块大小集中在平均值附近
+static size_t dedup_cut(const uint8_t* data, size_t len)
+{
+    size_t normal = len < DEDUP_CHUNK_AVG ? len : DEDUP_CHUNK_AVG;
+    size_t max = len < DEDUP_CHUNK_MAX ? len : DEDUP_CHUNK_MAX;
+    uint64_t fp = 0;
+    size_t i = DEDUP_CHUNK_MIN;
+
+    if(len <= DEDUP_CHUNK_MIN)
+        return len;
+    for(; i < normal; i ++)
+    {
+        fp = (fp << 1) + dedup_gear[data[i]];
+        if(!(fp & DEDUP_MASK_SMALL))
+            return i + 1;
+    }
+    for(; i < max; i ++)
+    {
+        fp = (fp << 1) + dedup_gear[data[i]];
+        if(!(fp & DEDUP_MASK_LARGE))
+            return i + 1;
+    }
+    return max;
+}
+
+static int send_all(int sockfd, const void* data, size_t len, int flags)
+{
+    const char* p = data;
+
+    while(len > 0)
+    {
+        ssize_t n = send(sockfd, p, len, flags);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 切块并生成索引, 返回块数; 块太多时返回 -1
+static int64_t dedup_build_index(const uint8_t* data, uint64_t size, uint8_t* index, uint64_t* offsets)
+{
+    uint64_t pos = 0;
+    int64_t count = 0;
+
+    while(pos < size)
+    {
+        if(count == DEDUP_MAX_CHUNKS)
+            return -1;
+
+        uint32_t len = dedup_cut(data + pos, size - pos);
+        uint32_t be_len = htonl(len);
+        uint8_t* entry = index + (size_t)count * DEDUP_ENTRY_SIZE;
+
+        sha256(data + pos, len, entry);
+        memcpy(entry + SHA256_DIGEST_LEN, &be_len, sizeof(be_len));
+        offsets[count ++] = pos;
+        pos += len;
+    }
+    return count;
+}
+
+// 客户端: 发送索引和服务器缺少的块
+// 返回 0 表示已发送完, 1 表示服务器拒绝了请求, DEDUP_FALLBACK 表示文件块太多 (还没有发送请求), -1 表示连接出错
+int send_file_dedup(int sockfd, const char* filename, int file_fd, uint64_t size, DedupStats* stats)
+{
+    FileHeader header;
+    uint16_t name_len = strlen(filename);
+    const uint8_t* data = NULL;
+    uint8_t* bitmap = NULL;
+    int ret = -1;
+
+    memset(stats, 0, sizeof(DedupStats));
+    pthread_once(&dedup_gear_once, dedup_gear_init);
+
+    // 块数不超过 size / DEDUP_CHUNK_MIN + 1, 超过上限的部分直接按上限分配, 切到上限时放弃
+    uint64_t max_count = size / DEDUP_CHUNK_MIN + 1;
+    if(max_count > DEDUP_MAX_CHUNKS)
+        max_count = DEDUP_MAX_CHUNKS;
+    uint8_t* index = malloc(max_count * DEDUP_ENTRY_SIZE);
+    uint64_t* offsets = malloc(max_count * sizeof(uint64_t));
+    if(!index || !offsets)
+        goto out;
+
+    if(size > 0)
+    {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+        if(data == MAP_FAILED)
+        {
+            perror("mmap");
+            data = NULL;
+            goto out;
+        }
+        madvise((void*)data, size, MADV_SEQUENTIAL);
+    }
+
+    int64_t count = dedup_build_index(data, size, index, offsets);
+    if(count < 0)
+    {
+        ret = DEDUP_FALLBACK;
+        goto out;
+    }
+    stats->chunks = count;
+
+    size_t index_len = (size_t)count * DEDUP_ENTRY_SIZE;
+    encode_file_header(&header, PROTOCOL_V2, CMD_PUT_DEDUP, size, name_len);
+    set_file_header_offset(&header, index_len);
+    if(send_all(sockfd, &header, sizeof(header), MSG_MORE | MSG_NOSIGNAL) < 0 ||
+       send_all(sockfd, filename, name_len, MSG_MORE | MSG_NOSIGNAL) < 0 ||
+       send_all(sockfd, index, index_len, MSG_NOSIGNAL) < 0 ||
+       receive_file_header(sockfd, &header) < 0)
+        goto out;
+    if(header.command != CMD_PUT_DEDUP)
+    {
+        ret = header.command == CMD_NAK ? 1 : -1;
+        goto out;
+    }
+
+    // 空文件没有位图, 不能用长度为 0 的 recv, 它会等到有数据才返回
+    size_t bitmap_len = (count + 7) / 8;
+    if(file_header_offset(&header) != bitmap_len || !(bitmap = malloc(bitmap_len ? bitmap_len : 1)) ||
+       (bitmap_len > 0 && recv(sockfd, bitmap, bitmap_len, MSG_WAITALL) != (ssize_t)bitmap_len))
+        goto out;
+
+    // 服务器缺少的块按顺序拼接, 每块一个 v2 数据块
+    uint64_t offset = 0;
+    for(int64_t i = 0; i < count; i ++)
+    {
+        if(!((bitmap[i / 8] >> (i % 8)) & 1))
+            continue;
+
+        ChunkHeader chunk;
+        uint32_t len = dedup_entry_length(index + (size_t)i * DEDUP_ENTRY_SIZE);
+
+        encode_chunk_header(&chunk, offset, len);
+        if(send_all(sockfd, &chunk, sizeof(chunk), MSG_MORE | MSG_NOSIGNAL) < 0 ||
+           send_all(sockfd, data + offsets[i], len, MSG_MORE | MSG_NOSIGNAL) < 0)
+            goto out;
+        offset += len;
+        stats->sent_chunks ++;
+    }
+    stats->sent = offset;
+    if(offset != file_header_size(&header))
+    {
+        printf("Chunk list does not match the server's request\n");
+        goto out;
+    }
+    ret = send_chunk_end(sockfd) < 0 ? -1 : 0;
+
+out:
+    if(data)
+        munmap((void*)data, size);
+    free(bitmap);
+    free(index);
+    free(offsets);
+    return ret;
+}
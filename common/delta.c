@@ -0,0 +1,692 @@
+// delta.c
+#define _GNU_SOURCE
+#include "transfer.h"
+#include "event_loop.h"
+#include "delta.h"
+#include "dedup.h"
+#include "tree.h"
+#include "log.h"
+#include <sys/mman.h>
+
+
+// 块大小取旧文件大小平方根附近的 2 的幂, 签名总量和匹配粒度之间折中
+static uint32_t delta_block_size(uint64_t size)
+{
+    uint64_t block = DELTA_BLOCK_MIN;
+
+    while((block < DELTA_BLOCK_MAX && block * block < size) || size / block >= DELTA_MAX_BLOCKS)
+        block <<= 1;
+    return (uint32_t)block;
+}
+
+// 服务器端: 收到 CMD_PUT_DELTA 的文件名, 打开旧文件和临时文件, 排入签名的回复头
+int open_upload_delta(ClientConn* conn, int root_fd)
+{
+    struct stat st;
+    const char* base;
+
+    if(!tree_request_path(conn, conn->filename))
+    {
+        log_warn("Security violation: Invalid file path");
+        return -1;
+    }
+
+    DeltaUpload* delta = calloc(1, sizeof(DeltaUpload));
+    if(!delta)
+        return -1;
+    delta->old_fd = -1;
+    delta->tmp_fd = -1;
+    md5_init(&delta->md5);
+    conn->delta = delta;
+
+    // 临时文件和目标在同一目录, 最后 renameat 原子替换
+    delta->dir_fd = tree_open_parent(root_fd, conn->filename, 1, &base);
+    if(delta->dir_fd < 0)
+    {
+        log_error("Failed to open directory: %s", strerror(errno));
+        return -1;
+    }
+    snprintf(delta->base_name, sizeof(delta->base_name), "%s", base);
+    snprintf(delta->tmp_name, sizeof(delta->tmp_name), ".%s.%d" DELTA_TEMP_SUFFIX, base, conn->fd);
+    delta->tmp_fd = openat(delta->dir_fd, delta->tmp_name, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if(delta->tmp_fd < 0)
+    {
+        log_error("Failed to open file for writing: %s", strerror(errno));
+        return -1;
+    }
+
+    // 没有旧文件时签名为空, 客户端发送的全是新数据
+    delta->old_fd = openat(delta->dir_fd, base, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(delta->old_fd >= 0 && (fstat(delta->old_fd, &st) != 0 || !S_ISREG(st.st_mode)))
+    {
+        close(delta->old_fd);
+        delta->old_fd = -1;
+    }
+    // 去重模式下旧文件可能是清单, 签名要按展开后的内容计算
+    if(delta->old_fd >= 0 && conn->loop->config->store_fd >= 0)
+        delta->old_fd = dedup_open_read(conn->loop->config->store_fd, delta->old_fd, &st, &delta->old_manifest);
+    if(delta->old_fd >= 0)
+    {
+        delta->old_size = st.st_size;
+        fchmod(delta->tmp_fd, st.st_mode & 07777);
+    }
+    delta->block_size = delta_block_size(delta->old_size);
+    delta->block_count = (delta->old_size + delta->block_size - 1) / delta->block_size;
+
+    if(delta->block_count > 0)
+    {
+        delta->block_buf = malloc(delta->block_size);
+        delta->sig_buf = malloc(DELTA_SIG_BATCH * sizeof(DeltaSignature));
+        if(!delta->block_buf || !delta->sig_buf)
+            return -1;
+    }
+
+    log_info("Delta base: %" PRIu64 " bytes in %u blocks of %u bytes",
+             delta->old_size, delta->block_count, delta->block_size);
+
+    FileHeader header;
+    encode_file_header(&header, conn->proto, CMD_PUT_DELTA, delta->old_size, 0);
+    set_file_header_offset(&header, delta->block_size);
+    conn_queue(conn, &header, sizeof(FileHeader));
+    return 0;
+}
+
+// 计算一批旧块的签名; 读取不完整时按 0 计算, 客户端引用到的话最后的 MD5 对不上
+static size_t delta_sign_batch(DeltaUpload* delta)
+{
+    DeltaSignature* sig = delta->sig_buf;
+    size_t bytes = 0;
+
+    while(sig < delta->sig_buf + DELTA_SIG_BATCH && delta->sig_next < delta->block_count)
+    {
+        uint64_t pos = (uint64_t)delta->sig_next * delta->block_size;
+        size_t len = delta->old_size - pos < delta->block_size ? (size_t)(delta->old_size - pos) : delta->block_size;
+        ssize_t n = dedup_pread(delta->old_manifest, delta->old_fd, delta->block_buf, len, pos);
+
+        if(n < (ssize_t)len)
+            memset(delta->block_buf + (n > 0 ? n : 0), 0, len - (n > 0 ? n : 0));
+        sig->weak = htonl(rolling_checksum(delta->block_buf, len));
+        md5(delta->block_buf, len, sig->strong);
+        sig ++;
+        delta->sig_next ++;
+        bytes += len;
+    }
+    delta->sig_len = (size_t)(sig - delta->sig_buf) * sizeof(DeltaSignature);
+    delta->sig_off = 0;
+    return bytes;
+}
+
+// 分批计算并发送签名, 大文件不会长时间占住事件循环; 返回值同 handle_file_upload
+int handle_delta_signature(ClientConn* conn)
+{
+    DeltaUpload* delta = conn->delta;
+    size_t budget = EVENT_LOOP_CONN_BUDGET;
+
+    while(1)
+    {
+        while(delta->sig_off < delta->sig_len)
+        {
+            ssize_t n = send(conn->fd, (uint8_t*)delta->sig_buf + delta->sig_off, delta->sig_len - delta->sig_off,
+                             MSG_NOSIGNAL);
+            if(n < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                if(errno == EAGAIN || errno == EWOULDBLOCK)
+                    return CONN_STEP_BLOCKED;
+            }
+            if(n <= 0)
+                return CONN_STEP_CLOSE;
+            delta->sig_off += n;
+        }
+
+        if(delta->sig_next == delta->block_count)
+            break;
+        if(budget == 0)
+            return CONN_STEP_YIELD;
+
+        size_t bytes = delta_sign_batch(delta);
+        budget = bytes < budget ? budget - bytes : 0;
+    }
+
+    free(delta->block_buf);
+    delta->block_buf = NULL;
+    free(delta->sig_buf);
+    delta->sig_buf = NULL;
+    return CONN_STEP_DONE;
+}
+
+// 写入重建的数据, 出错后只计数不再写入
+static void delta_write(DeltaUpload* delta, const char* data, size_t len)
+{
+    md5_update(&delta->md5, data, len);
+    if(!delta->failed)
+    {
+        size_t done = 0;
+        while(done < len)
+        {
+            ssize_t n = pwrite(delta->tmp_fd, data + done, len - done, delta->written + done);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+            {
+                log_error("Failed to write delta: %s", strerror(errno));
+                delta->failed = 1;
+                break;
+            }
+            done += n;
+        }
+    }
+    delta->written += len;
+}
+
+// 解析下一个操作; 越界或未知的操作说明数据流已不可信, 返回 -1
+static int delta_start_op(ClientConn* conn)
+{
+    DeltaUpload* delta = conn->delta;
+    DeltaOp* op = &delta->op;
+    uint64_t len = 0;
+
+    memcpy(op, conn->in_buf, sizeof(DeltaOp));
+    op->arg = ntohl(op->arg);
+    op->count = ntohl(op->count);
+
+    switch(op->type)
+    {
+        case DELTA_OP_END:
+            delta->ending = 1;
+            conn_expect(conn, MD5_DIGEST_LEN);
+            return 0;
+        case DELTA_OP_COPY:
+            if(op->arg >= delta->block_count || op->count > delta->block_count - op->arg)
+                return -1;
+            delta->copy_pos = (uint64_t)op->arg * delta->block_size;
+            len = (uint64_t)op->count * delta->block_size;
+            if(len > delta->old_size - delta->copy_pos)
+                len = delta->old_size - delta->copy_pos;
+            break;
+        case DELTA_OP_LITERAL:
+            if(op->arg > DELTA_LITERAL_MAX)
+                return -1;
+            len = op->arg;
+            break;
+        default:
+            return -1;
+    }
+    if(len > conn->file_total - delta->written)
+        return -1;
+    delta->op_left = len;
+    conn_expect(conn, sizeof(DeltaOp));
+    return 0;
+}
+
+// 执行当前操作的一部分, 返回处理的字节数, socket 暂时不可读返回 0, 连接出错返回 -1
+static ssize_t delta_step_op(ClientConn* conn, char* buffer, size_t buflen)
+{
+    DeltaUpload* delta = conn->delta;
+    size_t len = delta->op_left < buflen ? (size_t)delta->op_left : buflen;
+    ssize_t n;
+
+    if(delta->op.type == DELTA_OP_COPY)
+    {
+        // 旧文件在此期间被改短时重建结果不对, 由最后的 MD5 检查发现
+        n = dedup_pread(delta->old_manifest, delta->old_fd, buffer, len, delta->copy_pos);
+        if(n < (ssize_t)len)
+            memset(buffer + (n > 0 ? n : 0), 0, len - (n > 0 ? n : 0));
+        n = len;
+        delta->copy_pos += n;
+    }
+    else
+    {
+        n = recv(conn->fd, buffer, len, 0);
+        if(n < 0 && errno == EINTR)
+            return delta_step_op(conn, buffer, buflen);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if(n <= 0)
+            return -1;
+        delta->literal += n;
+    }
+
+    delta_write(delta, buffer, n);
+    delta->op_left -= n;
+    return n;
+}
+
+// 接收操作序列并重建文件, 收到 END 和 MD5 后返回 CONN_STEP_DONE, 其余返回值同 handle_file_upload
+int handle_delta_upload(ClientConn* conn, char* buffer, size_t buflen)
+{
+    DeltaUpload* delta = conn->delta;
+    size_t budget = EVENT_LOOP_CONN_BUDGET;
+
+    while(1)
+    {
+        if(delta->op_left == 0)
+        {
+            int ret = conn_fill(conn);
+            if(ret != CONN_STEP_DONE)
+                return ret;
+
+            if(delta->ending)
+            {
+                uint8_t digest[MD5_DIGEST_LEN];
+
+                md5_final(&delta->md5, digest);
+                if(delta->written != conn->file_total || memcmp(digest, conn->in_buf, MD5_DIGEST_LEN) != 0)
+                {
+                    log_warn("Delta of %s does not match: rebuilt %" PRIu64 "/%" PRIu64 " bytes",
+                             conn->filename, delta->written, conn->file_total);
+                    delta->failed = 1;
+                }
+                return CONN_STEP_DONE;
+            }
+            if(delta_start_op(conn) < 0)
+            {
+                log_warn("Invalid delta operation: type %u arg %u count %u",
+                         delta->op.type, delta->op.arg, delta->op.count);
+                return CONN_STEP_CLOSE;
+            }
+            continue;
+        }
+
+        if(budget == 0)
+            return CONN_STEP_YIELD;
+
+        ssize_t n = delta_step_op(conn, buffer, buflen);
+        if(n == 0)
+            return CONN_STEP_BLOCKED;
+        if(n < 0)
+        {
+            log_warn("Connection error during delta transfer");
+            return CONN_STEP_CLOSE;
+        }
+        budget = (size_t)n < budget ? budget - n : 0;
+    }
+}
+
+// 重建结果校验通过后落盘并替换原文件, 返回 0 表示成功
+int finish_upload_delta(ClientConn* conn)
+{
+    DeltaUpload* delta = conn->delta;
+
+    if(delta->failed)
+        return -1;
+    if(fdatasync(delta->tmp_fd) != 0 ||
+       renameat(delta->dir_fd, delta->tmp_name, delta->dir_fd, delta->base_name) != 0)
+    {
+        log_error("Failed to replace file: %s", strerror(errno));
+        return -1;
+    }
+    delta->tmp_name[0] = '\0';
+    return 0;
+}
+
+// 释放重建状态, 没有替换原文件时删除临时文件
+void close_upload_delta(ClientConn* conn)
+{
+    DeltaUpload* delta = conn->delta;
+
+    if(!delta)
+        return;
+    if(delta->tmp_fd >= 0)
+    {
+        close(delta->tmp_fd);
+        if(delta->tmp_name[0] && delta->dir_fd >= 0)
+            unlinkat(delta->dir_fd, delta->tmp_name, 0);
+    }
+    if(delta->dir_fd >= 0)
+        close(delta->dir_fd);
+    if(delta->old_fd >= 0)
+        close(delta->old_fd);
+    dedup_close_read(delta->old_manifest);
+    free(delta->block_buf);
+    free(delta->sig_buf);
+    free(delta);
+    conn->delta = NULL;
+}
+
+
+#define DELTA_FILTER_WORDS  1024
+
+// 客户端: 旧块签名的查找表, 按滚动校验和分桶, 桶内以链表串起块号
+typedef struct {
+    const DeltaSignature* sigs;
+    uint32_t full;                  // 完整块的个数, 末尾不足一块的部分单独匹配
+    uint32_t* heads;                // 桶的第一个块号 + 1, 0 表示空
+    uint32_t* next;                 // 同一个桶的下一个块号 + 1
+    uint32_t mask;
+    uint64_t filter[DELTA_FILTER_WORDS];    // 按校验和的 16 位标记可能存在的块, 放得进 L1, 大多数位置查这里就够了
+} DeltaIndex;
+
+static inline uint32_t delta_tag(uint32_t weak)
+{
+    return (weak ^ (weak >> 16)) & 0xffff;
+}
+
+static inline int delta_index_maybe(const DeltaIndex* index, uint32_t weak)
+{
+    uint32_t tag = delta_tag(weak);
+    return (index->filter[tag >> 6] >> (tag & 63)) & 1;
+}
+
+static inline uint32_t delta_bucket(const DeltaIndex* index, uint32_t weak)
+{
+    return ((weak ^ (weak >> 15)) * 0x9E3779B1u) >> 7 & index->mask;
+}
+
+static int delta_index_build(DeltaIndex* index, const DeltaSignature* sigs, uint32_t full)
+{
+    uint32_t buckets = 1024;
+
+    while(buckets < full * 2)
+        buckets <<= 1;
+    index->sigs = sigs;
+    index->full = full;
+    index->mask = buckets - 1;
+    index->heads = calloc(buckets, sizeof(uint32_t));
+    index->next = malloc((full ? full : 1) * sizeof(uint32_t));
+    if(!index->heads || !index->next)
+        return -1;
+
+    // 倒序插入, 桶内块号从小到大
+    for(uint32_t i = full; i > 0; i --)
+    {
+        uint32_t b = delta_bucket(index, sigs[i - 1].weak);
+        uint32_t tag = delta_tag(sigs[i - 1].weak);
+        index->next[i - 1] = index->heads[b];
+        index->heads[b] = i;
+        index->filter[tag >> 6] |= 1ull << (tag & 63);
+    }
+    return 0;
+}
+
+static int delta_block_matches(const DeltaSignature* sig, uint32_t weak, const uint8_t* data, size_t len,
+                               uint8_t* digest, int* have_digest)
+{
+    if(sig->weak != weak)
+        return 0;
+    // 强校验只在弱校验命中时计算, 同一位置只算一次
+    if(!*have_digest)
+    {
+        md5(data, len, digest);
+        *have_digest = 1;
+    }
+    return memcmp(sig->strong, digest, MD5_DIGEST_LEN) == 0;
+}
+
+// 查找和 data 开始的一块相同的旧块, 优先取上一次匹配的下一块, 连续的块可以合并成一个 COPY
+static int64_t delta_index_find(const DeltaIndex* index, uint32_t weak, const uint8_t* data, size_t len,
+                                uint32_t prefer)
+{
+    uint8_t digest[MD5_DIGEST_LEN];
+    int have_digest = 0;
+
+    if(prefer < index->full && delta_block_matches(&index->sigs[prefer], weak, data, len, digest, &have_digest))
+        return prefer;
+    for(uint32_t i = index->heads[delta_bucket(index, weak)]; i; i = index->next[i - 1])
+    {
+        if(delta_block_matches(&index->sigs[i - 1], weak, data, len, digest, &have_digest))
+            return i - 1;
+    }
+    return -1;
+}
+
+static void delta_index_free(DeltaIndex* index)
+{
+    free(index->heads);
+    free(index->next);
+}
+
+#define DELTA_WRITER_SIZE   65536       // 操作头和短的新数据攒够再发
+#define DELTA_INLINE_MAX    4096        // 不超过这个长度的新数据拷进缓冲, 更长的直接发送
+
+// 客户端的操作输出: 连续块号的 COPY 合并, 小操作攒在缓冲里一起发送
+typedef struct {
+    int sockfd;
+    uint8_t* buf;
+    size_t len;
+    uint32_t copy_start;
+    uint32_t copy_count;            // 0 表示没有待发的 COPY
+    int failed;
+} DeltaWriter;
+
+static int send_all(int sockfd, const void* data, size_t len, int flags)
+{
+    const char* p = data;
+
+    while(len > 0)
+    {
+        ssize_t n = send(sockfd, p, len, flags);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void delta_writer_flush(DeltaWriter* writer, int more)
+{
+    if(!writer->failed && writer->len > 0 &&
+       send_all(writer->sockfd, writer->buf, writer->len, more ? MSG_MORE | MSG_NOSIGNAL : MSG_NOSIGNAL) < 0)
+        writer->failed = 1;
+    writer->len = 0;
+}
+
+static void delta_writer_append(DeltaWriter* writer, const void* data, size_t len)
+{
+    if(writer->len + len > DELTA_WRITER_SIZE)
+        delta_writer_flush(writer, 1);
+    memcpy(writer->buf + writer->len, data, len);
+    writer->len += len;
+}
+
+static void delta_put_op(DeltaWriter* writer, uint8_t type, uint32_t arg, uint32_t count)
+{
+    DeltaOp op;
+
+    memset(&op, 0, sizeof(op));
+    op.type = type;
+    op.arg = htonl(arg);
+    op.count = htonl(count);
+    delta_writer_append(writer, &op, sizeof(op));
+}
+
+static void delta_flush_copy(DeltaWriter* writer)
+{
+    if(writer->copy_count == 0)
+        return;
+    delta_put_op(writer, DELTA_OP_COPY, writer->copy_start, writer->copy_count);
+    writer->copy_count = 0;
+}
+
+static void delta_copy(DeltaWriter* writer, uint32_t block)
+{
+    if(writer->copy_count > 0 && block == writer->copy_start + writer->copy_count)
+    {
+        writer->copy_count ++;
+        return;
+    }
+    delta_flush_copy(writer);
+    writer->copy_start = block;
+    writer->copy_count = 1;
+}
+
+static void delta_literal(DeltaWriter* writer, const uint8_t* data, uint64_t len)
+{
+    delta_flush_copy(writer);
+    while(len > 0 && !writer->failed)
+    {
+        size_t n = len < DELTA_LITERAL_MAX ? (size_t)len : DELTA_LITERAL_MAX;
+
+        delta_put_op(writer, DELTA_OP_LITERAL, n, 0);
+        if(n <= DELTA_INLINE_MAX)
+        {
+            delta_writer_append(writer, data, n);
+        }
+        else
+        {
+            delta_writer_flush(writer, 1);
+            if(!writer->failed && send_all(writer->sockfd, data, n, MSG_MORE | MSG_NOSIGNAL) < 0)
+                writer->failed = 1;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static int recv_all(int sockfd, void* data, size_t len)
+{
+    size_t got = 0;
+
+    while(got < len)
+    {
+        ssize_t n = recv(sockfd, (char*)data + got, len - got, 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        got += n;
+    }
+    return 0;
+}
+
+// 在新文件中逐字节滑动窗口, 能匹配旧块的部分发 COPY, 其余发 LITERAL
+static void delta_match(DeltaWriter* writer, const DeltaIndex* index, const DeltaSignature* tail, size_t tail_len,
+                        uint32_t tail_block, uint32_t block, const uint8_t* data, uint64_t size, DeltaStats* stats)
+{
+    uint64_t pos = 0;
+    uint64_t lit = 0;               // 待发送的新数据的起点
+    uint32_t weak = 0;
+    uint32_t prefer = 0;
+    int have_weak = 0;
+
+    while(index->full > 0 && pos + block <= size && !writer->failed)
+    {
+        if(!have_weak)
+        {
+            weak = rolling_checksum(data + pos, block);
+            have_weak = 1;
+        }
+
+        int64_t found = delta_index_maybe(index, weak) ? delta_index_find(index, weak, data + pos, block, prefer) : -1;
+        if(found >= 0)
+        {
+            delta_literal(writer, data + lit, pos - lit);
+            stats->literal += pos - lit;
+            delta_copy(writer, (uint32_t)found);
+            stats->matched += block;
+            prefer = (uint32_t)found + 1;
+            pos += block;
+            lit = pos;
+            have_weak = 0;
+            continue;
+        }
+        if(pos + block < size)
+            weak = rolling_roll(weak, data[pos], data[pos + block], block);
+        pos ++;
+    }
+
+    // 旧文件末尾不足一块的部分只可能和新文件的末尾相同
+    if(tail && size - lit >= tail_len)
+    {
+        const uint8_t* end = data + size - tail_len;
+        uint8_t digest[MD5_DIGEST_LEN];
+        int have_digest = 0;
+
+        if(delta_block_matches(tail, rolling_checksum(end, tail_len), end, tail_len, digest, &have_digest))
+        {
+            delta_literal(writer, data + lit, size - tail_len - lit);
+            stats->literal += size - tail_len - lit;
+            delta_copy(writer, tail_block);
+            stats->matched += tail_len;
+            lit = size;
+        }
+    }
+    delta_literal(writer, data + lit, size - lit);
+    stats->literal += size - lit;
+    delta_flush_copy(writer);
+}
+
+// 客户端: 发送增量上传请求, 接收签名后发送操作序列和新文件的 MD5
+// 返回 0 表示已发送完, 1 表示服务器拒绝了请求 (连接仍可用), -1 表示连接出错
+int send_file_delta(int sockfd, const char* filename, int file_fd, uint64_t size, DeltaStats* stats)
+{
+    FileHeader header;
+    uint16_t name_len = strlen(filename);
+
+    memset(stats, 0, sizeof(DeltaStats));
+    encode_file_header(&header, PROTOCOL_V2, CMD_PUT_DELTA, size, name_len);
+    if(send_all(sockfd, &header, sizeof(header), MSG_MORE | MSG_NOSIGNAL) < 0 ||
+       send_all(sockfd, filename, name_len, MSG_NOSIGNAL) < 0 ||
+       receive_file_header(sockfd, &header) < 0)
+        return -1;
+    if(header.command == CMD_NAK)
+        return 1;
+
+    uint64_t old_size = file_header_size(&header);
+    uint64_t block = file_header_offset(&header);
+    if(header.command != CMD_PUT_DELTA || block < DELTA_BLOCK_MIN || block > (1u << 30) || (block & (block - 1)) ||
+       (old_size + block - 1) / block > DELTA_MAX_BLOCKS)
+    {
+        printf("Invalid delta signature header\n");
+        return -1;
+    }
+
+    uint32_t count = (old_size + block - 1) / block;
+    size_t tail_len = old_size % block;
+    uint32_t full = tail_len ? count - 1 : count;
+    DeltaSignature* sigs = malloc((count ? count : 1) * sizeof(DeltaSignature));
+    if(!sigs)
+        return -1;
+    if(recv_all(sockfd, sigs, (size_t)count * sizeof(DeltaSignature)) < 0)
+    {
+        free(sigs);
+        return -1;
+    }
+    for(uint32_t i = 0; i < count; i ++)
+        sigs[i].weak = ntohl(sigs[i].weak);
+
+    DeltaIndex index;
+    DeltaWriter writer;
+    const uint8_t* data = NULL;
+    int ret = -1;
+
+    memset(&index, 0, sizeof(index));
+    memset(&writer, 0, sizeof(writer));
+    writer.sockfd = sockfd;
+    writer.buf = malloc(DELTA_WRITER_SIZE);
+    if(size > 0)
+    {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+        if(data == MAP_FAILED)
+        {
+            perror("mmap");
+            data = NULL;
+            goto out;
+        }
+        madvise((void*)data, size, MADV_SEQUENTIAL);
+    }
+    if(!writer.buf || delta_index_build(&index, sigs, full) < 0)
+        goto out;
+
+    printf("Delta base on server: %" PRIu64 " bytes in %u blocks of %" PRIu64 " bytes\n", old_size, count, block);
+    delta_match(&writer, &index, tail_len ? &sigs[count - 1] : NULL, tail_len, count - 1, block, data, size, stats);
+
+    uint8_t digest[MD5_DIGEST_LEN];
+    md5(data, size, digest);
+    delta_put_op(&writer, DELTA_OP_END, 0, 0);
+    delta_writer_append(&writer, digest, MD5_DIGEST_LEN);
+    delta_writer_flush(&writer, 0);
+    ret = writer.failed ? -1 : 0;
+
+out:
+    if(data)
+        munmap((void*)data, size);
+    delta_index_free(&index);
+    free(writer.buf);
+    free(sigs);
+    return ret;
+}
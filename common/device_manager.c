@@ -1,6 +1,7 @@
 // device_manager.c - 设备列表管理
 #include "discovery.h"
 #include "color.h"
+#include "log.h"
 
 
 DeviceList *device_list = NULL;
@@ -48,7 +49,7 @@ void add_device(const char* name, const char* ip) {
 
     pthread_mutex_unlock(&list_mutex);
 
-    printf("[+] New device discovered: %s (%s)\n", name, ip);
+    log_info("[+] New device discovered: %s (%s)", name, ip);
 }
 
 // 更新设备活跃时间
@@ -79,8 +80,8 @@ void remove_device(const char* ip) {
     while (current != NULL) {
         if (strcmp(current->info.ip_address, ip) == 0) {
             *pp = current->next;
-            printf("[-] Device removed: %s (%s)\n", 
-                   current->info.device_name, ip);
+            log_info("[-] Device removed: %s (%s)", 
+                     current->info.device_name, ip);
             free(current);
             pthread_mutex_unlock(&list_mutex);
             return;
@@ -105,9 +106,9 @@ void cleanup_old_devices() {
         if (difftime(now, current->info.last_seen) > DEVICE_TIMEOUT) {
             // 标记为离线而不是立即删除
             if (current->info.is_online) {
-                printf("[-] Device offline: %s (%s) - timeout\n",
-                       current->info.device_name, 
-                       current->info.ip_address);
+                log_info("[-] Device offline: %s (%s) - timeout",
+                         current->info.device_name, 
+                         current->info.ip_address);
                 current->info.is_online = 0;
             }
             
@@ -130,7 +131,7 @@ void cleanup_old_devices() {
     pthread_mutex_unlock(&list_mutex);
 
     if (removed_count > 0) {
-        printf("[i] Cleaned up %d old devices\n", removed_count);
+        log_debug("[i] Cleaned up %d old devices", removed_count);
     }
 }
 
@@ -1,6 +1,7 @@
 // discovery_threads.c
 #include "discovery.h"
 #include "color.h"
+#include "log.h"
 #include <signal.h>
 
 // 广播发送线程， 每30s发送一次
@@ -9,7 +10,7 @@ void* broadcast_sender_thread()
     int send_sock = create_send_socket();
     if(send_sock < 0)
     {
-        fprintf(stderr, "[Sender] Failed to create send socket\n");
+        log_warn("[Sender] Failed to create send socket");
         return NULL;
     }
 
@@ -23,7 +24,7 @@ void* broadcast_sender_thread()
         strcpy(my_ip, "0.0.0.0");
     }
 
-    printf("[Sender] I am %s (%s)\n", device_name, my_ip);
+    log_debug("[Sender] I am %s (%s)", device_name, my_ip);
 
     char broadcast_msg[256];
     snprintf(broadcast_msg, sizeof(broadcast_msg), "%s|%ld", device_name, time(NULL));
@@ -35,7 +36,7 @@ void* broadcast_sender_thread()
         if(send_broadcast_message(send_sock, broadcast_msg) > 0)
         {
             count ++;
-            printf("[Sender] Heartbeat #%d send\n", count);
+            log_debug("[Sender] Heartbeat #%d send", count);
         }
         // 等待 30s
         for(int i = 0; i < DISCOVERY_INTERVAL && running; i ++)
@@ -44,7 +45,7 @@ void* broadcast_sender_thread()
         }
     }
     close(send_sock);
-    printf("[Sender] Thread terminated\n");
+    log_debug("[Sender] Thread terminated");
     return NULL;
 }
 
@@ -54,11 +55,11 @@ void* broadcast_receiver_thread()
     int recv_sock = create_recv_socket();
     if(recv_sock < 0)
     {
-        fprintf(stderr, "[Receiver] Failed to create receive socket\n");
+        log_warn("[Receiver] Failed to create receive socket");
         return NULL;
     }
 
-    printf("[Receiver] Listening for broadcast messages ... \n");
+    log_debug("[Receiver] Listening for broadcast messages ...");
 
     // 使用select实现超时和非阻塞结合的接收
     fd_set read_fds;
@@ -80,7 +81,7 @@ void* broadcast_receiver_thread()
 
         if(activity < 0 && errno != EINTR)
         {
-            perror("[Receiver] Select error");
+            log_warn("[Receiver] Select error: %s", strerror(errno));
             break;
         }
 
@@ -107,7 +108,7 @@ void* broadcast_receiver_thread()
     }
 
     close(recv_sock);
-    printf("[Receiver] Thread terminated. Received %d messages.\n", recv_count);
+    log_debug("[Receiver] Thread terminated. Received %d messages.", recv_count);
     return NULL;
 }
 
@@ -120,20 +121,20 @@ void start_discovery_system()
     // 创建发送线程
     if(pthread_create(&sender_tid, NULL, broadcast_sender_thread, NULL) != 0)
     {
-        fprintf(stderr, "Failed to create sender thread\n");
+        log_warn("Failed to create sender thread");
         return;
     }
 
     // 创建接收线程
     if(pthread_create(&receiver_tid, NULL, broadcast_receiver_thread, NULL) != 0)
     {
-        fprintf(stderr, "Failed to create receiver thread\n");
+        log_warn("Failed to create receiver thread");
         running = 0;
         pthread_join(sender_tid, NULL);
         return;
     }
 
-    printf("[Discovery] Discovery system started (sender + receiver threads)\n");
+    log_debug("[Discovery] Discovery system started (sender + receiver threads)");
     
     // 分离线程， 让系统回收
     pthread_detach(sender_tid);
@@ -0,0 +1,1061 @@
+// mux.c - 多路复用模式: 一个连接上交错传输多个文件, 每个流单独流量控制
+#define _GNU_SOURCE
+#include "transfer.h"
+#include "event_loop.h"
+#include "transfer_engine.h"
+#include "mux.h"
+#include "tree.h"
+#include "dedup.h"
+#include "log.h"
+#include <poll.h>
+
+
+void encode_mux_frame(MuxFrame* frame, uint32_t stream, uint16_t type, uint32_t length, uint32_t value)
+{
+    frame->stream = htonl(stream);
+    frame->type = htons(type);
+    frame->flags = 0;
+    frame->length = htonl(length);
+    frame->value = htonl(value);
+}
+
+void decode_mux_frame(MuxFrame* frame)
+{
+    frame->stream = ntohl(frame->stream);
+    frame->type = ntohs(frame->type);
+    frame->flags = ntohs(frame->flags);
+    frame->length = ntohl(frame->length);
+    frame->value = ntohl(frame->value);
+}
+
+static int pwrite_full(int fd, const uint8_t* data, size_t len, uint64_t offset)
+{
+    while(len > 0)
+    {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+
+// ---------------- 服务器端 ----------------
+
+// 收到 CMD_MUX: 分配帧的收发缓冲, 之后连接只处理帧
+int open_mux_session(ClientConn* conn)
+{
+    MuxSession* mux = calloc(1, sizeof(MuxSession));
+    if(!mux)
+        return -1;
+    mux->in_data = malloc(MUX_FRAME_MAX);
+    mux->out = malloc(MUX_OUT_SIZE);
+    if(!mux->in_data || !mux->out)
+    {
+        free(mux->in_data);
+        free(mux->out);
+        free(mux);
+        return -1;
+    }
+    for(int i = 0; i < MUX_MAX_STREAMS; i ++)
+        mux->streams[i].file_fd = -1;
+    conn->mux = mux;
+    return 0;
+}
+
+static void close_stream(MuxStream* stream)
+{
+    if(stream->file_fd >= 0)
+        close(stream->file_fd);
+    dedup_close_read(stream->manifest);
+    memset(stream, 0, sizeof(MuxStream));
+    stream->file_fd = -1;
+}
+
+void close_mux_session(ClientConn* conn)
+{
+    MuxSession* mux = conn->mux;
+
+    if(!mux)
+        return;
+    for(int i = 0; i < MUX_MAX_STREAMS; i ++)
+    {
+        if(mux->streams[i].id)
+            close_stream(&mux->streams[i]);
+    }
+    free(mux->in_data);
+    free(mux->out);
+    free(mux);
+    conn->mux = NULL;
+}
+
+static MuxStream* find_stream(MuxSession* mux, uint32_t id)
+{
+    for(int i = 0; i < MUX_MAX_STREAMS; i ++)
+    {
+        if(mux->streams[i].id == id)
+            return &mux->streams[i];
+    }
+    return NULL;
+}
+
+// 输出缓冲的剩余空间, 已发出的部分先移走
+static size_t out_room(MuxSession* mux)
+{
+    if(mux->out_off > 0)
+    {
+        memmove(mux->out, mux->out + mux->out_off, mux->out_len - mux->out_off);
+        mux->out_len -= mux->out_off;
+        mux->out_off = 0;
+    }
+    return MUX_OUT_SIZE - mux->out_len;
+}
+
+// 排入控制帧; 读取帧之前已保证至少留有 MUX_CONTROL_ROOM
+static void queue_frame(MuxSession* mux, uint32_t stream, uint16_t type, uint32_t value,
+                        const void* payload, uint32_t length)
+{
+    MuxFrame frame;
+
+    if(out_room(mux) < sizeof(MuxFrame) + length)
+        return;
+    encode_mux_frame(&frame, stream, type, length, value);
+    memcpy(mux->out + mux->out_len, &frame, sizeof(MuxFrame));
+    if(length)
+        memcpy(mux->out + mux->out_len + sizeof(MuxFrame), payload, length);
+    mux->out_len += sizeof(MuxFrame) + length;
+}
+
+// 流结束: 回复结果后释放, 之后这个流号的帧都丢弃
+static void finish_stream(MuxSession* mux, MuxStream* stream, uint16_t result)
+{
+    queue_frame(mux, stream->id, MUX_FRAME_END, result, NULL, 0);
+    close_stream(stream);
+}
+
+// OPEN: 打开 PUT / GET 的文件; 失败只拒绝这个流, 连接继续
+static int handle_mux_open(ClientConn* conn, MuxSession* mux)
+{
+    const MuxFrame* frame = &mux->frame;
+    FileHeader header;
+    MuxStream* stream = NULL;
+    struct stat file_stat;
+
+    if(frame->stream == 0 || frame->length < sizeof(FileHeader) || find_stream(mux, frame->stream))
+    {
+        log_warn("Invalid mux open for stream %u", frame->stream);
+        return CONN_STEP_CLOSE;
+    }
+    memcpy(&header, mux->in_data, sizeof(FileHeader));
+    decode_file_header(&header);
+    size_t name_len = frame->length - sizeof(FileHeader);
+    if(header.magic != MAGIC_NUMBER)
+    {
+        log_warn("Invailed magic number");
+        return CONN_STEP_CLOSE;
+    }
+
+    for(int i = 0; i < MUX_MAX_STREAMS && !stream; i ++)
+    {
+        if(mux->streams[i].id == 0)
+            stream = &mux->streams[i];
+    }
+    if(!stream || name_len == 0 || name_len != header.filename_len || name_len >= MAX_PATH_LEN)
+    {
+        log_warn(stream ? "Invalid filename length: %zu" : "Too many streams, rejecting stream", name_len);
+        queue_frame(mux, frame->stream, MUX_FRAME_END, CMD_NAK, NULL, 0);
+        return CONN_STEP_DONE;
+    }
+
+    stream->id = frame->stream;
+    stream->command = header.command;
+    memcpy(stream->filename, mux->in_data + sizeof(FileHeader), name_len);
+    stream->filename[name_len] = '\0';
+
+    if(!tree_request_path(conn, stream->filename))
+    {
+        log_warn("Security violation: Invaild file path");
+        finish_stream(mux, stream, CMD_NAK);
+        return CONN_STEP_DONE;
+    }
+
+    if(header.command == CMD_PUT_FILE)
+    {
+        stream->file_fd = tree_openat(conn->loop->config->root_fd, stream->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(stream->file_fd < 0)
+        {
+            log_warn("Failed to receive file %s", stream->filename);
+            finish_stream(mux, stream, CMD_NAK);
+            return CONN_STEP_DONE;
+        }
+        stream->total = file_header_size(&header);
+        stream->window = MUX_WINDOW;
+        log_info("Receiving file: %s (Size: %" PRIu64 " bytes)", stream->filename, stream->total);
+    }
+    else if(header.command == CMD_GET_FILE)
+    {
+        stream->file_fd = tree_openat(conn->loop->config->root_fd, stream->filename, O_RDONLY, 0);
+        if(stream->file_fd >= 0 && (fstat(stream->file_fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)))
+        {
+            close(stream->file_fd);
+            stream->file_fd = -1;
+        }
+        // 去重模式下文件可能是清单, 大小改为展开后的大小, 数据从块仓库逐块读取
+        if(stream->file_fd >= 0 && conn->loop->config->store_fd >= 0)
+            stream->file_fd = dedup_open_read(conn->loop->config->store_fd, stream->file_fd, &file_stat, &stream->manifest);
+        if(stream->file_fd < 0)
+        {
+            log_warn("Failed to send file: %s", stream->filename);
+            finish_stream(mux, stream, CMD_NAK);
+            return CONN_STEP_DONE;
+        }
+        stream->total = file_stat.st_size;
+        stream->window = MUX_WINDOW;
+        log_info("sending file: %s", stream->filename);
+
+        encode_file_header(&header, PROTOCOL_V2, CMD_GET_FILE, stream->total, 0);
+        queue_frame(mux, stream->id, MUX_FRAME_HEADER, 0, &header, sizeof(FileHeader));
+        if(stream->total == 0)
+            finish_stream(mux, stream, CMD_ACK);
+    }
+    else
+    {
+        log_warn("Unknown command: %d", header.command);
+        finish_stream(mux, stream, CMD_NAK);
+    }
+    return CONN_STEP_DONE;
+}
+
+// DATA: 写入上传的文件, 积累到 MUX_WINDOW_UPDATE 后归还额度
+static int handle_mux_data(MuxSession* mux, MuxStream* stream)
+{
+    uint32_t length = mux->frame.length;
+
+    if(stream->command != CMD_PUT_FILE || length > stream->window || length > stream->total - stream->done)
+    {
+        log_warn("Invalid mux data for stream %u", stream->id);
+        return CONN_STEP_CLOSE;
+    }
+    if(pwrite_full(stream->file_fd, mux->in_data, length, stream->done) < 0)
+    {
+        log_error("Failed to write file: %s", strerror(errno));
+        log_warn("Failed to receive file %s", stream->filename);
+        finish_stream(mux, stream, CMD_NAK);
+        return CONN_STEP_DONE;
+    }
+
+    stream->done += length;
+    stream->window -= length;
+    stream->credit += length;
+    if(stream->credit >= MUX_WINDOW_UPDATE && stream->done < stream->total)
+    {
+        queue_frame(mux, stream->id, MUX_FRAME_WINDOW, stream->credit, NULL, 0);
+        stream->window += stream->credit;
+        stream->credit = 0;
+    }
+    return CONN_STEP_DONE;
+}
+
+static int handle_mux_frame(ClientConn* conn, MuxSession* mux)
+{
+    const MuxFrame* frame = &mux->frame;
+
+    if(frame->type == MUX_FRAME_OPEN)
+        return handle_mux_open(conn, mux);
+
+    // 已经结束或被拒绝的流, 客户端还没收到 END 时可能继续发送
+    MuxStream* stream = frame->stream ? find_stream(mux, frame->stream) : NULL;
+    if(!stream)
+        return CONN_STEP_DONE;
+
+    switch(frame->type)
+    {
+        case MUX_FRAME_DATA:
+            return handle_mux_data(mux, stream);
+        case MUX_FRAME_END:
+            if(stream->command != CMD_PUT_FILE)
+                return CONN_STEP_CLOSE;
+            if(stream->done == stream->total)
+            {
+                log_info("File received successfully: %s", stream->filename);
+                finish_stream(mux, stream, CMD_ACK);
+            }
+            else
+            {
+                log_warn("File transfer incomplete: received %" PRIu64 "/%" PRIu64 " bytes", stream->done, stream->total);
+                finish_stream(mux, stream, CMD_NAK);
+            }
+            return CONN_STEP_DONE;
+        case MUX_FRAME_WINDOW:
+            if(stream->command == CMD_GET_FILE)
+                stream->window += frame->value;
+            return CONN_STEP_DONE;
+        case MUX_FRAME_RESET:
+            log_warn("Transfer cancelled by client: %s", stream->filename);
+            close_stream(stream);
+            return CONN_STEP_DONE;
+        default:
+            log_warn("Unknown mux frame type: %u", frame->type);
+            return CONN_STEP_CLOSE;
+    }
+}
+
+// 读取并处理帧, 直到 socket 读空、输出缓冲快满或用完配额
+static int read_mux_frames(ClientConn* conn, size_t* budget)
+{
+    MuxSession* mux = conn->mux;
+
+    while(*budget > 0)
+    {
+        if(out_room(mux) < MUX_CONTROL_ROOM)
+            return CONN_STEP_DONE;
+
+        if(!mux->in_payload)
+        {
+            int ret = conn_fill(conn);
+            if(ret != CONN_STEP_DONE)
+                return ret;
+            memcpy(&mux->frame, conn->in_buf, sizeof(MuxFrame));
+            decode_mux_frame(&mux->frame);
+            if(mux->frame.length > MUX_FRAME_MAX)
+            {
+                log_warn("Invalid mux frame length: %u", mux->frame.length);
+                return CONN_STEP_CLOSE;
+            }
+            mux->in_payload = 1;
+            mux->in_len = 0;
+        }
+
+        while(mux->in_len < mux->frame.length)
+        {
+            ssize_t n = recv(conn->fd, mux->in_data + mux->in_len, mux->frame.length - mux->in_len, 0);
+            if(n > 0)
+            {
+                mux->in_len += n;
+                continue;
+            }
+            if(n == 0)
+                return CONN_STEP_CLOSE;
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_STEP_BLOCKED;
+            return CONN_STEP_CLOSE;
+        }
+
+        size_t used = sizeof(MuxFrame) + mux->frame.length;
+        *budget -= used < *budget ? used : *budget;
+        mux->in_payload = 0;
+        conn_expect(conn, sizeof(MuxFrame));
+        if(handle_mux_frame(conn, mux) == CONN_STEP_CLOSE)
+            return CONN_STEP_CLOSE;
+    }
+    return CONN_STEP_DONE;
+}
+
+// 轮流从有额度的下载流各取一帧数据, 小文件不用等大文件发完
+static size_t queue_mux_data(MuxSession* mux, size_t* budget)
+{
+    size_t queued = 0;
+
+    for(int idle = 0; idle < MUX_MAX_STREAMS && *budget > 0; )
+    {
+        if(out_room(mux) < sizeof(MuxFrame) + MUX_FRAME_MAX + MUX_CONTROL_ROOM)
+            break;
+
+        MuxStream* stream = &mux->streams[mux->next_send];
+        mux->next_send = (mux->next_send + 1) % MUX_MAX_STREAMS;
+        if(!stream->id || stream->command != CMD_GET_FILE || stream->window == 0 || stream->done >= stream->total)
+        {
+            idle ++;
+            continue;
+        }
+
+        uint64_t len = stream->total - stream->done;
+        if(len > stream->window)
+            len = stream->window;
+        if(len > MUX_FRAME_MAX)
+            len = MUX_FRAME_MAX;
+
+        uint8_t* data = mux->out + mux->out_len + sizeof(MuxFrame);
+        ssize_t n = dedup_pread(stream->manifest, stream->file_fd, data, len, stream->done);
+        if(n <= 0)
+        {
+            log_warn("Failed to send file: %s", stream->filename);
+            finish_stream(mux, stream, CMD_NAK);
+            continue;
+        }
+
+        MuxFrame frame;
+        encode_mux_frame(&frame, stream->id, MUX_FRAME_DATA, n, 0);
+        memcpy(mux->out + mux->out_len, &frame, sizeof(MuxFrame));
+        mux->out_len += sizeof(MuxFrame) + n;
+
+        stream->done += n;
+        stream->window -= n;
+        *budget -= (size_t)n < *budget ? (size_t)n : *budget;
+        queued += n;
+        idle = 0;
+
+        if(stream->done == stream->total)
+        {
+            log_info("File sent successfully: %s", stream->filename);
+            finish_stream(mux, stream, CMD_ACK);
+        }
+    }
+    return queued;
+}
+
+// 发送排队的帧, 发完后补充数据帧; 没有可发的数据时返回 CONN_STEP_DONE
+static int write_mux_frames(ClientConn* conn, size_t* budget)
+{
+    MuxSession* mux = conn->mux;
+
+    while(1)
+    {
+        while(mux->out_off < mux->out_len)
+        {
+            ssize_t n = send(conn->fd, mux->out + mux->out_off, mux->out_len - mux->out_off, MSG_NOSIGNAL);
+            if(n > 0)
+            {
+                mux->out_off += n;
+                continue;
+            }
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return CONN_STEP_BLOCKED;
+            return CONN_STEP_CLOSE;
+        }
+        mux->out_off = mux->out_len = 0;
+
+        if(*budget == 0 || queue_mux_data(mux, budget) == 0)
+            return CONN_STEP_DONE;
+    }
+}
+
+// 多路复用状态: 读写交替推进, 读空且没有可写的数据 (或 socket 写满) 时等待事件
+int handle_mux_session(ClientConn* conn)
+{
+    size_t budget = EVENT_LOOP_CONN_BUDGET;
+
+    while(1)
+    {
+        int wrote = write_mux_frames(conn, &budget);
+        if(wrote == CONN_STEP_CLOSE)
+            return CONN_STEP_CLOSE;
+
+        int read = read_mux_frames(conn, &budget);
+        if(read == CONN_STEP_CLOSE)
+            return CONN_STEP_CLOSE;
+        if(budget == 0)
+            return CONN_STEP_YIELD;
+
+        if(read == CONN_STEP_BLOCKED)
+        {
+            // 刚处理的帧可能打开了流或归还了额度
+            wrote = write_mux_frames(conn, &budget);
+            if(wrote == CONN_STEP_CLOSE)
+                return CONN_STEP_CLOSE;
+            return budget == 0 ? CONN_STEP_YIELD : CONN_STEP_BLOCKED;
+        }
+
+        // 输出缓冲满了暂停读取, socket 也写不动时等可写事件
+        if(wrote == CONN_STEP_BLOCKED)
+            return CONN_STEP_BLOCKED;
+    }
+}
+
+
+// ---------------- 客户端 ----------------
+
+// 客户端的一个流, 在发起传输的线程的栈上
+typedef struct {
+    uint32_t id;
+    uint16_t command;
+    const char* filename;       // 本地文件; GET 收到 HEADER 后由接收线程创建
+    int file_fd;
+    uint64_t total;
+    uint64_t done;
+    uint64_t window;            // PUT: 服务器给的剩余额度
+    uint64_t credit;            // GET: 已写入文件、待归还的额度
+    int opened;                 // GET: 已收到 HEADER
+    int busy;                   // GET: 接收线程正在锁外创建或写入文件, 注销前要等它结束
+    int result;                 // 0 进行中; CMD_ACK / CMD_NAK 为服务器的结果; -1 本地出错或连接断开
+    pthread_cond_t changed;
+} MuxClientStream;
+
+// 一个多路复用连接: 发送由各传输线程加锁进行, 接收由一个线程分发到各流
+typedef struct MuxClient {
+    int sockfd;
+    char ip[MAX_IP_LEN];
+    int port;
+    char username[MAX_USERNAME_LEN];
+    char password[MAX_PASSWORD_LEN];
+
+    pthread_mutex_t send_lock;      // 一个帧必须连续写入 socket
+    pthread_cond_t slots;           // 流表有空位
+    int refs;                       // 使用者加接收线程, 为 0 时释放
+    int users;
+    int broken;                     // 连接已断开或空闲关闭, 不再分配给新的传输
+    time_t idle_since;
+    uint32_t next_id;
+    MuxClientStream* streams[MUX_MAX_STREAMS];
+    struct MuxClient* next;
+} MuxClient;
+
+// 保护所有多路复用连接和流的状态; 不在持有它时阻塞发送或读写文件
+static pthread_mutex_t mux_lock = PTHREAD_MUTEX_INITIALIZER;
+static MuxClient* mux_clients = NULL;
+
+static int send_full(int sockfd, const void* data, size_t len, int flags)
+{
+    const char* p = data;
+
+    while(len > 0)
+    {
+        ssize_t n = send(sockfd, p, len, flags | MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_full(int sockfd, void* data, size_t len)
+{
+    char* p = data;
+
+    while(len > 0)
+    {
+        ssize_t n = recv(sockfd, p, len, 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_mux_frame(MuxClient* mux, uint32_t stream, uint16_t type, uint32_t value,
+                          const void* payload, uint32_t length)
+{
+    MuxFrame frame;
+    int ret;
+
+    encode_mux_frame(&frame, stream, type, length, value);
+    pthread_mutex_lock(&mux->send_lock);
+    ret = send_full(mux->sockfd, &frame, sizeof(MuxFrame), length ? MSG_MORE : 0);
+    if(ret == 0 && length)
+        ret = send_full(mux->sockfd, payload, length, 0);
+    pthread_mutex_unlock(&mux->send_lock);
+    return ret;
+}
+
+static void free_mux_client(MuxClient* mux)
+{
+    close(mux->sockfd);
+    pthread_mutex_destroy(&mux->send_lock);
+    pthread_cond_destroy(&mux->slots);
+    free(mux);
+}
+
+// 调用时持有 mux_lock
+static void unregister_mux_client(MuxClient* mux)
+{
+    MuxClient** link = &mux_clients;
+
+    mux->broken = 1;
+    while(*link && *link != mux)
+        link = &(*link)->next;
+    if(*link)
+        *link = mux->next;
+}
+
+// 调用时持有 mux_lock
+static MuxClientStream* find_client_stream(MuxClient* mux, uint32_t id)
+{
+    for(int i = 0; i < MUX_MAX_STREAMS; i ++)
+    {
+        if(mux->streams[i] && mux->streams[i]->id == id)
+            return mux->streams[i];
+    }
+    return NULL;
+}
+
+// 接收线程分发一个帧, 调用时持有 mux_lock; 返回 -1 表示数据流已不可信
+// GET 的 HEADER / DATA 需要文件操作时把流标记为 busy 存入 *io, 由调用者放开锁后处理
+static int dispatch_mux_frame(MuxClient* mux, const MuxFrame* frame, const uint8_t* payload, MuxClientStream** io)
+{
+    MuxClientStream* stream = find_client_stream(mux, frame->stream);
+    FileHeader header;
+
+    // 本地已放弃的流, 服务器还没收到 RESET 时可能继续发送
+    if(!stream)
+        return 0;
+
+    switch(frame->type)
+    {
+        case MUX_FRAME_HEADER:
+            if(stream->command != CMD_GET_FILE || stream->opened || frame->length != sizeof(FileHeader))
+                return -1;
+            memcpy(&header, payload, sizeof(FileHeader));
+            decode_file_header(&header);
+            stream->total = file_header_size(&header);
+            stream->opened = 1;
+            stream->busy = 1;
+            *io = stream;
+            return 0;
+        case MUX_FRAME_DATA:
+            if(stream->command != CMD_GET_FILE || !stream->opened || frame->length > stream->total - stream->done)
+                return -1;
+            if(stream->result == 0)
+            {
+                stream->busy = 1;
+                *io = stream;
+                return 0;
+            }
+            // 本地已出错, 数据丢弃但照常归还额度
+            stream->done += frame->length;
+            stream->credit += frame->length;
+            break;
+        case MUX_FRAME_END:
+            if(stream->result == 0)
+                stream->result = frame->value == CMD_ACK ? CMD_ACK : CMD_NAK;
+            break;
+        case MUX_FRAME_WINDOW:
+            if(stream->command == CMD_PUT_FILE)
+                stream->window += frame->value;
+            break;
+        default:
+            return -1;
+    }
+    pthread_cond_signal(&stream->changed);
+    return 0;
+}
+
+// 接收线程在 mux_lock 外处理 GET 的 HEADER / DATA: 创建文件或在 offset 写入数据, 返回新的 fd, 出错时 *failed 为 1
+// 流是 busy 的, 所属线程不会注销它, 接收线程又是唯一写文件的线程, 这里不用加锁
+static int write_client_stream(MuxClientStream* stream, const MuxFrame* frame, const uint8_t* payload, int file_fd,
+                               uint64_t offset, int* failed)
+{
+    *failed = 0;
+    if(frame->type == MUX_FRAME_HEADER)
+    {
+        file_fd = open(stream->filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(file_fd < 0)
+        {
+            perror("Failed to create file");
+            *failed = 1;
+        }
+    }
+    else if(pwrite_full(file_fd, payload, frame->length, offset) < 0)
+    {
+        perror("Failed to write file");
+        *failed = 1;
+    }
+    return file_fd;
+}
+
+// 锁外的文件操作结束: 记录 fd 和进度, 清除 busy 并唤醒所属线程; 调用时持有 mux_lock
+static void finish_client_write(MuxClientStream* stream, const MuxFrame* frame, int file_fd, int failed)
+{
+    if(frame->type == MUX_FRAME_HEADER)
+        stream->file_fd = file_fd;
+    else
+    {
+        stream->done += frame->length;
+        stream->credit += frame->length;
+    }
+    if(failed && stream->result == 0)
+        stream->result = -1;
+    stream->busy = 0;
+    pthread_cond_signal(&stream->changed);
+}
+
+// 接收线程: 读出每个帧交给对应的流; 连接没有流且空闲超时后关闭
+static void* mux_reader_thread(void* arg)
+{
+    MuxClient* mux = arg;
+    MuxFrame frame;
+    uint8_t* payload = malloc(MUX_FRAME_MAX);
+
+    while(payload)
+    {
+        struct pollfd pfd = { mux->sockfd, POLLIN, 0 };
+        int n = poll(&pfd, 1, 1000);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n == 0)
+        {
+            pthread_mutex_lock(&mux_lock);
+            int idle = mux->users == 0 && time(NULL) - mux->idle_since >= MUX_IDLE_TIMEOUT;
+            if(idle)
+                unregister_mux_client(mux);
+            pthread_mutex_unlock(&mux_lock);
+            if(idle)
+                break;
+            continue;
+        }
+        if(n < 0 || recv_full(mux->sockfd, &frame, sizeof(MuxFrame)) < 0)
+            break;
+        decode_mux_frame(&frame);
+        if(frame.length > MUX_FRAME_MAX || recv_full(mux->sockfd, payload, frame.length) < 0)
+            break;
+
+        MuxClientStream* io = NULL;
+        pthread_mutex_lock(&mux_lock);
+        int ret = dispatch_mux_frame(mux, &frame, payload, &io);
+        int file_fd = io ? io->file_fd : -1;
+        uint64_t offset = io ? io->done : 0;
+        pthread_mutex_unlock(&mux_lock);
+        if(ret < 0)
+        {
+            printf("Invalid mux frame from server\n");
+            break;
+        }
+
+        // 写文件时不持有 mux_lock: 慢盘只拖住这一个流, 其他流和连接照常收发
+        if(io)
+        {
+            int failed;
+            file_fd = write_client_stream(io, &frame, payload, file_fd, offset, &failed);
+            pthread_mutex_lock(&mux_lock);
+            finish_client_write(io, &frame, file_fd, failed);
+            pthread_mutex_unlock(&mux_lock);
+        }
+    }
+    free(payload);
+
+    // 连接断开: 进行中的流全部失败, 阻塞在发送上的线程也要返回
+    pthread_mutex_lock(&mux_lock);
+    unregister_mux_client(mux);
+    shutdown(mux->sockfd, SHUT_RDWR);
+    for(int i = 0; i < MUX_MAX_STREAMS; i ++)
+    {
+        MuxClientStream* stream = mux->streams[i];
+        if(stream && stream->result == 0)
+            stream->result = -1;
+        if(stream)
+            pthread_cond_signal(&stream->changed);
+    }
+    pthread_cond_broadcast(&mux->slots);
+    int last = -- mux->refs == 0;
+    pthread_mutex_unlock(&mux_lock);
+
+    if(last)
+        free_mux_client(mux);
+    return NULL;
+}
+
+// 找一个可用的多路复用连接, 没有返回 NULL
+MuxClient* mux_client_get(const char* ip, int port, const char* username, const char* password)
+{
+    MuxClient* found = NULL;
+
+    pthread_mutex_lock(&mux_lock);
+    for(MuxClient* mux = mux_clients; mux && !found; mux = mux->next)
+    {
+        if(mux->broken || mux->port != port || strcmp(mux->ip, ip) != 0 ||
+           strncmp(mux->username, username ? username : "", MAX_USERNAME_LEN - 1) != 0 ||
+           strncmp(mux->password, password ? password : "", MAX_PASSWORD_LEN - 1) != 0)
+            continue;
+        mux->users ++;
+        mux->refs ++;
+        found = mux;
+    }
+    pthread_mutex_unlock(&mux_lock);
+    return found;
+}
+
+// 把已认证的连接切换到多路复用模式并启动接收线程; 失败时 socket 由调用者关闭
+MuxClient* mux_client_start(int sockfd, const char* ip, int port, const char* username, const char* password)
+{
+    FileHeader reply;
+    pthread_t thread;
+
+    if(send_file_header(sockfd, PROTOCOL_V2, CMD_MUX, 0, 0) < 0 || receive_file_header(sockfd, &reply) < 0 ||
+       reply.command != CMD_ACK)
+    {
+        printf("Server refused multiplexed mode\n");
+        return NULL;
+    }
+
+    MuxClient* mux = calloc(1, sizeof(MuxClient));
+    if(!mux)
+        return NULL;
+    mux->sockfd = sockfd;
+    snprintf(mux->ip, sizeof(mux->ip), "%s", ip);
+    mux->port = port;
+    snprintf(mux->username, sizeof(mux->username), "%s", username ? username : "");
+    snprintf(mux->password, sizeof(mux->password), "%s", password ? password : "");
+    pthread_mutex_init(&mux->send_lock, NULL);
+    pthread_cond_init(&mux->slots, NULL);
+    mux->refs = 2;
+    mux->users = 1;
+    mux->next_id = 1;
+
+    if(pthread_create(&thread, NULL, mux_reader_thread, mux) != 0)
+    {
+        pthread_mutex_destroy(&mux->send_lock);
+        pthread_cond_destroy(&mux->slots);
+        free(mux);
+        return NULL;
+    }
+    pthread_detach(thread);
+
+    pthread_mutex_lock(&mux_lock);
+    mux->next = mux_clients;
+    mux_clients = mux;
+    pthread_mutex_unlock(&mux_lock);
+    return mux;
+}
+
+// 传输结束后归还连接; 空闲的连接由接收线程超时关闭
+void mux_client_put(MuxClient* mux)
+{
+    pthread_mutex_lock(&mux_lock);
+    mux->users --;
+    mux->idle_since = time(NULL);
+    int last = -- mux->refs == 0;
+    pthread_mutex_unlock(&mux_lock);
+
+    if(last)
+        free_mux_client(mux);
+}
+
+// 登记一个流, 流表满时等待; 调用时持有 mux_lock
+static int add_client_stream(MuxClient* mux, MuxClientStream* stream)
+{
+    while(!mux->broken)
+    {
+        for(int i = 0; i < MUX_MAX_STREAMS; i ++)
+        {
+            if(mux->streams[i])
+                continue;
+            stream->id = mux->next_id ++;
+            if(mux->next_id == 0)
+                mux->next_id = 1;
+            mux->streams[i] = stream;
+            return 0;
+        }
+        pthread_cond_wait(&mux->slots, &mux_lock);
+    }
+    return -1;
+}
+
+// 调用时持有 mux_lock
+static void remove_client_stream(MuxClient* mux, MuxClientStream* stream)
+{
+    for(int i = 0; i < MUX_MAX_STREAMS; i ++)
+    {
+        if(mux->streams[i] == stream)
+            mux->streams[i] = NULL;
+    }
+    pthread_cond_broadcast(&mux->slots);
+}
+
+// 等待流的状态变化; 定时醒来检查后台任务是否被取消 (共用的连接不能 shutdown)
+static void wait_client_stream(MuxClientStream* stream)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 200 * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec ++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&stream->changed, &mux_lock, &deadline);
+}
+
+static void init_client_stream(MuxClientStream* stream, uint16_t command, const char* filename)
+{
+    memset(stream, 0, sizeof(MuxClientStream));
+    stream->command = command;
+    stream->filename = filename;
+    stream->file_fd = -1;
+    pthread_cond_init(&stream->changed, NULL);
+}
+
+// 发送 OPEN: 负载为文件头加文件名
+static int open_client_stream(MuxClient* mux, MuxClientStream* stream, uint64_t size)
+{
+    uint8_t payload[sizeof(FileHeader) + MAX_PATH_LEN];
+    FileHeader header;
+    uint16_t name_len = strlen(stream->filename);
+
+    if(name_len == 0 || name_len >= MAX_PATH_LEN)
+    {
+        printf("Invalid filename: %s\n", stream->filename);
+        return -1;
+    }
+    encode_file_header(&header, PROTOCOL_V2, stream->command, size, name_len);
+    memcpy(payload, &header, sizeof(FileHeader));
+    memcpy(payload + sizeof(FileHeader), stream->filename, name_len);
+    return send_mux_frame(mux, stream->id, MUX_FRAME_OPEN, 0, payload, sizeof(FileHeader) + name_len);
+}
+
+// 流结束后注销; 服务器还没结束这个流时发送 RESET 让它停止
+static int close_client_stream(MuxClient* mux, MuxClientStream* stream)
+{
+    pthread_mutex_lock(&mux_lock);
+    remove_client_stream(mux, stream);
+    // 接收线程可能正在锁外写这个流的文件, 写完才能关闭 fd 和释放流
+    while(stream->busy)
+        pthread_cond_wait(&stream->changed, &mux_lock);
+    int reset = !mux->broken && stream->result != CMD_ACK && stream->result != CMD_NAK;
+    int result = stream->result;
+    pthread_mutex_unlock(&mux_lock);
+
+    if(reset)
+        send_mux_frame(mux, stream->id, MUX_FRAME_RESET, 0, NULL, 0);
+    if(stream->file_fd >= 0)
+        close(stream->file_fd);
+    pthread_cond_destroy(&stream->changed);
+    return result;
+}
+
+// 在多路复用连接上上传文件, 返回 0 表示成功
+int mux_send_file(MuxClient* mux, const char* filename)
+{
+    MuxClientStream stream;
+    struct stat file_stat;
+    int ret = 0;
+
+    if(stat(filename, &file_stat) != 0)
+    {
+        printf("File not found: %s \n", filename);
+        return -1;
+    }
+    if(!S_ISREG(file_stat.st_mode))
+    {
+        printf("Not a regular file: %s \n", filename);
+        return -1;
+    }
+
+    uint8_t* buffer = malloc(MUX_FRAME_MAX);
+    init_client_stream(&stream, CMD_PUT_FILE, filename);
+    stream.file_fd = open(filename, O_RDONLY | O_CLOEXEC);
+    stream.total = file_stat.st_size;
+    stream.window = MUX_WINDOW;
+    if(!buffer || stream.file_fd < 0)
+    {
+        perror("Failed to open file");
+        free(buffer);
+        if(stream.file_fd >= 0)
+            close(stream.file_fd);
+        pthread_cond_destroy(&stream.changed);
+        return -1;
+    }
+
+    pthread_mutex_lock(&mux_lock);
+    if(add_client_stream(mux, &stream) < 0)
+        stream.result = -1;
+    pthread_mutex_unlock(&mux_lock);
+
+    printf("Sending file: %s (Size  %ld bytes)\n", filename, (long)file_stat.st_size);
+    if(stream.result != 0 || open_client_stream(mux, &stream, stream.total) < 0)
+        ret = -1;
+
+    // 只在有额度时发送, 服务器写入文件后归还
+    while(ret == 0 && stream.done < stream.total)
+    {
+        pthread_mutex_lock(&mux_lock);
+        while(stream.window == 0 && stream.result == 0 && !engine_job_cancelled())
+            wait_client_stream(&stream);
+        uint64_t len = stream.total - stream.done;
+        if(len > stream.window)
+            len = stream.window;
+        if(len > MUX_FRAME_MAX)
+            len = MUX_FRAME_MAX;
+        int stop = stream.result != 0 || engine_job_cancelled();
+        if(!stop)
+            stream.window -= len;
+        pthread_mutex_unlock(&mux_lock);
+
+        if(stop || pread(stream.file_fd, buffer, len, stream.done) != (ssize_t)len ||
+           send_mux_frame(mux, stream.id, MUX_FRAME_DATA, 0, buffer, len) < 0)
+        {
+            ret = -1;
+            break;
+        }
+        stream.done += len;
+    }
+    free(buffer);
+
+    if(ret == 0 && send_mux_frame(mux, stream.id, MUX_FRAME_END, 0, NULL, 0) < 0)
+        ret = -1;
+    pthread_mutex_lock(&mux_lock);
+    while(ret == 0 && stream.result == 0 && !engine_job_cancelled())
+        wait_client_stream(&stream);
+    pthread_mutex_unlock(&mux_lock);
+
+    int result = close_client_stream(mux, &stream);
+    if(result == CMD_ACK)
+    {
+        printf("File transfer completed successfully\n");
+        return 0;
+    }
+    if(result == CMD_NAK)
+        printf("File transfer failed (server rejected)\n");
+    else
+        printf("File transfer incomplete: sent %" PRIu64 "/%" PRIu64 " bytes\n", stream.done, stream.total);
+    return -1;
+}
+
+// 在多路复用连接上下载文件, 数据由接收线程写入, 本线程负责归还额度
+int mux_receive_file(MuxClient* mux, const char* filename)
+{
+    MuxClientStream stream;
+    int ret = 0;
+
+    init_client_stream(&stream, CMD_GET_FILE, filename);
+    pthread_mutex_lock(&mux_lock);
+    if(add_client_stream(mux, &stream) < 0)
+        stream.result = -1;
+    pthread_mutex_unlock(&mux_lock);
+
+    if(stream.result != 0 || open_client_stream(mux, &stream, 0) < 0)
+        ret = -1;
+
+    pthread_mutex_lock(&mux_lock);
+    while(ret == 0 && stream.result == 0 && !engine_job_cancelled())
+    {
+        if(stream.credit >= MUX_WINDOW_UPDATE)
+        {
+            uint32_t credit = stream.credit;
+            stream.credit = 0;
+            pthread_mutex_unlock(&mux_lock);
+            ret = send_mux_frame(mux, stream.id, MUX_FRAME_WINDOW, credit, NULL, 0);
+            pthread_mutex_lock(&mux_lock);
+            continue;
+        }
+        wait_client_stream(&stream);
+    }
+    int opened = stream.opened;
+    pthread_mutex_unlock(&mux_lock);
+
+    int result = close_client_stream(mux, &stream);
+    if(result == CMD_ACK && stream.done == stream.total)
+    {
+        printf("File received successfully: %s\n", filename);
+        return 0;
+    }
+    if(result == CMD_NAK && !opened)
+        printf("Server rejected file request\n");
+    else
+        printf("File transfer incomplete: received %" PRIu64 "/%" PRIu64 " bytes\n", stream.done, stream.total);
+    return -1;
+}
@@ -1,6 +1,7 @@
 // network.c - 分离的广播发送和接收
 #include "discovery.h"
 #include "color.h"
+#include "log.h"
 #include <errno.h>
 #include <sys/time.h>
 #include <signal.h>
@@ -13,14 +14,14 @@ int create_send_socket() {
     
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
-        perror("[Sender] socket creation failed");
+        log_warn("[Sender] socket creation failed: %s", strerror(errno));
         return -1;
     }
     
     // 设置广播选项
     if (setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST,
                    &broadcast_enable, sizeof(broadcast_enable)) < 0) {
-        perror("[Sender] setsockopt SO_BROADCAST failed");
+        log_warn("[Sender] setsockopt SO_BROADCAST failed: %s", strerror(errno));
         close(sockfd);
         return -1;
     }
@@ -29,7 +30,7 @@ int create_send_socket() {
     int sendbuf = 65536;
     setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &sendbuf, sizeof(sendbuf));
     
-    printf("[Sender] Broadcast send socket created\n");
+    log_debug("[Sender] Broadcast send socket created");
     return sockfd;
 }
 
@@ -41,14 +42,14 @@ int create_recv_socket() {
     
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
-        perror("[Receiver] socket creation failed");
+        log_warn("[Receiver] socket creation failed: %s", strerror(errno));
         return -1;
     }
     
     // 设置地址重用（允许多个程序监听同一端口）
     if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
                    &reuse, sizeof(reuse)) < 0) {
-        perror("[Receiver] setsockopt SO_REUSEADDR failed");
+        log_warn("[Receiver] setsockopt SO_REUSEADDR failed: %s", strerror(errno));
         // 继续执行，不是致命错误
     }
     
@@ -62,7 +63,7 @@ int create_recv_socket() {
     // 接受发送本机任一IP的5050端口数据，无论数据是从外部网络还是本机内部外送的
     
     if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("[Receiver] bind failed");
+        log_warn("[Receiver] bind failed: %s", strerror(errno));
         close(sockfd);
         return -1;
     }
@@ -81,7 +82,7 @@ int create_recv_socket() {
     // 适合需要同时处理多个连接或者轮询的场景
     // 配合 select（） poll（） epoll()
     
-    printf("[Receiver] Broadcast receive socket created on port %d\n", BROADCAST_PORT);
+    log_debug("[Receiver] Broadcast receive socket created on port %d", BROADCAST_PORT);
     return sockfd;
 }
 
@@ -100,9 +101,9 @@ int send_broadcast_message(int send_sock, const char* message) {
                  sizeof(broadcast_addr));
     
     if (ret < 0) {
-        perror("[Sender] sendto broadcast failed");
+        log_warn("[Sender] sendto broadcast failed: %s", strerror(errno));
     } else {
-        printf("[Sender] Broadcast sent: %s\n", message);
+        log_debug("[Sender] Broadcast sent: %s", message);
     }
     
     return ret;
@@ -132,7 +133,7 @@ int receive_broadcast_message(int recv_sock) {
             return 0;  // 忽略自己
         }
         
-        printf("[Receiver] Received from %s: %s\n", sender_ip, buffer);
+        log_debug("[Receiver] Received from %s: %s", sender_ip, buffer);
         
         // 解析消息格式：DEVICE_NAME|TIMESTAMP
         char device_name[64];
@@ -144,7 +145,7 @@ int receive_broadcast_message(int recv_sock) {
     } else if (bytes_received < 0) {
         // 非阻塞socket会返回EAGAIN或EWOULDBLOCK
         if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("[Receiver] recvfrom error");
+            log_warn("[Receiver] recvfrom error: %s", strerror(errno));
         }
     }
     
@@ -0,0 +1,390 @@
+// pack.c
+#define _GNU_SOURCE
+#include "transfer.h"
+#include "event_loop.h"
+#include "pack.h"
+#include "tree.h"
+#include "telemetry.h"
+#include "log.h"
+#include <endian.h>
+
+
+// 服务器端: 收到 CMD_PUT_PACK 文件头, 准备接收索引
+int open_upload_pack(ClientConn* conn, int root_fd)
+{
+    uint64_t index_len = file_header_offset(&conn->header);
+
+    if(index_len == 0 || index_len > PACK_MAX_INDEX)
+    {
+        log_warn("Invalid pack index length: %" PRIu64, index_len);
+        return -1;
+    }
+
+    PackUpload* pack = calloc(1, sizeof(PackUpload));
+    if(!pack)
+        return -1;
+    pack->index = malloc(index_len);
+    if(!pack->index)
+    {
+        free(pack);
+        return -1;
+    }
+    pack->root_fd = root_fd;
+    pack->paths = (conn->features & FEATURE_TREE) != 0;
+    pack->index_len = index_len;
+    pack->cur_fd = -1;
+    conn->pack = pack;
+    return 0;
+}
+
+// 没有协商 FEATURE_TREE 时文件名只能是根目录下的文件, 不能带路径
+static int valid_pack_name(const PackUpload* pack, const char* name)
+{
+    return tree_valid_path(name) && (pack->paths || strchr(name, '/') == NULL);
+}
+
+// 解析索引, 文件大小之和必须等于文件头中的数据总长度
+static int parse_pack_index(PackUpload* pack, uint64_t total)
+{
+    size_t pos = 0;
+    uint64_t sum = 0;
+    size_t max_count = pack->index_len / (PACK_ENTRY_SIZE + 1);
+
+    if(max_count > PACK_MAX_FILES)
+        max_count = PACK_MAX_FILES;
+    pack->entries = calloc(max_count ? max_count : 1, sizeof(PackEntry));
+    if(!pack->entries)
+        return -1;
+
+    while(pos < pack->index_len)
+    {
+        uint64_t size;
+        uint16_t name_len;
+
+        if(pack->count == (int)max_count || pack->index_len - pos < PACK_ENTRY_SIZE)
+            return -1;
+        memcpy(&size, pack->index + pos, sizeof(size));
+        memcpy(&name_len, pack->index + pos + 8, sizeof(name_len));
+        size = be64toh(size);
+        name_len = ntohs(name_len);
+        pos += PACK_ENTRY_SIZE;
+
+        if(name_len == 0 || name_len >= (pack->paths ? MAX_PATH_LEN : MAX_FILENAME_LEN) ||
+           pack->index_len - pos < name_len)
+            return -1;
+
+        PackEntry* entry = &pack->entries[pack->count ++];
+        entry->size = size;
+        memcpy(entry->name, pack->index + pos, name_len);
+        entry->name[name_len] = '\0';
+        pos += name_len;
+
+        if(!valid_pack_name(pack, entry->name) || size > total - sum)
+            return -1;
+        sum += size;
+    }
+    return sum == total ? 0 : -1;
+}
+
+// 打开当前文件, 失败时丢弃它的数据, 其他文件照常写入
+static void pack_open_file(PackUpload* pack)
+{
+    PackEntry* entry = &pack->entries[pack->cur];
+
+    pack->cur_fd = tree_openat(pack->root_fd, entry->name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(pack->cur_fd < 0)
+    {
+        log_error("%s: %s", entry->name, strerror(errno));
+        pack->cur_failed = 1;
+    }
+}
+
+// 当前文件写完: 关闭并移到下一个, 空文件只需创建
+static void pack_next_file(PackUpload* pack)
+{
+    while(1)
+    {
+        if(pack->cur_fd >= 0)
+        {
+            close(pack->cur_fd);
+            pack->cur_fd = -1;
+        }
+        if(pack->cur_failed)
+            pack->failed ++;
+        pack->cur ++;
+        pack->cur_done = 0;
+        pack->cur_failed = 0;
+
+        if(pack->cur >= pack->count || pack->entries[pack->cur].size > 0)
+            break;
+        pack_open_file(pack);
+    }
+}
+
+static int write_all(int fd, const char* data, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 把收到的一段拼接数据分给各个文件, 一次 recv 的数据可能跨很多个小文件
+static void pack_write(PackUpload* pack, const char* data, size_t len)
+{
+    while(len > 0 && pack->cur < pack->count)
+    {
+        PackEntry* entry = &pack->entries[pack->cur];
+        size_t n = entry->size - pack->cur_done < len ? (size_t)(entry->size - pack->cur_done) : len;
+
+        if(pack->cur_fd < 0 && !pack->cur_failed)
+            pack_open_file(pack);
+        if(!pack->cur_failed && write_all(pack->cur_fd, data, n) < 0)
+        {
+            log_error("%s: %s", entry->name, strerror(errno));
+            pack->cur_failed = 1;
+        }
+
+        data += n;
+        len -= n;
+        pack->cur_done += n;
+        if(pack->cur_done == entry->size)
+            pack_next_file(pack);
+    }
+}
+
+// 接收并解析索引, 返回值同 handle_file_upload; 索引不合法时数据流已不可信, 关闭连接
+int handle_pack_index(ClientConn* conn)
+{
+    PackUpload* pack = conn->pack;
+
+    while(pack->index_got < pack->index_len)
+    {
+        ssize_t n = recv(conn->fd, pack->index + pack->index_got, pack->index_len - pack->index_got, 0);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_STEP_BLOCKED;
+        }
+        if(n <= 0)
+            return CONN_STEP_CLOSE;
+        pack->index_got += n;
+    }
+
+    if(parse_pack_index(pack, conn->file_total) < 0)
+    {
+        log_warn("Invalid pack index");
+        return CONN_STEP_CLOSE;
+    }
+    free(pack->index);
+    pack->index = NULL;
+
+    log_info("Receiving pack: %d files (Size: %" PRIu64 " bytes)", pack->count, conn->file_total);
+
+    // 开头的空文件没有数据, 直接创建
+    pack->cur = -1;
+    pack_next_file(pack);
+    return CONN_STEP_DONE;
+}
+
+// 接收当前数据块并写入各个文件, 返回值同 handle_file_upload
+int handle_pack_upload(ClientConn* conn, char* buffer, size_t buflen)
+{
+    size_t budget = EVENT_LOOP_CONN_BUDGET;
+
+    while(conn->file_done < conn->file_size)
+    {
+        if(budget == 0)
+            return CONN_STEP_YIELD;
+
+        size_t to_receive = buflen;
+        if(conn->file_size - conn->file_done < to_receive)
+        {
+            to_receive = conn->file_size - conn->file_done;
+        }
+
+        ssize_t bytes_received = recv(conn->fd, buffer, to_receive, 0);
+        telemetry_io(conn->stats, bytes_received > 0 ? bytes_received : 0, 1);
+        if(bytes_received < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_STEP_BLOCKED;
+        }
+        if(bytes_received <= 0)
+        {
+            log_warn("Connection error during pack transfer");
+            return CONN_STEP_CLOSE;
+        }
+
+        pack_write(conn->pack, buffer, bytes_received);
+        conn->file_done += bytes_received;
+        budget = (size_t)bytes_received < budget ? budget - bytes_received : 0;
+    }
+    return CONN_STEP_DONE;
+}
+
+// 包接收结束, 返回失败的文件数; 没收到数据的文件也算失败
+int finish_upload_pack(ClientConn* conn)
+{
+    PackUpload* pack = conn->pack;
+
+    if(pack->cur_fd >= 0)
+    {
+        close(pack->cur_fd);
+        pack->cur_fd = -1;
+    }
+    return pack->failed + (pack->count - pack->cur);
+}
+
+void close_upload_pack(ClientConn* conn)
+{
+    PackUpload* pack = conn->pack;
+
+    if(!pack)
+        return;
+    if(pack->cur_fd >= 0)
+        close(pack->cur_fd);
+    free(pack->index);
+    free(pack->entries);
+    free(pack);
+    conn->pack = NULL;
+}
+
+
+static int send_all(int sockfd, const void* data, size_t len, int flags)
+{
+    const char* p = data;
+
+    while(len > 0)
+    {
+        ssize_t n = send(sockfd, p, len, flags);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_pack_chunk(int sockfd, const char* buffer, uint64_t offset, size_t len)
+{
+    ChunkHeader chunk;
+
+    encode_chunk_header(&chunk, offset, len);
+    if(send_all(sockfd, &chunk, sizeof(chunk), MSG_MORE) < 0)
+        return -1;
+    return send_all(sockfd, buffer, len, 0);
+}
+
+// 读取文件的 len 字节到 buffer, 文件变短或读失败时用 0 补齐, 返回 -1
+static int read_pack_data(int fd, char* buffer, size_t len)
+{
+    size_t got = 0;
+
+    while(fd >= 0 && got < len)
+    {
+        ssize_t n = read(fd, buffer + got, len - got);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        got += n;
+    }
+    if(got == len)
+        return 0;
+    memset(buffer + got, 0, len - got);
+    return -1;
+}
+
+// 客户端: 发送索引和拼接后的数据, names 为服务器上的文件名, sizes 为打包前 stat 得到的大小
+// 小文件读到缓冲区里凑成整块再发, 一次 send 带很多个文件
+// 连接出错返回 -1, 否则返回读取不完整的文件数, 这些文件在服务器上的内容不可信
+int send_file_pack(int sockfd, char* const paths[], char* const names[], const uint64_t sizes[], int count)
+{
+    FileHeader header;
+    uint64_t total = 0;
+    size_t index_len = 0;
+    int unreadable = 0;
+
+    uint8_t* index = malloc((size_t)count * (PACK_ENTRY_SIZE + MAX_PATH_LEN));
+    if(!index)
+        return -1;
+    for(int i = 0; i < count; i ++)
+    {
+        size_t len = strlen(names[i]);
+        uint16_t name_len = htons(len);
+        uint64_t size = htobe64(sizes[i]);
+
+        memcpy(index + index_len, &size, sizeof(size));
+        memcpy(index + index_len + 8, &name_len, sizeof(name_len));
+        memcpy(index + index_len + PACK_ENTRY_SIZE, names[i], len);
+        index_len += PACK_ENTRY_SIZE + len;
+        total += sizes[i];
+    }
+
+    encode_file_header(&header, PROTOCOL_V2, CMD_PUT_PACK, total, 0);
+    set_file_header_offset(&header, index_len);
+    int ret = send_all(sockfd, &header, sizeof(header), MSG_MORE);
+    if(ret == 0)
+        ret = send_all(sockfd, index, index_len, MSG_MORE);
+    free(index);
+    if(ret < 0)
+        return -1;
+
+    size_t capacity = total < CHUNK_SIZE ? (size_t)total : CHUNK_SIZE;
+    char* buffer = malloc(capacity ? capacity : 1);
+    if(!buffer)
+        return -1;
+
+    uint64_t offset = 0;
+    size_t fill = 0;
+    for(int i = 0; i < count && ret == 0; i ++)
+    {
+        uint64_t left = sizes[i];
+        int bad = 0;
+        int fd = left ? open(paths[i], O_RDONLY | O_CLOEXEC) : -1;
+
+        while(left > 0 && ret == 0)
+        {
+            size_t n = capacity - fill < left ? capacity - fill : (size_t)left;
+
+            if(read_pack_data(fd, buffer + fill, n) < 0)
+                bad = 1;
+            fill += n;
+            left -= n;
+            if(fill == capacity)
+            {
+                ret = send_pack_chunk(sockfd, buffer, offset, fill);
+                offset += fill;
+                fill = 0;
+            }
+        }
+        if(fd >= 0)
+            close(fd);
+        if(bad)
+        {
+            printf("Failed to read %s while packing\n", paths[i]);
+            unreadable ++;
+        }
+    }
+    if(ret == 0 && fill > 0)
+        ret = send_pack_chunk(sockfd, buffer, offset, fill);
+    free(buffer);
+
+    if(ret < 0 || send_chunk_end(sockfd) < 0)
+        return -1;
+    return unreadable;
+}
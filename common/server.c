@@ -1,6 +1,20 @@
 // server.c
 #include "discovery.h"
 #include "transfer.h"
+#include "event_loop.h"
+#include "uring_backend.h"
+#include "worker_pool.h"
+#include "upload_session.h"
+#include "journal.h"
+#include "pack.h"
+#include "mux.h"
+#include "delta.h"
+#include "dedup.h"
+#include "compress.h"
+#include "checksum.h"
+#include "telemetry.h"
+#include "log.h"
+#include <sys/epoll.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <fcntl.h>
@@ -11,13 +25,14 @@ static ServerConfig server_config = {0};
 static pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER; 
 // 这个线程锁是为了控制启动TCP和终止TCP直接不能相互干扰， 在进程中间可以直接使用config， 不用加线程锁
 
-// 启动 tcp server 服务器 - 返回 0 表示启动成功
-int start_tcp_server(int port, const char* root_path, const char* username, const char* password)
+// 启动 tcp server 服务器 - 返回 0 表示启动成功, options 为 NULL 时使用默认参数
+int start_tcp_server(int port, const char* root_path, const char* username, const char* password,
+                     const ServerOptions* options)
 {
     pthread_mutex_lock(&server_mutex);
 
     if(server_config.is_running) {
-        printf("Server is already running on port %d\n", server_config.port);
+        log_warn("Server is already running on port %d", server_config.port);
         pthread_mutex_unlock(&server_mutex);
         return -1;
     }
@@ -35,7 +50,7 @@ int start_tcp_server(int port, const char* root_path, const char* username, cons
         struct stat st;
         if(stat(server_config.root_path, &st) != 0 || !S_ISDIR(st.st_mode))
         {
-            printf("Error: Root path '%s' does not exist or is not a directory\n", root_path);
+            log_error("Root path '%s' does not exist or is not a directory", root_path);
             pthread_mutex_unlock(&server_mutex);
             return -1;           
         }
@@ -66,98 +81,203 @@ int start_tcp_server(int port, const char* root_path, const char* username, cons
         server_config.auth.authenticated = 0;
     }
 
-    printf("Starting TCP server on port %d\n", server_config.port);
-    printf("Root path: %s\n", server_config.root_path);
+    // 设置线程池参数
+    memset(&server_config.options, 0, sizeof(ServerOptions));
+    if(options)
+        server_config.options = *options;
+    if(server_config.options.workers <= 0)
+    {
+        // 分片模式默认每个 CPU 一个分片
+        server_config.options.workers = server_config.options.reuseport ?
+                                        online_cpu_count() : DEFAULT_SERVER_WORKERS;
+    }
+    if(server_config.options.backlog <= 0)
+        server_config.options.backlog = DEFAULT_LISTEN_BACKLOG;
+    if(server_config.options.queue_size <= 0)
+        server_config.options.queue_size = DEFAULT_ACCEPT_QUEUE;
+
+    // 请求的路径都以根目录 fd 为起点打开, 不必每次拼接和解析完整路径
+    server_config.root_fd = open(server_config.root_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(server_config.root_fd < 0)
+    {
+        log_error("Failed to open root path: %s", strerror(errno));
+        pthread_mutex_unlock(&server_mutex);
+        return -1;
+    }
+    server_config.store_fd = -1;
+    if(server_config.options.dedup)
+    {
+        server_config.store_fd = dedup_open_store(server_config.root_fd);
+        if(server_config.store_fd < 0)
+        {
+            log_error("Failed to open chunk store: %s", strerror(errno));
+            close(server_config.root_fd);
+            server_config.root_fd = -1;
+            pthread_mutex_unlock(&server_mutex);
+            return -1;
+        }
+    }
+
+    log_info("Starting TCP server on port %d", server_config.port);
+    log_info("Root path: %s", server_config.root_path);
 
     // 创建服务器线程与shell进程并行运行， 可以输入stop
+    // 先置位运行标志, 事件循环一启动就会检查它
+    server_config.is_running = 1;
     if(pthread_create(&server_config.server_thread, NULL, tcp_server_thread, &server_config) != 0) {
-        perror("Failed to create server thread");
+        log_error("Failed to create server thread: %s", strerror(errno));
+        server_config.is_running = 0;
+        close(server_config.root_fd);
+        server_config.root_fd = -1;
+        if(server_config.store_fd >= 0)
+            close(server_config.store_fd);
+        server_config.store_fd = -1;
         pthread_mutex_unlock(&server_mutex);
         return -1;       
     }
 
-    server_config.is_running = 1;
     pthread_mutex_unlock(&server_mutex);
     return 0;
 }
 
-// tcp 服务器线程
+// 暂停或恢复 accept: 队列满时不再读取监听 socket, 新连接留在内核 backlog 中
+static void set_accept_paused(int epfd, int listenfd, int paused)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = paused ? 0 : EPOLLIN;
+    ev.data.fd = listenfd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, listenfd, &ev);
+}
+
+// 分片模式: 每个工作线程各自 accept, 服务器线程只等待停止
+static void run_sharded_server(ServerConfig* config)
+{
+    WorkerPool pool;
+
+    if(worker_pool_start(&pool, config) < 0)
+        return;
+
+    log_info("TCP server listening on port %d", config->port);
+    log_info("Ready to accept connections...");
+
+    while(config->is_running)
+        sleep(1);
+
+    worker_pool_stop(&pool);
+}
+
+// tcp 服务器线程: 只负责 accept, 连接交给固定数量的工作线程处理
 void* tcp_server_thread(void* arg)
 {
     ServerConfig* config = (ServerConfig*)arg;
-    int listenfd, connfd;
+    WorkerPool pool;
+    struct epoll_event ev, events[2];
+    struct sockaddr_in client_addr;
+    socklen_t client_len;
+    int listenfd, connfd, epfd;
     int port = config->port;
-    socklen_t client_len = sizeof(struct sockaddr_in);
+    int paused = 0;
 
-    struct sockaddr_in client_addr;
+    if(config->options.reuseport)
+    {
+        run_sharded_server(config);
+        log_info("TCP Server thread terminated!");
+        return NULL;
+    }
 
-    listenfd = open_listenfd(port);
+    listenfd = open_listenfd(port, config->options.backlog, 0);
     if (listenfd < 0) {
-        printf("Failed to create listening socket\n");
+        log_error("Failed to create listening socket");
         return NULL;
     }
     config->server_fd = listenfd;
-    
-    printf("TCP server listening on port %d\n", config->port);
-    printf("Ready to accept connections...\n");
-
 
-    while(config->is_running)
+    if(set_nonblocking(listenfd) < 0 || worker_pool_start(&pool, config) < 0)
     {
-        fd_set read_fds;
-        struct timeval timeout;
-
-        FD_ZERO(&read_fds);
-        FD_SET(listenfd, &read_fds);
+        close(listenfd);
+        config->server_fd = -1;
+        return NULL;
+    }
 
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = listenfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+    ev.data.fd = pool.space_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, pool.space_fd, &ev);
+    
+    log_info("TCP server listening on port %d", config->port);
+    log_info("Ready to accept connections...");
 
-        int activity = select(listenfd + 1, &read_fds, NULL, NULL, &timeout);
+    while(config->is_running)
+    {
+        int n = epoll_wait(epfd, events, 2, 1000);
 
-        if(activity < 0 && errno != EINTR)
+        if(n < 0 && errno != EINTR)
         {
-            perror("Select error\n");
+            log_error("epoll_wait error: %s", strerror(errno));
             break;
         }
 
-        if(activity > 0 && FD_ISSET(listenfd, &read_fds))
+        for(int i = 0; i < n; i ++)
         {
-            // 接收新的连接
-            connfd = accept(listenfd, (struct sockaddr*)&client_addr, &client_len);
-            if(connfd < 0)
+            if(events[i].data.fd == pool.space_fd)
             {
-                perror("Accept failed\n");
+                // 工作线程取走了连接, 队列有空位后恢复 accept
+                uint64_t count;
+                if(read(pool.space_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    log_error("eventfd read: %s", strerror(errno));
+                if(paused && !worker_pool_full(&pool))
+                {
+                    paused = 0;
+                    set_accept_paused(epfd, listenfd, 0);
+                    log_info("Accept queue has room, resuming accept");
+                }
                 continue;
             }
 
-            printf("New connection from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-
-            pthread_t client_thread;
-            ClientThreadArgs *args = malloc(sizeof(ClientThreadArgs));
-
-            if(args)
+            // 接收新的连接
+            while(!paused)
             {
-                args->client_fd = connfd;
-                memcpy(&args->client_addr, &client_addr, sizeof(client_addr));
-                memcpy(&args->config, config, sizeof(ServerConfig));
+                client_len = sizeof(client_addr);
+                connfd = accept(listenfd, (struct sockaddr*)&client_addr, &client_len);
+                if(connfd < 0)
+                {
+                    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                        log_error("Accept failed: %s", strerror(errno));
+                    break;
+                }
 
-                pthread_create(&client_thread, NULL, handle_client_connection_thread, args);
-                pthread_detach(client_thread);
+                log_info("New connection from %s:%d", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
 
-            } else 
-            {
-                close(connfd);
+                if(worker_pool_dispatch(&pool, connfd, &client_addr) < 0)
+                {
+                    // 不会发生: 队列满之前就已暂停 accept
+                    close(connfd);
+                    break;
+                }
+
+                if(worker_pool_full(&pool))
+                {
+                    paused = 1;
+                    set_accept_paused(epfd, listenfd, 1);
+                    log_warn("Accept queue full, pausing accept");
+                }
             }
         }
     }
 
-
-    // 关闭监听socket
+    // 先停工作线程, 再关闭监听socket
+    config->is_running = 0;
+    worker_pool_stop(&pool);
+    close(epfd);
     close(listenfd);
     config->server_fd = -1;
 
-    printf("TCP Server thread terminated! \n");
+    log_info("TCP Server thread terminated!");
     return NULL;
 }
 
@@ -180,142 +300,794 @@ void stop_tcp_server()
         close(server_config.server_fd);
         server_config.server_fd = -1;
     }
-    printf("TCP server stopped\n");
+    close(server_config.root_fd);
+    server_config.root_fd = -1;
+    if(server_config.store_fd >= 0)
+        close(server_config.store_fd);
+    server_config.store_fd = -1;
+    log_info("TCP server stopped");
 
     pthread_mutex_unlock(&server_mutex);
 }
 
-void* handle_client_connection_thread(void* arg)
+// 认证状态: 读完认证头后校验用户名密码, 返回状态机步进结果
+int authenticate_client(ClientConn* conn, const UserAuth* server_auth)
 {
-    ClientThreadArgs* args = (ClientThreadArgs*)arg;
-    int clientfd = args->client_fd;
-    struct sockaddr_in client_addr = args->client_addr;
-    ServerConfig config = args->config;
+    AuthHeader auth_header;
+    AuthHeader response;
+    int ret = conn_fill(conn);
 
+    if(ret != CONN_STEP_DONE)
+    {
+        if(ret == CONN_STEP_CLOSE)
+            log_warn("Failed to receive auth header");
+        return ret;
+    }
+    memcpy(&auth_header, conn->in_buf, sizeof(AuthHeader));
+    auth_header.username[MAX_USERNAME_LEN - 1] = '\0';
+    auth_header.password[MAX_PASSWORD_LEN - 1] = '\0';
+
+    int success = 1;
+    if(server_auth->authenticated)
+    {
+        success = strcmp(server_auth->username, auth_header.username) == 0 &&
+                  strcmp(server_auth->password, auth_header.password) == 0;
+    }
 
-    free(args);
+    memset(&response, 0, sizeof(AuthHeader));
+    response.auth_result = success ? 1 : 0;
+    conn_queue(conn, &response, sizeof(AuthHeader));
 
-    if(authenticate_client(clientfd, &config.auth) == 0)
+    if(success)
     {
-        handle_client_requests(clientfd, config.root_path);
+        conn->state = CONN_STATE_HEADER;
+        conn_expect(conn, sizeof(FileHeader));
     }
-    close(clientfd);
-    printf("Connection closed for %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-    return NULL;
+    else
+    {
+        conn->state = CONN_STATE_CLOSING;
+    }
+    return CONN_STEP_DONE;
 }
 
-int authenticate_client(int client_fd, UserAuth* server_auth)
+// 回复只带命令的文件头 (ACK / NAK)
+static void queue_response(ClientConn* conn, uint16_t command)
 {
-    AuthHeader auth_header;
-    ssize_t bytes;
+    FileHeader response;
+    encode_file_header(&response, conn->proto, command, 0, 0);
+    conn_queue(conn, &response, sizeof(FileHeader));
+}
 
-    bytes = recv(client_fd, &auth_header, sizeof(AuthHeader), 0);
-    if(bytes != sizeof(AuthHeader))
-    {
-        printf("Failed to receive auth header\n");
-        send_auth_response(client_fd, 0);  // 认证失败
-        return -1;    
+// 回复 HELLO: 协商的版本和双方都支持的可选功能
+static void queue_hello(ClientConn* conn)
+{
+    FileHeader response;
+
+    conn->features = conn->proto >= PROTOCOL_V2 ? conn->header.flags & PROTOCOL_FEATURES : 0;
+    // 没有开启去重的服务器不提供 CMD_PUT_DEDUP
+    if(conn->loop->config->store_fd < 0)
+        conn->features &= ~FEATURE_DEDUP;
+    encode_file_header(&response, conn->proto, CMD_HELLO, 0, 0);
+    response.flags = htons(conn->features);
+    conn_queue(conn, &response, sizeof(FileHeader));
+}
+
+// 文件头状态: 解析命令, 进入读取文件名阶段
+static int handle_request_header(ClientConn* conn)
+{
+    int ret = conn_fill(conn);
+    if(ret != CONN_STEP_DONE)
+        return ret;
+
+    memcpy(&conn->header, conn->in_buf, sizeof(FileHeader));
+    decode_file_header(&conn->header);
+
+    //  验证魔数
+    if(conn->header.magic != MAGIC_NUMBER) {
+        log_warn("Invailed magic number");
+        return CONN_STEP_CLOSE;
     }
 
-    if(server_auth->authenticated)
+    switch (conn->header.command)
     {
-        if(strcmp(server_auth->username, auth_header.username) == 0 &&
-            strcmp(server_auth->password, auth_header.password) == 0) {
-                send_auth_response(client_fd, 1);
-                return 0;
-            }else
+        case CMD_HELLO :
+            // 回复双方都支持的最高版本, 之后的文件头和数据按该版本解析
+            conn->proto = conn->header.version < PROTOCOL_VERSION ? conn->header.version : PROTOCOL_VERSION;
+            if(conn->proto < PROTOCOL_V1)
+                conn->proto = PROTOCOL_V1;
+            queue_hello(conn);
+            conn_expect(conn, sizeof(FileHeader));
+            break;
+        case CMD_PUT_PACK :
+            // 没有协商时和未知命令一样处理
+            if(!(conn->features & FEATURE_PACK))
+            {
+                log_warn("Unknown command: %d", conn->header.command);
+                queue_response(conn, CMD_NAK);
+                conn_expect(conn, sizeof(FileHeader));
+                break;
+            }
+            // 索引长度不合法时无法继续解析后续数据, 回复 NAK 后关闭
+            conn->file_total = file_header_size(&conn->header);
+            conn->file_offset = 0;
+            conn->file_size = 0;
+            conn->file_done = 0;
+            conn->file_received = 0;
+            conn->file_failed = 0;
+            if(open_upload_pack(conn, conn->loop->config->root_fd) < 0)
+            {
+                queue_response(conn, CMD_NAK);
+                conn->state = CONN_STATE_CLOSING;
+                break;
+            }
+            conn->state = CONN_STATE_PACK_INDEX;
+            break;
+        case CMD_MUX :
+            // 没有协商时和未知命令一样处理
+            if(!(conn->features & FEATURE_MUX))
+            {
+                log_warn("Unknown command: %d", conn->header.command);
+                queue_response(conn, CMD_NAK);
+                conn_expect(conn, sizeof(FileHeader));
+                break;
+            }
+            if(open_mux_session(conn) < 0)
+            {
+                queue_response(conn, CMD_NAK);
+                conn_expect(conn, sizeof(FileHeader));
+                break;
+            }
+            queue_response(conn, CMD_ACK);
+            conn->state = CONN_STATE_MUX;
+            conn_expect(conn, sizeof(MuxFrame));
+            break;
+        case CMD_LIST :
+            // 列目录是可选功能, 没有协商时和未知命令一样处理
+            if(!(conn->features & FEATURE_PIPELINE))
+            {
+                log_warn("Unknown command: %d", conn->header.command);
+                queue_response(conn, CMD_NAK);
+                conn_expect(conn, sizeof(FileHeader));
+                break;
+            }
+            // fall through
+        case CMD_GET_RANGE :
+        case CMD_PUT_RANGE :
+            // 范围请求依赖 v2 的 64 位偏移和分块数据
+            if(conn->proto < PROTOCOL_V2)
             {
-                send_auth_response(client_fd, 0);
-                return -1;
+                log_warn("Range request requires protocol v2");
+                queue_response(conn, CMD_NAK);
+                conn->state = CONN_STATE_CLOSING;
+                break;
+            }
+            // fall through
+        case CMD_PUT_FILE :
+        case CMD_GET_FILE :
+        case CMD_PUT_DELTA :
+        case CMD_PUT_DEDUP :
+            // 增量和去重上传是可选功能, 没有协商时和未知命令一样处理
+            if((conn->header.command == CMD_PUT_DELTA && !(conn->features & FEATURE_DELTA)) ||
+               (conn->header.command == CMD_PUT_DEDUP && !(conn->features & FEATURE_DEDUP)))
+            {
+                log_warn("Unknown command: %d", conn->header.command);
+                queue_response(conn, CMD_NAK);
+                conn_expect(conn, sizeof(FileHeader));
+                break;
+            }
+            // 文件名长度不合法时无法继续解析后续数据, 回复 NAK 后关闭; 相对路径可以更长
+            if(conn->header.filename_len == 0 ||
+               conn->header.filename_len >= ((conn->features & FEATURE_TREE) ? MAX_PATH_LEN : MAX_FILENAME_LEN))
+            {
+                log_warn("Invalid filename length: %u", conn->header.filename_len);
+                queue_response(conn, CMD_NAK);
+                conn->state = CONN_STATE_CLOSING;
+                break;
             }
-    }else{
-        send_auth_response(client_fd, 1);
-        return 0;
+            conn->state = CONN_STATE_FILENAME;
+            conn_expect(conn, conn->header.filename_len);
+            break;
+        default:
+            log_warn("Unknown command: %d", conn->header.command);
+            queue_response(conn, CMD_NAK);
+            conn_expect(conn, sizeof(FileHeader));
+            break;
     }
+    return CONN_STEP_DONE;
 }
 
+// 打包上传结束: 全部写入成功回复 ACK, 否则 NAK 带上失败的文件数
+static void finish_upload_pack_reply(ClientConn* conn)
+{
+    FileHeader response;
+    int count = conn->pack->count;
+    int failed = conn->file_failed ? count : finish_upload_pack(conn);
+
+    close_upload_pack(conn);
+    if(failed == 0)
+    {
+        log_info("Pack received successfully: %d files", count);
+        encode_file_header(&response, conn->proto, CMD_ACK, 0, 0);
+    }
+    else
+    {
+        log_warn("Failed to receive %d of %d files in pack", failed, count);
+        encode_file_header(&response, conn->proto, CMD_NAK, failed, 0);
+    }
+    conn_queue(conn, &response, sizeof(FileHeader));
+    conn->state = CONN_STATE_HEADER;
+    conn_expect(conn, sizeof(FileHeader));
+}
 
-// 处理客户端请求
-int handle_client_requests(int client_fd, const char *root_path)
+// 去重上传结束: 块都存入仓库后写入清单, 回复 ACK/NAK
+static void finish_upload_dedup_reply(ClientConn* conn)
 {
-    FileHeader header;
-    while(1)
+    uint64_t stored = conn->dedup->stored;
+
+    if(!conn->file_failed && finish_upload_dedup(conn, conn->loop->config->root_fd) == 0)
     {
-        // 接收文件头
-        if(receive_file_header(client_fd, &header) < 0) {
-            printf("failed to receive file header\n");
-            break;
+        log_info("File received successfully: %s (%" PRIu64 " of %" PRIu64 " bytes stored as new chunks)",
+                 conn->filename, stored, conn->dedup->size);
+        queue_response(conn, CMD_ACK);
+    }
+    else
+    {
+        log_warn("Failed to receive file %s", conn->filename);
+        queue_response(conn, CMD_NAK);
+    }
+    close_upload_dedup(conn);
+    conn->state = CONN_STATE_HEADER;
+    conn_expect(conn, sizeof(FileHeader));
+}
+
+// 上传结束: 关闭文件并回复 ACK/NAK
+static void finish_upload(ClientConn* conn)
+{
+    if(conn->pack)
+    {
+        finish_upload_pack_reply(conn);
+        return;
+    }
+    if(conn->dedup)
+    {
+        finish_upload_dedup_reply(conn);
+        return;
+    }
+
+    uint64_t lz_raw = conn->lz ? conn->lz->raw_bytes : 0;
+    uint64_t lz_wire = conn->lz ? conn->lz->wire_bytes : 0;
+
+    close_upload_journal(conn, !conn->file_failed);
+    close_compress(conn);
+    uring_upload_end(conn);
+    if(conn->file_fd >= 0)
+    {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+
+    if(!conn->file_failed)
+    {
+        if(lz_wire)
+            log_info("File received successfully: %s (compressed chunks: %" PRIu64 " bytes as %" PRIu64 ")",
+                     conn->filename, lz_raw, lz_wire);
+        else
+            log_info("File received successfully: %s", conn->filename);
+        queue_response(conn, CMD_ACK);
+    }
+    else
+    {
+        log_warn("Failed to receive file %s", conn->filename);
+        queue_response(conn, CMD_NAK);
+    }
+    conn->state = CONN_STATE_HEADER;
+    conn_expect(conn, sizeof(FileHeader));
+}
+
+// 文件名状态: 打开文件, 进入数据收发阶段
+static int handle_request_filename(ClientConn* conn, const ServerConfig* config)
+{
+    int ret = conn_fill(conn);
+    if(ret != CONN_STEP_DONE)
+        return ret;
+
+    memcpy(conn->filename, conn->in_buf, conn->header.filename_len);
+    conn->filename[conn->header.filename_len] = '\0';
+    telemetry_rename(conn->stats, conn->filename);
+
+    // 增量上传: 先发送旧文件的签名, 客户端收到后才发送操作序列
+    if(conn->header.command == CMD_PUT_DELTA)
+    {
+        conn->file_total = file_header_size(&conn->header);
+        log_info("Receiving delta: %s (Size: %" PRIu64 " bytes)", conn->filename, conn->file_total);
+        if(open_upload_delta(conn, config->root_fd) < 0)
+        {
+            close_upload_delta(conn);
+            log_warn("Failed to receive file %s", conn->filename);
+            queue_response(conn, CMD_NAK);
+            conn->state = CONN_STATE_HEADER;
+            conn_expect(conn, sizeof(FileHeader));
+            return CONN_STEP_DONE;
         }
+        conn->state = CONN_STATE_DELTA_SIGNATURE;
+        return CONN_STEP_DONE;
+    }
 
-        //  验证魔数
-        if(header.magic != MAGIC_NUMBER) {
-            printf("Invailed magic number\n");
-            break;
+    // 去重上传: 先接收块索引, 索引长度不合法时无法继续解析, 回复 NAK 后关闭
+    if(conn->header.command == CMD_PUT_DEDUP)
+    {
+        if(open_upload_dedup(conn, config->store_fd) < 0)
+        {
+            close_upload_dedup(conn);
+            log_warn("Failed to receive file %s", conn->filename);
+            queue_response(conn, CMD_NAK);
+            conn->state = CONN_STATE_CLOSING;
+            return CONN_STEP_DONE;
         }
+        conn->state = CONN_STATE_DEDUP_INDEX;
+        return CONN_STEP_DONE;
+    }
 
-        // 根据命令类型来处理
-        switch (header.command)
+    if(conn->header.command == CMD_PUT_FILE || conn->header.command == CMD_PUT_RANGE)
+    {
+        conn->file_total = file_header_size(&conn->header);
+        log_info("Receiving file: %s (Size: %" PRIu64 " bytes)", conn->filename, conn->file_total);
+
+        // 打开失败也要读完数据, 保持数据流同步
+        conn->file_offset = 0;
+        conn->file_done = 0;
+        conn->file_received = 0;
+        conn->no_splice = 0;
+        conn->chunk_flags = 0;
+        conn->crc_bad = 0;
+        conn->crc_rounds = 0;
+        if(conn->header.command == CMD_PUT_RANGE)
+            conn->file_failed = open_upload_range(conn) < 0;
+        else
+            conn->file_failed = open_upload_file(conn, config->root_path) < 0;
+
+        // 续传请求的客户端在等 CMD_RESUME, 打开失败时直接拒绝, 不会再发数据
+        if(conn->file_failed && conn->proto >= PROTOCOL_V2 && (conn->features & FEATURE_RESUME) &&
+           (conn->header.flags & FILE_FLAG_RESUME) && conn->header.command == CMD_PUT_FILE)
         {
-            case CMD_PUT_FILE :{
-                printf("Client put file\n");
-                
-                // 接收文件名
-                char filename[MAX_FILENAME_LEN];
-                if(recv(client_fd, filename, header.filename_len, 0) != header.filename_len)
-                {
-                    printf("Failed to receive filename\n");
-                    send_response(client_fd, CMD_NAK);
-                    break;
-                }
-                filename[header.filename_len] = '\0';
+            finish_upload(conn);
+            return CONN_STEP_DONE;
+        }
+        if(conn->proto < PROTOCOL_V2)
+        {
+            conn->file_size = conn->file_total;
+            conn->state = CONN_STATE_UPLOAD;
+        }
+        else
+        {
+            conn->file_size = 0;
+            conn->state = CONN_STATE_CHUNK;
+            conn_expect(conn, sizeof(ChunkHeader));
+        }
+    }
+    else
+    {
+        if(conn->header.command == CMD_LIST)
+        {
+            ret = open_list_file(conn, config->root_path);
+        }
+        else
+        {
+            log_info("sending file: %s", conn->filename);
+            ret = open_download_file(conn, config->root_path);
+        }
+
+        if(ret < 0)
+        {
+            log_warn("Failed to send file: %s", conn->filename);
+            queue_response(conn, CMD_NAK);
+            conn->state = CONN_STATE_HEADER;
+            conn_expect(conn, sizeof(FileHeader));
+        }
+        else
+        {
+            conn->state = CONN_STATE_DOWNLOAD;
+        }
+    }
+    return CONN_STEP_DONE;
+}
 
-                printf("Receiving file: %s (Size: %u bytes)\n", filename, header.filesize);
+// 要求客户端重传 [offset, offset + length), length 为 0 表示这一轮的重传请求发完了
+static int queue_chunk_nak(ClientConn* conn, uint64_t offset, uint64_t length)
+{
+    FileHeader response;
 
-                // 处理文件上传
-                if(handle_file_upload(client_fd, root_path, filename, header.filesize) == 0)
-                {
-                    printf("File received successfully: %s\n", filename);
-                    send_response(client_fd, CMD_ACK);
-                }
-                else
-                {
-                    printf("Failed to receive file %s\n", filename);
-                    send_response(client_fd, CMD_NAK);
-                }
-                break;
-            }
-            case CMD_GET_FILE :{
-                printf("Client get file\n");
-                
-                char filename[MAX_FILENAME_LEN];
-                if(recv(client_fd, filename, header.filename_len, 0) != header.filename_len)
-                {
-                    printf("Failed to receive filename\n");
-                    send_response(client_fd, CMD_NAK);
-                    break;
-                }
-                filename[header.filename_len] = '\0';
+    encode_file_header(&response, conn->proto, CMD_CHUNK_NAK, length, 0);
+    set_file_header_offset(&response, offset);
+    return conn_queue(conn, &response, sizeof(FileHeader));
+}
 
-                printf("sending file: %s", filename);
+// v2 数据块头: 设置下一个数据段, 长度为 0 表示上传结束
+static int handle_request_chunk(ClientConn* conn)
+{
+    ChunkHeader chunk;
+    int ret = conn_fill(conn);
+    if(ret != CONN_STEP_DONE)
+        return ret;
 
-                // 处理文件下载
-                if(handle_file_download(client_fd, root_path, filename) == 0)
-                {
-                    printf("File sent successfully: %s\n", filename);
-                }
-                else
-                {
-                    send_file_header(client_fd, CMD_NAK, 0, 0);
-                    printf("Failed to send file: %s", filename);
-                }
+    memcpy(&chunk, conn->in_buf, sizeof(ChunkHeader));
+    decode_chunk_header(&chunk);
+
+    // 这一轮有校验失败的块: 通知客户端重传, 之后它会再发一次结束块; 重传轮数用完后按失败处理
+    if(chunk.length == 0 && conn->crc_bad > 0)
+    {
+        conn->crc_bad = 0;
+        if(++ conn->crc_rounds <= CRC_MAX_ROUNDS)
+        {
+            if(queue_chunk_nak(conn, 0, 0) < 0)
+                return CONN_STEP_CLOSE;
+            conn_expect(conn, sizeof(ChunkHeader));
+            return CONN_STEP_DONE;
+        }
+        log_warn("Too many corrupted chunks in %s", conn->filename);
+        conn->file_failed = 1;
+    }
+
+    if(chunk.length == 0 && conn->session)
+    {
+        // 并行上传: 提交本连接的字节数, 所有连接的范围都到齐后才回复
+        upload_session_commit(conn->session, conn->file_received, conn->file_failed);
+        conn->session_committed = 1;
+        uring_upload_end(conn);
+        close(conn->file_fd);
+        conn->file_fd = -1;
+        conn->state = CONN_STATE_WAIT_RANGES;
+        return CONN_STEP_DONE;
+    }
+
+    if(chunk.length == 0)
+    {
+        // 数据总量不对时文件不完整, 回复 NAK
+        if(conn->file_received != conn->file_total && !conn->file_failed)
+        {
+            log_warn("File transfer incomplete: received %" PRIu64 "/%" PRIu64 " bytes",
+                     conn->file_received, conn->file_total);
+            conn->file_failed = 1;
+        }
+        finish_upload(conn);
+        return CONN_STEP_DONE;
+    }
+
+    // 数据块越界说明数据流已不可信, 直接关闭; 打包和去重上传按顺序解析, 数据块必须连续
+    if(chunk.offset > conn->file_total || chunk.length > conn->file_total - chunk.offset ||
+       ((conn->pack || conn->dedup) && chunk.offset != conn->file_received))
+    {
+        log_warn("Invalid chunk: offset %" PRIu64 " length %u", chunk.offset, chunk.length);
+        return CONN_STEP_CLOSE;
+    }
+
+    // 压缩的数据块: 只用于普通文件上传, 负载先收到缓冲区再解压
+    if(conn->lz)
+        conn->lz->active = 0;
+    if(chunk.flags & CHUNK_FLAG_LZ)
+    {
+        if(!(conn->features & FEATURE_COMPRESS) || conn->pack || conn->dedup ||
+           chunk.length > COMPRESS_PAYLOAD_MAX || open_compress(conn) < 0)
+        {
+            log_warn("Invalid compressed chunk: offset %" PRIu64 " length %u", chunk.offset, chunk.length);
+            return CONN_STEP_CLOSE;
+        }
+        conn->lz->active = 1;
+    }
+    // 带 CRC 的数据块: 只用于普通文件上传, 数据收完后再读 4 字节校验值
+    if((chunk.flags & CHUNK_FLAG_CRC) && (!(conn->features & FEATURE_CRC) || conn->pack || conn->dedup))
+    {
+        log_warn("Invalid chunk: offset %" PRIu64 " length %u", chunk.offset, chunk.length);
+        return CONN_STEP_CLOSE;
+    }
+    conn->chunk_flags = chunk.flags;
+    conn->chunk_crc = 0;
+    conn->chunk_corrupt = 0;
+    telemetry_chunk(conn->stats);
+
+    conn->file_offset = chunk.offset;
+    conn->file_size = chunk.length;
+    conn->file_done = 0;
+    conn->state = CONN_STATE_UPLOAD;
+    return CONN_STEP_DONE;
+}
+
+// 并行上传: 等待会话完成, 由会话的 eventfd 唤醒; 完成后回复 ACK, 失败回复 NAK
+static int handle_request_wait_ranges(ClientConn* conn)
+{
+    int status = upload_session_status(conn->session);
+    char c;
+
+    if(status == UPLOAD_SESSION_PENDING)
+    {
+        // 等待期间客户端断开, 不必再等
+        if(recv(conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+            return CONN_STEP_CLOSE;
+        if(conn->wait_fd < 0 && event_loop_watch(conn->loop, conn, conn->session->event_fd) < 0)
+            return CONN_STEP_CLOSE;
+        return CONN_STEP_BLOCKED;
+    }
+
+    event_loop_unwatch(conn->loop, conn);
+    upload_session_leave(conn->session, 0);
+    conn->session = NULL;
+    conn->file_failed = status != UPLOAD_SESSION_DONE;
+    finish_upload(conn);
+    return CONN_STEP_DONE;
+}
+
+// 增量上传: 签名发完后接收操作序列
+static int handle_request_delta_signature(ClientConn* conn)
+{
+    int ret = handle_delta_signature(conn);
+    if(ret != CONN_STEP_DONE)
+        return ret;
+
+    conn->state = CONN_STATE_DELTA;
+    conn_expect(conn, sizeof(DeltaOp));
+    return CONN_STEP_DONE;
+}
+
+// 增量上传: 重建完成后替换原文件并回复 ACK/NAK
+static int handle_request_delta(ClientConn* conn)
+{
+    EventLoop* loop = conn->loop;
+    int ret = handle_delta_upload(conn, loop->scratch, loop->scratch_size);
+    if(ret != CONN_STEP_DONE)
+        return ret;
+
+    uint64_t literal = conn->delta->literal;
+    if(finish_upload_delta(conn) == 0)
+    {
+        log_info("File received successfully: %s (%" PRIu64 " of %" PRIu64 " bytes sent as new data)",
+                 conn->filename, literal, conn->file_total);
+        queue_response(conn, CMD_ACK);
+    }
+    else
+    {
+        log_warn("Failed to receive file %s", conn->filename);
+        queue_response(conn, CMD_NAK);
+    }
+    close_upload_delta(conn);
+    conn->state = CONN_STATE_HEADER;
+    conn_expect(conn, sizeof(FileHeader));
+    return CONN_STEP_DONE;
+}
+
+// 去重上传: 位图发完后和 v2 上传一样按数据块接收缺少的块
+static int handle_request_dedup_index(ClientConn* conn)
+{
+    int ret = handle_dedup_index(conn);
+    if(ret != CONN_STEP_DONE)
+        return ret;
+
+    conn->file_offset = 0;
+    conn->file_size = 0;
+    conn->file_done = 0;
+    conn->file_received = 0;
+    conn->file_failed = 0;
+    conn->state = CONN_STATE_CHUNK;
+    conn_expect(conn, sizeof(ChunkHeader));
+    return CONN_STEP_DONE;
+}
+
+// 打包上传: 索引收完后和 v2 上传一样按数据块接收
+static int handle_request_pack_index(ClientConn* conn)
+{
+    int ret = handle_pack_index(conn);
+    if(ret != CONN_STEP_DONE)
+        return ret;
+
+    conn->state = CONN_STATE_CHUNK;
+    conn_expect(conn, sizeof(ChunkHeader));
+    return CONN_STEP_DONE;
+}
+
+// 一个数据块收完, 让出给其他连接后再读下一个块头
+static int finish_chunk(ClientConn* conn)
+{
+    conn->file_received += conn->file_size;
+    if(conn->journal && !conn->file_failed)
+        journal_add(conn->journal, conn->file_offset, conn->file_offset + conn->file_size);
+    conn->state = CONN_STATE_CHUNK;
+    conn_expect(conn, sizeof(ChunkHeader));
+    return CONN_STEP_YIELD;
+}
+
+static int handle_request_upload(ClientConn* conn)
+{
+    EventLoop* loop = conn->loop;
+    int ret = conn->pack ? handle_pack_upload(conn, loop->scratch, loop->scratch_size)
+            : conn->dedup ? handle_dedup_upload(conn)
+            : conn->lz && conn->lz->active ? handle_compress_upload(conn)
+                          : handle_file_upload(conn, loop->scratch, loop->scratch_size);
+    if(ret != CONN_STEP_DONE)
+        return ret;
+
+    if(conn->proto < PROTOCOL_V2)
+    {
+        finish_upload(conn);
+        return CONN_STEP_DONE;
+    }
+    if(conn->chunk_flags & CHUNK_FLAG_CRC)
+    {
+        conn->state = CONN_STATE_CHUNK_CRC;
+        conn_expect(conn, sizeof(uint32_t));
+        return CONN_STEP_DONE;
+    }
+    return finish_chunk(conn);
+}
+
+// 数据块后面的 CRC32C: 不对时不记账, 要求客户端单独重传这一块
+static int handle_request_chunk_crc(ClientConn* conn)
+{
+    uint32_t crc;
+    int ret = conn_fill(conn);
+    if(ret != CONN_STEP_DONE)
+        return ret;
+
+    memcpy(&crc, conn->in_buf, sizeof(crc));
+    if(!conn->chunk_corrupt && ntohl(crc) == conn->chunk_crc)
+        return finish_chunk(conn);
+
+    log_warn("Chunk at offset %" PRIu64 " failed CRC check, requesting retransmission", conn->file_offset);
+    if(queue_chunk_nak(conn, conn->file_offset, conn->file_size) < 0)
+        return CONN_STEP_CLOSE;
+    conn->crc_bad ++;
+    conn->state = CONN_STATE_CHUNK;
+    conn_expect(conn, sizeof(ChunkHeader));
+    return CONN_STEP_DONE;
+}
+
+// v2: 当前数据块发完后排入下一个块头, 文件发完后排入结束块
+// 返回 CONN_STEP_YIELD 让块头先发出去, 再发送数据; 压缩下载读文件失败时返回 CONN_STEP_CLOSE
+static int queue_next_chunk(ClientConn* conn)
+{
+    ChunkHeader chunk;
+    uint64_t next = conn->file_offset + conn->file_size;
+    uint32_t max = conn->lz ? COMPRESS_BLOCK : CHUNK_SIZE;
+    uint32_t length = conn->file_total - next < max ? (uint32_t)(conn->file_total - next) : max;
+
+    if(conn->lz && length > 0)
+        return queue_compress_chunk(conn, next, length);
+
+    encode_chunk_header(&chunk, next, length);
+    conn_queue(conn, &chunk, sizeof(ChunkHeader));
+    if(length)
+        telemetry_chunk(conn->stats);
+
+    conn->file_offset = next;
+    conn->file_size = length;
+    conn->file_done = 0;
+    return length ? CONN_STEP_YIELD : CONN_STEP_DONE;
+}
+
+static int handle_request_download(ClientConn* conn)
+{
+    int ret = conn->lz ? handle_compress_download(conn) : handle_file_download(conn);
+    if(ret != CONN_STEP_DONE)
+    {
+        if(ret == CONN_STEP_CLOSE)
+            log_warn("File transfer incomplete: sent up to %" PRIu64 "/%" PRIu64 " bytes",
+                     conn->file_offset + conn->file_done, conn->file_total);
+        return ret;
+    }
+
+    // v2: 还有数据时继续下一个块, 结束块排入后和 v1 一样等待确认
+    if(conn->proto >= PROTOCOL_V2)
+    {
+        ret = queue_next_chunk(conn);
+        if(ret != CONN_STEP_DONE)
+            return ret;
+    }
+
+    if(conn->lz)
+    {
+        log_info("File sent compressed: %s (%" PRIu64 " bytes as %" PRIu64 ")",
+                 conn->filename, conn->lz->raw_bytes, conn->lz->wire_bytes);
+        close_compress(conn);
+    }
+    close(conn->file_fd);
+    conn->file_fd = -1;
+    close_download_dedup(conn);
+
+    // mget 连续发送请求, 不逐个确认
+    if((conn->header.flags & FILE_FLAG_NO_ACK) && (conn->features & FEATURE_PIPELINE))
+    {
+        log_info("File sent: %s", conn->filename);
+        conn->state = CONN_STATE_HEADER;
+        conn_expect(conn, sizeof(FileHeader));
+        return CONN_STEP_DONE;
+    }
+
+    // 等待客户端发送的确认消息
+    conn->state = CONN_STATE_WAIT_ACK;
+    conn_expect(conn, sizeof(FileHeader));
+    return CONN_STEP_DONE;
+}
+
+static int handle_request_ack(ClientConn* conn)
+{
+    FileHeader response;
+    int ret = conn_fill(conn);
+    if(ret != CONN_STEP_DONE)
+        return ret;
+
+    memcpy(&response, conn->in_buf, sizeof(FileHeader));
+    decode_file_header(&response);
+
+    if(response.command == CMD_ACK)
+        log_info("File sent successfully: %s", conn->filename);
+    else
+        log_warn("Failed to send file: %s", conn->filename);
+
+    conn->state = CONN_STATE_HEADER;
+    conn_expect(conn, sizeof(FileHeader));
+    return CONN_STEP_DONE;
+}
+
+// 处理客户端请求: 按连接状态逐步推进, 直到 socket 阻塞、让出或需要关闭
+int handle_client_requests(ClientConn* conn, const ServerConfig* config)
+{
+    int ret;
+
+    while(1)
+    {
+        // 先把待发的控制消息发完, 保证响应顺序
+        ret = conn_flush(conn);
+        if(ret != CONN_STEP_DONE)
+            return ret;
+
+        switch (conn->state)
+        {
+            case CONN_STATE_AUTH:
+                ret = authenticate_client(conn, &config->auth);
                 break;
-            }
-            default:{
-                printf("Unknown command: %d\n", header.command);
-                send_response(client_fd, CMD_NAK);
+            case CONN_STATE_HEADER:
+                ret = handle_request_header(conn);
                 break;
-            }
+            case CONN_STATE_FILENAME:
+                ret = handle_request_filename(conn, config);
+                break;
+            case CONN_STATE_PACK_INDEX:
+                ret = handle_request_pack_index(conn);
+                break;
+            case CONN_STATE_CHUNK:
+                ret = handle_request_chunk(conn);
+                break;
+            case CONN_STATE_CHUNK_CRC:
+                ret = handle_request_chunk_crc(conn);
+                break;
+            case CONN_STATE_UPLOAD:
+                ret = handle_request_upload(conn);
+                break;
+            case CONN_STATE_DOWNLOAD:
+                ret = handle_request_download(conn);
+                break;
+            case CONN_STATE_WAIT_ACK:
+                ret = handle_request_ack(conn);
+                break;
+            case CONN_STATE_WAIT_RANGES:
+                ret = handle_request_wait_ranges(conn);
+                break;
+            case CONN_STATE_MUX:
+                ret = handle_mux_session(conn);
+                break;
+            case CONN_STATE_DELTA_SIGNATURE:
+                ret = handle_request_delta_signature(conn);
+                break;
+            case CONN_STATE_DELTA:
+                ret = handle_request_delta(conn);
+                break;
+            case CONN_STATE_DEDUP_INDEX:
+                ret = handle_request_dedup_index(conn);
+                break;
+            case CONN_STATE_CLOSING:
+            default:
+                return CONN_STEP_CLOSE;
         }
+
+        if(ret != CONN_STEP_DONE)
+            return ret;
     }
-    return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,437 @@
+// tree.c
+#define _GNU_SOURCE
+#include "transfer.h"
+#include "journal.h"
+#include "tree.h"
+#include "delta.h"
+#include "dedup.h"
+#include <dirent.h>
+#include <libgen.h>
+
+
+// 相对路径只能向下: 不以 '/' 开头, 没有空的、"." 或 ".." 的路径段, 也不能进入根目录下的去重块仓库
+int tree_valid_path(const char* path)
+{
+    const char* p = path;
+
+    if(*p == '\0' || strlen(path) >= MAX_PATH_LEN)
+        return 0;
+    while(1)
+    {
+        const char* end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+
+        if(len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.'))
+            return 0;
+        if(p == path && len == strlen(DEDUP_STORE_DIR) && memcmp(p, DEDUP_STORE_DIR, len) == 0)
+            return 0;
+        if(!end)
+            return 1;
+        p = end + 1;
+    }
+}
+
+// 检查客户端请求的文件名: 没有协商 FEATURE_TREE 时只能是根目录下的文件, 不能带路径
+int tree_request_path(const ClientConn* conn, const char* name)
+{
+    return tree_valid_path(name) && ((conn->features & FEATURE_TREE) || strchr(name, '/') == NULL);
+}
+
+// 从根目录 fd 逐段打开 path 中最后一个 '/' 之前的目录, 中间的目录不跟随符号链接, 不会走出根目录
+// 返回的 fd 可能就是 root_fd; name 指向 path 中的文件名部分
+static int tree_walk_parent(int root_fd, char* path, int create, char** name)
+{
+    char* slash;
+    int dir_fd = root_fd;
+
+    *name = path;
+    while((slash = strchr(*name, '/')) != NULL)
+    {
+        *slash = '\0';
+        int next = openat(dir_fd, *name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if(next < 0 && errno == ENOENT && create)
+        {
+            // 并发上传同一目录下的文件时, 另一个连接可能已经创建了它
+            if(mkdirat(dir_fd, *name, 0755) == 0 || errno == EEXIST)
+                next = openat(dir_fd, *name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+
+        int saved = errno;
+        if(dir_fd != root_fd)
+            close(dir_fd);
+        if(next < 0)
+        {
+            errno = saved;
+            return -1;
+        }
+        dir_fd = next;
+        *name = slash + 1;
+    }
+    return dir_fd;
+}
+
+// 以根目录 fd 为起点逐段打开路径, flags 带 O_CREAT 时创建缺少的目录
+int tree_openat(int root_fd, const char* path, int flags, mode_t mode)
+{
+    char buf[MAX_PATH_LEN];
+    char* name;
+
+    if(!tree_valid_path(path))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(buf, path);
+
+    int dir_fd = tree_walk_parent(root_fd, buf, flags & O_CREAT, &name);
+    if(dir_fd < 0)
+        return -1;
+
+    int fd = openat(dir_fd, name, flags | O_CLOEXEC, mode);
+    int saved = errno;
+    if(dir_fd != root_fd)
+        close(dir_fd);
+    errno = saved;
+    return fd;
+}
+
+// 打开 path 所在的目录, 用于在同一目录下建临时文件再 renameat 替换; create 非 0 时创建缺少的目录
+// 返回的 fd 由调用者关闭 (文件在根目录下时是根目录 fd 的副本), base 指向 path 中的文件名部分
+int tree_open_parent(int root_fd, const char* path, int create, const char** base)
+{
+    char buf[MAX_PATH_LEN];
+    char* name;
+
+    if(!tree_valid_path(path))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(buf, path);
+
+    int dir_fd = tree_walk_parent(root_fd, buf, create, &name);
+    *base = path + (name - buf);
+    if(dir_fd == root_fd)
+        return fcntl(root_fd, F_DUPFD_CLOEXEC, 0);
+    return dir_fd;
+}
+
+// 把目录下所有普通文件的路径以 '\0' 分隔写入 out_fd, 不跟随符号链接; 续传日志、增量和去重上传的临时文件
+// 以及去重块仓库不列出
+static int tree_list_dir(int dir_fd, const char* prefix, int depth, int out_fd, uint64_t* size)
+{
+    struct dirent* entry;
+    struct stat st;
+    size_t suffix = strlen(JOURNAL_SUFFIX);
+    size_t delta_suffix = strlen(DELTA_TEMP_SUFFIX);
+    size_t dedup_suffix = strlen(DEDUP_TEMP_SUFFIX);
+    int ret = 0;
+
+    DIR* dir = fdopendir(dir_fd);
+    if(!dir)
+    {
+        close(dir_fd);
+        return -1;
+    }
+
+    while(ret == 0 && (entry = readdir(dir)) != NULL)
+    {
+        char name[MAX_PATH_LEN];
+        size_t len = strlen(entry->d_name);
+
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if(len > suffix && strcmp(entry->d_name + len - suffix, JOURNAL_SUFFIX) == 0)
+            continue;
+        if(len > delta_suffix && strcmp(entry->d_name + len - delta_suffix, DELTA_TEMP_SUFFIX) == 0)
+            continue;
+        if(len > dedup_suffix && strcmp(entry->d_name + len - dedup_suffix, DEDUP_TEMP_SUFFIX) == 0)
+            continue;
+        if(!prefix[0] && strcmp(entry->d_name, DEDUP_STORE_DIR) == 0)
+            continue;
+        int n = prefix[0] ? snprintf(name, sizeof(name), "%s/%s", prefix, entry->d_name)
+                          : snprintf(name, sizeof(name), "%s", entry->d_name);
+        if(n >= (int)sizeof(name) || fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+
+        if(S_ISREG(st.st_mode))
+        {
+            if(write(out_fd, name, n + 1) != n + 1)
+                ret = -1;
+            *size += n + 1;
+        }
+        else if(S_ISDIR(st.st_mode) && depth < TREE_MAX_DEPTH)
+        {
+            int sub = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if(sub >= 0)
+                ret = tree_list_dir(sub, name, depth + 1, out_fd, size);
+        }
+    }
+    closedir(dir);
+    return ret;
+}
+
+// 列出 path 目录下的整棵树, "." 表示根目录; 写入的是相对根目录的路径
+int tree_list(int root_fd, const char* path, int out_fd, uint64_t* size)
+{
+    int root = strcmp(path, ".") == 0;
+    int dir_fd = root ? openat(root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                      : tree_openat(root_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW, 0);
+
+    *size = 0;
+    if(dir_fd < 0)
+        return -1;
+    return tree_list_dir(dir_fd, root ? "" : path, 0, out_fd, size);
+}
+
+// 客户端 get -r: 在当前目录下创建 path 的上级目录
+int tree_make_parents(const char* path)
+{
+    char buf[MAX_PATH_LEN];
+    char* slash = buf;
+
+    if(!tree_valid_path(path))
+        return -1;
+    strcpy(buf, path);
+    while((slash = strchr(slash, '/')) != NULL)
+    {
+        *slash = '\0';
+        if(mkdir(buf, 0755) < 0 && errno != EEXIST)
+        {
+            perror(buf);
+            return -1;
+        }
+        *slash++ = '/';
+    }
+    return 0;
+}
+
+
+// 等待遍历的目录
+typedef struct TreeDir {
+    char path[MAX_PATH_LEN * 2];
+    char name[MAX_PATH_LEN];            // 空串表示服务器根目录
+    int depth;
+    struct TreeDir* next;
+} TreeDir;
+
+// 遍历到的文件放入队列, 队列满时等待发送线程
+static void tree_push_item(TreeWalk* walk, const TreeItem* item)
+{
+    pthread_mutex_lock(&walk->lock);
+    while(walk->count == TREE_QUEUE_SIZE && !walk->stopped)
+        pthread_cond_wait(&walk->changed, &walk->lock);
+    if(!walk->stopped)
+    {
+        walk->items[(walk->head + walk->count) % TREE_QUEUE_SIZE] = *item;
+        walk->count ++;
+        pthread_cond_broadcast(&walk->changed);
+    }
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static void tree_push_dir(TreeWalk* walk, TreeDir* dir)
+{
+    pthread_mutex_lock(&walk->lock);
+    dir->next = walk->dirs;
+    walk->dirs = dir;
+    pthread_cond_broadcast(&walk->changed);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static void tree_skip(TreeWalk* walk, const char* path, const char* reason)
+{
+    printf("Skipping %s: %s\n", path, reason);
+    __atomic_add_fetch(&walk->skipped, 1, __ATOMIC_RELAXED);
+}
+
+// 遍历一个目录: 子目录交给其他线程, 文件放入队列
+static void tree_walk_dir(TreeWalk* walk, const TreeDir* dir)
+{
+    struct dirent* entry;
+    struct stat st;
+    TreeItem item;
+
+    DIR* d = opendir(dir->path);
+    if(!d)
+    {
+        perror(dir->path);
+        return;
+    }
+
+    while((entry = readdir(d)) != NULL && !__atomic_load_n(&walk->stopped, __ATOMIC_RELAXED))
+    {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        int n = snprintf(item.path, sizeof(item.path), "%s/%s", dir->path, entry->d_name);
+        int m = dir->name[0] ? snprintf(item.name, sizeof(item.name), "%s/%s", dir->name, entry->d_name)
+                             : snprintf(item.name, sizeof(item.name), "%s", entry->d_name);
+        if(n >= (int)sizeof(item.path) || m >= (int)sizeof(item.name))
+        {
+            tree_skip(walk, entry->d_name, "path too long");
+            continue;
+        }
+        if(fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            perror(item.path);
+            continue;
+        }
+
+        if(S_ISREG(st.st_mode))
+        {
+            item.size = st.st_size;
+            tree_push_item(walk, &item);
+        }
+        else if(S_ISDIR(st.st_mode))
+        {
+            TreeDir* sub = malloc(sizeof(TreeDir));
+            if(!sub || dir->depth >= TREE_MAX_DEPTH)
+            {
+                free(sub);
+                tree_skip(walk, item.path, "directory too deep");
+                continue;
+            }
+            memcpy(sub->path, item.path, sizeof(sub->path));
+            memcpy(sub->name, item.name, sizeof(sub->name));
+            sub->depth = dir->depth + 1;
+            tree_push_dir(walk, sub);
+        }
+        else
+        {
+            tree_skip(walk, item.path, "not a regular file");
+        }
+    }
+    closedir(d);
+}
+
+// 遍历线程: 取出目录遍历, 没有待遍历的目录且其他线程都空闲时结束
+static void* tree_walk_thread(void* arg)
+{
+    TreeWalk* walk = (TreeWalk*)arg;
+
+    pthread_mutex_lock(&walk->lock);
+    while(1)
+    {
+        while(!walk->dirs && walk->busy > 0 && !walk->stopped)
+            pthread_cond_wait(&walk->changed, &walk->lock);
+        if(!walk->dirs || walk->stopped)
+            break;
+
+        TreeDir* dir = walk->dirs;
+        walk->dirs = dir->next;
+        walk->busy ++;
+        pthread_mutex_unlock(&walk->lock);
+
+        tree_walk_dir(walk, dir);
+        free(dir);
+
+        pthread_mutex_lock(&walk->lock);
+        walk->busy --;
+    }
+    pthread_cond_broadcast(&walk->changed);
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+// 开始遍历 root, 文件在服务器上放在 root 的最后一段目录名下
+int tree_walk_start(TreeWalk* walk, const char* root)
+{
+    struct stat st;
+    char copy[MAX_PATH_LEN * 2];
+
+    memset(walk, 0, sizeof(TreeWalk));
+    if(stat(root, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        printf("Not a directory: %s\n", root);
+        return -1;
+    }
+
+    TreeDir* dir = calloc(1, sizeof(TreeDir));
+    walk->items = malloc(TREE_QUEUE_SIZE * sizeof(TreeItem));
+    if(!dir || !walk->items || strlen(root) >= sizeof(dir->path))
+    {
+        free(dir);
+        free(walk->items);
+        return -1;
+    }
+    strcpy(dir->path, root);
+
+    // "." 和 "/" 这类没有目录名的, 直接放在服务器根目录下
+    strcpy(copy, root);
+    const char* base = basename(copy);
+    if(tree_valid_path(base))
+        snprintf(dir->name, sizeof(dir->name), "%s", base);
+    walk->dirs = dir;
+
+    pthread_mutex_init(&walk->lock, NULL);
+    pthread_cond_init(&walk->changed, NULL);
+    for(int i = 0; i < TREE_WALK_THREADS; i ++)
+    {
+        if(pthread_create(&walk->threads[walk->thread_count], NULL, tree_walk_thread, walk) == 0)
+            walk->thread_count ++;
+    }
+    if(walk->thread_count == 0)
+    {
+        tree_walk_stop(walk);
+        return -1;
+    }
+    return 0;
+}
+
+// 取出下一个文件, 遍历结束且队列为空时返回 0
+int tree_walk_next(TreeWalk* walk, TreeItem* item)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&walk->lock);
+    while(walk->count == 0 && (walk->dirs || walk->busy > 0) && !walk->stopped)
+        pthread_cond_wait(&walk->changed, &walk->lock);
+    if(walk->count > 0)
+    {
+        *item = walk->items[walk->head];
+        walk->head = (walk->head + 1) % TREE_QUEUE_SIZE;
+        walk->count --;
+        pthread_cond_broadcast(&walk->changed);
+        ret = 1;
+    }
+    pthread_mutex_unlock(&walk->lock);
+    return ret;
+}
+
+// 取消遍历, 遍历线程和等待的发送线程尽快返回
+void tree_walk_cancel(TreeWalk* walk)
+{
+    pthread_mutex_lock(&walk->lock);
+    __atomic_store_n(&walk->stopped, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&walk->changed);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+// 遍历完成且所有文件都已取走
+int tree_walk_done(TreeWalk* walk)
+{
+    pthread_mutex_lock(&walk->lock);
+    int done = !walk->stopped && !walk->dirs && walk->busy == 0 && walk->count == 0;
+    pthread_mutex_unlock(&walk->lock);
+    return done;
+}
+
+// 结束遍历并回收线程, 没有取走的文件丢弃
+void tree_walk_stop(TreeWalk* walk)
+{
+    tree_walk_cancel(walk);
+
+    for(int i = 0; i < walk->thread_count; i ++)
+        pthread_join(walk->threads[i], NULL);
+    while(walk->dirs)
+    {
+        TreeDir* next = walk->dirs->next;
+        free(walk->dirs);
+        walk->dirs = next;
+    }
+    free(walk->items);
+    walk->items = NULL;
+    pthread_mutex_destroy(&walk->lock);
+    pthread_cond_destroy(&walk->changed);
+}
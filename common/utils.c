@@ -1,13 +1,29 @@
 // utils.c
+#define _GNU_SOURCE
 #include "discovery.h"
 #include "color.h"
 #include "transfer.h"
+#include "event_loop.h"
+#include "uring_backend.h"
+#include "progress.h"
+#include "upload_session.h"
+#include "journal.h"
+#include "tree.h"
+#include "dedup.h"
+#include "compress.h"
+#include "checksum.h"
+#include "telemetry.h"
+#include "log.h"
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fnmatch.h>
 
 typedef struct sockaddr SA;
 
 int open_clientfd(const char* ip_address, int port)
 {
-    int client_fd;
+    int client_fd, optval = 1;
     struct sockaddr_in server_addr;
 
     if((client_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
@@ -25,10 +41,15 @@ int open_clientfd(const char* ip_address, int port)
         close(client_fd);
         return -1;
     }
+
+    // 连接会被复用做多次请求/应答, 关闭 Nagle, 避免短消息等对端的延迟确认
+    // 块头和数据已经用 MSG_MORE 合并发送
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
     return client_fd;
 }
 
-int open_listenfd(int port)
+// 创建监听 socket; reuseport 非 0 时允许多个 socket 绑定同一端口, 由内核分配新连接
+int open_listenfd(int port, int backlog, int reuseport)
 {
     int listenfd, optval = 1;
     struct sockaddr_in serveraddr;
@@ -41,6 +62,14 @@ int open_listenfd(int port)
     // 设置 socket
     if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const void*)&optval, sizeof(int)) < 0)
     {
+        close(listenfd);
+        return -1;
+    }
+
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, (const void*)&optval, sizeof(int)) < 0)
+    {
+        log_error("setsockopt SO_REUSEPORT: %s", strerror(errno));
+        close(listenfd);
         return -1;
     }
 
@@ -51,33 +80,84 @@ int open_listenfd(int port)
     serveraddr.sin_port = htons((unsigned short)port);
 
     if(bind(listenfd, (SA*)&serveraddr, sizeof(serveraddr)) < 0)
+    {
+        close(listenfd);
         return -1;
+    }
 
     // 将 listening socket 设置为准备接收所有的连接请求
-    if(listen(listenfd, 5) < 0)
+    if(listen(listenfd, backlog > 0 ? backlog : DEFAULT_LISTEN_BACKLOG) < 0)
+    {
+        close(listenfd);
         return -1;
+    }
 
     return listenfd;
 }
 
 
-int send_file_header(int sockfd, uint16_t command, int filesize, int filename_len)
+// 填充文件头并转换为网络字节序, v1 只能表示 32 位文件大小
+void encode_file_header(FileHeader* header, uint16_t version, uint16_t command, uint64_t filesize, uint16_t filename_len)
 {
-    FileHeader header;
-    memset(&header, 0, sizeof(FileHeader));
+    memset(header, 0, sizeof(FileHeader));
 
-    header.magic = MAGIC_NUMBER;
-    header.version = 1;
-    header.command = command;
-    header.filesize = filesize;
-    header.filename_len = filename_len;
+    header->magic = htonl(MAGIC_NUMBER);
+    header->version = htons(version);
+    header->command = htons(command);
+    header->filesize = htonl((uint32_t)filesize);
+    header->filename_len = htons(filename_len);
+    if(version >= PROTOCOL_V2)
+        header->filesize_hi = htonl((uint32_t)(filesize >> 32));
+}
 
-    // 转化为网络字节序
-    header.magic = htonl(header.magic);
-    header.version = htons(header.version);
-    header.command = htons(header.command);
-    header.filesize = htonl(header.filesize);
-    header.filename_len = htons(header.filename_len);
+// 把收到的文件头转换为主机字节序
+void decode_file_header(FileHeader* header)
+{
+    header->magic = ntohl(header->magic);
+    header->version = ntohs(header->version);
+    header->command = ntohs(header->command);
+    header->filesize = ntohl(header->filesize);
+    header->filename_len = ntohs(header->filename_len);
+    header->flags = ntohs(header->flags);
+    header->filesize_hi = ntohl(header->filesize_hi);
+    header->offset = ntohl(header->offset);
+    header->offset_hi = ntohl(header->offset_hi);
+    header->session = ntohl(header->session);
+}
+
+// 已解码文件头中的文件大小, v1 对端的保留字段不一定为 0, 不能读高 32 位
+uint64_t file_header_size(const FileHeader* header)
+{
+    if(header->version < PROTOCOL_V2)
+        return header->filesize;
+    return ((uint64_t)header->filesize_hi << 32) | header->filesize;
+}
+
+// 已解码的范围请求/回复中的起始位置
+uint64_t file_header_offset(const FileHeader* header)
+{
+    if(header->version < PROTOCOL_V2)
+        return 0;
+    return ((uint64_t)header->offset_hi << 32) | header->offset;
+}
+
+// 在已编码的文件头中填入起始位置
+void set_file_header_offset(FileHeader* header, uint64_t offset)
+{
+    header->offset = htonl((uint32_t)offset);
+    header->offset_hi = htonl((uint32_t)(offset >> 32));
+}
+
+int send_file_header(int sockfd, uint16_t version, uint16_t command, uint64_t filesize, uint16_t filename_len)
+{
+    FileHeader header;
+
+    if(version < PROTOCOL_V2 && filesize > UINT32_MAX)
+    {
+        printf("File too large for protocol v1 (%" PRIu64 " bytes)\n", filesize);
+        return -1;
+    }
+    encode_file_header(&header, version, command, filesize, filename_len);
 
     ssize_t sent =  send(sockfd, &header, sizeof(FileHeader), 0);
     return (sent == sizeof(FileHeader)) ? 0 : -1;
@@ -86,19 +166,228 @@ int send_file_header(int sockfd, uint16_t command, int filesize, int filename_le
 // 接收文件头
 int receive_file_header(int sockfd, FileHeader* header)
 {
-    if (recv(sockfd, header, sizeof(FileHeader), 0) != sizeof(FileHeader)) {
+    if (recv(sockfd, header, sizeof(FileHeader), MSG_WAITALL) != sizeof(FileHeader)) {
         return -1;
     }
 
-    header->magic = ntohl(header->magic);
-    header->version = ntohs(header->version);
-    header->command = ntohs(header->command);
-    header->filesize = ntohl(header->filesize);
-    header->filename_len = ntohs(header->filename_len);
+    decode_file_header(header);
+    return 0;
+}
+
+// 认证后协商协议版本, 返回双方都支持的版本, 连接出错返回 -1
+// v1 服务器不认识 HELLO, 回复 NAK 后仍停留在等待文件头的状态, 可以继续按 v1 使用
+int negotiate_protocol(int sockfd, uint16_t* features)
+{
+    FileHeader header;
+    FileHeader response;
+
+    encode_file_header(&header, PROTOCOL_VERSION, CMD_HELLO, 0, 0);
+    header.flags = htons(PROTOCOL_FEATURES);
+    if(send(sockfd, &header, sizeof(FileHeader), 0) != sizeof(FileHeader) ||
+       receive_file_header(sockfd, &response) < 0)
+        return -1;
+
+    // 不认识功能位的 v2 服务器回复 0
+    *features = 0;
+    if(response.command != CMD_HELLO || response.version < PROTOCOL_V2)
+        return PROTOCOL_V1;
+    *features = response.flags & PROTOCOL_FEATURES;
+    return response.version < PROTOCOL_VERSION ? response.version : PROTOCOL_VERSION;
+}
+
+void encode_chunk_header(ChunkHeader* chunk, uint64_t offset, uint32_t length)
+{
+    memset(chunk, 0, sizeof(ChunkHeader));
+    chunk->offset = htobe64(offset);
+    chunk->length = htonl(length);
+}
+
+void decode_chunk_header(ChunkHeader* chunk)
+{
+    chunk->offset = be64toh(chunk->offset);
+    chunk->length = ntohl(chunk->length);
+    chunk->flags = ntohl(chunk->flags);
+}
+
+// 用 sendfile 发送文件中 [offset, offset + size) 的数据, 成功返回 0
+// 单次 sendfile 最多约 2GB, 需要循环
+int send_file_data(int sockfd, int file_fd, uint64_t offset, uint64_t size)
+{
+    off_t pos = offset;
+    uint64_t end = offset + size;
+
+    while((uint64_t)pos < end)
+    {
+        ssize_t sent = sendfile(sockfd, file_fd, &pos, end - pos);
+        telemetry_io(telemetry_thread, sent > 0 ? sent : 0, 1);
+        if(sent < 0 && errno == EINTR)
+            continue;
+        if(sent <= 0)
+        {
+            printf("File transfer incomplete: sent %" PRIu64 "/%" PRIu64 " bytes\n",
+                   (uint64_t)pos - offset, size);
+            return -1;
+        }
+    }
+    return 0;
+}
 
+// v2: 把文件的 [offset, offset + length) 按数据块发送, 不发送结束块
+int send_file_range(int sockfd, int file_fd, uint64_t offset, uint64_t length)
+{
+    ChunkHeader chunk;
+    uint64_t end = offset + length;
+
+    while(offset < end)
+    {
+        uint32_t size = end - offset < CHUNK_SIZE ? (uint32_t)(end - offset) : CHUNK_SIZE;
+
+        // MSG_MORE: 块头和随后的数据合并发送
+        encode_chunk_header(&chunk, offset, size);
+        if(send(sockfd, &chunk, sizeof(chunk), MSG_MORE) != sizeof(chunk))
+            return -1;
+        telemetry_io(telemetry_thread, 0, 1);
+        telemetry_chunk(telemetry_thread);
+        if(send_file_data(sockfd, file_fd, offset, size) < 0)
+            return -1;
+        offset += size;
+    }
     return 0;
 }
 
+// v2: 发送长度为 0 的结束块
+int send_chunk_end(int sockfd)
+{
+    ChunkHeader chunk;
+
+    encode_chunk_header(&chunk, 0, 0);
+    return send(sockfd, &chunk, sizeof(chunk), 0) == sizeof(chunk) ? 0 : -1;
+}
+
+// v2: 把整个文件按数据块发送, 最后发送长度为 0 的结束块
+int send_file_chunks(int sockfd, int file_fd, uint64_t size)
+{
+    if(send_file_range(sockfd, file_fd, 0, size) < 0)
+        return -1;
+    return send_chunk_end(sockfd);
+}
+
+static int send_all(int sockfd, const void* data, size_t len, int flags)
+{
+    const char* p = data;
+
+    while(len > 0)
+    {
+        ssize_t n = send(sockfd, p, len, flags);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// v2: 同 send_file_range, 每个数据块后面跟 CRC32C; 数据读到用户态, 边计算校验边发送
+int send_file_range_crc(int sockfd, int file_fd, uint64_t offset, uint64_t length)
+{
+    char* buffer = malloc(CRC_SEND_BUF);
+    uint64_t end = offset + length;
+    int ret = -1;
+
+    if(!buffer)
+        return -1;
+
+    while(offset < end)
+    {
+        ChunkHeader chunk;
+        uint32_t size = end - offset < CHUNK_SIZE ? (uint32_t)(end - offset) : CHUNK_SIZE;
+        uint32_t crc = 0;
+
+        encode_chunk_header(&chunk, offset, size);
+        chunk.flags = htonl(CHUNK_FLAG_CRC);
+        if(send_all(sockfd, &chunk, sizeof(chunk), MSG_MORE) < 0)
+            goto out;
+        telemetry_chunk(telemetry_thread);
+        for(uint32_t done = 0; done < size; )
+        {
+            size_t want = size - done < CRC_SEND_BUF ? size - done : CRC_SEND_BUF;
+            ssize_t n = pread(file_fd, buffer, want, offset + done);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+            {
+                perror("Failed to read file");
+                goto out;
+            }
+            crc = crc32c(crc, buffer, n);
+            if(send_all(sockfd, buffer, n, MSG_MORE) < 0)
+                goto out;
+            telemetry_io(telemetry_thread, n, 2);
+            done += n;
+        }
+        crc = htonl(crc);
+        if(send_all(sockfd, &crc, sizeof(crc), 0) < 0)
+            goto out;
+        offset += size;
+    }
+    ret = 0;
+
+out:
+    free(buffer);
+    return ret;
+}
+
+// v2: 发完结束块后等待上传的回复
+// 服务器先逐个回复 CRC 不对的块 (CMD_CHUNK_NAK), 再以长度为 0 的 CMD_CHUNK_NAK 结束这一轮,
+// 这时重传这些块并再发一次结束块; 返回 0 时 response 为最终的 ACK/NAK
+int receive_upload_reply(int sockfd, int file_fd, FileHeader* response)
+{
+    struct { uint64_t offset, length; }* retry = NULL;
+    size_t count = 0, cap = 0;
+    int ret = -1;
+
+    while(receive_file_header(sockfd, response) >= 0)
+    {
+        if(response->command != CMD_CHUNK_NAK)
+        {
+            ret = 0;
+            break;
+        }
+
+        uint64_t offset = file_header_offset(response);
+        uint64_t length = file_header_size(response);
+        if(length > 0)
+        {
+            if(count == cap)
+            {
+                void* p = realloc(retry, (cap ? cap * 2 : 8) * sizeof(*retry));
+                if(!p)
+                    break;
+                retry = p;
+                cap = cap ? cap * 2 : 8;
+            }
+            retry[count].offset = offset;
+            retry[count].length = length;
+            count ++;
+            continue;
+        }
+
+        size_t i;
+        for(i = 0; i < count; i ++)
+        {
+            printf("Retransmitting corrupted chunk at offset %" PRIu64 "\n", retry[i].offset);
+            if(send_file_range_crc(sockfd, file_fd, retry[i].offset, retry[i].length) < 0)
+                break;
+        }
+        if(i < count || send_chunk_end(sockfd) < 0)
+            break;
+        count = 0;
+    }
+    free(retry);
+    return ret;
+}
 
 // 发送认证请求
 int send_auth_request(int sockfd, const char* username, const char* password)
@@ -147,151 +436,741 @@ int receive_auth_reponse(int sockfd)
 int send_response(int sockfd, uint16_t command)
 {
     FileHeader response;
-    memset(&response, 0, sizeof(FileHeader));
-
-    response.magic = MAGIC_NUMBER;
-    response.version = 1;
-    response.command = command;
 
     // 必须转换为网络字节序！
-    response.magic = htonl(response.magic);
-    response.version = htons(response.version);
-    response.command = htons(response.command);
-
+    encode_file_header(&response, PROTOCOL_V1, command, 0, 0);
     
     ssize_t sent = send(sockfd, &response, sizeof(FileHeader), 0);
 
     return (sent == sizeof(FileHeader)) ? 0 : -1;
 }
 
-// 处理文件上传, 将 put 上传的文件保存在服务器
-int handle_file_upload(int client_fd, const char* root_path, const char* filename, uint32_t filesize)
+// 从 offset 开始写满 len 字节到文件
+static int write_full(int fd, const char* data, size_t len, off_t offset)
 {
-    char fullpath[MAX_PATH_LEN * 2];
-    struct stat file_stat;
-
-    snprintf(fullpath, sizeof(fullpath), "%s/%s", root_path, filename);
+    while(len > 0)
+    {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
 
-    // 安全验证： 防止路径遍历攻击
-    if(validate_path(root_path, fullpath))
+// 客户端零拷贝接收用的管道, 失败时 pipefd 为 -1, 只走缓冲区
+static void open_receive_pipe(int pipefd[2], size_t* pipe_size)
+{
+    if(pipe2(pipefd, O_CLOEXEC) < 0)
     {
-        printf("Security violation: Invalid file path\n");
-        return -1;
+        pipefd[0] = pipefd[1] = -1;
+        return;
     }
+    fcntl(pipefd[1], F_SETPIPE_SZ, EVENT_LOOP_PIPE_SIZE);
+    int n = fcntl(pipefd[1], F_GETPIPE_SZ);
+    *pipe_size = n > 0 ? (size_t)n : 65536;
+}
 
-    // 打开文件
-    FILE* file = fopen(fullpath, "wb");
-    if(!file)
+static void close_receive_pipe(int pipefd[2])
+{
+    if(pipefd[0] >= 0)
     {
-        perror("Failed to open file for writing");
-        return -1;
+        close(pipefd[0]);
+        close(pipefd[1]);
     }
+    pipefd[0] = pipefd[1] = -1;
+}
 
+// 接收 size 字节写到文件的 offset 处, 优先 socket -> 管道 -> 文件零拷贝, 不支持时回退到 recv+pwrite
+static int receive_into_file(int sockfd, int file_fd, uint64_t offset, uint64_t size,
+                             int pipefd[2], size_t pipe_size, TransferProgress* progress)
+{
     char buffer[65536];
-    uint32_t total_received = 0;
-    ssize_t bytes_received;
+    loff_t pos = offset;
+    uint64_t end = offset + size;
 
-    printf("saving to: %s\n", fullpath);
-
-    while(total_received < filesize)
+    while(pipefd[0] >= 0 && (uint64_t)pos < end)
     {
-        size_t to_receive = sizeof(buffer);
-        if(filesize - total_received < to_receive)
+        size_t to_receive = end - pos < pipe_size ? end - pos : pipe_size;
+        uint64_t start = telemetry_now();
+        ssize_t n = splice(sockfd, NULL, pipefd[1], NULL, to_receive, SPLICE_F_MOVE);
+        // 阻塞读 socket 的时间即等待网络的时间
+        telemetry_stall(telemetry_thread, telemetry_now() - start);
+        telemetry_io(telemetry_thread, n > 0 ? n : 0, 1);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EINVAL || errno == ENOSYS))
+            break;          // socket 不支持 splice, 改用缓冲区
+        if(n <= 0)
         {
-            to_receive = filesize - total_received;
+            printf("Connection error during file transfer\n");
+            return -1;
         }
 
-        bytes_received = recv(client_fd, buffer, to_receive, 0);
+        // 排空管道; 文件不支持 splice 时读出来写
+        size_t left = n;
+        while(left > 0)
+        {
+            ssize_t m = splice(pipefd[0], NULL, file_fd, &pos, left, SPLICE_F_MOVE);
+            telemetry_io(telemetry_thread, 0, 1);
+            if(m < 0 && errno == EINTR)
+                continue;
+            if(m < 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            {
+                m = read(pipefd[0], buffer, left < sizeof(buffer) ? left : sizeof(buffer));
+                if(m > 0 && write_full(file_fd, buffer, m, pos) < 0)
+                    m = -1;
+                if(m > 0)
+                    pos += m;
+                telemetry_io(telemetry_thread, 0, 2);
+            }
+            if(m <= 0)
+            {
+                perror("Failed to write file");
+                return -1;
+            }
+            left -= m;
+        }
+        progress_add(progress, n);
+    }
 
-        if(bytes_received <= 0)
+    while((uint64_t)pos < end)
+    {
+        size_t to_receive = end - pos < sizeof(buffer) ? end - pos : sizeof(buffer);
+        uint64_t start = telemetry_now();
+        ssize_t n = recv(sockfd, buffer, to_receive, 0);
+        telemetry_stall(telemetry_thread, telemetry_now() - start);
+        telemetry_io(telemetry_thread, n > 0 ? n : 0, 2);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
         {
             printf("Connection error during file transfer\n");
-            fclose(file);
             return -1;
         }
-        fwrite(buffer, 1, bytes_received, file);
-        total_received += bytes_received;
+        if(write_full(file_fd, buffer, n, pos) < 0)
+        {
+            perror("Failed to write file");
+            return -1;
+        }
+        pos += n;
+        progress_add(progress, n);
+    }
+    return 0;
+}
+
+// v1: 接收 size 字节写到文件的 offset 处, 成功返回 0, 连接或写文件出错返回 -1
+int receive_file_data(int sockfd, int file_fd, uint64_t offset, uint64_t size, TransferProgress* progress)
+{
+    int pipefd[2] = { -1, -1 };
+    size_t pipe_size = 0;
+
+    if(size > 0)
+        open_receive_pipe(pipefd, &pipe_size);
+    int ret = receive_into_file(sockfd, file_fd, offset, size, pipefd, pipe_size, progress);
+    close_receive_pipe(pipefd);
+    return ret;
+}
+
+// v2: 接收数据块直到结束块, 每块写到块头给出的位置
+// 数据块必须落在 [offset, offset + length) 内且总量等于 length
+int receive_file_chunks(int sockfd, int file_fd, uint64_t offset, uint64_t length, TransferProgress* progress,
+                        TransferJournal* journal)
+{
+    int pipefd[2] = { -1, -1 };
+    size_t pipe_size = 0;
+    uint64_t received = 0;
+    ChunkHeader chunk;
+    uint8_t* packed = NULL;         // 压缩数据块的负载和解压结果, 第一次收到时分配
+    int ret = -1;
+
+    open_receive_pipe(pipefd, &pipe_size);
+    while(1)
+    {
+        uint64_t start = telemetry_now();
+        ssize_t got = recv(sockfd, &chunk, sizeof(chunk), MSG_WAITALL);
+        telemetry_stall(telemetry_thread, telemetry_now() - start);
+        telemetry_io(telemetry_thread, 0, 1);
+        if(got != sizeof(chunk))
+        {
+            printf("Connection error during file transfer\n");
+            break;
+        }
+        decode_chunk_header(&chunk);
+
+        if(chunk.length == 0)
+        {
+            ret = received == length ? 0 : -1;
+            if(ret < 0)
+                printf("File transfer incomplete: received %" PRIu64 "/%" PRIu64 " bytes\n", received, length);
+            break;
+        }
+        if(chunk.offset < offset || chunk.offset - offset > length ||
+           chunk.length > length - (chunk.offset - offset))
+        {
+            printf("Invalid chunk: offset %" PRIu64 " length %u\n", chunk.offset, chunk.length);
+            break;
+        }
 
-        if(filesize > 0) {
-            float progress = (float)total_received / filesize * 100;
-            printf("\rProgress: %.1f%% (%u / %u bytes)", progress, total_received, filesize);
-            fflush(stdout);
+        if(chunk.flags & CHUNK_FLAG_LZ)
+        {
+            // 压缩的数据块: 收齐负载后解压, 原始数据也必须落在范围内
+            if(chunk.length > COMPRESS_PAYLOAD_MAX ||
+               (!packed && !(packed = malloc(COMPRESS_PAYLOAD_MAX + COMPRESS_BLOCK))))
+            {
+                printf("Invalid chunk: offset %" PRIu64 " length %u\n", chunk.offset, chunk.length);
+                break;
+            }
+            uint8_t* raw = packed + COMPRESS_PAYLOAD_MAX;
+            uint64_t start = telemetry_now();
+            ssize_t got = recv(sockfd, packed, chunk.length, MSG_WAITALL);
+            telemetry_stall(telemetry_thread, telemetry_now() - start);
+            telemetry_io(telemetry_thread, got > 0 ? got : 0, 2);
+            if(got != chunk.length)
+            {
+                printf("Connection error during file transfer\n");
+                break;
+            }
+            int64_t n = decompress_chunk(packed, chunk.length, raw);
+            if(n < 0 || (uint64_t)n > length - (chunk.offset - offset))
+            {
+                printf("Invalid compressed chunk at offset %" PRIu64 "\n", chunk.offset);
+                break;
+            }
+            if(write_full(file_fd, (const char*)raw, n, chunk.offset) < 0)
+            {
+                perror("Failed to write file");
+                break;
+            }
+            progress_add(progress, n);
+            chunk.length = n;
         }
-    } 
-    printf("\n");
-    fclose(file);
+        else if(receive_into_file(sockfd, file_fd, chunk.offset, chunk.length, pipefd, pipe_size, progress) < 0)
+            break;
+        telemetry_chunk(telemetry_thread);
+        received += chunk.length;
+        if(journal)
+            journal_add(journal, chunk.offset, chunk.offset + chunk.length);
+    }
+    close_receive_pipe(pipefd);
+    free(packed);
+    return ret;
+}
+
+// 打开 put 上传的目标文件, 失败返回 -1
+// 续传请求: 按日志保留已收到的数据, 回复 CMD_RESUME 告诉客户端从哪里继续
+int open_upload_file(ClientConn* conn, const char* root_path)
+{
+    char fullpath[MAX_PATH_LEN * 2];
+    int resume = conn->proto >= PROTOCOL_V2 && (conn->features & FEATURE_RESUME) &&
+                 (conn->header.flags & FILE_FLAG_RESUME);
+
+    snprintf(fullpath, sizeof(fullpath), "%s/%s", root_path, conn->filename);
+
+    // 安全验证： 防止路径遍历攻击
+    if(!tree_request_path(conn, conn->filename))
+    {
+        log_warn("Security violation: Invalid file path");
+        return -1;
+    }
+
+    // 以缓存的根目录 fd 为起点打开, 相对路径中缺少的目录一并创建
+    conn->file_fd = tree_openat(conn->loop->config->root_fd, conn->filename, O_WRONLY | O_CREAT | (resume ? 0 : O_TRUNC),
+                                0644);
+    if(conn->file_fd < 0)
+    {
+        log_error("Failed to open file for writing: %s", strerror(errno));
+        return -1;
+    }
+
+    log_info("saving to: %s", fullpath);
+    if(!resume)
+        return 0;
+
+    conn->journal = malloc(sizeof(TransferJournal));
+    if(!conn->journal)
+        return -1;
+
+    // 日志不匹配时从头接收, 已有的内容作废
+    uint64_t offset = journal_open(conn->journal, fullpath, conn->file_fd, conn->file_total, conn->header.session);
+    if(offset == 0 && ftruncate(conn->file_fd, 0) < 0)
+    {
+        log_error("ftruncate: %s", strerror(errno));
+        free(conn->journal);
+        conn->journal = NULL;
+        return -1;
+    }
+    if(offset > 0)
+        log_info("Resuming upload of %s at %" PRIu64 "/%" PRIu64 " bytes", conn->filename, offset, conn->file_total);
+
+    // 前面的数据视为已收到, 结束时的总量检查不变
+    conn->file_received = offset;
+
+    FileHeader header;
+    encode_file_header(&header, conn->proto, CMD_RESUME, conn->file_total, 0);
+    set_file_header_offset(&header, offset);
+    conn_queue(conn, &header, sizeof(FileHeader));
     return 0;
 }
 
-int handle_file_download(int client_fd, const char* root_path, const char* filename)
+// 上传结束: 成功时删除续传日志, 否则保存已收到的范围, 下次从断点继续
+void close_upload_journal(ClientConn* conn, int complete)
+{
+    if(!conn->journal)
+        return;
+    if(complete)
+        journal_remove(conn->journal);
+    else if(conn->file_fd >= 0)
+        journal_save(conn->journal);
+    free(conn->journal);
+    conn->journal = NULL;
+}
+
+// 并行上传的一个连接: 加入同一文件的上传会话, 会话负责创建和预分配文件
+int open_upload_range(ClientConn* conn)
+{
+    if(!tree_request_path(conn, conn->filename))
+    {
+        log_warn("Security violation: Invalid file path");
+        return -1;
+    }
+
+    conn->session = upload_session_join(conn->loop->config->root_fd, conn->filename, conn->header.session,
+                                        conn->file_total);
+    if(!conn->session)
+        return -1;
+    conn->session_committed = 0;
+
+    // 每个连接持有自己的 fd, 关闭路径和普通上传一致
+    conn->file_fd = fcntl(conn->session->fd, F_DUPFD_CLOEXEC, 0);
+    if(conn->file_fd < 0)
+    {
+        log_error("fcntl F_DUPFD_CLOEXEC: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// 打开 get 请求的文件, 并把回复的文件头和文件名放入输出缓冲
+int open_download_file(ClientConn* conn, const char* root_path)
 {
     char fullpath[MAX_PATH_LEN * 2];
     struct stat file_stat;
+    FileHeader header;
+    size_t name_len = strlen(conn->filename);
 
-    snprintf(fullpath, sizeof(fullpath), "%s/%s", root_path, filename);
+    snprintf(fullpath, sizeof(fullpath), "%s/%s", root_path, conn->filename);
 
     //  安全验证
-    if(validate_path(root_path, fullpath))
+    if(!tree_request_path(conn, conn->filename))
     {
-        printf("Security violation: Invaild file path\n");
+        log_warn("Security violation: Invaild file path");
         return -1;
     }
 
-    // 检查文件存在
-    if(stat(fullpath, &file_stat) != 0)
+    conn->file_fd = tree_openat(conn->loop->config->root_fd, conn->filename, O_RDONLY, 0);
+    if(conn->file_fd < 0)
     {
-        printf("File not found: %s\n", fullpath);
+        log_warn("File not found: %s", fullpath);
         return -1;
     }
 
     // 检查文件格式是否正确
-    if(!S_ISREG(file_stat.st_mode))
+    if(fstat(conn->file_fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode))
     {
-        printf("Not a regular file :%s\n", fullpath);
+        log_warn("Not a regular file :%s", fullpath);
+        close(conn->file_fd);
+        conn->file_fd = -1;
         return -1;
     }
 
+    // 去重模式下上传的文件存为清单, 发送时从块仓库逐块读取
+    if(conn->loop->config->store_fd >= 0)
+    {
+        conn->file_fd = dedup_open_read(conn->loop->config->store_fd, conn->file_fd, &file_stat, &conn->manifest);
+        if(conn->file_fd < 0)
+            return -1;
+    }
 
-    if(send_file_header(client_fd, CMD_GET_FILE, file_stat.st_size, strlen(filename)) < 0)
+    // v1 客户端只能接收 32 位大小的文件
+    if(conn->proto < PROTOCOL_V2 && (uint64_t)file_stat.st_size > UINT32_MAX)
     {
-        printf("Failed to send file header \n");
+        log_warn("File too large for protocol v1: %s", fullpath);
+        close(conn->file_fd);
+        conn->file_fd = -1;
+        close_download_dedup(conn);
         return -1;
     }
 
-    send(client_fd, filename, strlen(filename), 0);
+    // 范围请求只发送 [offset, offset + length), 超出文件末尾的部分截掉
+    uint64_t size = file_stat.st_size;
+    uint64_t offset = 0, end = size;
+    uint32_t stamp = file_stamp(&file_stat);
+    if(conn->header.command == CMD_GET_FILE && (conn->header.flags & FILE_FLAG_RESUME) &&
+       conn->proto >= PROTOCOL_V2 && (conn->features & FEATURE_RESUME))
+    {
+        // 续传: 客户端记录的文件没变才从它给的位置继续, 否则从头发送
+        uint64_t resume = file_header_offset(&conn->header);
+        if(conn->header.session == stamp && file_header_size(&conn->header) == size && resume <= size)
+            offset = resume;
+    }
+    else if(conn->header.command == CMD_GET_RANGE)
+    {
+        offset = file_header_offset(&conn->header);
+        if(offset > size)
+        {
+            log_warn("Range offset %" PRIu64 " beyond end of file: %s", offset, fullpath);
+            close(conn->file_fd);
+            conn->file_fd = -1;
+            close_download_dedup(conn);
+            return -1;
+        }
+        uint64_t length = file_header_size(&conn->header);
+        end = length < size - offset ? offset + length : size;
+    }
+
+    // v2 的数据段在发送每个数据块时设置
+    conn->file_total = end;
+    conn->file_offset = offset;
+    conn->file_size = conn->proto < PROTOCOL_V2 ? conn->file_total : 0;
+    conn->file_done = 0;
 
-    // 传输数据
-    int file_fd = open(fullpath, O_RDONLY);
-    off_t offset = 0;
+    // 压缩下载: 按小块读出压缩后发送; 分配失败时照常发送, 客户端两种数据块都能接收
+    if(conn->proto >= PROTOCOL_V2 && (conn->header.flags & FILE_FLAG_COMPRESS) && (conn->features & FEATURE_COMPRESS))
+        open_compress(conn);
 
-    printf("Sending file: %s (Size  %ld bytes)\n", filename, (long)file_stat.st_size);
-    
-    ssize_t sent = sendfile(client_fd, file_fd, &offset, file_stat.st_size);
+    // 回复中的 filesize 总是整个文件的大小, 客户端据此预分配和切分范围
+    encode_file_header(&header, conn->proto, conn->header.command, size, name_len);
+    set_file_header_offset(&header, offset);
+    if(conn->proto >= PROTOCOL_V2)
+        header.session = htonl(stamp);
+    conn_queue(conn, &header, sizeof(FileHeader));
+    conn_queue(conn, conn->filename, name_len);
+
+    if(conn->header.command == CMD_GET_RANGE || offset > 0)
+        log_info("Sending range of %s: %" PRIu64 "-%" PRIu64 " (Size %" PRIu64 " bytes)",
+                 conn->filename, offset, end, size);
+    else
+        log_info("Sending file: %s (Size  %ld bytes)", conn->filename, (long)file_stat.st_size);
+    return 0;
+}
 
-    if(sent != file_stat.st_size)
+// 列出 conn->filename 目录下所有普通文件的相对路径, 以 '\0' 分隔写入内存文件后按下载发送
+static int open_tree_list(ClientConn* conn)
+{
+    FileHeader header;
+    uint64_t size = 0;
+
+    conn->file_fd = memfd_create("lftp-list", MFD_CLOEXEC);
+    if(conn->file_fd < 0)
+    {
+        log_error("memfd_create: %s", strerror(errno));
+        return -1;
+    }
+    if(tree_list(conn->loop->config->root_fd, conn->filename, conn->file_fd, &size) < 0)
     {
-        printf("File transfer incomplete: sent %ld/%ld bytes\n", sent, (long)file_stat.st_size);
-        close(file_fd);
-        close(client_fd); 
+        log_warn("Failed to list directory: %s", conn->filename);
+        close(conn->file_fd);
+        conn->file_fd = -1;
         return -1;
     }
 
-    // 等待客户端发送的确认消息， todo:如果是 NAK 就重试N次
-    FileHeader response;
-    int ret = receive_file_header(client_fd, &response);
-    close(file_fd);
+    conn->file_total = size;
+    conn->file_offset = 0;
+    conn->file_size = 0;
+    conn->file_done = 0;
+
+    encode_file_header(&header, conn->proto, CMD_LIST, size, 0);
+    conn_queue(conn, &header, sizeof(FileHeader));
+    log_info("Listing tree %s (%" PRIu64 " bytes)", conn->filename, size);
+    return 0;
+}
+
+// 列出根目录下匹配 conn->filename 的普通文件, 名字以 '\0' 分隔写入内存文件后按下载发送
+// 隐藏文件只在通配符以 '.' 开头时匹配, 续传日志不列出
+int open_list_file(ClientConn* conn, const char* root_path)
+{
+    FileHeader header;
+    struct dirent* entry;
+    struct stat st;
+    uint64_t size = 0;
+
+    // get -r: 列出目录下整棵树的文件
+    if((conn->header.flags & FILE_FLAG_RECURSIVE) && (conn->features & FEATURE_TREE))
+        return open_tree_list(conn);
 
-    if(ret >= 0 && response.command == CMD_ACK)
+    DIR* dir = opendir(root_path);
+    if(!dir)
     {
-        return 0;
+        log_error("opendir: %s", strerror(errno));
+        return -1;
     }
-    return -1;
-}
 
+    conn->file_fd = memfd_create("lftp-list", MFD_CLOEXEC);
+    if(conn->file_fd < 0)
+    {
+        log_error("memfd_create: %s", strerror(errno));
+        closedir(dir);
+        return -1;
+    }
+
+    while((entry = readdir(dir)) != NULL)
+    {
+        size_t len = strlen(entry->d_name);
+        size_t suffix = strlen(JOURNAL_SUFFIX);
+
+        if(len >= MAX_FILENAME_LEN || fnmatch(conn->filename, entry->d_name, FNM_PERIOD) != 0)
+            continue;
+        if(len > suffix && strcmp(entry->d_name + len - suffix, JOURNAL_SUFFIX) == 0)
+            continue;
+        if(fstatat(dirfd(dir), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        if(write(conn->file_fd, entry->d_name, len + 1) != (ssize_t)(len + 1))
+        {
+            log_error("Failed to build file list: %s", strerror(errno));
+            closedir(dir);
+            close(conn->file_fd);
+            conn->file_fd = -1;
+            return -1;
+        }
+        size += len + 1;
+    }
+    closedir(dir);
+
+    conn->file_total = size;
+    conn->file_offset = 0;
+    conn->file_size = 0;
+    conn->file_done = 0;
 
-// 验证路径安全性(防止目录遍历攻击)
-int validate_path(const char* root_path, const char* requested_path)
+    encode_file_header(&header, conn->proto, CMD_LIST, size, 0);
+    conn_queue(conn, &header, sizeof(FileHeader));
+    log_info("Listing %s (%" PRIu64 " bytes)", conn->filename, size);
+    return 0;
+}
+
+// 把管道里的 len 字节写入文件; 文件不支持 splice 或写失败时读出来中转或丢弃
+// 数据写到文件的 pos 处; 返回 -1 表示管道异常, 此时管道已关闭, 之后的上传都走缓冲区
+static int splice_drain(ClientConn* conn, loff_t pos, size_t len, char* buffer, size_t buflen)
 {
-    // todo
+    EventLoop* loop = conn->loop;
+
+    while(len > 0)
+    {
+        if(!conn->no_splice && !conn->file_failed)
+        {
+            ssize_t n = splice(loop->splice_pipe[0], NULL, conn->file_fd, &pos, len, SPLICE_F_MOVE);
+            telemetry_io(conn->stats, 0, 1);
+            if(n > 0)
+            {
+                len -= n;
+                continue;
+            }
+            if(n < 0 && errno == EINTR)
+                continue;
+
+            if(n < 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            {
+                log_warn("splice not supported for %s, using buffered writes", conn->filename);
+                conn->no_splice = 1;
+            }
+            else
+            {
+                log_error("Failed to write file: %s", strerror(errno));
+                conn->file_failed = 1;
+            }
+        }
+
+        // 管道里的数据必须取走, 否则会混入下一次上传
+        ssize_t n = read(loop->splice_pipe[0], buffer, len < buflen ? len : buflen);
+        telemetry_io(conn->stats, 0, conn->file_failed ? 1 : 2);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+        {
+            log_error("splice pipe: %s", strerror(errno));
+            event_loop_close_pipe(loop);
+            return -1;
+        }
+        if(!conn->file_failed && write_full(conn->file_fd, buffer, n, pos) < 0)
+        {
+            log_error("Failed to write file: %s", strerror(errno));
+            conn->file_failed = 1;
+        }
+        pos += n;
+        len -= n;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+// 零拷贝接收: socket -> 管道 -> 文件, 数据不经过用户态
+// 无法 splice 时设置 no_splice 并返回 CONN_STEP_DONE, 剩余数据由调用者用缓冲区接收
+static int splice_file_upload(ClientConn* conn, char* buffer, size_t buflen, size_t* budget)
+{
+    EventLoop* loop = conn->loop;
+
+    while(conn->file_done < conn->file_size && !conn->no_splice && !conn->file_failed)
+    {
+        if(*budget == 0)
+            return CONN_STEP_YIELD;
+
+        size_t to_receive = loop->splice_pipe_size;
+        if(conn->file_size - conn->file_done < to_receive)
+            to_receive = conn->file_size - conn->file_done;
+        if(*budget < to_receive)
+            to_receive = *budget;
+
+        // 管道每次都排空, EAGAIN 只可能是 socket 暂时没有数据
+        ssize_t n = splice(conn->fd, NULL, loop->splice_pipe[1], NULL, to_receive,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        telemetry_io(conn->stats, n > 0 ? n : 0, 1);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_STEP_BLOCKED;
+            if(errno == EINVAL || errno == ENOSYS)
+            {
+                conn->no_splice = 1;
+                break;
+            }
+        }
+        if(n <= 0)
+        {
+            log_warn("Connection error during file transfer");
+            return CONN_STEP_CLOSE;
+        }
+
+        if(splice_drain(conn, conn->file_offset + conn->file_done, n, buffer, buflen) < 0)
+            return CONN_STEP_CLOSE;
+        conn->file_done += n;
+        *budget = (size_t)n < *budget ? *budget - n : 0;
+    }
+    return CONN_STEP_DONE;
+}
+
+// 处理文件上传, 将 put 上传的数据写入文件
+// 返回 CONN_STEP_DONE 表示接收完成, BLOCKED/YIELD 表示稍后继续, CLOSE 表示连接出错
+int handle_file_upload(ClientConn* conn, char* buffer, size_t buflen)
+{
+    size_t budget = EVENT_LOOP_CONN_BUDGET;
+    int crc = conn->chunk_flags & CHUNK_FLAG_CRC;
+
+    // io_uring 后端: 传输开始前决定, 中途不切换
+    // 带 CRC 的数据块要经过用户态计算校验, 只走缓冲区中转
+    if(conn->loop->uring && conn->file_size > 0 && !conn->file_failed && !crc &&
+       (conn->io_slot || conn->file_done == 0))
+    {
+        int ret = uring_file_upload(conn);
+        if(ret != URING_STEP_FALLBACK)
+            return ret;
+    }
+
+    if(conn->loop->splice_pipe[0] >= 0 && !crc)
+    {
+        int ret = splice_file_upload(conn, buffer, buflen, &budget);
+        if(ret != CONN_STEP_DONE)
+            return ret;
+    }
+
+    // 缓冲区中转: 不支持 splice, 或写文件失败后丢弃剩余数据
+    while(conn->file_done < conn->file_size)
+    {
+        if(budget == 0)
+            return CONN_STEP_YIELD;
+
+        size_t to_receive = buflen;
+        if(conn->file_size - conn->file_done < to_receive)
+        {
+            to_receive = conn->file_size - conn->file_done;
+        }
+
+        ssize_t bytes_received = recv(conn->fd, buffer, to_receive, 0);
+        telemetry_io(conn->stats, bytes_received > 0 ? bytes_received : 0, conn->file_failed ? 1 : 2);
+        if(bytes_received < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_STEP_BLOCKED;
+        }
+        if(bytes_received <= 0)
+        {
+            log_warn("Connection error during file transfer");
+            return CONN_STEP_CLOSE;
+        }
+
+        if(crc)
+            conn->chunk_crc = crc32c(conn->chunk_crc, buffer, bytes_received);
+        // 写入失败后丢弃剩余数据, 结束时回复 NAK
+        if(!conn->file_failed &&
+           write_full(conn->file_fd, buffer, bytes_received, conn->file_offset + conn->file_done) < 0)
+        {
+            log_error("Failed to write file: %s", strerror(errno));
+            conn->file_failed = 1;
+        }
+        conn->file_done += bytes_received;
+        budget = (size_t)bytes_received < budget ? budget - bytes_received : 0;
+    }
+    return CONN_STEP_DONE;
+}
+
+// 用 sendfile 发送文件数据, 返回值同 handle_file_upload; 去重清单逐块发送, 不走 io_uring
+int handle_file_download(ClientConn* conn)
+{
+    size_t budget = EVENT_LOOP_CONN_BUDGET;
+
+    if(conn->loop->uring && !conn->manifest && conn->file_size > 0 && (conn->io_slot || conn->file_done == 0))
+    {
+        int ret = uring_file_download(conn);
+        if(ret != URING_STEP_FALLBACK)
+            return ret;
+    }
+
+    while(conn->file_done < conn->file_size)
+    {
+        if(budget == 0)
+            return CONN_STEP_YIELD;
+
+        off_t offset = conn->file_offset + conn->file_done;
+        size_t to_send = budget;
+        if(conn->file_size - conn->file_done < to_send)
+            to_send = conn->file_size - conn->file_done;
+
+        // 去重清单: 直接从仓库里的块文件发送, 每次最多发到块末尾
+        int file_fd = conn->file_fd;
+        if(conn->manifest)
+        {
+            size_t avail;
+            file_fd = dedup_read_chunk(conn->manifest, offset, &offset, &avail);
+            if(file_fd < 0)
+                return CONN_STEP_CLOSE;
+            if(avail < to_send)
+                to_send = avail;
+        }
+
+        ssize_t sent = sendfile(conn->fd, file_fd, &offset, to_send);
+        telemetry_io(conn->stats, sent > 0 ? sent : 0, 1);
+        if(sent < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_STEP_BLOCKED;
+            return CONN_STEP_CLOSE;
+        }
+        if(sent == 0)
+            return CONN_STEP_CLOSE;     // 文件在发送过程中被截断
+
+        conn->file_done += sent;
+        budget -= sent;
+    }
+    return CONN_STEP_DONE;
+}
@@ -0,0 +1,346 @@
+// checksum.c - 传输用的校验: MD5, SHA-256, CRC32C 和滚动校验和
+#include "checksum.h"
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static inline uint32_t rotl32(uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+static void md5_block(Md5Context* ctx, const uint8_t* block)
+{
+    uint32_t m[16];
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+
+    // MD5 按小端解释输入
+    for(int i = 0; i < 16; i ++)
+        m[i] = block[i * 4] | (block[i * 4 + 1] << 8) | (block[i * 4 + 2] << 16) | ((uint32_t)block[i * 4 + 3] << 24);
+
+    for(int i = 0; i < 64; i ++)
+    {
+        uint32_t f;
+        int g;
+
+        if(i < 16)
+        {
+            f = (b & c) | (~b & d);
+            g = i;
+        }
+        else if(i < 32)
+        {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) & 15;
+        }
+        else if(i < 48)
+        {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        }
+        else
+        {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
+
+        uint32_t t = d;
+        d = c;
+        c = b;
+        b = b + rotl32(a + f + md5_k[i] + m[g], md5_r[i]);
+        a = t;
+    }
+
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+}
+
+void md5_init(Md5Context* ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->count = 0;
+}
+
+void md5_update(Md5Context* ctx, const void* data, size_t len)
+{
+    const uint8_t* p = data;
+    size_t used = ctx->count & 63;
+
+    ctx->count += len;
+    if(used)
+    {
+        size_t fill = 64 - used;
+        if(len < fill)
+        {
+            memcpy(ctx->buffer + used, p, len);
+            return;
+        }
+        memcpy(ctx->buffer + used, p, fill);
+        md5_block(ctx, ctx->buffer);
+        p += fill;
+        len -= fill;
+    }
+    for(; len >= 64; p += 64, len -= 64)
+        md5_block(ctx, p);
+    memcpy(ctx->buffer, p, len);
+}
+
+void md5_final(Md5Context* ctx, uint8_t digest[MD5_DIGEST_LEN])
+{
+    static const uint8_t padding[64] = { 0x80 };
+    uint8_t bits[8];
+    uint64_t count = ctx->count * 8;
+    size_t used = ctx->count & 63;
+
+    for(int i = 0; i < 8; i ++)
+        bits[i] = (uint8_t)(count >> (i * 8));
+    md5_update(ctx, padding, used < 56 ? 56 - used : 120 - used);
+    md5_update(ctx, bits, 8);
+
+    for(int i = 0; i < 4; i ++)
+    {
+        digest[i * 4] = (uint8_t)ctx->state[i];
+        digest[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 8);
+        digest[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 16);
+        digest[i * 4 + 3] = (uint8_t)(ctx->state[i] >> 24);
+    }
+}
+
+void md5(const void* data, size_t len, uint8_t digest[MD5_DIGEST_LEN])
+{
+    Md5Context ctx;
+
+    md5_init(&ctx);
+    md5_update(&ctx, data, len);
+    md5_final(&ctx, digest);
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotr32(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_block(Sha256Context* ctx, const uint8_t* block)
+{
+    uint32_t w[64];
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+
+    // SHA-256 按大端解释输入
+    for(int i = 0; i < 16; i ++)
+        w[i] = ((uint32_t)block[i * 4] << 24) | (block[i * 4 + 1] << 16) | (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    for(int i = 16; i < 64; i ++)
+    {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    for(int i = 0; i < 64; i ++)
+    {
+        uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+        uint32_t t1 = h + s1 + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+        uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+    ctx->state[4] += e;
+    ctx->state[5] += f;
+    ctx->state[6] += g;
+    ctx->state[7] += h;
+}
+
+void sha256_init(Sha256Context* ctx)
+{
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->count = 0;
+}
+
+void sha256_update(Sha256Context* ctx, const void* data, size_t len)
+{
+    const uint8_t* p = data;
+    size_t used = ctx->count & 63;
+
+    ctx->count += len;
+    if(used)
+    {
+        size_t fill = 64 - used;
+        if(len < fill)
+        {
+            memcpy(ctx->buffer + used, p, len);
+            return;
+        }
+        memcpy(ctx->buffer + used, p, fill);
+        sha256_block(ctx, ctx->buffer);
+        p += fill;
+        len -= fill;
+    }
+    for(; len >= 64; p += 64, len -= 64)
+        sha256_block(ctx, p);
+    memcpy(ctx->buffer, p, len);
+}
+
+void sha256_final(Sha256Context* ctx, uint8_t digest[SHA256_DIGEST_LEN])
+{
+    static const uint8_t padding[64] = { 0x80 };
+    uint8_t bits[8];
+    uint64_t count = ctx->count * 8;
+    size_t used = ctx->count & 63;
+
+    for(int i = 0; i < 8; i ++)
+        bits[i] = (uint8_t)(count >> (56 - i * 8));
+    sha256_update(ctx, padding, used < 56 ? 56 - used : 120 - used);
+    sha256_update(ctx, bits, 8);
+
+    for(int i = 0; i < 8; i ++)
+    {
+        digest[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)ctx->state[i];
+    }
+}
+
+void sha256(const void* data, size_t len, uint8_t digest[SHA256_DIGEST_LEN])
+{
+    Sha256Context ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+}
+
+#define CRC32C_POLY     0x82f63b78      // 反射后的 Castagnoli 多项式
+
+static uint32_t crc32c_table[8][256];
+static int crc32c_hw;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void)
+{
+    for(uint32_t i = 0; i < 256; i ++)
+    {
+        uint32_t crc = i;
+        for(int j = 0; j < 8; j ++)
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        crc32c_table[0][i] = crc;
+    }
+    // table[k][i]: 字节 i 后面再跟 k 个 0 字节的 CRC, 一次查 8 个表处理 8 字节
+    for(uint32_t i = 0; i < 256; i ++)
+        for(int k = 1; k < 8; k ++)
+            crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[k - 1][i] & 0xff];
+#if defined(__x86_64__)
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_slice8(uint32_t crc, const uint8_t* p, size_t len)
+{
+    for(; len >= 8; p += 8, len -= 8)
+    {
+        uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+        uint32_t hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    }
+    while(len --)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p ++) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t* p, size_t len)
+{
+    uint64_t c = crc;
+
+    for(; len >= 8; p += 8, len -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = (uint32_t)c;
+    while(len --)
+        crc = _mm_crc32_u8(crc, *p ++);
+    return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if(crc32c_hw)
+        return ~crc32c_sse42(crc, data, len);
+#endif
+    return ~crc32c_slice8(crc, data, len);
+}
+
+uint32_t rolling_checksum(const uint8_t* data, size_t len)
+{
+    uint32_t a = 0, b = 0;
+
+    for(size_t i = 0; i < len; i ++)
+    {
+        a += data[i];
+        b += (uint32_t)(len - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
@@ -0,0 +1,529 @@
+// event_loop.c - epoll 边沿触发的服务器事件循环
+#define _GNU_SOURCE
+#include "event_loop.h"
+#include "uring_backend.h"
+#include "upload_session.h"
+#include "pack.h"
+#include "mux.h"
+#include "delta.h"
+#include "dedup.h"
+#include "compress.h"
+#include "telemetry.h"
+#include "log.h"
+#include <poll.h>
+#include <netinet/tcp.h>
+
+// epoll 事件中区分特殊 fd 的标记, 普通连接的 data.ptr 指向 ClientConn
+static char listen_tag;
+static char notify_tag;
+static char uring_tag;
+
+int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// 创建上传 splice 用的管道, 失败时上传走缓冲区中转
+static void event_loop_open_pipe(EventLoop* loop)
+{
+    if(pipe2(loop->splice_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        log_error("pipe2: %s", strerror(errno));
+        loop->splice_pipe[0] = loop->splice_pipe[1] = -1;
+        return;
+    }
+
+    // 管道越大每次 splice 搬运越多; 超过 pipe-max-size 时保留默认容量
+    fcntl(loop->splice_pipe[1], F_SETPIPE_SZ, EVENT_LOOP_PIPE_SIZE);
+    int size = fcntl(loop->splice_pipe[1], F_GETPIPE_SZ);
+    loop->splice_pipe_size = size > 0 ? (size_t)size : 65536;
+}
+
+void event_loop_close_pipe(EventLoop* loop)
+{
+    if(loop->splice_pipe[0] >= 0)
+    {
+        close(loop->splice_pipe[0]);
+        close(loop->splice_pipe[1]);
+    }
+    loop->splice_pipe[0] = loop->splice_pipe[1] = -1;
+}
+
+int event_loop_init(EventLoop* loop, ServerConfig* config)
+{
+    memset(loop, 0, sizeof(EventLoop));
+    loop->listenfd = -1;
+    loop->notify_fd = -1;
+    loop->splice_pipe[0] = loop->splice_pipe[1] = -1;
+    loop->config = config;
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(loop->epfd < 0)
+    {
+        log_error("epoll_create1: %s", strerror(errno));
+        return -1;
+    }
+
+    loop->scratch_size = EVENT_LOOP_SCRATCH_SIZE;
+    loop->scratch = malloc(loop->scratch_size);
+    if(!loop->scratch)
+    {
+        close(loop->epfd);
+        return -1;
+    }
+
+    if(config->options.io_backend != IO_BACKEND_COPY)
+        event_loop_open_pipe(loop);
+
+    if(config->options.io_backend == IO_BACKEND_URING)
+    {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &uring_tag;
+        if(uring_backend_init(loop) < 0 ||
+           epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->uring->event_fd, &ev) < 0)
+        {
+            uring_backend_destroy(loop);
+            log_warn("io_uring unavailable, falling back to the posix I/O path");
+        }
+    }
+    return 0;
+}
+
+// 监听 socket 使用水平触发, 每轮只 accept 一批, 避免饿死已有连接
+int event_loop_add_listener(EventLoop* loop, int listenfd)
+{
+    struct epoll_event ev;
+
+    if(set_nonblocking(listenfd) < 0)
+        return -1;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_tag;
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+    {
+        log_error("epoll_ctl listen: %s", strerror(errno));
+        return -1;
+    }
+    loop->listenfd = listenfd;
+    return 0;
+}
+
+// 注册唤醒 fd, 可读时在事件循环线程里调用 on_notify
+int event_loop_add_notify(EventLoop* loop, int notify_fd, void (*on_notify)(EventLoop* loop), void* owner)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &notify_tag;
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, notify_fd, &ev) < 0)
+    {
+        log_error("epoll_ctl notify: %s", strerror(errno));
+        return -1;
+    }
+    loop->notify_fd = notify_fd;
+    loop->on_notify = on_notify;
+    loop->owner = owner;
+    return 0;
+}
+
+ClientConn* event_loop_add_conn(EventLoop* loop, int fd, const struct sockaddr_in* addr)
+{
+    struct epoll_event ev;
+    int optval = 1;
+    ClientConn* conn = calloc(1, sizeof(ClientConn));
+    if(!conn)
+        return NULL;
+    conn->stats = malloc(sizeof(TransferStats));
+    if(!conn->stats)
+    {
+        free(conn);
+        return NULL;
+    }
+
+    // 控制消息 (回复、块头) 都很短, 关闭 Nagle 免得等客户端的延迟确认
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+    conn->fd = fd;
+    conn->addr = *addr;
+    conn->loop = loop;
+    conn->file_fd = -1;
+    conn->wait_fd = -1;
+    conn->proto = PROTOCOL_V1;
+    conn->state = CONN_STATE_AUTH;
+    conn_expect(conn, sizeof(AuthHeader));
+
+    // 连接 socket 使用边沿触发, 读写事件一次注册
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if(set_nonblocking(fd) < 0 || epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        log_error("epoll_ctl add: %s", strerror(errno));
+        free(conn->stats);
+        free(conn);
+        return NULL;
+    }
+    telemetry_register(conn->stats, "server", addr);
+
+    conn->next = loop->conns;
+    if(loop->conns)
+        loop->conns->prev = conn;
+    loop->conns = conn;
+    __atomic_add_fetch(&loop->conn_count, 1, __ATOMIC_RELAXED);
+    return conn;
+}
+
+// 额外监听一个 fd (水平触发), 可读时驱动连接; 每个连接同时只能有一个
+// 注册的是 fd 的副本, 同一事件循环里的多个连接可以等待同一个 fd
+int event_loop_watch(EventLoop* loop, ClientConn* conn, int fd)
+{
+    struct epoll_event ev;
+    int wait_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+
+    if(wait_fd < 0)
+    {
+        log_error("fcntl F_DUPFD_CLOEXEC: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, wait_fd, &ev) < 0)
+    {
+        log_error("epoll_ctl watch: %s", strerror(errno));
+        close(wait_fd);
+        return -1;
+    }
+    conn->wait_fd = wait_fd;
+    return 0;
+}
+
+void event_loop_unwatch(EventLoop* loop, ClientConn* conn)
+{
+    if(conn->wait_fd < 0)
+        return;
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->wait_fd, NULL);
+    close(conn->wait_fd);
+    conn->wait_fd = -1;
+}
+
+void event_loop_close_conn(EventLoop* loop, ClientConn* conn)
+{
+    if(conn->closed)
+        return;
+    conn->closed = 1;
+
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    event_loop_unwatch(loop, conn);
+    uring_conn_abort(conn);
+    close(conn->fd);
+    telemetry_unregister(conn->stats);
+    // 上传中断: 保存续传日志, 客户端重连后从断点继续
+    close_upload_journal(conn, 0);
+    close_upload_pack(conn);
+    close_upload_delta(conn);
+    close_upload_dedup(conn);
+    close_download_dedup(conn);
+    close_compress(conn);
+    close_mux_session(conn);
+    if(conn->file_fd >= 0)
+    {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+    // 提交前断开的并行上传连接, 这次上传已不可能完整
+    if(conn->session)
+    {
+        upload_session_leave(conn->session, !conn->session_committed);
+        conn->session = NULL;
+    }
+
+    log_info("Connection closed for %s:%d", inet_ntoa(conn->addr.sin_addr), ntohs(conn->addr.sin_port));
+
+    // 从活动链表摘下, 放到 dead 链表, 本轮事件处理完再释放
+    if(conn->prev)
+        conn->prev->next = conn->next;
+    else
+        loop->conns = conn->next;
+    if(conn->next)
+        conn->next->prev = conn->prev;
+
+    conn->next = loop->dead;
+    loop->dead = conn;
+    __atomic_sub_fetch(&loop->conn_count, 1, __ATOMIC_RELAXED);
+}
+
+// 传输进行中的状态: 在这些状态阻塞是在等对端的数据、发送缓冲区或磁盘, 计入等待时间
+// 等待下一个请求的空闲连接不算
+static int conn_transferring(const ClientConn* conn)
+{
+    switch(conn->state)
+    {
+        case CONN_STATE_PACK_INDEX:
+        case CONN_STATE_CHUNK:
+        case CONN_STATE_CHUNK_CRC:
+        case CONN_STATE_UPLOAD:
+        case CONN_STATE_DOWNLOAD:
+        case CONN_STATE_WAIT_ACK:
+        case CONN_STATE_DELTA:
+        case CONN_STATE_DEDUP_INDEX:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// 推进连接的状态机, 直到阻塞、让出或关闭
+void event_loop_drive(EventLoop* loop, ClientConn* conn)
+{
+    int ret;
+
+    if(conn->closed)
+        return;
+
+    if(conn->stall_since)
+    {
+        telemetry_stall(conn->stats, telemetry_now() - conn->stall_since);
+        conn->stall_since = 0;
+    }
+
+    ret = handle_client_requests(conn, loop->config);
+    if(ret == CONN_STEP_CLOSE)
+    {
+        event_loop_close_conn(loop, conn);
+    }
+    else if(ret == CONN_STEP_YIELD && !conn->ready)
+    {
+        conn->ready = 1;
+        conn->ready_next = loop->ready;
+        loop->ready = conn;
+    }
+    else if(ret == CONN_STEP_BLOCKED && conn_transferring(conn))
+    {
+        conn->stall_since = telemetry_now();
+    }
+}
+
+static void event_loop_accept(EventLoop* loop)
+{
+    struct sockaddr_in client_addr;
+    socklen_t client_len;
+    int connfd;
+
+    for(int i = 0; i < EVENT_LOOP_ACCEPT_BATCH; i ++)
+    {
+        client_len = sizeof(client_addr);
+        connfd = accept4(loop->listenfd, (struct sockaddr*)&client_addr, &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(connfd < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log_error("Accept failed: %s", strerror(errno));
+            return;
+        }
+
+        log_info("New connection from %s:%d", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+
+        ClientConn* conn = event_loop_add_conn(loop, connfd, &client_addr);
+        if(!conn)
+        {
+            close(connfd);
+            continue;
+        }
+        // 客户端通常连上就发认证头, 先尝试推进一次
+        event_loop_drive(loop, conn);
+    }
+}
+
+// 释放已关闭的连接, 还有 io_uring 请求在途的留到下一轮
+static void event_loop_reap(EventLoop* loop)
+{
+    ClientConn** pp = &loop->dead;
+
+    while(*pp)
+    {
+        ClientConn* conn = *pp;
+        if(conn->io_inflight > 0)
+        {
+            pp = &conn->next;
+            continue;
+        }
+        *pp = conn->next;
+        free(conn->stats);
+        free(conn);
+    }
+}
+
+void event_loop_run(EventLoop* loop)
+{
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+    while(loop->config->is_running)
+    {
+        // 有待推进的连接时不阻塞等待
+        int timeout = loop->ready ? 0 : 1000;
+        int n = epoll_wait(loop->epfd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            log_error("epoll_wait: %s", strerror(errno));
+            break;
+        }
+
+        for(int i = 0; i < n; i ++)
+        {
+            void* tag = events[i].data.ptr;
+            if(tag == &listen_tag)
+            {
+                event_loop_accept(loop);
+                continue;
+            }
+            if(tag == &notify_tag)
+            {
+                loop->on_notify(loop);
+                continue;
+            }
+            if(tag == &uring_tag)
+            {
+                uring_backend_complete(loop);
+                continue;
+            }
+
+            ClientConn* conn = tag;
+
+            if(events[i].events & EPOLLERR)
+            {
+                event_loop_close_conn(loop, conn);
+                continue;
+            }
+            event_loop_drive(loop, conn);
+        }
+
+        // 上一轮用完配额的连接, 取出当前链表后逐个推进
+        ClientConn* ready = loop->ready;
+        loop->ready = NULL;
+        while(ready)
+        {
+            ClientConn* conn = ready;
+            ready = conn->ready_next;
+            conn->ready = 0;
+            conn->ready_next = NULL;
+            event_loop_drive(loop, conn);
+        }
+
+        // 本轮积累的 io_uring 请求一次提交
+        uring_backend_submit(loop);
+        event_loop_reap(loop);
+    }
+}
+
+void event_loop_destroy(EventLoop* loop)
+{
+    while(loop->conns)
+        event_loop_close_conn(loop, loop->conns);
+
+    // 等待在途的 io_uring 请求结束
+    while(loop->uring && loop->dead)
+    {
+        uring_backend_submit(loop);
+        event_loop_reap(loop);
+        if(loop->dead)
+        {
+            struct pollfd pfd = { loop->uring->event_fd, POLLIN, 0 };
+            poll(&pfd, 1, 100);
+            uring_backend_complete(loop);
+        }
+    }
+    event_loop_reap(loop);
+    uring_backend_destroy(loop);
+
+    if(loop->epfd >= 0)
+        close(loop->epfd);
+    loop->epfd = -1;
+
+    // 监听 socket 归事件循环所有
+    if(loop->listenfd >= 0)
+        close(loop->listenfd);
+    loop->listenfd = -1;
+
+    event_loop_close_pipe(loop);
+    free(loop->scratch);
+    loop->scratch = NULL;
+}
+
+
+// 设置下一条控制消息的长度
+void conn_expect(ClientConn* conn, size_t len)
+{
+    conn->in_len = 0;
+    conn->in_need = len;
+}
+
+// 读满 in_need 字节, 只读当前阶段需要的数据, 不会多读后续消息
+int conn_fill(ClientConn* conn)
+{
+    while(conn->in_len < conn->in_need)
+    {
+        ssize_t n = recv(conn->fd, conn->in_buf + conn->in_len, conn->in_need - conn->in_len, 0);
+        if(n > 0)
+        {
+            conn->in_len += n;
+            continue;
+        }
+        if(n == 0)
+            return CONN_STEP_CLOSE;
+        if(errno == EINTR)
+            continue;
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return CONN_STEP_BLOCKED;
+        return CONN_STEP_CLOSE;
+    }
+    return CONN_STEP_DONE;
+}
+
+// 把控制消息放入输出缓冲, 由 conn_flush 发送
+int conn_queue(ClientConn* conn, const void* data, size_t len)
+{
+    if(conn->out_off > 0)
+    {
+        memmove(conn->out_buf, conn->out_buf + conn->out_off, conn->out_len - conn->out_off);
+        conn->out_len -= conn->out_off;
+        conn->out_off = 0;
+    }
+    if(conn->out_len + len > sizeof(conn->out_buf))
+        return -1;
+
+    memcpy(conn->out_buf + conn->out_len, data, len);
+    conn->out_len += len;
+    return 0;
+}
+
+int conn_flush(ClientConn* conn)
+{
+    while(conn->out_off < conn->out_len)
+    {
+        ssize_t n = send(conn->fd, conn->out_buf + conn->out_off, conn->out_len - conn->out_off, MSG_NOSIGNAL);
+        if(n > 0)
+        {
+            conn->out_off += n;
+            continue;
+        }
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return CONN_STEP_BLOCKED;
+        return CONN_STEP_CLOSE;
+    }
+    conn->out_off = conn->out_len = 0;
+    return CONN_STEP_DONE;
+}
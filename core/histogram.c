@@ -0,0 +1,70 @@
+// histogram.c - 延迟直方图, 按值的数量级分桶, 记录和统计都不分配内存
+#include "histogram.h"
+#include <string.h>
+#include <math.h>
+
+#define HISTOGRAM_LINEAR    (1u << HISTOGRAM_SUB_BITS)      // 这以下的值每个一个桶
+#define HISTOGRAM_HALF      (1u << (HISTOGRAM_SUB_BITS - 1))
+
+static inline unsigned histogram_index(uint64_t value)
+{
+    if(value < HISTOGRAM_LINEAR)
+        return (unsigned)value;
+    // 保留最高的 HISTOGRAM_SUB_BITS 位, 右移的位数决定所在区间
+    unsigned shift = 63 - __builtin_clzll(value) - (HISTOGRAM_SUB_BITS - 1);
+    return shift * HISTOGRAM_HALF + (unsigned)(value >> shift);
+}
+
+// 桶里最大的值
+static uint64_t histogram_upper(unsigned index)
+{
+    if(index < HISTOGRAM_LINEAR)
+        return index;
+    unsigned shift = index / HISTOGRAM_HALF - 1;
+    uint64_t sub = index - shift * HISTOGRAM_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+void histogram_init(Histogram* hist)
+{
+    memset(hist, 0, sizeof(Histogram));
+}
+
+void histogram_record(Histogram* hist, uint64_t value)
+{
+    uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&hist->counts[histogram_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->total, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->sum, value, __ATOMIC_RELAXED);
+    while(value > max &&
+          !__atomic_compare_exchange_n(&hist->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+uint64_t histogram_percentile(const Histogram* hist, double percentile)
+{
+    uint64_t total = __atomic_load_n(&hist->total, __ATOMIC_RELAXED);
+    uint64_t seen = 0;
+
+    if(total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)ceil(percentile / 100.0 * total);
+    if(rank == 0)
+        rank = 1;
+    for(unsigned i = 0; i < HISTOGRAM_BUCKETS; i ++)
+    {
+        seen += __atomic_load_n(&hist->counts[i], __ATOMIC_RELAXED);
+        if(seen >= rank)
+        {
+            uint64_t upper = histogram_upper(i);
+            return upper < hist->max ? upper : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+double histogram_mean(const Histogram* hist)
+{
+    return hist->total ? (double)hist->sum / hist->total : 0;
+}
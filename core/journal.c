@@ -0,0 +1,197 @@
+// journal.c - 断点续传日志, 记录接收方已经可靠写入的字节范围
+#include "journal.h"
+#include "log.h"
+
+// 日志文件头, 后面跟 count 个 ByteRange; 只在本机读写, 使用主机字节序
+typedef struct {
+    uint32_t magic;
+    uint32_t stamp;
+    uint64_t size;
+    uint32_t count;
+    uint32_t reserved;
+} JournalHeader;
+
+// 源文件标识: 修改时间, 配合文件大小判断对端的文件有没有变
+uint32_t file_stamp(const struct stat* st)
+{
+    return (uint32_t)st->st_mtim.tv_sec ^ (uint32_t)st->st_mtim.tv_nsec;
+}
+
+// 读取 file_path 的日志, 返回可以续传的位置, 没有可用的日志时返回 0
+// 日志中记录的 size 和 stamp 填入 journal
+uint64_t journal_load(TransferJournal* journal, const char* file_path, int file_fd)
+{
+    JournalHeader header;
+    struct stat st;
+
+    memset(journal, 0, sizeof(TransferJournal));
+    snprintf(journal->path, sizeof(journal->path), "%s%s", file_path, JOURNAL_SUFFIX);
+    journal->file_fd = file_fd;
+
+    int fd = open(journal->path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return 0;
+
+    if(read(fd, &header, sizeof(header)) != sizeof(header) ||
+       header.magic != JOURNAL_MAGIC || header.count > JOURNAL_MAX_RANGES ||
+       read(fd, journal->ranges, header.count * sizeof(ByteRange)) != (ssize_t)(header.count * sizeof(ByteRange)) ||
+       fstat(file_fd, &st) != 0)
+    {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    // 续传只从一个位置继续, 只保留从 0 开始的连续部分; 数据文件比记录的短说明被改动过
+    journal->size = header.size;
+    journal->stamp = header.stamp;
+    journal->count = header.count;
+    uint64_t prefix = journal_prefix(journal);
+    if(prefix > header.size || prefix > (uint64_t)st.st_size)
+        prefix = 0;
+    journal->count = prefix ? 1 : 0;
+    return prefix;
+}
+
+// 读取日志, 与 (size, stamp) 一致时返回可以续传的位置
+// 否则清空记录返回 0, 调用方需要从头接收 (截断数据文件)
+uint64_t journal_open(TransferJournal* journal, const char* file_path, int file_fd, uint64_t size, uint32_t stamp)
+{
+    uint64_t prefix = journal_load(journal, file_path, file_fd);
+
+    if(journal->size != size || journal->stamp != stamp)
+    {
+        journal->size = size;
+        journal->stamp = stamp;
+        journal->count = 0;
+        prefix = 0;
+    }
+    return prefix;
+}
+
+// 从 0 开始连续可用的长度
+uint64_t journal_prefix(const TransferJournal* journal)
+{
+    if(journal->count > 0 && journal->ranges[0].start == 0)
+        return journal->ranges[0].end;
+    return 0;
+}
+
+// 数据先落盘, 再用临时文件加 rename 原子地替换日志
+static int journal_write(const TransferJournal* journal)
+{
+    char tmp[sizeof(journal->path) + 4];
+    JournalHeader header;
+
+    if(fdatasync(journal->file_fd) < 0)
+    {
+        log_error("fdatasync: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = JOURNAL_MAGIC;
+    header.stamp = journal->stamp;
+    header.size = journal->size;
+    header.count = journal->count;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", journal->path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        log_error("Failed to write journal: %s", strerror(errno));
+        return -1;
+    }
+    size_t len = journal->count * sizeof(ByteRange);
+    if(write(fd, &header, sizeof(header)) != sizeof(header) ||
+       write(fd, journal->ranges, len) != (ssize_t)len ||
+       fdatasync(fd) < 0)
+    {
+        log_error("Failed to write journal: %s", strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+
+    if(rename(tmp, journal->path) < 0)
+    {
+        log_error("Failed to write journal: %s", strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// 后台保存 journal_add 时的快照
+static int journal_save_copy(void* arg)
+{
+    int ret = journal_write(arg);
+
+    free(arg);
+    return ret;
+}
+
+// 记录 [start, end) 已写入, 与相邻范围合并; 范围表满时丢弃, 下次续传重传即可
+void journal_add(TransferJournal* journal, uint64_t start, uint64_t end)
+{
+    int i, j;
+
+    if(start >= end)
+        return;
+
+    // ranges 按起点排序且互不相邻
+    for(i = 0; i < journal->count && journal->ranges[i].end < start; i ++)
+        ;
+    for(j = i; j < journal->count && journal->ranges[j].start <= end; j ++)
+    {
+        if(journal->ranges[j].start < start)
+            start = journal->ranges[j].start;
+        if(journal->ranges[j].end > end)
+            end = journal->ranges[j].end;
+    }
+
+    if(i == j)
+    {
+        if(journal->count == JOURNAL_MAX_RANGES)
+            return;
+        memmove(&journal->ranges[i + 1], &journal->ranges[i], (journal->count - i) * sizeof(ByteRange));
+        journal->count ++;
+    }
+    else if(j - i > 1)
+    {
+        memmove(&journal->ranges[i + 1], &journal->ranges[j], (journal->count - j) * sizeof(ByteRange));
+        journal->count -= j - i - 1;
+    }
+    journal->ranges[i].start = start;
+    journal->ranges[i].end = end;
+
+    // 定期保存交给后台线程, 不阻塞接收; 上一次还没保存完时推迟到下一块
+    journal->unsynced += end - start;
+    if(journal->unsynced >= JOURNAL_SYNC_BYTES && sync_pending(&journal->sync) == 0)
+    {
+        TransferJournal* copy = malloc(sizeof(TransferJournal));
+        if(!copy)
+            return;
+        memcpy(copy, journal, sizeof(TransferJournal));
+        journal->unsynced = 0;
+        sync_submit(&journal->sync, journal_save_copy, copy);
+    }
+}
+
+// 立即保存; 先等后台的保存结束, 旧的快照不会覆盖这次的内容
+int journal_save(TransferJournal* journal)
+{
+    sync_wait(&journal->sync);
+    if(journal_write(journal) < 0)
+        return -1;
+    journal->unsynced = 0;
+    return 0;
+}
+
+// 传输完成, 不再需要日志; 等后台的保存结束, 它不会在删除后重新写出日志
+void journal_remove(TransferJournal* journal)
+{
+    sync_wait(&journal->sync);
+    unlink(journal->path);
+}
@@ -0,0 +1,346 @@
+// log.c - 异步日志: 每个线程一个无锁环形缓冲区, 由一个写线程加时间戳后输出
+#include "log.h"
+#include "color.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#define LOG_BATCH_MS    20      // 写线程输出一批后等待更多日志的时间, 期间记录日志不唤醒它
+#define LOG_PATH_LEN    4096
+
+typedef struct {
+    uint64_t time_ns;           // CLOCK_REALTIME, 记录时取得
+    int level;
+    char text[LOG_LINE_MAX];
+} LogEntry;
+
+// 单生产者单消费者: 所属线程推进 tail, 写线程推进 head
+typedef struct LogRing {
+    uint64_t tail __attribute__((aligned(64)));
+    uint64_t dropped;           // 缓冲区满时丢弃的条数
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t limit;             // 写线程本轮输出到这里为止, 日志不断时也能结束一轮
+    int dead;                   // 线程已退出, 输出完后由写线程释放
+    struct LogRing* next;
+    LogEntry entries[LOG_RING_SIZE];
+} LogRing;
+
+int log_level = LOG_LEVEL_INFO;
+
+static const char* level_names[] = { "debug", "info", "warn", "error" };
+static const char* level_tags[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+static __thread LogRing* log_thread = NULL;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;    // 保护 rings 链表和日志文件
+static LogRing* rings = NULL;
+static FILE* log_file = NULL;
+static char log_path[LOG_PATH_LEN];
+static int event_fd = -1;
+static int writer_started = 0;
+static pid_t writer_pid;        // fork 出的子进程没有写线程
+static int writer_idle = 0;     // 写线程在无限期等待, 记录日志后需要唤醒
+static int console_color = 0;
+
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t flush_request = 0;
+static uint64_t flush_done = 0;
+
+static void log_wake(void)
+{
+    uint64_t one = 1;
+
+    // 计数器满时写线程反正会醒来, 失败不用处理
+    if(write(event_fd, &one, sizeof(one)) < 0)
+        return;
+}
+
+static void output(int level, uint64_t time_ns, const char* text)
+{
+    time_t secs = time_ns / 1000000000ULL;
+    int msecs = (time_ns / 1000000ULL) % 1000;
+    struct tm tm;
+
+    localtime_r(&secs, &tm);
+    if(console_color && level >= LOG_LEVEL_WARN)
+        printf("%02d:%02d:%02d.%03d %s%s" COLOR_RESET " %s\n", tm.tm_hour, tm.tm_min, tm.tm_sec, msecs,
+               level == LOG_LEVEL_ERROR ? COLOR_RED : COLOR_YELLOW, level_tags[level], text);
+    else
+        printf("%02d:%02d:%02d.%03d %s %s\n", tm.tm_hour, tm.tm_min, tm.tm_sec, msecs, level_tags[level], text);
+    if(log_file)
+        fprintf(log_file, "%04d-%02d-%02d %02d:%02d:%02d.%03d %s %s\n", tm.tm_year + 1900, tm.tm_mon + 1,
+                tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, msecs, level_tags[level], text);
+}
+
+// 按时间顺序合并输出各线程缓冲区里的日志, 返回输出的条数; 调用者持有 log_lock
+static int drain_locked(void)
+{
+    int count = 0;
+
+    for(LogRing* ring = rings; ring; ring = ring->next)
+        ring->limit = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+
+    while(1)
+    {
+        LogRing* first = NULL;
+        for(LogRing* ring = rings; ring; ring = ring->next)
+        {
+            if(ring->head == ring->limit)
+                continue;
+            if(!first || ring->entries[ring->head & (LOG_RING_SIZE - 1)].time_ns <
+                         first->entries[first->head & (LOG_RING_SIZE - 1)].time_ns)
+                first = ring;
+        }
+        if(!first)
+            break;
+
+        LogEntry* entry = &first->entries[first->head & (LOG_RING_SIZE - 1)];
+        output(entry->level, entry->time_ns, entry->text);
+        __atomic_store_n(&first->head, first->head + 1, __ATOMIC_RELEASE);
+        count ++;
+    }
+
+    for(LogRing** pp = &rings; *pp; )
+    {
+        LogRing* ring = *pp;
+        uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if(dropped)
+        {
+            struct timespec now;
+            char text[64];
+            clock_gettime(CLOCK_REALTIME, &now);
+            snprintf(text, sizeof(text), "%" PRIu64 " log messages dropped", dropped);
+            output(LOG_LEVEL_WARN, (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec, text);
+            count ++;
+        }
+        if(__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) &&
+           ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+        {
+            *pp = ring->next;
+            free(ring);
+            continue;
+        }
+        pp = &ring->next;
+    }
+
+    if(count)
+    {
+        fflush(stdout);
+        if(log_file)
+            fflush(log_file);
+    }
+    return count;
+}
+
+static int drain(void)
+{
+    pthread_mutex_lock(&log_lock);
+    int count = drain_locked();
+    pthread_mutex_unlock(&log_lock);
+    return count;
+}
+
+static void* writer_thread(void* arg)
+{
+    struct pollfd pfd = { .fd = event_fd, .events = POLLIN };
+    uint64_t value;
+
+    (void)arg;
+    while(1)
+    {
+        uint64_t request = __atomic_load_n(&flush_request, __ATOMIC_ACQUIRE);
+        int count = drain();
+
+        if(request != flush_done)
+        {
+            pthread_mutex_lock(&flush_lock);
+            flush_done = request;
+            pthread_cond_broadcast(&flush_cond);
+            pthread_mutex_unlock(&flush_lock);
+        }
+
+        if(count > 0)
+        {
+            // 刚输出过: 短暂等待攒一批, 这段时间记录日志不用唤醒
+            poll(&pfd, 1, LOG_BATCH_MS);
+        }
+        else
+        {
+            // 先声明空闲再检查一次, 和 log_write 先发布再检查空闲配对, 不会漏掉唤醒
+            __atomic_store_n(&writer_idle, 1, __ATOMIC_SEQ_CST);
+            if(drain() == 0)
+                poll(&pfd, 1, -1);
+            __atomic_store_n(&writer_idle, 0, __ATOMIC_SEQ_CST);
+        }
+        if(read(event_fd, &value, sizeof(value)) < 0)
+            continue;
+    }
+    return NULL;
+}
+
+static void ring_release(void* arg)
+{
+    __atomic_store_n(&((LogRing*)arg)->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void log_start(void)
+{
+    pthread_t thread;
+
+    console_color = isatty(STDOUT_FILENO);
+    if(pthread_key_create(&ring_key, ring_release) != 0)
+        return;
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(event_fd < 0)
+        return;
+    if(pthread_create(&thread, NULL, writer_thread, NULL) != 0)
+    {
+        close(event_fd);
+        event_fd = -1;
+        return;
+    }
+    pthread_detach(thread);
+    writer_pid = getpid();
+    __atomic_store_n(&writer_started, 1, __ATOMIC_RELEASE);
+    // 退出前输出剩下的日志
+    atexit(log_flush);
+}
+
+// 线程第一次记录日志时分配缓冲区并登记; 写线程不可用时返回 NULL
+static LogRing* ring_create(void)
+{
+    pthread_once(&log_once, log_start);
+    if(!__atomic_load_n(&writer_started, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    LogRing* ring = calloc(1, sizeof(LogRing));
+    if(!ring)
+        return NULL;
+    pthread_setspecific(ring_key, ring);
+    pthread_mutex_lock(&log_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&log_lock);
+    log_thread = ring;
+    return ring;
+}
+
+void log_write(int level, const char* fmt, ...)
+{
+    int saved_errno = errno;
+    LogRing* ring = log_thread ? log_thread : ring_create();
+    struct timespec now;
+    va_list ap;
+
+    if(level < LOG_LEVEL_DEBUG || level > LOG_LEVEL_ERROR)
+        level = LOG_LEVEL_ERROR;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    if(!ring)
+    {
+        // 写线程启动失败, 直接输出
+        char text[LOG_LINE_MAX];
+        va_start(ap, fmt);
+        vsnprintf(text, sizeof(text), fmt, ap);
+        va_end(ap);
+        pthread_mutex_lock(&log_lock);
+        output(level, (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec, text);
+        fflush(stdout);
+        pthread_mutex_unlock(&log_lock);
+        errno = saved_errno;
+        return;
+    }
+
+    uint64_t tail = ring->tail;
+    uint64_t used = tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if(used >= LOG_RING_SIZE)
+    {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        errno = saved_errno;
+        return;
+    }
+
+    LogEntry* entry = &ring->entries[tail & (LOG_RING_SIZE - 1)];
+    entry->time_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    entry->level = level;
+    va_start(ap, fmt);
+    vsnprintf(entry->text, sizeof(entry->text), fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    // 写线程空闲时唤醒; 正在攒批时只在缓冲区用到一半时提前唤醒
+    if((__atomic_load_n(&writer_idle, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&writer_idle, 0, __ATOMIC_SEQ_CST)) ||
+       used + 1 == LOG_RING_SIZE / 2)
+        log_wake();
+    errno = saved_errno;
+}
+
+int log_parse_level(const char* name)
+{
+    for(int i = 0; i < (int)(sizeof(level_names) / sizeof(level_names[0])); i ++)
+    {
+        if(strcasecmp(name, level_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+const char* log_level_name(int level)
+{
+    return level >= LOG_LEVEL_DEBUG && level <= LOG_LEVEL_ERROR ? level_names[level] : "unknown";
+}
+
+void log_set_level(int level)
+{
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+int log_set_file(const char* path)
+{
+    FILE* file = NULL;
+
+    if(path)
+    {
+        file = fopen(path, "ae");
+        if(!file)
+            return -1;
+    }
+
+    // 换文件前先把已记录的日志写进原来的文件
+    log_flush();
+    pthread_mutex_lock(&log_lock);
+    if(log_file)
+        fclose(log_file);
+    log_file = file;
+    snprintf(log_path, sizeof(log_path), "%s", path ? path : "");
+    pthread_mutex_unlock(&log_lock);
+    return 0;
+}
+
+const char* log_file_path(void)
+{
+    return log_path[0] ? log_path : NULL;
+}
+
+void log_flush(void)
+{
+    if(!__atomic_load_n(&writer_started, __ATOMIC_ACQUIRE) || getpid() != writer_pid)
+        return;
+
+    pthread_mutex_lock(&flush_lock);
+    uint64_t request = __atomic_add_fetch(&flush_request, 1, __ATOMIC_RELEASE);
+    log_wake();
+    while(flush_done < request)
+        pthread_cond_wait(&flush_cond, &flush_lock);
+    pthread_mutex_unlock(&flush_lock);
+}
@@ -0,0 +1,210 @@
+// lz.c - 数据块压缩: LZ77 (LZ4 块格式) 和抽样熵估计
+#include "lz.h"
+#include <string.h>
+#include <math.h>
+
+#define LZ_LAST_LITERALS    5       // 块末尾这么多字节总是字面量
+#define LZ_MATCH_LIMIT      12      // 离块末尾不到这么多字节时不再查找匹配
+#define LZ_SKIP_TRIGGER     6       // 连续 64 次找不到匹配后步长加 1, 快速跳过不可压缩的区域
+
+#define LZ_SAMPLE_RUNS      16      // 熵估计: 均匀取 16 段, 每段 256 字节
+#define LZ_SAMPLE_RUN       256
+#define LZ_ENTROPY_LIMIT    7.5     // 每字节的比特数超过它就不压缩
+
+static inline uint32_t lz_read32(const uint8_t* p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// 长度达到 15 时写扩展字节, len 为减去 15 后的部分
+static uint8_t* lz_write_length(uint8_t* op, size_t len)
+{
+    for(; len >= 255; len -= 255)
+        *op ++ = 255;
+    *op ++ = (uint8_t)len;
+    return op;
+}
+
+// 写一个序列的标记和字面量, 返回写完字面量后的位置; 空间不够返回 NULL
+static uint8_t* lz_write_literals(uint8_t* op, uint8_t* op_end, const uint8_t* lit, size_t len, size_t reserve)
+{
+    if((size_t)(op_end - op) < 1 + len / 255 + 1 + len + reserve)
+        return NULL;
+    *op ++ = (uint8_t)((len >= 15 ? 15 : len) << 4);
+    if(len >= 15)
+        op = lz_write_length(op, len - 15);
+    memcpy(op, lit, len);
+    return op + len;
+}
+
+size_t lz_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap)
+{
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + len;
+    uint8_t* op = dst;
+    uint8_t* op_end = dst + cap;
+
+    if(len > LZ_MATCH_LIMIT)
+    {
+        uint32_t table[1 << LZ_HASH_BITS];
+        const uint8_t* match_end = end - LZ_LAST_LITERALS;
+        const uint8_t* limit = end - LZ_MATCH_LIMIT;
+        unsigned misses = 0;
+
+        // 表项为块内位置, 初始都指向块首; 候选位置的内容总要比较, 不会错配
+        memset(table, 0, sizeof(table));
+        while(ip < limit)
+        {
+            uint32_t seq = lz_read32(ip);
+            uint32_t h = lz_hash(seq);
+            const uint8_t* ref = src + table[h];
+
+            table[h] = (uint32_t)(ip - src);
+            if(ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq)
+            {
+                ip += 1 + (misses ++ >> LZ_SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            // 匹配向前后两个方向扩展
+            while(ip > anchor && ref > src && ip[-1] == ref[-1])
+            {
+                ip --;
+                ref --;
+            }
+            const uint8_t* p = ip + LZ_MIN_MATCH;
+            const uint8_t* q = ref + LZ_MIN_MATCH;
+            while(p < match_end && *p == *q)
+            {
+                p ++;
+                q ++;
+            }
+
+            size_t match = p - ip - LZ_MIN_MATCH;
+            uint8_t* token = op;
+            op = lz_write_literals(op, op_end, anchor, ip - anchor, 2 + match / 255 + 1);
+            if(!op)
+                return 0;
+            *op ++ = (uint8_t)(ip - ref);
+            *op ++ = (uint8_t)((ip - ref) >> 8);
+            *token |= match >= 15 ? 15 : match;
+            if(match >= 15)
+                op = lz_write_length(op, match - 15);
+
+            ip = p;
+            anchor = ip;
+            // 匹配末尾的位置也放进表里, 连续的重复内容更容易接上
+            if(ip < limit)
+                table[lz_hash(lz_read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+        }
+    }
+
+    // 最后一个序列只有字面量
+    op = lz_write_literals(op, op_end, anchor, end - anchor, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+ssize_t lz_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap)
+{
+    const uint8_t* ip = src;
+    const uint8_t* end = src + len;
+    uint8_t* op = dst;
+    uint8_t* op_end = dst + cap;
+
+    while(ip < end)
+    {
+        uint8_t token = *ip ++;
+        size_t lit = token >> 4;
+        uint8_t b;
+
+        if(lit == 15)
+        {
+            do
+            {
+                if(ip >= end)
+                    return -1;
+                b = *ip ++;
+                lit += b;
+            } while(b == 255);
+        }
+        if((size_t)(end - ip) < lit || (size_t)(op_end - op) < lit)
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if(ip == end)
+            break;
+
+        if(end - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > (size_t)(op - dst))
+            return -1;
+
+        size_t match = token & 15;
+        if(match == 15)
+        {
+            do
+            {
+                if(ip >= end)
+                    return -1;
+                b = *ip ++;
+                match += b;
+            } while(b == 255);
+        }
+        match += LZ_MIN_MATCH;
+        if((size_t)(op_end - op) < match)
+            return -1;
+
+        // 距离小于长度时源和目标重叠, 只能逐字节复制
+        const uint8_t* ref = op - offset;
+        if(offset >= match)
+        {
+            memcpy(op, ref, match);
+            op += match;
+        }
+        else
+        {
+            while(match --)
+                *op ++ = *ref ++;
+        }
+    }
+    return op - dst;
+}
+
+int lz_incompressible(const uint8_t* data, size_t len)
+{
+    uint32_t count[256];
+    double entropy = 0;
+
+    if(len < LZ_SAMPLE_RUNS * LZ_SAMPLE_RUN)
+        return 0;
+
+    memset(count, 0, sizeof(count));
+    for(int i = 0; i < LZ_SAMPLE_RUNS; i ++)
+    {
+        const uint8_t* p = data + (len - LZ_SAMPLE_RUN) * i / (LZ_SAMPLE_RUNS - 1);
+        for(int j = 0; j < LZ_SAMPLE_RUN; j ++)
+            count[p[j]] ++;
+    }
+    for(int i = 0; i < 256; i ++)
+    {
+        if(count[i])
+        {
+            double p = (double)count[i] / (LZ_SAMPLE_RUNS * LZ_SAMPLE_RUN);
+            entropy -= p * log2(p);
+        }
+    }
+    return entropy > LZ_ENTROPY_LIMIT;
+}
@@ -0,0 +1,75 @@
+// progress.c - 与数据路径解耦的传输进度显示
+#include "progress.h"
+#include "transfer_engine.h"
+
+static double elapsed_seconds(const struct timespec* begin)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - begin->tv_sec) + (now.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+static void progress_print(TransferProgress* progress)
+{
+    uint64_t done = __atomic_load_n(&progress->done, __ATOMIC_RELAXED);
+    double secs = elapsed_seconds(&progress->begin);
+    double rate = secs > 0 ? done / secs / (1024 * 1024) : 0;
+
+    printf("\rProgress: %.1f%% (%" PRIu64 "/%" PRIu64 " bytes, %.1f MB/s)",
+           (double)done / progress->total * 100, done, progress->total, rate);
+    fflush(stdout);
+}
+
+static void* progress_thread(void* arg)
+{
+    TransferProgress* progress = (TransferProgress*)arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&progress->lock);
+    while(!progress->stop)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += PROGRESS_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        pthread_cond_timedwait(&progress->cond, &progress->lock, &deadline);
+        if(!progress->stop)
+            progress_print(progress);
+    }
+    pthread_mutex_unlock(&progress->lock);
+    return NULL;
+}
+
+void progress_start(TransferProgress* progress, uint64_t total)
+{
+    memset(progress, 0, sizeof(TransferProgress));
+    progress->total = total;
+    clock_gettime(CLOCK_MONOTONIC, &progress->begin);
+    pthread_mutex_init(&progress->lock, NULL);
+    pthread_cond_init(&progress->cond, NULL);
+
+    // 空文件不需要进度; 后台任务不打印进度, 避免打乱 shell 的输入
+    if(total > 0 && !engine_in_job() && pthread_create(&progress->thread, NULL, progress_thread, progress) == 0)
+        progress->started = 1;
+}
+
+// 停止打印线程并输出最终进度
+void progress_finish(TransferProgress* progress)
+{
+    if(progress->started)
+    {
+        pthread_mutex_lock(&progress->lock);
+        progress->stop = 1;
+        pthread_cond_signal(&progress->cond);
+        pthread_mutex_unlock(&progress->lock);
+        pthread_join(progress->thread, NULL);
+        progress->started = 0;
+
+        progress_print(progress);
+        printf("\n");
+    }
+    pthread_mutex_destroy(&progress->lock);
+    pthread_cond_destroy(&progress->cond);
+}
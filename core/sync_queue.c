@@ -0,0 +1,128 @@
+// sync_queue.c - 后台落盘线程, fdatasync / fsync 这类可能阻塞很久的操作不占用事件循环
+#include "sync_queue.h"
+#include "log.h"
+
+typedef struct SyncJob {
+    SyncFunc func;
+    void* arg;
+    SyncGroup* group;
+    struct SyncJob* next;
+} SyncJob;
+
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_ready = PTHREAD_COND_INITIALIZER;    // 有新操作
+static pthread_cond_t sync_done = PTHREAD_COND_INITIALIZER;     // 有操作完成
+static pthread_once_t sync_once = PTHREAD_ONCE_INIT;
+static SyncJob* queue_head;
+static SyncJob* queue_tail;
+static int queue_len;
+static int sync_started;            // 启动的线程数, 0 表示全部在调用线程执行
+
+// 操作完成, 计入所属的组; 调用时持有 sync_lock
+static void finish_job(SyncGroup* group, int ret)
+{
+    if(!group)
+        return;
+    if(ret != 0)
+        group->failed ++;
+    group->pending --;
+    pthread_cond_broadcast(&sync_done);
+}
+
+static void* sync_thread(void* arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&sync_lock);
+    while(1)
+    {
+        while(!queue_head)
+            pthread_cond_wait(&sync_ready, &sync_lock);
+
+        SyncJob* job = queue_head;
+        queue_head = job->next;
+        if(!queue_head)
+            queue_tail = NULL;
+        queue_len --;
+        pthread_mutex_unlock(&sync_lock);
+
+        int ret = job->func(job->arg);
+
+        pthread_mutex_lock(&sync_lock);
+        finish_job(job->group, ret);
+        free(job);
+    }
+    return NULL;
+}
+
+static void sync_start(void)
+{
+    pthread_t thread;
+
+    for(int i = 0; i < SYNC_THREADS; i ++)
+    {
+        if(pthread_create(&thread, NULL, sync_thread, NULL) == 0)
+        {
+            pthread_detach(thread);
+            sync_started ++;
+        }
+    }
+    if(sync_started == 0)
+        log_warn("Failed to start sync threads, syncing inline");
+}
+
+// 提交操作; 线程不可用或队列已满时在调用线程直接执行, 结果同样计入 group
+void sync_submit(SyncGroup* group, SyncFunc func, void* arg)
+{
+    SyncJob* job = NULL;
+
+    pthread_once(&sync_once, sync_start);
+    pthread_mutex_lock(&sync_lock);
+    if(group)
+        group->pending ++;
+    if(sync_started > 0 && queue_len < SYNC_QUEUE_MAX)
+        job = malloc(sizeof(SyncJob));
+    if(job)
+    {
+        job->func = func;
+        job->arg = arg;
+        job->group = group;
+        job->next = NULL;
+        if(queue_tail)
+            queue_tail->next = job;
+        else
+            queue_head = job;
+        queue_tail = job;
+        queue_len ++;
+        pthread_cond_signal(&sync_ready);
+        pthread_mutex_unlock(&sync_lock);
+        return;
+    }
+    pthread_mutex_unlock(&sync_lock);
+
+    int ret = func(arg);
+    pthread_mutex_lock(&sync_lock);
+    finish_job(group, ret);
+    pthread_mutex_unlock(&sync_lock);
+}
+
+// group 中还没完成的操作数
+int sync_pending(SyncGroup* group)
+{
+    pthread_mutex_lock(&sync_lock);
+    int pending = group->pending;
+    pthread_mutex_unlock(&sync_lock);
+    return pending;
+}
+
+// 等待 group 中的操作全部完成, 有失败的返回 -1 并清除失败计数
+int sync_wait(SyncGroup* group)
+{
+    pthread_mutex_lock(&sync_lock);
+    while(group->pending > 0)
+        pthread_cond_wait(&sync_done, &sync_lock);
+    int ret = group->failed ? -1 : 0;
+    group->failed = 0;
+    pthread_mutex_unlock(&sync_lock);
+    return ret;
+}
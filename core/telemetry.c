@@ -0,0 +1,219 @@
+// telemetry.c - 传输计数的登记、定时采样和 stats 输出
+// 数据路径只累加自己连接的计数; 全局合计由已注销连接的累计值加上登记中的连接算出, 不共享热点缓存行
+#include "telemetry.h"
+
+__thread TransferStats* telemetry_thread = NULL;
+
+typedef struct {
+    uint64_t bytes;
+    uint64_t chunks;
+    uint64_t syscalls;
+    uint64_t stall_ns;
+} TelemetryTotals;
+
+static pthread_mutex_t telemetry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t telemetry_cond = PTHREAD_COND_INITIALIZER;
+static TransferStats* registry = NULL;
+static TelemetryTotals retired;         // 已注销连接的计数
+static int next_id = 1;
+static int sampler_started = 0;
+static uint64_t total_sample_bytes;     // 上次采样时的全局字节数
+static uint64_t total_sample_ns;
+static double total_rate;
+
+static uint64_t load(const uint64_t* counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// 计算每个连接和全局在上一个采样间隔内的吞吐, 调用者持有锁
+static void sample_locked(void)
+{
+    uint64_t now = telemetry_now();
+    uint64_t total = retired.bytes;
+
+    for(TransferStats* stats = registry; stats; stats = stats->next)
+    {
+        uint64_t bytes = load(&stats->bytes);
+        if(now > stats->sample_ns)
+            stats->rate = (bytes - stats->sample_bytes) * 1e9 / (now - stats->sample_ns);
+        stats->sample_bytes = bytes;
+        stats->sample_ns = now;
+        total += bytes;
+    }
+    if(now > total_sample_ns && total_sample_ns)
+        total_rate = (total - total_sample_bytes) * 1e9 / (now - total_sample_ns);
+    total_sample_bytes = total;
+    total_sample_ns = now;
+}
+
+static void* sampler_thread(void* arg)
+{
+    struct timespec deadline;
+
+    (void)arg;
+    pthread_mutex_lock(&telemetry_lock);
+    while(1)
+    {
+        // 没有登记的连接时不必定时醒来
+        while(!registry)
+        {
+            total_rate = 0;
+            pthread_cond_wait(&telemetry_cond, &telemetry_lock);
+        }
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += TELEMETRY_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&telemetry_cond, &telemetry_lock, &deadline);
+        sample_locked();
+    }
+    return NULL;
+}
+
+static void register_locked(TransferStats* stats)
+{
+    stats->id = next_id ++;
+    stats->begin_ns = stats->sample_ns = telemetry_now();
+    stats->next = registry;
+    registry = stats;
+
+    if(!sampler_started)
+    {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, sampler_thread, NULL) == 0)
+        {
+            pthread_detach(thread);
+            sampler_started = 1;
+        }
+    }
+    pthread_cond_signal(&telemetry_cond);
+}
+
+// 从登记表摘下, 计数并入全局累计; 没有登记过的忽略
+static void unregister_locked(TransferStats* stats)
+{
+    for(TransferStats** pp = &registry; *pp; pp = &(*pp)->next)
+    {
+        if(*pp != stats)
+            continue;
+        *pp = stats->next;
+        retired.bytes += load(&stats->bytes);
+        retired.chunks += load(&stats->chunks);
+        retired.syscalls += load(&stats->syscalls);
+        retired.stall_ns += load(&stats->stall_ns);
+        return;
+    }
+}
+
+void telemetry_register(TransferStats* stats, const char* role, const struct sockaddr_in* peer)
+{
+    char ip[INET_ADDRSTRLEN];
+
+    memset(stats, 0, sizeof(TransferStats));
+    stats->sockfd = -1;
+    stats->role = role;
+    inet_ntop(AF_INET, &peer->sin_addr, ip, sizeof(ip));
+    snprintf(stats->peer, sizeof(stats->peer), "%s:%d", ip, ntohs(peer->sin_port));
+    snprintf(stats->name, sizeof(stats->name), "-");
+
+    pthread_mutex_lock(&telemetry_lock);
+    register_locked(stats);
+    pthread_mutex_unlock(&telemetry_lock);
+}
+
+void telemetry_unregister(TransferStats* stats)
+{
+    pthread_mutex_lock(&telemetry_lock);
+    unregister_locked(stats);
+    pthread_mutex_unlock(&telemetry_lock);
+}
+
+// 名称在锁内更新, stats 命令不会读到写了一半的字符串
+void telemetry_rename(TransferStats* stats, const char* name)
+{
+    pthread_mutex_lock(&telemetry_lock);
+    snprintf(stats->name, sizeof(stats->name), "%s", name);
+    pthread_mutex_unlock(&telemetry_lock);
+}
+
+void telemetry_attach(int sockfd, const char* ip, int port, int job)
+{
+    TransferStats* stats = calloc(1, sizeof(TransferStats));
+
+    telemetry_thread = stats;
+    if(!stats)
+        return;
+    stats->sockfd = sockfd;
+    stats->role = "client";
+    snprintf(stats->peer, sizeof(stats->peer), "%s:%d", ip, port);
+    if(job > 0)
+        snprintf(stats->name, sizeof(stats->name), "job %d", job);
+    else
+        snprintf(stats->name, sizeof(stats->name), "-");
+
+    pthread_mutex_lock(&telemetry_lock);
+    register_locked(stats);
+    pthread_mutex_unlock(&telemetry_lock);
+}
+
+// 连接可能由其他线程归还 (并行传输的连接在子线程结束后统一归还), 按 socket 查找
+void telemetry_detach(int sockfd)
+{
+    TransferStats* found = NULL;
+
+    pthread_mutex_lock(&telemetry_lock);
+    for(TransferStats* stats = registry; stats; stats = stats->next)
+    {
+        if(stats->sockfd == sockfd)
+        {
+            found = stats;
+            break;
+        }
+    }
+    if(found)
+        unregister_locked(found);
+    pthread_mutex_unlock(&telemetry_lock);
+
+    if(found && telemetry_thread == found)
+        telemetry_thread = NULL;
+    free(found);
+}
+
+void telemetry_print(void)
+{
+    uint64_t now = telemetry_now();
+    TelemetryTotals total;
+    int count = 0;
+
+    pthread_mutex_lock(&telemetry_lock);
+    total = retired;
+    if(registry)
+        printf("%4s  %-6s  %-21s  %-20s  %14s  %8s  %10s  %8s  %9s  %9s\n", "ID", "ROLE", "PEER", "TRANSFER", "BYTES",
+               "CHUNKS", "SYSCALLS", "STALL", "MB/s", "AVG MB/s");
+    for(TransferStats* stats = registry; stats; stats = stats->next)
+    {
+        uint64_t bytes = load(&stats->bytes);
+        uint64_t chunks = load(&stats->chunks);
+        uint64_t syscalls = load(&stats->syscalls);
+        uint64_t stall_ns = load(&stats->stall_ns);
+        double secs = (now - stats->begin_ns) / 1e9;
+
+        printf("%4d  %-6s  %-21s  %-20.20s  %14" PRIu64 "  %8" PRIu64 "  %10" PRIu64 "  %7.2fs  %9.1f  %9.1f\n",
+               stats->id, stats->role, stats->peer, stats->name, bytes, chunks, syscalls, stall_ns / 1e9,
+               stats->rate / (1024 * 1024), secs > 0 ? bytes / secs / (1024 * 1024) : 0);
+        total.bytes += bytes;
+        total.chunks += chunks;
+        total.syscalls += syscalls;
+        total.stall_ns += stall_ns;
+        count ++;
+    }
+    double rate = registry ? total_rate : 0;
+    pthread_mutex_unlock(&telemetry_lock);
+
+    if(count == 0)
+        printf("No active connections\n");
+    printf("Total: %d active, %" PRIu64 " bytes, %" PRIu64 " chunks, %" PRIu64 " syscalls, %.2fs stalled, %.1f MB/s\n",
+           count, total.bytes, total.chunks, total.syscalls, total.stall_ns / 1e9, rate / (1024 * 1024));
+}
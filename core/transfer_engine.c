@@ -0,0 +1,405 @@
+// transfer_engine.c - 后台传输任务: 队列、调度和取消
+#include "transfer_engine.h"
+
+static pthread_mutex_t engine_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t engine_changed = PTHREAD_COND_INITIALIZER;   // 任务入队或状态变化
+static TransferJob* jobs = NULL;            // 所有任务, 按提交顺序
+static int next_id = 1;
+static int engine_started = 0;
+
+// 当前线程所属的任务, 传输函数据此登记连接
+static __thread TransferJob* current_job = NULL;
+
+static const char* state_names[] = { "queued", "running", "done", "failed", "cancelled" };
+static const char* priority_names[] = { "high", "normal", "low" };
+
+static double seconds_between(const struct timespec* begin, const struct timespec* end)
+{
+    return (end->tv_sec - begin->tv_sec) + (end->tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+static void format_command(const TransferJob* job, char* buf, size_t len)
+{
+    size_t pos = 0;
+
+    buf[0] = '\0';
+    for(int i = 0; i < job->argc && pos < len; i ++)
+        pos += snprintf(buf + pos, len - pos, i ? " %s" : "%s", job->argv[i]);
+}
+
+static TransferJob* find_job(int id)
+{
+    for(TransferJob* job = jobs; job; job = job->next)
+    {
+        if(job->id == id)
+            return job;
+    }
+    return NULL;
+}
+
+static int host_running(const char* host)
+{
+    int count = 0;
+
+    for(TransferJob* job = jobs; job; job = job->next)
+        count += job->state == JOB_RUNNING && strcmp(job->host, host) == 0;
+    return count;
+}
+
+// 调度: 优先级高的先运行; 同一优先级中, 正在运行任务少的主机先运行, 再按大小从小到大, 最后按提交顺序
+static TransferJob* pick_job(void)
+{
+    TransferJob* best = NULL;
+    int best_load = 0;
+
+    for(TransferJob* job = jobs; job; job = job->next)
+    {
+        if(job->state != JOB_QUEUED)
+            continue;
+
+        int load = host_running(job->host);
+        if(!best || job->priority < best->priority ||
+           (job->priority == best->priority &&
+            (load < best_load || (load == best_load && job->size < best->size))))
+        {
+            best = job;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+// 已结束的任务只保留最近的 ENGINE_HISTORY 个
+static void prune_history(void)
+{
+    int finished = 0;
+
+    for(TransferJob* job = jobs; job; job = job->next)
+        finished += job->state >= JOB_DONE;
+
+    TransferJob** link = &jobs;
+    while(*link && finished > ENGINE_HISTORY)
+    {
+        TransferJob* job = *link;
+        if(job->state >= JOB_DONE)
+        {
+            *link = job->next;
+            free(job);
+            finished --;
+        }
+        else
+        {
+            link = &job->next;
+        }
+    }
+}
+
+static void finish_job(TransferJob* job, JobState state)
+{
+    char command[ENGINE_LINE_LEN];
+
+    job->state = state;
+    clock_gettime(CLOCK_MONOTONIC, &job->finished);
+    format_command(job, command, sizeof(command));
+    printf("\n[%d] %s: %s (%.1fs)\n", job->id, state_names[state], command,
+           state == JOB_CANCELLED && job->started.tv_sec == 0 ? 0.0 : seconds_between(&job->started, &job->finished));
+    fflush(stdout);
+    pthread_cond_broadcast(&engine_changed);
+}
+
+static void* engine_worker(void* arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&engine_lock);
+    while(1)
+    {
+        TransferJob* job;
+        while((job = pick_job()) == NULL)
+            pthread_cond_wait(&engine_changed, &engine_lock);
+
+        job->state = JOB_RUNNING;
+        clock_gettime(CLOCK_MONOTONIC, &job->started);
+        pthread_mutex_unlock(&engine_lock);
+
+        current_job = job;
+        int result = job->func(job->argc, job->argv);
+        current_job = NULL;
+
+        pthread_mutex_lock(&engine_lock);
+        job->result = result;
+        finish_job(job, job->cancelled ? JOB_CANCELLED : result == 0 ? JOB_DONE : JOB_FAILED);
+        prune_history();
+    }
+    return NULL;
+}
+
+// 第一次提交任务时启动工作线程, 之后常驻
+static int engine_start(void)
+{
+    pthread_t thread;
+    int started = 0;
+
+    for(int i = 0; i < ENGINE_WORKERS; i ++)
+    {
+        if(pthread_create(&thread, NULL, engine_worker, NULL) == 0)
+        {
+            pthread_detach(thread);
+            started ++;
+        }
+    }
+    return started > 0 ? 0 : -1;
+}
+
+// 提交后台任务, argv 会被复制; 返回任务号, 失败返回 -1
+int engine_submit(JobFunc func, int argc, char* argv[], JobPriority priority, const char* host, uint64_t size)
+{
+    TransferJob* job = calloc(1, sizeof(TransferJob));
+    size_t pos = 0;
+
+    if(!job || argc <= 0 || argc >= ENGINE_MAX_ARGS)
+    {
+        free(job);
+        return -1;
+    }
+    for(int i = 0; i < argc; i ++)
+    {
+        size_t len = strlen(argv[i]) + 1;
+        if(pos + len > sizeof(job->line))
+        {
+            free(job);
+            return -1;
+        }
+        memcpy(job->line + pos, argv[i], len);
+        job->argv[i] = job->line + pos;
+        pos += len;
+    }
+    job->argc = argc;
+    job->argv[argc] = NULL;
+    job->func = func;
+    job->priority = priority;
+    job->size = size;
+    snprintf(job->host, sizeof(job->host), "%s", host);
+    clock_gettime(CLOCK_MONOTONIC, &job->submitted);
+
+    pthread_mutex_lock(&engine_lock);
+    if(!engine_started)
+    {
+        if(engine_start() < 0)
+        {
+            pthread_mutex_unlock(&engine_lock);
+            free(job);
+            return -1;
+        }
+        engine_started = 1;
+    }
+
+    job->id = next_id ++;
+    TransferJob** link = &jobs;
+    while(*link)
+        link = &(*link)->next;
+    *link = job;
+    int id = job->id;
+    pthread_cond_broadcast(&engine_changed);
+    pthread_mutex_unlock(&engine_lock);
+    return id;
+}
+
+// jobs 命令: 列出排队、运行中和最近结束的任务
+void engine_list(void)
+{
+    struct timespec now;
+    char command[ENGINE_LINE_LEN];
+    char size[32];
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&engine_lock);
+    if(!jobs)
+    {
+        printf("No jobs\n");
+        pthread_mutex_unlock(&engine_lock);
+        return;
+    }
+
+    printf("%4s  %-9s  %-6s  %-15s  %12s  %8s  %s\n", "ID", "STATE", "PRIO", "HOST", "SIZE", "TIME", "COMMAND");
+    for(TransferJob* job = jobs; job; job = job->next)
+    {
+        double secs = job->state == JOB_QUEUED ? seconds_between(&job->submitted, &now) :
+                      job->state == JOB_RUNNING ? seconds_between(&job->started, &now) :
+                      job->started.tv_sec == 0 ? 0.0 : seconds_between(&job->started, &job->finished);
+
+        if(job->size == ENGINE_SIZE_UNKNOWN)
+            snprintf(size, sizeof(size), "-");
+        else
+            snprintf(size, sizeof(size), "%" PRIu64, job->size);
+        format_command(job, command, sizeof(command));
+        printf("%4d  %-9s  %-6s  %-15s  %12s  %7.1fs  %s\n", job->id, state_names[job->state],
+               priority_names[job->priority], job->host, size, secs, command);
+    }
+    pthread_mutex_unlock(&engine_lock);
+}
+
+// wait 命令: 等待一个任务结束, id 为 0 时等待所有任务; 任务成功返回 0
+int engine_wait(int id)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&engine_lock);
+    while(1)
+    {
+        int pending = 0;
+
+        if(id > 0)
+        {
+            TransferJob* job = find_job(id);
+            if(!job)
+            {
+                printf("No such job: %d\n", id);
+                ret = -1;
+                break;
+            }
+            if(job->state >= JOB_DONE)
+            {
+                ret = job->state == JOB_DONE ? 0 : -1;
+                break;
+            }
+            pending = 1;
+        }
+        else
+        {
+            for(TransferJob* job = jobs; job; job = job->next)
+                pending += job->state < JOB_DONE;
+            if(!pending)
+                break;
+        }
+        pthread_cond_wait(&engine_changed, &engine_lock);
+    }
+    pthread_mutex_unlock(&engine_lock);
+    return ret;
+}
+
+// cancel 命令: 排队的任务直接取消; 运行中的任务断开它的连接, 传输出错返回后结束
+int engine_cancel(int id)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&engine_lock);
+    TransferJob* job = find_job(id);
+    if(!job || job->state >= JOB_DONE)
+    {
+        printf(job ? "Job %d has already finished\n" : "No such job: %d\n", id);
+        ret = -1;
+    }
+    else if(job->state == JOB_QUEUED)
+    {
+        job->cancelled = 1;
+        finish_job(job, JOB_CANCELLED);
+        prune_history();
+    }
+    else
+    {
+        job->cancelled = 1;
+        for(int i = 0; i < job->socket_count; i ++)
+            shutdown(job->sockets[i], SHUT_RDWR);
+        printf("Cancelling job %d\n", id);
+    }
+    pthread_mutex_unlock(&engine_lock);
+    return ret;
+}
+
+int engine_parse_priority(const char* name)
+{
+    for(int i = 0; i < JOB_PRIO_COUNT; i ++)
+    {
+        if(strcmp(name, priority_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// 登记当前任务打开或借用的连接; 任务已取消时立即断开
+void engine_track_socket(int sockfd)
+{
+    TransferJob* job = current_job;
+
+    if(!job)
+        return;
+    pthread_mutex_lock(&engine_lock);
+    if(job->socket_count < ENGINE_JOB_SOCKETS)
+        job->sockets[job->socket_count ++] = sockfd;
+    if(job->cancelled)
+        shutdown(sockfd, SHUT_RDWR);
+    pthread_mutex_unlock(&engine_lock);
+}
+
+// 连接归还时取消登记, 返回 1 表示任务已取消, 连接不能再复用
+int engine_untrack_socket(int sockfd)
+{
+    TransferJob* job = current_job;
+    int cancelled;
+
+    if(!job)
+        return 0;
+    pthread_mutex_lock(&engine_lock);
+    for(int i = 0; i < job->socket_count; i ++)
+    {
+        if(job->sockets[i] == sockfd)
+        {
+            job->sockets[i] = job->sockets[-- job->socket_count];
+            break;
+        }
+    }
+    cancelled = job->cancelled;
+    pthread_mutex_unlock(&engine_lock);
+    return cancelled;
+}
+
+typedef struct {
+    void* (*start)(void*);
+    void* arg;
+    TransferJob* job;
+} JobThread;
+
+static void* job_thread_main(void* arg)
+{
+    JobThread thread = *(JobThread*)arg;
+
+    free(arg);
+    current_job = thread.job;
+    return thread.start(thread.arg);
+}
+
+// 创建属于当前任务的线程, 它打开的连接同样会被登记
+int engine_thread_create(pthread_t* thread, void* (*start)(void*), void* arg)
+{
+    JobThread* ctx = malloc(sizeof(JobThread));
+
+    if(!ctx)
+        return -1;
+    ctx->start = start;
+    ctx->arg = arg;
+    ctx->job = current_job;
+    int ret = pthread_create(thread, NULL, job_thread_main, ctx);
+    if(ret != 0)
+        free(ctx);
+    return ret;
+}
+
+int engine_in_job(void)
+{
+    return current_job != NULL;
+}
+
+// 当前线程所属任务的编号, 不在任务中时为 0
+int engine_job_id(void)
+{
+    return current_job ? current_job->id : 0;
+}
+
+// 当前任务是否已被取消; 不经过自己的连接等待的传输 (多路复用) 据此提前结束
+int engine_job_cancelled(void)
+{
+    TransferJob* job = current_job;
+
+    return job && __atomic_load_n(&job->cancelled, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,153 @@
+// upload_session.c - 并行上传的共享会话, 多个工作线程的连接共同写一个文件
+#define _GNU_SOURCE
+#include "upload_session.h"
+#include "tree.h"
+#include "log.h"
+#include <sys/eventfd.h>
+
+static UploadSession* sessions = NULL;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 调用时持有 sessions_lock
+static void upload_session_signal(UploadSession* session)
+{
+    uint64_t one = 1;
+    if(write(session->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        log_error("eventfd write: %s", strerror(errno));
+}
+
+// 调用时持有 sessions_lock
+static UploadSession* upload_session_create(int root_fd, const char* path, uint32_t id, uint64_t size)
+{
+    UploadSession* session = calloc(1, sizeof(UploadSession));
+    if(!session)
+        return NULL;
+
+    session->root_fd = root_fd;
+    snprintf(session->path, sizeof(session->path), "%s", path);
+    session->id = id;
+    session->size = size;
+
+    // 第一个连接创建并预分配文件, 各范围直接写到最终位置
+    session->fd = tree_openat(root_fd, path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(session->fd < 0)
+    {
+        log_error("Failed to open file for writing: %s", strerror(errno));
+        free(session);
+        return NULL;
+    }
+    if(size > 0 && fallocate(session->fd, 0, 0, size) < 0 && ftruncate(session->fd, size) < 0)
+    {
+        log_error("Failed to preallocate file: %s", strerror(errno));
+        close(session->fd);
+        free(session);
+        return NULL;
+    }
+
+    session->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(session->event_fd < 0)
+    {
+        close(session->fd);
+        free(session);
+        return NULL;
+    }
+
+    if(size == 0)
+        session->done = 1;
+
+    session->next = sessions;
+    sessions = session;
+    log_info("Parallel upload started: %s (Size: %" PRIu64 " bytes)", path, size);
+    return session;
+}
+
+// 加入 (root_fd, path, id) 对应的会话, 不存在时创建; 大小不一致或创建失败返回 NULL
+UploadSession* upload_session_join(int root_fd, const char* path, uint32_t id, uint64_t size)
+{
+    UploadSession* session;
+
+    pthread_mutex_lock(&sessions_lock);
+    for(session = sessions; session; session = session->next)
+    {
+        if(session->id == id && session->root_fd == root_fd && strcmp(session->path, path) == 0)
+            break;
+    }
+
+    if(!session)
+        session = upload_session_create(root_fd, path, id, size);
+    else if(session->size != size)
+    {
+        log_warn("Parallel upload size mismatch: %s", path);
+        session = NULL;
+    }
+
+    if(session)
+        session->refs ++;
+    pthread_mutex_unlock(&sessions_lock);
+    return session;
+}
+
+// 连接发完自己的范围后提交收到的字节数, 返回提交后的会话状态
+int upload_session_commit(UploadSession* session, uint64_t bytes, int failed)
+{
+    pthread_mutex_lock(&sessions_lock);
+    if(!session->done && !session->failed)
+    {
+        session->received += bytes;
+        if(failed || session->received > session->size)
+            session->failed = 1;
+        else if(session->received == session->size)
+            session->done = 1;
+
+        if(session->failed || session->done)
+            upload_session_signal(session);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+    return upload_session_status(session);
+}
+
+int upload_session_status(UploadSession* session)
+{
+    pthread_mutex_lock(&sessions_lock);
+    int status = session->failed ? UPLOAD_SESSION_FAILED :
+                 session->done ? UPLOAD_SESSION_DONE : UPLOAD_SESSION_PENDING;
+    pthread_mutex_unlock(&sessions_lock);
+    return status;
+}
+
+// 连接退出会话; aborted 表示连接在提交前断开, 这次上传不可能完整了
+void upload_session_leave(UploadSession* session, int aborted)
+{
+    UploadSession** pp;
+
+    pthread_mutex_lock(&sessions_lock);
+    if(aborted && !session->done && !session->failed)
+    {
+        session->failed = 1;
+        upload_session_signal(session);
+    }
+
+    if(-- session->refs > 0)
+    {
+        pthread_mutex_unlock(&sessions_lock);
+        return;
+    }
+
+    for(pp = &sessions; *pp; pp = &(*pp)->next)
+    {
+        if(*pp == session)
+        {
+            *pp = session->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    if(session->failed)
+        log_warn("Parallel upload failed: %s", session->path);
+    else
+        log_info("Parallel upload finished: %s", session->path);
+    close(session->fd);
+    close(session->event_fd);
+    free(session);
+}
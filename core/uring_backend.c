@@ -0,0 +1,695 @@
+// uring_backend.c - 服务器传输路径的 io_uring 后端
+// 上传: socket 读入注册缓冲区, 再写入注册文件; 下载: 文件 splice 到管道再 splice 到 socket
+// 请求在事件循环的一轮中累积, 每轮只调用一次 io_uring_enter 批量提交
+#define _GNU_SOURCE
+#include "uring_backend.h"
+#include "telemetry.h"
+#include "log.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+
+enum {
+    URING_OP_READ = 1,          // socket -> 注册缓冲区
+    URING_OP_WRITE,             // 注册缓冲区 -> 文件
+    URING_OP_SPLICE_IN,         // 文件 -> 管道
+    URING_OP_SPLICE_OUT,        // 管道 -> socket
+    URING_OP_POLL,              // 等 socket 可读, 链接在读请求前面
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// 检查内核是否支持需要的操作
+static int uring_probe_ops(UringBackend* ring)
+{
+    static const int needed[] = { IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_SPLICE };
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    int ok = 1;
+
+    if(!probe)
+        return -1;
+    if(sys_io_uring_register(ring->ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+    {
+        free(probe);
+        return -1;
+    }
+
+    for(size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i ++)
+    {
+        int op = needed[i];
+        if(op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+            ok = 0;
+    }
+    free(probe);
+    return ok ? 0 : -1;
+}
+
+static int uring_map_rings(UringBackend* ring, struct io_uring_params* p)
+{
+    ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if(p->features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED)
+        return -1;
+
+    if(p->features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ring == MAP_FAILED)
+            return -1;
+    }
+
+    ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED)
+        return -1;
+
+    char* sq = ring->sq_ring;
+    char* cq = ring->cq_ring;
+    ring->sq_head = (unsigned*)(sq + p->sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + p->sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + p->sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + p->sq_off.array);
+    ring->sq_entries = p->sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    ring->cq_head = (unsigned*)(cq + p->cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p->cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + p->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p->cq_off.cqes);
+    return 0;
+}
+
+// 注册缓冲区和稀疏的文件表, 传输开始时再把文件填进对应位置
+static int uring_register_resources(UringBackend* ring)
+{
+    struct iovec iov[URING_SLOTS * URING_SLOT_BUFS];
+    int fds[URING_SLOTS];
+    unsigned max_workers[2] = { URING_MAX_WORKERS, URING_MAX_WORKERS };
+
+    ring->buffers = mmap(NULL, (size_t)URING_SLOTS * URING_SLOT_BUFS * URING_BUF_SIZE,
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->buffers == MAP_FAILED)
+    {
+        ring->buffers = NULL;
+        return -1;
+    }
+
+    for(int i = 0; i < URING_SLOTS * URING_SLOT_BUFS; i ++)
+    {
+        iov[i].iov_base = ring->buffers + (size_t)i * URING_BUF_SIZE;
+        iov[i].iov_len = URING_BUF_SIZE;
+    }
+    if(sys_io_uring_register(ring->ring_fd, IORING_REGISTER_BUFFERS, iov, URING_SLOTS * URING_SLOT_BUFS) < 0)
+        return -1;
+
+    for(int i = 0; i < URING_SLOTS; i ++)
+        fds[i] = -1;
+    if(sys_io_uring_register(ring->ring_fd, IORING_REGISTER_FILES, fds, URING_SLOTS) < 0)
+        return -1;
+
+    // 限制 splice 阻塞时占用的内核线程, 失败不影响使用
+    sys_io_uring_register(ring->ring_fd, IORING_REGISTER_IOWQ_MAX_WORKERS, max_workers, 2);
+
+    if(sys_io_uring_register(ring->ring_fd, IORING_REGISTER_EVENTFD, &ring->event_fd, 1) < 0)
+        return -1;
+    return 0;
+}
+
+// 创建事件循环的 io_uring 实例, 内核不支持时返回 -1, 由调用者回退到普通路径
+int uring_backend_init(EventLoop* loop)
+{
+    struct io_uring_params params;
+    UringBackend* ring = calloc(1, sizeof(UringBackend));
+
+    if(!ring)
+        return -1;
+    ring->ring_fd = -1;
+    ring->event_fd = -1;
+    loop->uring = ring;
+
+    memset(&params, 0, sizeof(params));
+    ring->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if(ring->ring_fd < 0)
+    {
+        log_error("io_uring_setup: %s", strerror(errno));
+        goto fail;
+    }
+
+    ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(ring->event_fd < 0 ||
+       uring_probe_ops(ring) < 0 ||
+       uring_map_rings(ring, &params) < 0 ||
+       uring_register_resources(ring) < 0)
+    {
+        log_warn("io_uring: required features not available");
+        goto fail;
+    }
+
+    for(int i = 0; i < URING_SLOTS; i ++)
+    {
+        UringSlot* slot = &ring->slots[i];
+        slot->index = i;
+        slot->pipefd[0] = slot->pipefd[1] = -1;
+    }
+    return 0;
+
+fail:
+    uring_backend_destroy(loop);
+    return -1;
+}
+
+void uring_backend_destroy(EventLoop* loop)
+{
+    UringBackend* ring = loop->uring;
+    if(!ring)
+        return;
+
+    if(ring->sqes && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if(ring->sq_ring && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if(ring->ring_fd >= 0)
+        close(ring->ring_fd);
+    if(ring->event_fd >= 0)
+        close(ring->event_fd);
+    if(ring->buffers)
+        munmap(ring->buffers, (size_t)URING_SLOTS * URING_SLOT_BUFS * URING_BUF_SIZE);
+
+    free(ring);
+    loop->uring = NULL;
+}
+
+// 把已填写的 sqe 一次提交给内核; 内核暂时忙时留到下一轮再提交
+static int uring_submit(UringBackend* ring)
+{
+    unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if(to_submit == 0)
+        return 0;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    while(1)
+    {
+        int ret = sys_io_uring_enter(ring->ring_fd, to_submit, 0, 0);
+        if(ret >= 0)
+            return ret;
+        if(errno == EINTR)
+            continue;
+        if(errno == EAGAIN || errno == EBUSY)
+            return 0;
+        log_error("io_uring_enter: %s", strerror(errno));
+        return -1;
+    }
+}
+
+int uring_backend_submit(EventLoop* loop)
+{
+    return loop->uring ? uring_submit(loop->uring) : 0;
+}
+
+// 取一个空闲的 sqe, 队列满时先把已填写的请求提交
+static struct io_uring_sqe* uring_get_sqe(UringBackend* ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if(ring->sq_local_tail - head >= ring->sq_entries)
+    {
+        uring_submit(ring);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if(ring->sq_local_tail - head >= ring->sq_entries)
+            return NULL;
+    }
+
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail ++;
+    ring->inflight ++;
+    return sqe;
+}
+
+static char* slot_buffer(UringBackend* ring, UringSlot* slot, int buf)
+{
+    return ring->buffers + (size_t)(slot->index * URING_SLOT_BUFS + buf) * URING_BUF_SIZE;
+}
+
+static int set_socket_blocking(int fd, int blocking)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags < 0)
+        return -1;
+    flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags);
+}
+
+static int uring_update_file(UringBackend* ring, int index, int fd)
+{
+    struct io_uring_files_update update;
+
+    memset(&update, 0, sizeof(update));
+    update.offset = index;
+    update.fds = (uint64_t)(uintptr_t)&fd;
+    return sys_io_uring_register(ring->ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1 ? 0 : -1;
+}
+
+// 为连接分配传输槽; 槽用完或准备失败返回 -1, 连接走普通路径
+static int uring_slot_begin(ClientConn* conn, int upload)
+{
+    UringBackend* ring = conn->loop->uring;
+    UringSlot* slot = NULL;
+
+    for(int i = 0; i < URING_SLOTS; i ++)
+    {
+        if(!ring->slots[i].in_use)
+        {
+            slot = &ring->slots[i];
+            break;
+        }
+    }
+    if(!slot)
+        return -1;
+
+    if(!upload)
+    {
+        if(pipe2(slot->pipefd, O_CLOEXEC) < 0)
+            return -1;
+        // 超过 pipe-max-size 时保留默认容量, 按实际容量拆分 splice
+        fcntl(slot->pipefd[1], F_SETPIPE_SZ, URING_PIPE_SIZE);
+        int size = fcntl(slot->pipefd[1], F_GETPIPE_SZ);
+        slot->pipe_size = size > 0 ? (uint32_t)size : 65536;
+    }
+
+    // splice 遇到非阻塞的 socket 会直接返回 EAGAIN, 下载期间 socket 改为阻塞;
+    // 上传的读请求由内核等到数据到达, socket 保持非阻塞, 数据块之间的块头照常由事件循环读取
+    if(uring_update_file(ring, slot->index, conn->file_fd) < 0 ||
+       (!upload && set_socket_blocking(conn->fd, 1) < 0))
+    {
+        if(!upload)
+        {
+            close(slot->pipefd[0]);
+            close(slot->pipefd[1]);
+            slot->pipefd[0] = slot->pipefd[1] = -1;
+        }
+        return -1;
+    }
+
+    memset(slot->buf_busy, 0, sizeof(slot->buf_busy));
+    slot->in_use = 1;
+    slot->conn = conn;
+    slot->upload = upload;
+    slot->reading = 0;
+    slot->received = slot->written = 0;
+    slot->pipe_fill = slot->spliced = 0;
+    slot->splicing = 0;
+    slot->error = 0;
+    conn->io_slot = slot;
+    return 0;
+}
+
+// 释放传输槽, 所有请求完成后才能调用
+static void uring_slot_end(UringBackend* ring, UringSlot* slot)
+{
+    ClientConn* conn = slot->conn;
+
+    uring_update_file(ring, slot->index, -1);
+    if(slot->pipefd[0] >= 0)
+    {
+        close(slot->pipefd[0]);
+        close(slot->pipefd[1]);
+        slot->pipefd[0] = slot->pipefd[1] = -1;
+    }
+
+    if(!slot->upload && !conn->closed)
+        set_socket_blocking(conn->fd, 0);
+    conn->io_slot = NULL;
+    slot->conn = NULL;
+    slot->in_use = 0;
+}
+
+static struct io_uring_sqe* uring_slot_sqe(UringBackend* ring, UringSlot* slot, UringReq* req, int op)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    if(!sqe)
+    {
+        slot->error = 1;
+        return NULL;
+    }
+    req->slot = slot;
+    req->op = op;
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+    slot->conn->io_inflight ++;
+    return sqe;
+}
+
+// 上传: 上一串读请求都结束后, 每个空闲缓冲区提交一个读请求并链接起来
+// 链接的请求按顺序执行, 读满一个缓冲区才开始下一个; 读到的数据不够时后面的请求以 ECANCELED 结束
+// 所以完成的读请求总是按顺序、首尾相接的, 各自的数据写到 received 对应的位置
+static void uring_upload_pump(UringBackend* ring, UringSlot* slot)
+{
+    ClientConn* conn = slot->conn;
+    struct io_uring_sqe* prev = NULL;
+    uint64_t queued = slot->received;
+
+    if(slot->error || slot->reading || slot->received >= conn->file_size)
+        return;
+
+    for(int b = 0; b < URING_SLOT_BUFS && queued < conn->file_size; b ++)
+    {
+        if(slot->buf_busy[b])
+            continue;
+
+        if(!prev && ring->read_poll)
+        {
+            prev = uring_slot_sqe(ring, slot, &slot->poll_req, URING_OP_POLL);
+            if(!prev)
+                return;
+            prev->opcode = IORING_OP_POLL_ADD;
+            prev->fd = conn->fd;
+            prev->poll32_events = POLLIN;
+            prev->flags = IOSQE_IO_LINK;
+            slot->reading ++;
+        }
+
+        uint64_t remaining = conn->file_size - queued;
+        uint32_t len = remaining < URING_BUF_SIZE ? (uint32_t)remaining : URING_BUF_SIZE;
+        UringReq* req = &slot->read_req[b];
+        struct io_uring_sqe* sqe = uring_slot_sqe(ring, slot, req, URING_OP_READ);
+        if(!sqe)
+        {
+            // 已经链接的请求照常提交, 最后一个不再带链接标志
+            if(prev)
+                prev->flags &= ~IOSQE_IO_LINK;
+            return;
+        }
+
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = conn->fd;
+        sqe->addr = (uint64_t)(uintptr_t)slot_buffer(ring, slot, b);
+        sqe->len = len;
+        sqe->off = 0;
+        sqe->buf_index = slot->index * URING_SLOT_BUFS + b;
+        sqe->flags = IOSQE_IO_LINK;
+
+        req->buf = b;
+        req->len = len;
+        slot->buf_busy[b] = 1;
+        slot->reading ++;
+        queued += len;
+        prev = sqe;
+    }
+    if(prev)
+        prev->flags &= ~IOSQE_IO_LINK;
+}
+
+// 下载: 文件 -> 管道 -> socket 两个 splice 链接提交, 管道里有剩余时先发完
+static void uring_download_pump(UringBackend* ring, UringSlot* slot)
+{
+    ClientConn* conn = slot->conn;
+    struct io_uring_sqe* sqe;
+
+    if(slot->error || slot->splicing)
+        return;
+
+    if(slot->pipe_fill == 0)
+    {
+        uint64_t remaining = conn->file_size - slot->spliced;
+        if(remaining == 0)
+            return;
+        uint32_t len = remaining < slot->pipe_size ? (uint32_t)remaining : slot->pipe_size;
+
+        sqe = uring_slot_sqe(ring, slot, &slot->splice_in_req, URING_OP_SPLICE_IN);
+        if(!sqe)
+            return;
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = slot->index;
+        sqe->splice_flags = SPLICE_F_FD_IN_FIXED | SPLICE_F_MOVE;
+        sqe->splice_off_in = conn->file_offset + slot->spliced;
+        sqe->fd = slot->pipefd[1];
+        sqe->off = (uint64_t)-1;
+        sqe->len = len;
+        sqe->flags = IOSQE_IO_LINK;
+        slot->splice_in_req.len = len;
+        slot->splicing ++;
+    }
+
+    sqe = uring_slot_sqe(ring, slot, &slot->splice_out_req, URING_OP_SPLICE_OUT);
+    if(!sqe)
+        return;
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = slot->pipefd[0];
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    sqe->fd = conn->fd;
+    sqe->off = (uint64_t)-1;
+    sqe->len = slot->pipe_fill ? (uint32_t)slot->pipe_fill : slot->splice_in_req.len;
+    slot->splicing ++;
+}
+
+static void uring_handle_cqe(UringBackend* ring, struct io_uring_cqe* cqe)
+{
+    UringReq* req = (UringReq*)(uintptr_t)cqe->user_data;
+    UringSlot* slot = req->slot;
+    ClientConn* conn = slot->conn;
+    int res = cqe->res;
+
+    ring->inflight --;
+    conn->io_inflight --;
+
+    switch(req->op)
+    {
+        case URING_OP_POLL:
+            // 失败时链接的读请求以 ECANCELED 结束, 在那里处理
+            slot->reading --;
+            break;
+
+        case URING_OP_READ:
+            slot->reading --;
+            if(res == -ECANCELED || res == -EAGAIN)
+            {
+                // 前一个请求没读满, 或者老内核不等非阻塞 socket 的数据: 缓冲区放回去, 下一串再读
+                slot->buf_busy[req->buf] = 0;
+                if(res == -EAGAIN && !ring->read_poll)
+                {
+                    log_debug("io_uring: socket reads return EAGAIN, polling first");
+                    ring->read_poll = 1;
+                }
+                break;
+            }
+            if(res <= 0)
+            {
+                slot->buf_busy[req->buf] = 0;
+                slot->error = 1;
+                break;
+            }
+            slot->received += res;
+            // 请求批量提交, 不对应单独的系统调用, 只计字节数
+            telemetry_io(conn->stats, res, 0);
+
+            // 写入失败后只丢弃数据, 继续读完保持数据流同步
+            if(conn->file_failed || conn->closed)
+            {
+                slot->buf_busy[req->buf] = 0;
+                slot->written += res;
+                break;
+            }
+
+            UringReq* write_req = &slot->write_req[req->buf];
+            struct io_uring_sqe* sqe = uring_slot_sqe(ring, slot, write_req, URING_OP_WRITE);
+            if(!sqe)
+            {
+                slot->buf_busy[req->buf] = 0;
+                break;
+            }
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->fd = slot->index;
+            sqe->addr = (uint64_t)(uintptr_t)slot_buffer(ring, slot, req->buf);
+            sqe->len = res;
+            sqe->off = conn->file_offset + slot->received - res;
+            sqe->buf_index = slot->index * URING_SLOT_BUFS + req->buf;
+            write_req->buf = req->buf;
+            write_req->len = res;
+            break;
+
+        case URING_OP_WRITE:
+            slot->buf_busy[req->buf] = 0;
+            if(res != (int)req->len && !conn->file_failed)
+            {
+                log_error("Failed to write file: %s", strerror(res < 0 ? -res : EIO));
+                conn->file_failed = 1;
+            }
+            slot->written += req->len;
+            break;
+
+        case URING_OP_SPLICE_IN:
+            slot->splicing --;
+            if(res <= 0)
+                slot->error = 1;    // 链接的 splice_out 会以 ECANCELED 结束
+            else
+            {
+                slot->pipe_fill += res;
+                slot->spliced += res;
+            }
+            break;
+
+        case URING_OP_SPLICE_OUT:
+            slot->splicing --;
+            // splice_in 搬得比请求的少时链接断开, 管道里已有的数据下一轮再发
+            if(res == -ECANCELED && !slot->error)
+                break;
+            if(res < 0)
+            {
+                slot->error = 1;
+                break;
+            }
+            slot->pipe_fill -= res;
+            conn->file_done += res;
+            telemetry_io(conn->stats, res, 0);
+            break;
+    }
+
+    if(slot->upload)
+        conn->file_done = slot->written;
+}
+
+// 处理所有完成事件, 并推进相关连接的状态机
+void uring_backend_complete(EventLoop* loop)
+{
+    UringBackend* ring = loop->uring;
+    uint64_t count;
+
+    if(read(ring->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        log_error("eventfd read: %s", strerror(errno));
+
+    while(1)
+    {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if(head == tail)
+            break;
+
+        struct io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        UringSlot* slot = ((UringReq*)(uintptr_t)cqe.user_data)->slot;
+        ClientConn* conn = slot->conn;
+        uring_handle_cqe(ring, &cqe);
+
+        if(conn->closed)
+        {
+            // 连接已关闭, 等在途请求都结束后释放槽, 连接随后由事件循环回收
+            if(conn->io_inflight == 0)
+                uring_slot_end(ring, slot);
+            continue;
+        }
+        event_loop_drive(loop, conn);
+    }
+}
+
+// 关闭连接前调用: shutdown 让阻塞在 socket 上的请求尽快结束
+void uring_conn_abort(ClientConn* conn)
+{
+    UringSlot* slot = conn->io_slot;
+    if(!slot)
+        return;
+
+    slot->error = 1;
+    shutdown(conn->fd, SHUT_RDWR);
+    if(conn->io_inflight == 0)
+        uring_slot_end(conn->loop->uring, slot);
+}
+
+// 上传的一步: 返回 CONN_STEP_DONE 表示当前数据块全部写入文件, 没有空闲槽时返回 URING_STEP_FALLBACK
+// 槽留给同一文件的下一个数据块, 上传结束时由 uring_upload_end 释放
+int uring_file_upload(ClientConn* conn)
+{
+    UringBackend* ring = conn->loop->uring;
+    UringSlot* slot = conn->io_slot;
+
+    if(!slot)
+    {
+        if(uring_slot_begin(conn, 1) < 0)
+            return URING_STEP_FALLBACK;
+        slot = conn->io_slot;
+    }
+
+    if(slot->error)
+        return conn->io_inflight ? CONN_STEP_BLOCKED : CONN_STEP_CLOSE;
+
+    if(slot->written >= conn->file_size && conn->io_inflight == 0)
+    {
+        slot->received = slot->written = 0;
+        return CONN_STEP_DONE;
+    }
+
+    uring_upload_pump(ring, slot);
+    return CONN_STEP_BLOCKED;
+}
+
+// 上传结束 (或改走其他路径) 时释放传输槽, 注册的文件随之解除; 数据块之间没有在途请求
+void uring_upload_end(ClientConn* conn)
+{
+    UringSlot* slot = conn->io_slot;
+
+    if(slot && slot->upload && conn->io_inflight == 0)
+        uring_slot_end(conn->loop->uring, slot);
+}
+
+int uring_file_download(ClientConn* conn)
+{
+    UringBackend* ring = conn->loop->uring;
+    UringSlot* slot = conn->io_slot;
+
+    if(!slot)
+    {
+        if(uring_slot_begin(conn, 0) < 0)
+            return URING_STEP_FALLBACK;
+        slot = conn->io_slot;
+    }
+
+    if(slot->error)
+        return conn->io_inflight ? CONN_STEP_BLOCKED : CONN_STEP_CLOSE;
+
+    if(conn->file_done >= conn->file_size && conn->io_inflight == 0)
+    {
+        uring_slot_end(ring, slot);
+        return CONN_STEP_DONE;
+    }
+
+    uring_download_pump(ring, slot);
+    return CONN_STEP_BLOCKED;
+}
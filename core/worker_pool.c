@@ -0,0 +1,288 @@
+// worker_pool.c - 固定大小的工作线程池和有界连接队列
+#define _GNU_SOURCE
+#include "worker_pool.h"
+#include "log.h"
+#include <sys/eventfd.h>
+#include <sched.h>
+
+
+static int accept_queue_init(AcceptQueue* queue, int capacity)
+{
+    queue->items = calloc(capacity, sizeof(PendingConn));
+    if(!queue->items)
+        return -1;
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    return 0;
+}
+
+// 入队, 队列已满返回 -1
+static int accept_queue_push(AcceptQueue* queue, int fd, const struct sockaddr_in* addr)
+{
+    pthread_mutex_lock(&queue->lock);
+    if(queue->count == queue->capacity)
+    {
+        pthread_mutex_unlock(&queue->lock);
+        return -1;
+    }
+
+    PendingConn* item = &queue->items[(queue->head + queue->count) % queue->capacity];
+    item->fd = fd;
+    item->addr = *addr;
+    queue->count ++;
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+// 出队, 队列为空返回 -1; was_full 表示出队前队列是满的
+static int accept_queue_pop(AcceptQueue* queue, PendingConn* out, int* was_full)
+{
+    pthread_mutex_lock(&queue->lock);
+    if(queue->count == 0)
+    {
+        pthread_mutex_unlock(&queue->lock);
+        return -1;
+    }
+
+    *was_full = queue->count == queue->capacity;
+    *out = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count --;
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+static void accept_queue_destroy(AcceptQueue* queue)
+{
+    PendingConn item;
+    int was_full;
+
+    // 关闭还没被接管的连接
+    while(accept_queue_pop(queue, &item, &was_full) == 0)
+        close(item.fd);
+
+    free(queue->items);
+    queue->items = NULL;
+    pthread_mutex_destroy(&queue->lock);
+}
+
+static void eventfd_signal(int fd)
+{
+    uint64_t one = 1;
+    if(write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        log_error("eventfd write: %s", strerror(errno));
+}
+
+// 工作线程被唤醒: 按投递次数从共享队列取出连接
+static void worker_adopt_conns(EventLoop* loop)
+{
+    ServerWorker* worker = loop->owner;
+    WorkerPool* pool = worker->pool;
+    uint64_t count = 0;
+    PendingConn item;
+    int was_full;
+
+    if(read(worker->notify_fd, &count, sizeof(count)) != sizeof(count))
+        return;
+
+    while(count -- > 0 && accept_queue_pop(&pool->queue, &item, &was_full) == 0)
+    {
+        if(was_full)
+            eventfd_signal(pool->space_fd);
+
+        ClientConn* conn = event_loop_add_conn(loop, item.fd, &item.addr);
+        if(!conn)
+        {
+            close(item.fd);
+            continue;
+        }
+        event_loop_drive(loop, conn);
+    }
+}
+
+// 当前进程可用的 CPU 个数
+int online_cpu_count(void)
+{
+    cpu_set_t set;
+
+    if(sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+        return CPU_COUNT(&set);
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+// 第 index 个可用的 CPU 编号, 超出时循环使用
+static int nth_allowed_cpu(int index)
+{
+    cpu_set_t set;
+    int count, seen = 0;
+
+    if(sched_getaffinity(0, sizeof(set), &set) != 0 || (count = CPU_COUNT(&set)) == 0)
+        return -1;
+
+    index %= count;
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu ++)
+    {
+        if(CPU_ISSET(cpu, &set) && seen ++ == index)
+            return cpu;
+    }
+    return -1;
+}
+
+static void* server_worker_thread(void* arg)
+{
+    ServerWorker* worker = (ServerWorker*)arg;
+
+    if(worker->cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            log_warn("Failed to pin worker to cpu %d", worker->cpu);
+    }
+
+    event_loop_run(&worker->loop);
+    event_loop_destroy(&worker->loop);
+    return NULL;
+}
+
+int worker_pool_start(WorkerPool* pool, ServerConfig* config)
+{
+    int workers = config->options.workers;
+    int queue_size = config->options.queue_size;
+
+    memset(pool, 0, sizeof(WorkerPool));
+    pool->space_fd = -1;
+    pool->sharded = config->options.reuseport;
+
+    pool->workers = calloc(workers, sizeof(ServerWorker));
+    if(!pool->workers)
+        return -1;
+    pool->worker_count = workers;
+    for(int i = 0; i < workers; i ++)
+        pool->workers[i].notify_fd = -1;
+
+    if(!pool->sharded)
+    {
+        pool->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(pool->space_fd < 0 || accept_queue_init(&pool->queue, queue_size) < 0)
+        {
+            worker_pool_stop(pool);
+            return -1;
+        }
+    }
+
+    for(int i = 0; i < workers; i ++)
+    {
+        ServerWorker* worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->cpu = -1;
+
+        if(event_loop_init(&worker->loop, config) < 0)
+            goto fail;
+
+        if(pool->sharded)
+        {
+            // 每个分片一个监听 socket, 由内核按四元组哈希分配连接
+            int listenfd = open_listenfd(config->port, config->options.backlog, 1);
+            if(listenfd < 0 || event_loop_add_listener(&worker->loop, listenfd) < 0)
+            {
+                if(listenfd >= 0)
+                    close(listenfd);
+                event_loop_destroy(&worker->loop);
+                goto fail;
+            }
+            worker->cpu = nth_allowed_cpu(i);
+        }
+        else
+        {
+            worker->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if(worker->notify_fd < 0 ||
+               event_loop_add_notify(&worker->loop, worker->notify_fd, worker_adopt_conns, worker) < 0)
+            {
+                event_loop_destroy(&worker->loop);
+                goto fail;
+            }
+        }
+
+        if(pthread_create(&worker->thread, NULL, server_worker_thread, worker) != 0)
+        {
+            event_loop_destroy(&worker->loop);
+            goto fail;
+        }
+        pool->started ++;
+    }
+
+    if(pool->sharded)
+        log_info("Worker pool started: %d SO_REUSEPORT shards, backlog %d", workers, config->options.backlog);
+    else
+        log_info("Worker pool started: %d workers, accept queue %d", workers, queue_size);
+    return 0;
+
+fail:
+    // 已启动的工作线程要靠运行标志退出
+    log_error("Failed to start server workers");
+    config->is_running = 0;
+    worker_pool_stop(pool);
+    return -1;
+}
+
+// 把连接放入队列并唤醒当前连接数最少的工作线程, 队列已满返回 -1
+int worker_pool_dispatch(WorkerPool* pool, int fd, const struct sockaddr_in* addr)
+{
+    ServerWorker* target = &pool->workers[0];
+    int least = __atomic_load_n(&target->loop.conn_count, __ATOMIC_RELAXED);
+
+    if(accept_queue_push(&pool->queue, fd, addr) < 0)
+        return -1;
+
+    for(int i = 1; i < pool->worker_count; i ++)
+    {
+        int count = __atomic_load_n(&pool->workers[i].loop.conn_count, __ATOMIC_RELAXED);
+        if(count < least)
+        {
+            least = count;
+            target = &pool->workers[i];
+        }
+    }
+
+    eventfd_signal(target->notify_fd);
+    return 0;
+}
+
+int worker_pool_full(WorkerPool* pool)
+{
+    pthread_mutex_lock(&pool->queue.lock);
+    int full = pool->queue.count == pool->queue.capacity;
+    pthread_mutex_unlock(&pool->queue.lock);
+    return full;
+}
+
+// 等待工作线程退出 (调用前需清除 config->is_running) 并释放资源
+void worker_pool_stop(WorkerPool* pool)
+{
+    for(int i = 0; i < pool->started; i ++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    if(pool->workers)
+    {
+        for(int i = 0; i < pool->worker_count; i ++)
+        {
+            if(pool->workers[i].notify_fd >= 0)
+                close(pool->workers[i].notify_fd);
+        }
+        free(pool->workers);
+        pool->workers = NULL;
+    }
+
+    if(pool->space_fd >= 0)
+        close(pool->space_fd);
+    pool->space_fd = -1;
+
+    if(pool->queue.items)
+        accept_queue_destroy(&pool->queue);
+    pool->started = 0;
+}
@@ -0,0 +1,46 @@
+#ifndef _CHECKSUM_H_
+#define _CHECKSUM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MD5_DIGEST_LEN      16
+#define SHA256_DIGEST_LEN   32
+
+typedef struct {
+    uint32_t state[4];
+    uint64_t count;             // 已输入的字节数
+    uint8_t buffer[64];
+} Md5Context;
+
+void md5_init(Md5Context* ctx);
+void md5_update(Md5Context* ctx, const void* data, size_t len);
+void md5_final(Md5Context* ctx, uint8_t digest[MD5_DIGEST_LEN]);
+void md5(const void* data, size_t len, uint8_t digest[MD5_DIGEST_LEN]);
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t count;
+    uint8_t buffer[64];
+} Sha256Context;
+
+void sha256_init(Sha256Context* ctx);
+void sha256_update(Sha256Context* ctx, const void* data, size_t len);
+void sha256_final(Sha256Context* ctx, uint8_t digest[SHA256_DIGEST_LEN]);
+void sha256(const void* data, size_t len, uint8_t digest[SHA256_DIGEST_LEN]);
+
+// CRC32C (Castagnoli 多项式), crc 为前面数据的结果, 第一次传 0
+// CPU 支持 SSE4.2 时用 crc32 指令, 否则查表 (slice-by-8)
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+// rsync 的滚动校验和: 低 16 位为字节和, 高 16 位为加权和, 窗口后移一个字节只需 O(1) 更新
+uint32_t rolling_checksum(const uint8_t* data, size_t len);
+
+static inline uint32_t rolling_roll(uint32_t sum, uint8_t out, uint8_t in, size_t len)
+{
+    uint32_t a = (sum & 0xffff) - out + in;
+    uint32_t b = (sum >> 16) - (uint32_t)len * out + a;
+    return (a & 0xffff) | (b << 16);
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include "transfer.h"
+#include "lz.h"
+
+// 传输压缩 (FEATURE_COMPRESS), put -z / get -z 按文件开启:
+// 数据按 COMPRESS_BLOCK 切成 v2 数据块, 压缩的块在块头 flags 中带 CHUNK_FLAG_LZ, length 为压缩后的长度,
+// 数据为 4 字节原始长度 (网络字节序) 加 LZ 压缩数据, offset 仍是原始数据在文件中的位置
+// 发送方先抽样估计每块的熵, 接近随机的数据 (媒体、压缩包) 和压缩后省不到 1/16 的块按原样发送
+// 上传时协商了功能服务器就接受压缩块; 下载时请求带 FILE_FLAG_COMPRESS 服务器才压缩
+#define COMPRESS_BLOCK      (128 << 10)
+#define COMPRESS_HEAD       4                                   // 负载开头的原始长度
+#define COMPRESS_PAYLOAD_MAX (COMPRESS_HEAD + COMPRESS_BLOCK)   // 压缩后不比原始数据短就不用压缩格式
+
+// 服务器端一个传输的压缩状态, 传输结束时释放
+typedef struct CompressStream {
+    uint8_t* raw;               // 原始数据
+    uint8_t* packed;            // 压缩的负载
+    int active;                 // 上传: 当前数据块是压缩的, 负载收到 packed 中
+    const uint8_t* out;         // 下载: 当前块要发送的数据, 指向 raw 或 packed
+    size_t out_len;
+    size_t out_sent;
+    uint64_t raw_bytes;         // 原始数据的字节数
+    uint64_t wire_bytes;        // 实际传输的数据字节数
+} CompressStream;
+
+// 客户端统计
+typedef struct {
+    uint64_t raw;
+    uint64_t wire;
+    uint32_t compressed;        // 压缩发送的块数
+    uint32_t bypassed;          // 按原样发送的块数
+} CompressStats;
+
+// 压缩一块数据到 payload (至少 COMPRESS_PAYLOAD_MAX 字节), 返回负载长度; 返回 0 表示应按原样发送
+uint32_t compress_chunk(const uint8_t* raw, uint32_t len, uint8_t* payload);
+// 解压负载到 raw (至少 COMPRESS_BLOCK 字节), 返回原始长度; 数据不合法返回 -1
+int64_t decompress_chunk(const uint8_t* payload, uint32_t len, uint8_t* raw);
+
+// 服务器端
+int open_compress(ClientConn* conn);
+int handle_compress_upload(ClientConn* conn);
+int queue_compress_chunk(ClientConn* conn, uint64_t offset, uint32_t length);
+int handle_compress_download(ClientConn* conn);
+void close_compress(ClientConn* conn);
+
+// 客户端: 把文件的 [offset, offset + length) 压缩后按数据块发送, 不发送结束块; crc 非 0 时每块带 CRC32C
+int send_file_range_compress(int sockfd, int file_fd, uint64_t offset, uint64_t length, int crc, CompressStats* stats);
+
+#endif
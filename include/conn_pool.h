@@ -0,0 +1,31 @@
+#ifndef _CONN_POOL_H_
+#define _CONN_POOL_H_
+
+#include "transfer.h"
+
+#define CONN_POOL_SIZE          32      // 最多同时缓存的连接 (空闲 + 使用中)
+#define CONN_POOL_IDLE_TIMEOUT  60      // 空闲连接保留的秒数
+#define CONN_POOL_REAP_INTERVAL 5       // 清理线程检查超时的间隔 (秒)
+
+// 客户端连接池: 已认证并协商过协议的连接, 按 (IP, 端口, 用户) 复用
+typedef struct {
+    int sockfd;                 // -1 表示空位
+    int in_use;                 // 已借出
+    char ip[MAX_IP_LEN];
+    int port;
+    char username[MAX_USERNAME_LEN];
+    char password[MAX_PASSWORD_LEN];
+    int proto;
+    uint16_t features;
+    time_t idle_since;
+} PooledConn;
+
+int conn_pool_acquire(const char* ip, int port, const char* username, const char* password,
+                      int* proto, uint16_t* features);
+void conn_pool_add(int sockfd, const char* ip, int port, const char* username, const char* password,
+                   int proto, uint16_t features);
+void conn_pool_release(int sockfd, int reusable);
+void conn_pool_detach(int sockfd);
+void conn_pool_clear(void);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include "transfer.h"
+#include "checksum.h"
+#include "sync_queue.h"
+
+// 去重上传 (CMD_PUT_DEDUP), 服务器用 server -D 开启:
+// 客户端按内容切块 (FastCDC 的 gear 滚动哈希), 相同内容总在相同位置切开, 文件中间插入数据只影响附近的块
+// 1. 客户端发送文件头 (filesize 为文件大小, offset 为索引长度)、文件名和索引:
+//    每块 32 字节 SHA-256 + 4 字节长度 (网络字节序), 按文件中的顺序排列
+// 2. 服务器查块仓库, 回复文件头 (filesize 为需要上传的字节数, offset 为位图长度) 和位图:
+//    第 i 位为 1 表示需要第 i 块的数据; 同一文件里重复的块只要第一次出现的那个
+// 3. 客户端把需要的块按顺序拼接, 用 v2 数据块发送, 服务器校验 SHA-256 后存入仓库
+// 4. 服务器把索引作为清单写到文件名的位置, 回复 ACK/NAK; 下载时按清单从仓库逐块读取
+#define DEDUP_STORE_DIR     ".lftp-chunks"  // 根目录下的块仓库, 块按哈希存为 "ab/cdef..."
+#define DEDUP_TEMP_SUFFIX   ".lftp-dedup"   // 写入中的块和清单
+#define DEDUP_CHUNK_MIN     (4 << 10)
+#define DEDUP_CHUNK_AVG     (16 << 10)      // 期望的平均块大小, 2 的幂
+#define DEDUP_CHUNK_MAX     (64 << 10)
+#define DEDUP_MAX_CHUNKS    (1 << 20)       // 一个文件最多的块数, 超过时客户端按普通上传
+#define DEDUP_ENTRY_SIZE    (SHA256_DIGEST_LEN + 4)
+#define DEDUP_MANIFEST_MAGIC "LFTPDDM1"
+#define DEDUP_MANIFEST_HEAD 24              // 魔数 8 字节 + 文件大小 8 字节 + 块数 4 字节 + 保留 4 字节
+
+// 服务器端的去重上传状态
+typedef struct DedupUpload {
+    int store_fd;
+    uint64_t size;              // 文件大小
+    uint8_t* index;             // 接收中的索引, 也是最后写入的清单内容
+    size_t index_len;
+    size_t index_got;
+    uint32_t count;
+
+    uint8_t* reply;             // 回复头和位图
+    size_t reply_len;
+    size_t reply_off;
+
+    uint32_t cur;               // 正在接收的块, 只在需要的块之间移动
+    uint8_t* chunk;             // 当前块的数据
+    uint32_t chunk_got;
+    uint64_t stored;            // 新存入仓库的字节数
+    int failed;                 // 块校验或写入失败, 读完数据后回复 NAK
+    SyncGroup sync;             // 后台落盘并 rename 的新块
+    uint8_t dirs[32];           // 存入过新块的子目录, 按哈希第一个字节记位, 写清单前逐个 fsync
+} DedupUpload;
+
+// 服务器端读取清单: 按位置找到所在的块, 直接读仓库里的块文件, 不展开成完整文件
+typedef struct DedupReader {
+    int store_fd;
+    uint64_t size;              // 展开后的文件大小
+    uint32_t count;
+    uint8_t* index;             // 清单中的索引
+    uint64_t* starts;           // 第 i 块在文件中的起点, starts[count] 为文件大小
+    uint32_t cur;               // chunk_fd 对应的块
+    int chunk_fd;               // 最近读的块, -1 表示没有打开
+} DedupReader;
+
+// 客户端统计
+typedef struct {
+    uint32_t chunks;
+    uint32_t sent_chunks;
+    uint64_t sent;              // 上传的块数据字节数
+} DedupStats;
+
+#define DEDUP_FALLBACK      2   // send_file_dedup: 文件块太多, 改用普通上传
+
+// 服务器端
+int dedup_open_store(int root_fd);
+int dedup_open_read(int store_fd, int fd, struct stat* st, DedupReader** reader);
+int dedup_read_chunk(DedupReader* reader, uint64_t offset, off_t* chunk_offset, size_t* avail);
+ssize_t dedup_pread(DedupReader* reader, int fd, void* data, size_t len, uint64_t offset);
+void dedup_close_read(DedupReader* reader);
+void close_download_dedup(ClientConn* conn);
+int open_upload_dedup(ClientConn* conn, int store_fd);
+int handle_dedup_index(ClientConn* conn);
+int handle_dedup_upload(ClientConn* conn);
+int finish_upload_dedup(ClientConn* conn, int root_fd);
+void close_upload_dedup(ClientConn* conn);
+
+// 客户端: 发送索引, 按服务器的位图发送缺少的块, 不等待最后的 ACK/NAK
+int send_file_dedup(int sockfd, const char* filename, int file_fd, uint64_t size, DedupStats* stats);
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include "transfer.h"
+#include "checksum.h"
+
+// 增量上传 (CMD_PUT_DELTA): 服务器上已有旧版本时只发送变化的部分, 做法同 rsync
+// 1. 客户端发送文件头 (filesize 为新文件大小) 和文件名
+// 2. 服务器把旧文件按块计算签名并回复: 文件头的 filesize 为旧文件大小, offset 为块大小,
+//    后面每块一个 DeltaSignature; 文件不存在时签名为空; 无法写入时只回复 NAK
+// 3. 客户端用滚动校验和在新文件的每个位置查找旧块, 发送 DeltaOp 序列:
+//    COPY 复制旧文件中连续的若干块, LITERAL 后面跟 arg 字节新数据, END 后面跟新文件的 MD5
+// 4. 服务器把结果写入同目录下的临时文件, 长度和 MD5 都对上才替换原文件, 回复 ACK/NAK
+#define DELTA_BLOCK_MIN     2048            // 块大小约为旧文件大小的平方根, 取 2 的幂
+#define DELTA_BLOCK_MAX     (128 << 10)
+#define DELTA_MAX_BLOCKS    (1 << 22)       // 签名最多的块数, 超过时加大块
+#define DELTA_SIG_BATCH     256             // 服务器每次计算并发送的签名数
+#define DELTA_LITERAL_MAX   CHUNK_SIZE      // 单个 LITERAL 的最大长度
+#define DELTA_TEMP_SUFFIX   ".lftp-delta"   // 临时文件名: ".<文件名>.lftp-delta"
+
+// 一个旧块的签名, 网络字节序
+typedef struct {
+    uint32_t weak;                  // 滚动校验和
+    uint8_t strong[MD5_DIGEST_LEN];
+} DeltaSignature;
+
+enum {
+    DELTA_OP_END = 0,
+    DELTA_OP_COPY = 1,              // arg 为起始块号, count 为块数
+    DELTA_OP_LITERAL = 2,           // arg 为数据长度
+};
+
+typedef struct {
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t arg;
+    uint32_t count;
+} DeltaOp;
+
+// 服务器端的重建状态
+typedef struct DeltaUpload {
+    int old_fd;                     // 旧文件, -1 表示没有
+    struct DedupReader* old_manifest;   // 旧文件是去重清单时逐块读取, NULL 表示普通文件
+    int dir_fd;                     // 文件所在目录, 临时文件建在这里再 rename
+    int tmp_fd;
+    char base_name[MAX_PATH_LEN];
+    char tmp_name[MAX_PATH_LEN + 32];
+    uint64_t old_size;
+    uint32_t block_size;
+    uint32_t block_count;
+
+    // 发送签名
+    uint32_t sig_next;              // 下一个要计算的块
+    uint8_t* block_buf;             // 读取旧块的缓冲, 签名发完后释放
+    DeltaSignature* sig_buf;
+    size_t sig_len;
+    size_t sig_off;
+
+    // 接收操作
+    DeltaOp op;                     // 正在执行的操作
+    uint64_t op_left;               // 当前操作剩余的字节数
+    uint64_t copy_pos;              // COPY 在旧文件中的读取位置
+    uint64_t written;               // 已重建的字节数
+    uint64_t literal;               // 其中客户端发来的新数据
+    int ending;                     // 已收到 END, 等待新文件的 MD5
+    Md5Context md5;                 // 重建结果的 MD5
+    int failed;                     // 写入出错, 继续读完数据流后回复 NAK
+} DeltaUpload;
+
+// 客户端统计
+typedef struct {
+    uint64_t matched;               // 复用旧块的字节数
+    uint64_t literal;               // 发送的新数据字节数
+} DeltaStats;
+
+// 服务器端
+int open_upload_delta(ClientConn* conn, int root_fd);
+int handle_delta_signature(ClientConn* conn);
+int handle_delta_upload(ClientConn* conn, char* buffer, size_t buflen);
+int finish_upload_delta(ClientConn* conn);
+void close_upload_delta(ClientConn* conn);
+
+// 客户端: 发出请求后接收签名并发送操作序列, 不等待最后的 ACK/NAK
+int send_file_delta(int sockfd, const char* filename, int file_fd, uint64_t size, DeltaStats* stats);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef _EVENT_LOOP_H_
+#define _EVENT_LOOP_H_
+
+#include "transfer.h"
+#include <sys/epoll.h>
+
+#define EVENT_LOOP_MAX_EVENTS   256         // 单次 epoll_wait 返回的最大事件数
+#define EVENT_LOOP_SCRATCH_SIZE 65536       // 数据收发的共享缓冲区
+#define EVENT_LOOP_CONN_BUDGET  (4 << 20)   // 每个连接每轮最多处理的数据量
+#define EVENT_LOOP_ACCEPT_BATCH 64          // 每轮最多 accept 的连接数
+#define EVENT_LOOP_PIPE_SIZE    (1 << 20)   // 上传 splice 管道的期望容量
+
+// epoll 事件循环: 一个线程驱动所有连接的状态机
+typedef struct EventLoop {
+    int epfd;
+    int listenfd;                   // 监听 socket, -1 表示没有
+    int notify_fd;                  // 外部唤醒用的 eventfd, -1 表示没有
+    void (*on_notify)(struct EventLoop* loop);
+    void* owner;                    // 事件循环的所有者 (工作线程)
+    ServerConfig* config;
+
+    ClientConn* conns;              // 活动连接链表
+    ClientConn* ready;              // 用完配额、需要继续推进的连接
+    ClientConn* dead;               // 本轮关闭, 等待释放的连接
+    int conn_count;
+
+    char* scratch;                  // 上传数据的中转缓冲
+    size_t scratch_size;
+
+    // 上传零拷贝: socket -> 管道 -> 文件, 每次 splice 后立即排空, 所有连接共用
+    int splice_pipe[2];             // -1 表示不可用, 走缓冲区中转
+    size_t splice_pipe_size;
+
+    struct UringBackend* uring;     // io_uring 后端, NULL 表示使用普通系统调用
+} EventLoop;
+
+int event_loop_init(EventLoop* loop, ServerConfig* config);
+int event_loop_add_listener(EventLoop* loop, int listenfd);
+int event_loop_add_notify(EventLoop* loop, int notify_fd, void (*on_notify)(EventLoop* loop), void* owner);
+ClientConn* event_loop_add_conn(EventLoop* loop, int fd, const struct sockaddr_in* addr);
+void event_loop_close_conn(EventLoop* loop, ClientConn* conn);
+int event_loop_watch(EventLoop* loop, ClientConn* conn, int fd);
+void event_loop_unwatch(EventLoop* loop, ClientConn* conn);
+void event_loop_drive(EventLoop* loop, ClientConn* conn);
+void event_loop_run(EventLoop* loop);
+void event_loop_destroy(EventLoop* loop);
+void event_loop_close_pipe(EventLoop* loop);
+
+// 连接的非阻塞读写辅助函数
+void conn_expect(ClientConn* conn, size_t len);
+int conn_fill(ClientConn* conn);
+int conn_queue(ClientConn* conn, const void* data, size_t len);
+int conn_flush(ClientConn* conn);
+int set_nonblocking(int fd);
+
+#endif
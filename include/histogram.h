@@ -0,0 +1,26 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// HDR 风格的对数分桶直方图: 小于 2^HISTOGRAM_SUB_BITS 的值每个一个桶,
+// 更大的值每个 2 的幂区间分成 2^(HISTOGRAM_SUB_BITS - 1) 个桶, 相对误差不超过 1/64
+// 记录只做原子操作, 多个线程可以同时写同一个直方图
+#define HISTOGRAM_SUB_BITS  7
+#define HISTOGRAM_BUCKETS   ((64 - HISTOGRAM_SUB_BITS + 2) << (HISTOGRAM_SUB_BITS - 1))
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;                 // 记录的个数
+    uint64_t sum;
+    uint64_t max;
+} Histogram;
+
+void histogram_init(Histogram* hist);
+void histogram_record(Histogram* hist, uint64_t value);
+// percentile 为 0-100, 返回所在桶的上界 (不超过记录过的最大值); 没有记录时返回 0
+uint64_t histogram_percentile(const Histogram* hist, double percentile);
+double histogram_mean(const Histogram* hist);
+
+#endif
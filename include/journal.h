@@ -0,0 +1,38 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "transfer.h"
+#include "sync_queue.h"
+
+#define JOURNAL_SUFFIX      ".lftp-journal"
+#define JOURNAL_MAGIC       0x4C46544A      // "LFTJ"
+#define JOURNAL_MAX_RANGES  64              // 记录的不连续范围上限, 超出的范围下次重传
+#define JOURNAL_SYNC_BYTES  (64 << 20)      // 新写入这么多数据后在后台落盘一次
+
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} ByteRange;
+
+// 续传日志: 和未收完的文件放在一起, 记录已经写入并落盘的字节范围
+// size 和 stamp 标识发送方的文件, 不一致时不能续传
+typedef struct TransferJournal {
+    char path[MAX_PATH_LEN * 2 + sizeof(JOURNAL_SUFFIX)];
+    int file_fd;                    // 数据文件, 保存日志前先 fdatasync
+    uint64_t size;
+    uint32_t stamp;
+    int count;
+    ByteRange ranges[JOURNAL_MAX_RANGES];
+    uint64_t unsynced;              // 上次保存后新记录的字节数
+    SyncGroup sync;                 // 后台进行中的保存, 同时最多一个
+} TransferJournal;
+
+uint64_t journal_load(TransferJournal* journal, const char* file_path, int file_fd);
+uint64_t journal_open(TransferJournal* journal, const char* file_path, int file_fd, uint64_t size, uint32_t stamp);
+uint64_t journal_prefix(const TransferJournal* journal);
+void journal_add(TransferJournal* journal, uint64_t start, uint64_t end);
+int journal_save(TransferJournal* journal);
+void journal_remove(TransferJournal* journal);
+uint32_t file_stamp(const struct stat* st);
+
+#endif
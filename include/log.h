@@ -0,0 +1,47 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <errno.h>
+#include <string.h>
+
+// 日志级别, 低于当前级别的调用只读一次全局变量, 不格式化
+enum {
+    LOG_LEVEL_DEBUG,                // 发现广播、心跳等详细信息, 默认不输出
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+};
+
+#define LOG_LINE_MAX    256         // 一条日志的最大长度, 超出的部分截断
+#define LOG_RING_SIZE   256         // 每个线程缓冲的条数, 2 的幂; 写满时丢弃并计数
+
+extern int log_level;
+
+// 格式化到当前线程的环形缓冲区后立即返回, 由后台写线程加上时间戳输出到终端和日志文件
+// 不加锁, 只有写线程空闲时才需要一次系统调用唤醒它; 不改变 errno
+void log_write(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define log_at(level, ...) \
+    do { \
+        if((level) >= __atomic_load_n(&log_level, __ATOMIC_RELAXED)) \
+            log_write((level), __VA_ARGS__); \
+    } while(0)
+
+#define log_debug(...)  log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...)   log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...)   log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...)  log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// 级别名 debug / info / warn / error, 不认识时返回 -1
+int log_parse_level(const char* name);
+const char* log_level_name(int level);
+void log_set_level(int level);
+
+// 另外追加写入 path, NULL 关闭日志文件; 打开失败返回 -1, 原来的文件保持不变
+int log_set_file(const char* path);
+const char* log_file_path(void);
+
+// 等待写线程输出完调用前记录的日志; shell 显示提示符前调用, 避免日志插在输入行中间
+void log_flush(void);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef _LZ_H_
+#define _LZ_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// LZ77 块压缩, 格式同 LZ4 的块格式: 每个序列一个标记字节 (高 4 位字面量长度, 低 4 位匹配长度 - 4),
+// 长度为 15 时后面跟若干扩展字节 (255 表示继续), 字面量之后是 2 字节小端的匹配距离; 最后一个序列只有字面量
+#define LZ_MIN_MATCH        4
+#define LZ_MAX_OFFSET       65535
+#define LZ_HASH_BITS        14
+
+// 压缩结果的最大长度
+static inline size_t lz_bound(size_t len)
+{
+    return len + len / 255 + 16;
+}
+
+// 压缩 len 字节到 dst, 返回压缩后的长度; 超出 cap 时返回 0
+size_t lz_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap);
+
+// 解压到 dst, 返回解压后的长度; 数据不合法或超出 cap 时返回 -1
+ssize_t lz_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap);
+
+// 抽样估计字节熵, 非 0 表示接近随机数据 (媒体、压缩包、加密数据), 不值得压缩
+int lz_incompressible(const uint8_t* data, size_t len);
+
+#endif
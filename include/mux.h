@@ -0,0 +1,81 @@
+#ifndef _MUX_H_
+#define _MUX_H_
+
+#include "transfer.h"
+
+// 多路复用模式 (CMD_MUX): 服务器回复 ACK 后连接不再是一问一答, 双方都只发送帧
+// 每个传输是一个流, 各流的数据帧交错发送, 大文件不会堵住后面的小请求
+// 每个流单独做流量控制: 发送方只能发送对方给的额度, 接收方写入数据后用 MUX_FRAME_WINDOW 归还
+#define MUX_MAX_STREAMS     64          // 一个连接同时打开的流数
+#define MUX_FRAME_MAX       65536       // 数据帧的最大负载, 越小各流交错得越细
+#define MUX_WINDOW          (1 << 20)   // 流打开时双方的初始额度
+#define MUX_WINDOW_UPDATE   (MUX_WINDOW / 4)    // 积累到这么多再归还额度, 减少 WINDOW 帧
+#define MUX_OUT_SIZE        (256 << 10) // 服务器端待发送帧的缓冲
+#define MUX_CONTROL_ROOM    1024        // 输出缓冲至少留这么多给控制帧, 不够时暂停读取
+#define MUX_IDLE_TIMEOUT    60          // 客户端没有流的连接保留的秒数
+
+// 帧类型
+typedef enum {
+    MUX_FRAME_OPEN = 1,         // 客户端打开流: 负载为 PUT / GET 的文件头和文件名
+    MUX_FRAME_HEADER,           // 服务器回复 GET: 负载为带文件大小的文件头
+    MUX_FRAME_DATA,             // 文件数据, 按顺序追加
+    MUX_FRAME_END,              // 数据发完; 服务器发送时 value 为结果 (CMD_ACK / CMD_NAK), 之后流关闭
+    MUX_FRAME_WINDOW,           // value 为归还给对方的额度
+    MUX_FRAME_RESET,            // 客户端放弃流, 服务器关闭它, 不回复
+} MuxFrameType;
+
+// 帧头, 字段为网络字节序, 后面跟 length 字节负载
+typedef struct {
+    uint32_t stream;            // 流号, 由客户端分配, 不重复使用
+    uint16_t type;
+    uint16_t flags;             // 保留, 填 0
+    uint32_t length;
+    uint32_t value;
+} MuxFrame;
+
+// 服务器端的一个流
+typedef struct {
+    uint32_t id;                // 0 表示空闲
+    uint16_t command;           // CMD_PUT_FILE / CMD_GET_FILE
+    int file_fd;
+    struct DedupReader* manifest;   // 下载去重清单时逐块读取, NULL 表示普通文件
+    uint64_t total;             // 文件大小
+    uint64_t done;              // 已收到或已发送的字节
+    uint64_t window;            // 下载: 客户端给的剩余额度
+    uint64_t credit;            // 上传: 已写入文件、还没归还的额度
+    char filename[MAX_PATH_LEN];
+} MuxStream;
+
+// 服务器端连接的多路复用状态
+typedef struct MuxSession {
+    MuxStream streams[MUX_MAX_STREAMS];
+    int next_send;              // 轮流发送数据的起点
+
+    MuxFrame frame;             // 正在接收的帧 (已转为主机字节序)
+    int in_payload;             // 帧头已收完, 正在接收负载
+    uint8_t* in_data;           // 帧负载
+    size_t in_len;
+
+    uint8_t* out;               // 待发送的帧
+    size_t out_len;
+    size_t out_off;
+} MuxSession;
+
+void encode_mux_frame(MuxFrame* frame, uint32_t stream, uint16_t type, uint32_t length, uint32_t value);
+void decode_mux_frame(MuxFrame* frame);
+
+// 服务器端
+int open_mux_session(ClientConn* conn);
+int handle_mux_session(ClientConn* conn);
+void close_mux_session(ClientConn* conn);
+
+// 客户端: 同一服务器、同一用户的多路复用连接在并发的传输之间共用
+struct MuxClient;
+
+struct MuxClient* mux_client_get(const char* ip, int port, const char* username, const char* password);
+struct MuxClient* mux_client_start(int sockfd, const char* ip, int port, const char* username, const char* password);
+void mux_client_put(struct MuxClient* mux);
+int mux_send_file(struct MuxClient* mux, const char* filename);
+int mux_receive_file(struct MuxClient* mux, const char* filename);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef _PACK_H_
+#define _PACK_H_
+
+#include "transfer.h"
+
+// 小文件打包上传 (CMD_PUT_PACK): 一批小文件合成一个请求, 省掉逐个文件的请求头和往返
+// 文件头: filesize 为所有文件数据的总长度, offset 为索引长度, 没有文件名
+// 索引: 每个文件 8 字节大小 + 2 字节文件名长度 (网络字节序) + 文件名, 按数据的顺序排列
+// 数据: 按索引顺序拼接的文件内容, 用 v2 数据块顺序发送, 块的 offset 为在拼接数据中的位置
+#define PACK_FILE_MAX       (1 << 20)   // 不超过这个大小的文件才打包
+#define PACK_MAX_FILES      1024        // 一个包最多的文件数
+#define PACK_MAX_BYTES      (64 << 20)  // 一个包最多的数据量
+#define PACK_ENTRY_SIZE     10          // 索引项的固定部分
+#define PACK_MAX_INDEX      (PACK_MAX_FILES * (PACK_ENTRY_SIZE + MAX_PATH_LEN))
+
+typedef struct {
+    uint64_t size;
+    char name[MAX_PATH_LEN];            // 协商了 FEATURE_TREE 时可以是相对路径
+} PackEntry;
+
+// 服务器端的解包状态, 数据按顺序写入各个文件
+typedef struct PackUpload {
+    int root_fd;
+    int paths;                  // 文件名可以是相对路径
+    uint8_t* index;             // 接收中的索引
+    size_t index_len;
+    size_t index_got;
+
+    PackEntry* entries;
+    int count;
+    int cur;                    // 正在写入的文件
+    uint64_t cur_done;          // 当前文件已写入的字节
+    int cur_fd;                 // -1 表示还没打开
+    int cur_failed;             // 当前文件无法写入, 丢弃它的数据
+    int failed;                 // 写入失败的文件数
+} PackUpload;
+
+// 服务器端
+int open_upload_pack(ClientConn* conn, int root_fd);
+int handle_pack_index(ClientConn* conn);
+int handle_pack_upload(ClientConn* conn, char* buffer, size_t buflen);
+int finish_upload_pack(ClientConn* conn);
+void close_upload_pack(ClientConn* conn);
+
+// 客户端: 发送一个包, 不等待回复
+int send_file_pack(int sockfd, char* const paths[], char* const names[], const uint64_t sizes[], int count);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef _PROGRESS_H_
+#define _PROGRESS_H_
+
+#include "transfer.h"
+
+#define PROGRESS_INTERVAL_MS    250     // 进度刷新间隔
+
+// 传输进度: 数据路径只做原子累加, 由独立线程定时打印
+typedef struct TransferProgress {
+    uint64_t total;
+    uint64_t done;                  // 原子更新
+    int stop;
+    int started;                    // 打印线程是否在运行
+    struct timespec begin;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} TransferProgress;
+
+void progress_start(TransferProgress* progress, uint64_t total);
+void progress_finish(TransferProgress* progress);
+
+static inline void progress_add(TransferProgress* progress, uint64_t bytes)
+{
+    if(progress)
+        __atomic_add_fetch(&progress->done, bytes, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef _SYNC_QUEUE_H_
+#define _SYNC_QUEUE_H_
+
+#include "transfer.h"
+
+#define SYNC_THREADS        4       // 后台落盘线程数
+#define SYNC_QUEUE_MAX      256     // 排队的操作上限, 超出时在调用线程直接执行
+
+// 一组后台落盘操作: 提交方用它等待自己的操作全部完成
+typedef struct SyncGroup {
+    int pending;                    // 还没完成的操作数, 持有 sync_lock 时读写
+    int failed;                     // 失败的操作数
+} SyncGroup;
+
+// 后台执行的操作, 返回 0 表示成功; arg 由操作自己释放
+typedef int (*SyncFunc)(void* arg);
+
+void sync_submit(SyncGroup* group, SyncFunc func, void* arg);
+int sync_pending(SyncGroup* group);
+int sync_wait(SyncGroup* group);
+
+#endif
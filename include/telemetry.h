@@ -0,0 +1,74 @@
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include "transfer.h"
+
+#define TELEMETRY_INTERVAL_MS   500     // 采样线程计算吞吐的间隔
+#define TELEMETRY_PEER_LEN      (INET_ADDRSTRLEN + 8)
+#define TELEMETRY_NAME_LEN      64
+
+// 一个连接的传输计数: 数据路径只做原子累加, 不加锁, 不格式化, 不输出
+// 登记后由采样线程按固定间隔计算吞吐, stats 命令读取采样结果
+typedef struct TransferStats {
+    uint64_t bytes;                 // 收发的文件数据
+    uint64_t chunks;                // 数据块
+    uint64_t syscalls;              // 数据路径上的系统调用
+    uint64_t stall_ns;              // 等待的时间: 服务器为传输中连接阻塞的时间, 客户端为阻塞读 socket 的时间
+
+    // 以下由 telemetry.c 在锁内维护
+    int id;
+    int sockfd;                     // 客户端连接的 socket, 服务器端为 -1
+    const char* role;
+    char peer[TELEMETRY_PEER_LEN];
+    char name[TELEMETRY_NAME_LEN];  // 服务器端为当前请求的文件, 客户端为所属的任务
+    uint64_t begin_ns;              // 登记时间, CLOCK_MONOTONIC 纳秒
+    uint64_t sample_ns;             // 上次采样时间
+    uint64_t sample_bytes;          // 上次采样时的 bytes
+    double rate;                    // 最近一个采样间隔的吞吐, 字节/秒
+    struct TransferStats* next;
+} TransferStats;
+
+// 当前线程正在使用的客户端连接的计数, 没有时为 NULL
+extern __thread TransferStats* telemetry_thread;
+
+static inline uint64_t telemetry_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void telemetry_io(TransferStats* stats, uint64_t bytes, uint64_t syscalls)
+{
+    if(stats)
+    {
+        __atomic_add_fetch(&stats->bytes, bytes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats->syscalls, syscalls, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void telemetry_chunk(TransferStats* stats)
+{
+    if(stats)
+        __atomic_add_fetch(&stats->chunks, 1, __ATOMIC_RELAXED);
+}
+
+static inline void telemetry_stall(TransferStats* stats, uint64_t ns)
+{
+    if(stats)
+        __atomic_add_fetch(&stats->stall_ns, ns, __ATOMIC_RELAXED);
+}
+
+// 服务器端: 计数嵌在连接里, 建立时登记, 关闭时注销
+void telemetry_register(TransferStats* stats, const char* role, const struct sockaddr_in* peer);
+void telemetry_unregister(TransferStats* stats);
+void telemetry_rename(TransferStats* stats, const char* name);
+
+// 客户端: 取得连接时登记并设为当前线程的计数, 归还连接时注销; job 为所属任务号, 0 表示前台
+void telemetry_attach(int sockfd, const char* ip, int port, int job);
+void telemetry_detach(int sockfd);
+
+// stats 命令: 每个连接的吞吐和计数, 以及全局合计
+void telemetry_print(void);
+
+#endif
@@ -34,9 +34,45 @@
 #define MAX_PASSWORD_LEN 32
 #define MAX_FILENAME_LEN 64
 #define MAX_IP_LEN      32
+#define DEFAULT_LISTEN_BACKLOG 128  // listen() 的默认 backlog
 
 #define MAGIC_NUMBER 0x4C465450 // LFTP 传输的魔数
 
+// 协议版本, 认证后用 CMD_HELLO 协商, 不认识 HELLO 的 v1 服务器回复 NAK
+#define PROTOCOL_V1         1       // 32 位文件大小, 数据原样跟在文件名后
+#define PROTOCOL_V2         2       // 64 位文件大小, 数据按 ChunkHeader 分块发送
+#define PROTOCOL_VERSION    PROTOCOL_V2
+#define CHUNK_SIZE          (4 << 20)   // v2 单个数据块的最大长度
+#define CRC_SEND_BUF        (256 << 10) // 带 CRC 发送时每次读出并校验的数据量
+#define MAX_GET_STREAMS     16          // get -j 的最大连接数
+#define GET_RANGES_PER_STREAM 4         // get -j 每个连接平均分到的范围数, 快的连接多取
+#define MAX_PUT_STREAMS     16          // put -j 的最大连接数
+
+// v2 可选功能: HELLO 的 flags 为客户端支持的功能, 服务器回复双方都支持的部分
+#define FEATURE_RESUME      0x0001      // 断点续传
+#define FEATURE_PIPELINE    0x0002      // CMD_LIST 和 FILE_FLAG_NO_ACK, mget 连续发送请求
+#define FEATURE_PACK        0x0004      // CMD_PUT_PACK, mput 把小文件打包发送
+#define FEATURE_TREE        0x0008      // 文件名可以是根目录下的相对路径, put -r / get -r
+#define FEATURE_MUX         0x0010      // CMD_MUX, 多个传输共用一个连接, 格式见 mux.h
+#define FEATURE_DELTA       0x0020      // CMD_PUT_DELTA, 只发送和服务器上旧版本不同的部分, 格式见 delta.h
+#define FEATURE_DEDUP       0x0040      // CMD_PUT_DEDUP, 服务器开启去重时 put 只上传它没有的块, 格式见 dedup.h
+#define FEATURE_COMPRESS    0x0080      // CHUNK_FLAG_LZ, put -z / get -z 压缩数据块, 格式见 compress.h
+#define FEATURE_CRC         0x0100      // CHUNK_FLAG_CRC, put -k 上传的数据块带 CRC32C, 校验失败的块用 CMD_CHUNK_NAK 要求重传
+#define PROTOCOL_FEATURES   (FEATURE_RESUME | FEATURE_PIPELINE | FEATURE_PACK | FEATURE_TREE | FEATURE_MUX | \
+                             FEATURE_DELTA | FEATURE_DEDUP | FEATURE_COMPRESS | FEATURE_CRC)
+
+// PUT / GET 请求的 flags
+#define FILE_FLAG_RESUME    0x0001      // 请求续传, session 为源文件标识
+#define FILE_FLAG_NO_ACK    0x0002      // GET / LIST: 发完数据直接处理下一个请求, 不等客户端确认
+#define FILE_FLAG_RECURSIVE 0x0004      // LIST: 文件名为目录, 列出其下所有文件的相对路径
+#define FILE_FLAG_COMPRESS  0x0008      // GET: 服务器压缩发送的数据块
+
+// v2 数据块的 flags
+#define CHUNK_FLAG_LZ       0x0001      // 数据是压缩的, length 为压缩后的长度
+#define CHUNK_FLAG_CRC      0x0002      // 数据后面跟 4 字节 CRC32C (网络字节序), 按解压后的原始数据计算
+
+#define CRC_MAX_ROUNDS      3           // 一个文件最多重传几轮校验失败的块, 超过后回复 NAK
+
 // 用户认证信息
 typedef struct {
     char username[MAX_USERNAME_LEN];
@@ -45,42 +81,79 @@ typedef struct {
 } UserAuth;
 
 
+// 服务器可调参数, 0 表示使用默认值
+typedef struct {
+    int workers;                    // 工作线程数 (分片模式下为分片数)
+    int queue_size;                 // 等待工作线程接管的连接队列长度
+    int backlog;                    // listen() 的 backlog
+    int reuseport;                  // 非 0: 每个工作线程一个 SO_REUSEPORT 监听 socket 并绑定 CPU
+    int io_backend;                 // 传输数据使用的 I/O 后端
+    int dedup;                      // 非 0: 开启去重, put 上传的文件按块存入根目录下的块仓库
+} ServerOptions;
+
+// 服务器传输路径的 I/O 后端
+typedef enum {
+    IO_BACKEND_POSIX = 0,           // 上传 splice 经管道写文件, 下载 sendfile, 均不经用户态
+    IO_BACKEND_URING,               // io_uring 批量提交, 内核不支持时回退到 POSIX
+    IO_BACKEND_COPY,                // 上传 recv 到缓冲区再 write, 用于对比和排查
+} IoBackendType;
+
 // 服务器配置信息
 typedef struct {
     int is_running;
     int port;
     char root_path[MAX_PATH_LEN];
+    int root_fd;                    // 根目录, 请求的文件都以它为起点 openat
+    int store_fd;                   // 去重的块仓库, -1 表示没有开启去重
     UserAuth auth;                  // 认证信息
+    ServerOptions options;          // 线程池等参数
     int server_fd;                  // 服务器socket
     pthread_t server_thread;        // 服务器线程
 } ServerConfig;
 
-// 客户端处理线程参数
-typedef struct {
-    int client_fd;
-    struct sockaddr_in client_addr;
-    ServerConfig config;
-}ClientThreadArgs;
 
 
 // 文件传输命令
 typedef enum {
     CMD_PUT_FILE = 0x01,    // 上传文件
     CMD_GET_FILE = 0x02,    // 下载文件
+    CMD_GET_RANGE = 0x06,   // v2: 下载文件的一段, offset 为起点, filesize 为长度
+    CMD_PUT_RANGE = 0x07,   // v2: 并行上传的一个连接, filesize 为整个文件大小, session 相同的连接写同一个文件
+    CMD_RESUME = 0x08,      // v2 续传上传的回复: offset 为服务器已有的数据长度, 从这里继续发送
+    CMD_LIST = 0x09,        // v2: 文件名为通配符, 回复的数据是根目录下匹配的文件名, 以 '\0' 分隔
+    CMD_PUT_PACK = 0x0A,    // v2: 一批小文件打包上传, 格式见 pack.h; NAK 的 filesize 为失败的文件数
+    CMD_MUX = 0x0B,         // v2: 切换到多路复用模式, 服务器回复 ACK 后双方只发送帧
+    CMD_PUT_DELTA = 0x0C,   // v2: 增量上传, 服务器先回复旧文件的块签名, 格式见 delta.h
+    CMD_PUT_DEDUP = 0x0D,   // v2: 去重上传, 服务器先回复缺少哪些块, 格式见 dedup.h
+    CMD_CHUNK_NAK = 0x0E,   // v2 上传的回复: 数据块 CRC 不对, offset/filesize 为要重传的范围;
+                            // 收到结束块时 filesize 为 0, 客户端重传这一轮的块后再发结束块
     CMD_ACK = 0x03,         // 确认
     CMD_NAK = 0x04,         // 拒绝
+    CMD_HELLO = 0x05,       // 协商协议版本, version 字段为支持的最高版本
 } CommandType;
 
 // 文件传输头
+// v1 对端把 filesize_hi 之后的字节当作保留字段, 发送时填 0, 接收时忽略
 typedef struct {
     uint32_t magic;
     uint16_t version;
     uint16_t command;          // 命令类型
-    uint32_t filesize;           // 文件大小
+    uint32_t filesize;           // 文件大小 (v2 为低 32 位)
     uint16_t filename_len;          // 文件名长度
-    uint8_t reserved[16];      // 保留字段
+    uint16_t flags;            // v2: HELLO 为功能位, PUT/GET 为请求选项
+    uint32_t filesize_hi;      // v2: 文件大小的高 32 位
+    uint32_t offset;           // v2 范围请求: 起始位置的低 32 位
+    uint32_t offset_hi;        // v2 范围请求: 起始位置的高 32 位
+    uint32_t session;          // v2 并行上传: 会话号; 续传和下载回复: 源文件标识
 } FileHeader;
 
+// v2 数据块头, 后面跟 length 字节数据; length 为 0 表示文件数据结束
+typedef struct {
+    uint64_t offset;           // 数据在文件中的位置
+    uint32_t length;
+    uint32_t flags;            // CHUNK_FLAG_*, 协商了 FEATURE_COMPRESS / FEATURE_CRC 才可能非 0
+} ChunkHeader;
+
 // 认证头
 typedef struct {
     char username[MAX_USERNAME_LEN];
@@ -88,38 +161,186 @@ typedef struct {
     uint8_t auth_result;    // 0 -表示失败； 1-表示成功
 }AuthHeader;
 
+// 服务器端连接状态
+typedef enum {
+    CONN_STATE_AUTH = 0,        // 等待认证头
+    CONN_STATE_HEADER,          // 等待文件头
+    CONN_STATE_FILENAME,        // 等待文件名
+    CONN_STATE_PACK_INDEX,      // 打包上传: 等待索引
+    CONN_STATE_CHUNK,           // v2: 等待下一个上传数据块头
+    CONN_STATE_UPLOAD,          // 接收上传的文件数据
+    CONN_STATE_DOWNLOAD,        // 发送下载的文件数据
+    CONN_STATE_WAIT_ACK,        // 等待客户端确认下载
+    CONN_STATE_WAIT_RANGES,     // 并行上传: 本连接的范围已收完, 等待其他连接
+    CONN_STATE_MUX,             // 多路复用模式: 收发帧, 不再回到等待文件头的状态
+    CONN_STATE_DELTA_SIGNATURE, // 增量上传: 发送旧文件的块签名
+    CONN_STATE_DELTA,           // 增量上传: 接收操作序列并重建文件
+    CONN_STATE_DEDUP_INDEX,     // 去重上传: 接收块索引, 回复缺少的块
+    CONN_STATE_CHUNK_CRC,       // v2: 等待上传数据块后面的 CRC32C
+    CONN_STATE_CLOSING,         // 发完剩余数据后关闭
+} ConnState;
+
+// 状态机单步推进的结果
+#define CONN_STEP_CLOSE    -1   // 出错或对端关闭, 需要关闭连接
+#define CONN_STEP_BLOCKED   0   // socket 暂时不可读写, 等待下一次事件
+#define CONN_STEP_DONE      1   // 当前阶段完成, 继续推进
+#define CONN_STEP_YIELD     2   // 用完本轮配额, 让出给其他连接
+
+#define CONN_MSG_BUF_SIZE   512 // 控制消息缓冲 (认证头/文件头/文件名)
+
+struct EventLoop;
+struct UploadSession;
+struct TransferJournal;
+struct PackUpload;
+struct MuxSession;
+struct DeltaUpload;
+struct DedupUpload;
+struct DedupReader;
+struct CompressStream;
+
+// 服务器端的单个连接, 由事件循环驱动
+typedef struct ClientConn {
+    int fd;
+    struct sockaddr_in addr;
+    ConnState state;
+    struct EventLoop* loop;
+
+    // 控制消息输入: 只读取当前阶段需要的字节数
+    uint8_t in_buf[CONN_MSG_BUF_SIZE];
+    size_t in_len;
+    size_t in_need;
+
+    // 控制消息输出: socket 不可写时暂存
+    uint8_t out_buf[CONN_MSG_BUF_SIZE];
+    size_t out_len;
+    size_t out_off;
+
+    int proto;                  // 协商后的协议版本
+    uint16_t features;          // 协商后的可选功能
+
+    // 当前请求
+    FileHeader header;
+    char filename[MAX_PATH_LEN];    // 协商了 FEATURE_TREE 时可以是相对路径
+    int file_fd;
+    uint64_t file_total;        // 上传: 整个文件的大小; 下载: 要发送数据的终点
+    // 当前数据段: v1 为整个文件, v2 为一个数据块
+    uint64_t file_offset;       // 数据段在文件中的起始位置
+    uint64_t file_size;         // 数据段长度
+    uint64_t file_done;         // 数据段已传输的字节
+    uint64_t file_received;     // v2 上传: 已收完的数据块字节数
+    int file_failed;            // 写文件出错, 继续读完数据后回复 NAK
+    int no_splice;              // 目标文件不支持 splice, 本次上传改用缓冲区中转
+    uint32_t chunk_flags;       // v2 上传: 当前数据块的 CHUNK_FLAG_*
+    uint32_t chunk_crc;         // 当前数据块已收数据的 CRC32C
+    int chunk_corrupt;          // 当前数据块已知损坏 (压缩数据解不开), 读完 CRC 后要求重传
+    int crc_bad;                // 本轮校验失败、等待重传的块数
+    int crc_rounds;             // 已经要求重传的轮数
+
+    // 并行上传
+    struct UploadSession* session;  // 加入的上传会话, NULL 表示普通上传
+    int session_committed;      // 已提交本连接收到的字节, 断开不再使会话失败
+    int wait_fd;                // 等待会话完成时注册到 epoll 的 fd 副本, -1 表示没有
+
+    struct TransferJournal* journal;    // 续传上传的日志, NULL 表示不记录
+    struct PackUpload* pack;    // 打包上传的解包状态, NULL 表示普通上传
+    struct MuxSession* mux;     // 多路复用模式的流和帧缓冲, NULL 表示一问一答模式
+    struct DeltaUpload* delta;  // 增量上传的重建状态, NULL 表示普通上传
+    struct DedupUpload* dedup;  // 去重上传的索引和当前块, NULL 表示普通上传
+    struct DedupReader* manifest;   // 下载的文件是去重清单时从块仓库逐块读取, NULL 表示普通文件
+    struct CompressStream* lz;  // 传输压缩的缓冲, NULL 表示没有压缩的数据块
+
+    // io_uring 后端
+    struct UringSlot* io_slot;  // 占用的传输槽, NULL 表示走普通路径
+    int io_inflight;            // 已提交未完成的请求数, 为 0 才能释放连接
+
+    struct TransferStats* stats;    // 连接的传输计数, stats 命令显示
+    uint64_t stall_since;       // 传输中等待 socket 的开始时间, 0 表示没有在等
+
+    // 事件循环内部使用
+    int closed;
+    int ready;
+    struct ClientConn* prev;
+    struct ClientConn* next;
+    struct ClientConn* ready_next;
+} ClientConn;
+
 // TCP 服务器相关
 int start_tcp_server(int port, const char* root_path, 
-                     const char* username, const char* password);
+                     const char* username, const char* password,
+                     const ServerOptions* options);
 void stop_tcp_server();
 void* tcp_server_thread(void* arg);
-int handle_client_requests(int client_fd, const char *root_path);
-void* handle_client_connection_thread(void* arg);
+int authenticate_client(ClientConn* conn, const UserAuth* server_auth);
+int handle_client_requests(ClientConn* conn, const ServerConfig* config);
+
+int open_upload_file(ClientConn* conn, const char* root_path);
+int open_upload_range(ClientConn* conn);
+void close_upload_journal(ClientConn* conn, int complete);
+int open_download_file(ClientConn* conn, const char* root_path);
+int open_list_file(ClientConn* conn, const char* root_path);
+int handle_file_upload(ClientConn* conn, char* buffer, size_t buflen);
+int handle_file_download(ClientConn* conn);
+
+struct TransferProgress;
 
-int handle_file_upload(int client_fd, const char* root_path, const char* filename, uint32_t filesize);
-int handle_file_download(int client_fd, const char* root_path, const char* filename);
-int validate_path(const char* root_path, const char* requested_path);
+// put 的选项
+#define PUT_COMPRESS        0x01        // put -z: 压缩数据块
+#define PUT_CRC             0x02        // put -k: 数据块带 CRC32C, 上传改走用户态拷贝
 
 // TCP 客户端相关
 int send_tcp_file(const char* filename, const char* ip, int port, const char*username, const char* password);
+int send_tcp_file_options(const char* filename, const char* ip, int port, const char* username, const char* password,
+                          int options);
+int send_tcp_file_parallel(const char* filename, const char* ip, int port, const char* username, const char* password,
+                           int streams, int options);
 int receive_tcp_file(const char* filename, const char* ip, int port, const char*username, const char* password);
+int receive_tcp_file_parallel(const char* filename, const char* ip, int port, const char* username, const char* password,
+                              int streams);
+int send_tcp_file_mux(const char* filename, const char* ip, int port, const char* username, const char* password);
+int receive_tcp_file_mux(const char* filename, const char* ip, int port, const char* username, const char* password);
+int send_tcp_file_delta(const char* filename, const char* ip, int port, const char* username, const char* password);
+int receive_tcp_file_compress(const char* filename, const char* ip, int port, const char* username,
+                              const char* password);
+int send_tcp_files(char* const patterns[], int count, const char* ip, int port, const char* username, const char* password);
+int receive_tcp_files(char* const patterns[], int count, const char* ip, int port, const char* username, const char* password);
+int send_tcp_tree(const char* dirname, const char* ip, int port, const char* username, const char* password, int streams);
+int receive_tcp_tree(const char* dirname, const char* ip, int port, const char* username, const char* password,
+                     int streams);
 
 
 // TCP 相关的命令行解析
 int parse_server_command(int argc, char* argv[]);
 int parse_transfer_command(int argc, char* argv[]);
+int parse_batch_command(int argc, char* argv[]);
+int parse_log_command(int argc, char* argv[]);
 
 
 // 工具函数
 int open_clientfd(const char* ip_address, int port);
-int open_listenfd(int port);
-int authenticate_client(int client_fd, UserAuth* server_auth);
+int open_listenfd(int port, int backlog, int reuseport);
 int send_response(int sockfd, uint16_t command);
 int send_auth_response(int sockfd, int success);
 int receive_auth_reponse(int sockfd);
 
-int send_file_header(int sockfd, uint16_t command, int filesize, int filename_len);
+void encode_file_header(FileHeader* header, uint16_t version, uint16_t command, uint64_t filesize, uint16_t filename_len);
+void decode_file_header(FileHeader* header);
+uint64_t file_header_size(const FileHeader* header);
+uint64_t file_header_offset(const FileHeader* header);
+void set_file_header_offset(FileHeader* header, uint64_t offset);
+int send_file_header(int sockfd, uint16_t version, uint16_t command, uint64_t filesize, uint16_t filename_len);
 int receive_file_header(int sockfd, FileHeader* header);
+int negotiate_protocol(int sockfd, uint16_t* features);
+void encode_chunk_header(ChunkHeader* chunk, uint64_t offset, uint32_t length);
+void decode_chunk_header(ChunkHeader* chunk);
+int send_file_data(int sockfd, int file_fd, uint64_t offset, uint64_t size);
+int send_file_range(int sockfd, int file_fd, uint64_t offset, uint64_t length);
+int send_chunk_end(int sockfd);
+int send_file_chunks(int sockfd, int file_fd, uint64_t size);
+int send_file_range_crc(int sockfd, int file_fd, uint64_t offset, uint64_t length);
+int receive_upload_reply(int sockfd, int file_fd, FileHeader* response);
+int receive_file_data(int sockfd, int file_fd, uint64_t offset, uint64_t size, struct TransferProgress* progress);
+int receive_file_chunks(int sockfd, int file_fd, uint64_t offset, uint64_t length, struct TransferProgress* progress,
+                        struct TransferJournal* journal);
 int send_auth_request(int sockfd, const char* username, const char* password);
 
 
@@ -0,0 +1,70 @@
+#ifndef _TRANSFER_ENGINE_H_
+#define _TRANSFER_ENGINE_H_
+
+#include "transfer.h"
+
+#define ENGINE_WORKERS      4           // 同时运行的传输任务数
+#define ENGINE_MAX_ARGS     64
+#define ENGINE_LINE_LEN     1024        // 任务命令行的最大长度
+#define ENGINE_JOB_SOCKETS  64          // 一个任务同时使用的连接数上限 (-j 的连接加上控制连接)
+#define ENGINE_HISTORY      32          // jobs 中保留的已结束任务数
+#define ENGINE_SIZE_UNKNOWN UINT64_MAX  // 事先不知道大小的任务排在已知大小的后面
+
+// 优先级: 只有高优先级没有可运行的任务时才调度低优先级
+typedef enum {
+    JOB_PRIO_HIGH = 0,
+    JOB_PRIO_NORMAL,
+    JOB_PRIO_LOW,
+    JOB_PRIO_COUNT,
+} JobPriority;
+
+typedef enum {
+    JOB_QUEUED = 0,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+    JOB_CANCELLED,
+} JobState;
+
+// 任务执行的函数, 即 shell 的命令解析函数, 返回 0 表示成功
+typedef int (*JobFunc)(int argc, char* argv[]);
+
+// 后台传输任务
+typedef struct TransferJob {
+    int id;
+    JobState state;
+    JobPriority priority;
+    char host[MAX_IP_LEN];          // 同一主机的任务轮流调度
+    uint64_t size;                  // 预计传输的字节数, 小的先调度
+
+    char line[ENGINE_LINE_LEN];     // 命令行, argv 指向其中
+    int argc;
+    char* argv[ENGINE_MAX_ARGS];
+    JobFunc func;
+    int result;
+
+    int cancelled;
+    int sockets[ENGINE_JOB_SOCKETS];    // 任务正在使用的连接, 取消时 shutdown 让阻塞的传输返回
+    int socket_count;
+
+    struct timespec submitted;
+    struct timespec started;
+    struct timespec finished;
+    struct TransferJob* next;
+} TransferJob;
+
+int engine_submit(JobFunc func, int argc, char* argv[], JobPriority priority, const char* host, uint64_t size);
+void engine_list(void);
+int engine_wait(int id);
+int engine_cancel(int id);
+int engine_parse_priority(const char* name);
+
+// 传输代码使用: 登记任务的连接, 以及让子线程继承所属的任务
+void engine_track_socket(int sockfd);
+int engine_untrack_socket(int sockfd);
+int engine_thread_create(pthread_t* thread, void* (*start)(void*), void* arg);
+int engine_in_job(void);
+int engine_job_id(void);
+int engine_job_cancelled(void);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _TREE_H_
+#define _TREE_H_
+
+#include "transfer.h"
+
+// 递归传输 (put -r / get -r): 文件名是根目录下的相对路径, 如 "photos/2024/a.jpg"
+#define TREE_WALK_THREADS   4           // 遍历本地目录树的线程数
+#define TREE_QUEUE_SIZE     1024        // 遍历结果队列的长度, 满了遍历线程等待发送线程取走
+#define TREE_MAX_DEPTH      64          // 目录的最大深度
+
+// 遍历得到的一个普通文件
+typedef struct {
+    char path[MAX_PATH_LEN * 2];        // 本地路径
+    char name[MAX_PATH_LEN];            // 发给服务器的相对路径
+    uint64_t size;
+} TreeItem;
+
+struct TreeDir;
+
+// 本地目录树的并行遍历: 多个线程 stat 目录项, 文件放入队列, 发送线程边遍历边取
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t threads[TREE_WALK_THREADS];
+    int thread_count;
+
+    struct TreeDir* dirs;               // 等待遍历的目录
+    int busy;                           // 正在遍历目录的线程数
+    int stopped;                        // 取消遍历
+    int skipped;                        // 跳过的文件数
+
+    TreeItem* items;                    // 环形队列
+    int head;
+    int count;
+} TreeWalk;
+
+// 路径检查和以根目录 fd 为起点的打开
+int tree_valid_path(const char* path);
+int tree_request_path(const ClientConn* conn, const char* name);
+int tree_openat(int root_fd, const char* path, int flags, mode_t mode);
+int tree_open_parent(int root_fd, const char* path, int create, const char** base);
+int tree_list(int root_fd, const char* path, int out_fd, uint64_t* size);
+int tree_make_parents(const char* path);
+
+// 客户端遍历
+int tree_walk_start(TreeWalk* walk, const char* root);
+int tree_walk_next(TreeWalk* walk, TreeItem* item);
+void tree_walk_cancel(TreeWalk* walk);
+int tree_walk_done(TreeWalk* walk);
+void tree_walk_stop(TreeWalk* walk);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef _UPLOAD_SESSION_H_
+#define _UPLOAD_SESSION_H_
+
+#include "transfer.h"
+
+// put -j 的服务器端会话: 同一次上传的多个连接把各自的范围写进同一个预分配文件
+// 以 (根目录, 相对路径, 会话号) 区分, 所有连接都退出后释放
+typedef struct UploadSession {
+    int root_fd;
+    char path[MAX_PATH_LEN];        // 根目录下的相对路径
+    uint32_t id;
+    uint64_t size;
+    uint64_t received;              // 各连接已提交的字节数
+    int fd;
+    int event_fd;                   // 完成或失败后一直可读, 唤醒等待中的连接
+    int refs;
+    int failed;
+    int done;
+    struct UploadSession* next;
+} UploadSession;
+
+// 会话状态
+#define UPLOAD_SESSION_PENDING  0   // 还有范围没到
+#define UPLOAD_SESSION_DONE     1   // 所有范围都已写入
+#define UPLOAD_SESSION_FAILED  -1   // 有连接出错, 文件不完整
+
+// path 必须已经过 tree_request_path 检查, 文件以 root_fd 为起点打开, 缺少的目录一并创建
+UploadSession* upload_session_join(int root_fd, const char* path, uint32_t id, uint64_t size);
+int upload_session_commit(UploadSession* session, uint64_t bytes, int failed);
+int upload_session_status(UploadSession* session);
+void upload_session_leave(UploadSession* session, int aborted);
+
+#endif
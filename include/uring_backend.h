@@ -0,0 +1,96 @@
+#ifndef _URING_BACKEND_H_
+#define _URING_BACKEND_H_
+
+#include "event_loop.h"
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES       256         // 提交队列长度
+#define URING_SLOTS         16          // 每个事件循环同时走 io_uring 的传输数
+#define URING_SLOT_BUFS     4           // 每个传输的注册缓冲区个数, 空闲的都用来读 socket, 其余在写文件
+#define URING_BUF_SIZE      (256 << 10)
+#define URING_PIPE_SIZE     (1 << 20)   // 下载时 splice 管道的期望容量
+#define URING_MAX_WORKERS   16          // 阻塞型请求 (splice) 使用的内核线程上限
+
+#define URING_STEP_FALLBACK (-2)        // 没有空闲传输槽, 本次传输走普通路径
+
+struct UringSlot;
+
+// 一个已提交的请求, 地址放在 sqe 的 user_data 里
+typedef struct {
+    struct UringSlot* slot;
+    int op;
+    int buf;                    // 使用的注册缓冲区下标
+    uint32_t len;
+} UringReq;
+
+// 传输槽: 占用一组注册缓冲区和一个注册文件位置
+// 上传从第一个数据块占用到整个文件收完, 下载每个数据块占用一次
+typedef struct UringSlot {
+    int index;
+    int in_use;
+    ClientConn* conn;
+    int upload;
+
+    // 上传: 空闲缓冲区上的读请求链接成一串按顺序读 socket, 写文件可以并发
+    int buf_busy[URING_SLOT_BUFS];
+    int reading;                // 在途的读请求数
+    uint64_t received;          // 当前数据块已从 socket 读到的字节
+    uint64_t written;           // 当前数据块已写入文件的字节
+
+    // 下载: 文件 -> 管道 -> socket
+    int pipefd[2];
+    uint32_t pipe_size;         // 管道的实际容量, 每次 splice 最多搬这么多
+    uint64_t pipe_fill;         // 管道中还没发出的字节
+    uint64_t spliced;           // 已搬进管道的字节
+    int splicing;               // 未完成的 splice 请求数
+
+    int error;
+    UringReq poll_req;
+    UringReq read_req[URING_SLOT_BUFS];
+    UringReq write_req[URING_SLOT_BUFS];
+    UringReq splice_in_req;
+    UringReq splice_out_req;
+} UringSlot;
+
+// 每个事件循环一个 io_uring 实例
+typedef struct UringBackend {
+    int ring_fd;
+    int event_fd;               // 有完成事件时可读, 注册在 epoll 中
+
+    // 提交队列
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe* sqes;
+    unsigned sq_local_tail;     // 已填写但还没提交的位置
+
+    // 完成队列
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    char* buffers;              // URING_SLOTS * URING_SLOT_BUFS 个注册缓冲区
+    UringSlot slots[URING_SLOTS];
+    int inflight;               // 整个实例未完成的请求数
+    int read_poll;              // 内核对非阻塞 socket 的读直接返回 EAGAIN, 读之前先链接一个 poll
+} UringBackend;
+
+int uring_backend_init(EventLoop* loop);
+void uring_backend_destroy(EventLoop* loop);
+void uring_backend_complete(EventLoop* loop);
+int uring_backend_submit(EventLoop* loop);
+int uring_file_upload(ClientConn* conn);
+void uring_upload_end(ClientConn* conn);
+int uring_file_download(ClientConn* conn);
+void uring_conn_abort(ClientConn* conn);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef _WAN_H_
+#define _WAN_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+// 用户态 TCP 代理模拟的网络条件, 两个方向各自生效
+// 用户态代理两边都是完整的 TCP 连接, 没法真的丢包: 丢包表现为这段数据晚一个重传超时才送到,
+// 后面的数据按顺序排在它后面, 和 TCP 丢包时应用看到的停顿一致
+typedef struct {
+    double delay;                   // 单向延迟, 秒
+    double jitter;                  // 每段数据的延迟在 delay ± jitter 内均匀分布, 不会乱序
+    double rate;                    // 每个方向的带宽, 字节/秒, 所有连接共享; 0 为不限
+    double loss;                    // 丢包率 0-1, 按 WAN_PACKET_SIZE 字节一个包计算
+    double reset;                   // 连接的平均存活时间, 秒, 到时向两端发 RST; 0 为不重置
+    size_t window;                  // 每个连接每个方向在途的最多字节数, 相当于 TCP 窗口
+} WanConditions;
+
+#define WAN_PACKET_SIZE     1448
+#define WAN_DEFAULT_WINDOW  (4 << 20)
+#define WAN_MIN_WINDOW      (16 << 10)
+#define WAN_SPEC_LEN        160     // wan_format 输出的最大长度
+
+// 解析 "wan", "wifi,loss=1", "delay=40,jitter=5,rate=20" 这样的描述:
+// 预设 lan / wifi / wan / lossy, 以及 delay=ms, jitter=ms, rate=Mbit/s, loss=%, reset=s, window=KB
+// 后面的项覆盖前面的; 成功返回 0
+int wan_parse(const char* spec, WanConditions* cond);
+// 输出为 wan_parse 能解析的形式
+void wan_format(const WanConditions* cond, char* buf, size_t len);
+
+// 在 listen_port 上接受连接并转发到 target_ip:target_port, 每个连接一个线程; 一个进程只能启动一次
+// log 非 NULL 时记录连接的建立、结束和重置
+int wan_proxy_start(int listen_port, const char* target_ip, int target_port, const WanConditions* cond,
+                    FILE* log);
+
+#endif
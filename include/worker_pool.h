@@ -0,0 +1,55 @@
+#ifndef _WORKER_POOL_H_
+#define _WORKER_POOL_H_
+
+#include "event_loop.h"
+
+#define DEFAULT_SERVER_WORKERS  4       // 默认工作线程数
+#define MAX_SERVER_WORKERS      256
+#define DEFAULT_ACCEPT_QUEUE    128     // 默认等待分配的连接数
+#define MAX_ACCEPT_QUEUE        65536
+
+// 已 accept、等待工作线程接管的连接
+typedef struct {
+    int fd;
+    struct sockaddr_in addr;
+} PendingConn;
+
+// 有界的连接队列, 满时 accept 线程暂停接收新连接
+typedef struct {
+    PendingConn* items;
+    int capacity;
+    int head;
+    int count;
+    pthread_mutex_t lock;
+} AcceptQueue;
+
+struct WorkerPool;
+
+// 工作线程: 各自运行一个事件循环, 驱动分配到的连接
+typedef struct {
+    EventLoop loop;
+    pthread_t thread;
+    int notify_fd;                  // eventfd, 有新连接投递时唤醒
+    int cpu;                        // 绑定的 CPU, -1 表示不绑定
+    struct WorkerPool* pool;
+} ServerWorker;
+
+// 固定大小的工作线程池
+// 普通模式: accept 线程把连接放入共享队列, 工作线程取出后驱动
+// 分片模式: 每个工作线程有自己的 SO_REUSEPORT 监听 socket, 自己 accept, 不经过队列
+typedef struct WorkerPool {
+    ServerWorker* workers;
+    int worker_count;
+    int started;                    // 已启动的线程数
+    AcceptQueue queue;
+    int space_fd;                   // eventfd, 队列从满变为不满时唤醒 accept 线程
+    int sharded;
+} WorkerPool;
+
+int online_cpu_count(void);
+int worker_pool_start(WorkerPool* pool, ServerConfig* config);
+int worker_pool_dispatch(WorkerPool* pool, int fd, const struct sockaddr_in* addr);
+int worker_pool_full(WorkerPool* pool);
+void worker_pool_stop(WorkerPool* pool);
+
+#endif